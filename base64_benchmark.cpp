@@ -0,0 +1,149 @@
+#include "ns_common.h"
+#include "ns_memory.h"
+#include "ns_time.h"
+#include "ns_util.h"
+#include "ns_base64.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Build: g++ -O2 -o base64_benchmark base64_benchmark.cpp
+   Encodes and decodes a buffer with the old per-character ns_to_base64 path and with every
+   ns_base64 implementation the cpu supports, and prints MB/s of binary data. */
+
+#define BENCHMARK_BUFFER_SIZE Megabytes(12)
+#define BENCHMARK_ITERATIONS 16
+
+struct Base64Benchmark
+{
+    NsBase64Implementation implementation;
+    const char *name;
+};
+
+Base64Benchmark benchmarks[] = {
+    { NS_BASE64_SCALAR, "scalar" },
+    { NS_BASE64_SSE, "sse" },
+    { NS_BASE64_AVX2, "avx2" },
+};
+
+/* ns_common.h leaves allocation to the program. */
+internal void *ns_memory_allocate(size_t size)
+{
+    void *result = malloc(size);
+    return result;
+}
+
+internal void ns_memory_free(void *memory)
+{
+    free(memory);
+}
+
+/* What ns_sha1 used to do: one ns_to_base64 call per character. */
+uint64_t encode_per_character(const uint8_t *src, uint64_t length, char *dest)
+{
+    uint64_t i, dest_idx;
+    for(i = 0, dest_idx = 0; (i + 3) <= length; i += 3, dest_idx += 4)
+    {
+        uint32_t three_set = ((src[i + 0] << 16) |
+                              (src[i + 1] <<  8) |
+                              (src[i + 2] <<  0));
+
+        dest[dest_idx + 0] = ns_to_base64((three_set >> 18) & 0x3f);
+        dest[dest_idx + 1] = ns_to_base64((three_set >> 12) & 0x3f);
+        dest[dest_idx + 2] = ns_to_base64((three_set >>  6) & 0x3f);
+        dest[dest_idx + 3] = ns_to_base64((three_set >>  0) & 0x3f);
+    }
+    return dest_idx;
+}
+
+double get_megabytes_per_second(uint64_t elapsed_nanos)
+{
+    double megabytes = ((double)BENCHMARK_BUFFER_SIZE*BENCHMARK_ITERATIONS)/(1024.0*1024.0);
+    double seconds = (double)elapsed_nanos/1e9;
+    double result = (megabytes/seconds);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t encoded_length = ns_base64_get_encoded_length(BENCHMARK_BUFFER_SIZE);
+    uint8_t *buffer = (uint8_t *)ns_memory_allocate(BENCHMARK_BUFFER_SIZE);
+    uint8_t *decoded = (uint8_t *)ns_memory_allocate(BENCHMARK_BUFFER_SIZE);
+    char *encoded = (char *)ns_memory_allocate(encoded_length);
+    char *reference = (char *)ns_memory_allocate(encoded_length);
+    if(buffer == NULL || decoded == NULL || encoded == NULL || reference == NULL)
+    {
+        DebugPrintInfo();
+        return 1;
+    }
+
+    srand(1);
+    for(uint32_t i = 0; i < BENCHMARK_BUFFER_SIZE; i++)
+    {
+        buffer[i] = (uint8_t)rand();
+    }
+
+    // the buffer size is a multiple of 3, so there's no padding for the old path to handle
+    {
+        uint64_t start_nanos = ns_time_get_nanos();
+        for(int iteration = 0; iteration < BENCHMARK_ITERATIONS; iteration++)
+        {
+            encode_per_character(buffer, BENCHMARK_BUFFER_SIZE, reference);
+        }
+        uint64_t elapsed_nanos = (ns_time_get_nanos() - start_nanos);
+        printf("%-14s encode %8.1f MB/s\n", "ns_to_base64", get_megabytes_per_second(elapsed_nanos));
+    }
+
+    for(uint32_t i = 0; i < ArrayCount(benchmarks); i++)
+    {
+        Base64Benchmark *benchmark = &benchmarks[i];
+        if(!ns_base64_check_supported(benchmark->implementation))
+        {
+            printf("%-14s not supported\n", benchmark->name);
+            continue;
+        }
+
+        uint64_t start_nanos = ns_time_get_nanos();
+        for(int iteration = 0; iteration < BENCHMARK_ITERATIONS; iteration++)
+        {
+            ns_base64_encode(buffer, BENCHMARK_BUFFER_SIZE, encoded, benchmark->implementation);
+        }
+        uint64_t encode_nanos = (ns_time_get_nanos() - start_nanos);
+
+        if(memcmp(encoded, reference, encoded_length) != 0)
+        {
+            printf("%-14s encode mismatch\n", benchmark->name);
+            return 1;
+        }
+
+        uint64_t decoded_length = 0;
+        start_nanos = ns_time_get_nanos();
+        for(int iteration = 0; iteration < BENCHMARK_ITERATIONS; iteration++)
+        {
+            if(ns_base64_decode(encoded, encoded_length, decoded, &decoded_length,
+                                benchmark->implementation) != NS_SUCCESS)
+            {
+                printf("%-14s decode failed\n", benchmark->name);
+                return 1;
+            }
+        }
+        uint64_t decode_nanos = (ns_time_get_nanos() - start_nanos);
+
+        if(decoded_length != BENCHMARK_BUFFER_SIZE || memcmp(decoded, buffer, BENCHMARK_BUFFER_SIZE) != 0)
+        {
+            printf("%-14s decode mismatch\n", benchmark->name);
+            return 1;
+        }
+
+        printf("%-14s encode %8.1f MB/s  decode %8.1f MB/s\n", benchmark->name,
+               get_megabytes_per_second(encode_nanos), get_megabytes_per_second(decode_nanos));
+    }
+
+    ns_memory_free(reference);
+    ns_memory_free(encoded);
+    ns_memory_free(decoded);
+    ns_memory_free(buffer);
+
+    return 0;
+}
@@ -0,0 +1,614 @@
+#include "ns_common.h"
+#include "ns_memory.h"
+#include "ns_time.h"
+#include "ns_atomic.h"
+#include "ns_socket.h"
+#include "ns_thread.h"
+#include "ns_semaphore.h"
+#include "ns_histogram.h"
+#include "ns_http_server.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+
+/* Build: g++ -O2 -o http_server_benchmark http_server_benchmark.cpp -lpthread
+   Starts ns_http_server_startup on loopback in a child process for each combination of
+   max_threads and max_connections, drives it with keep-alive connections spread over a few
+   client threads, and prints requests/s and latency percentiles.
+
+   Options:
+     --rate N         total requests/s, sent on a fixed schedule (open loop). latency is
+                      measured from when each request was due, not when it went out, so a
+                      stalled server can't hide its stall by slowing the client down.
+                      0 (the default) is closed loop: each connection keeps --pipeline
+                      requests in flight and sends another as soon as one is answered.
+     --duration N     seconds measured per configuration (default 5)
+     --warmup N       seconds run before measuring (default 1)
+     --connections N  client connections, capped at the server's max_connections (default 64)
+     --pipeline N     requests in flight per connection in closed loop mode (default 4)
+     --threads N      client threads (default 2)
+     --placement P    none, spread or compact: how the server pins its threads to cores
+                      (default none)
+     --processes N    run the server as N forked workers sharing the listening socket, each
+                      with max_threads threads (default 0: one process, no supervisor) */
+
+#define BENCHMARK_MAX_OUTSTANDING 1024 // per connection; a power of two
+#define BENCHMARK_READ_BUFFER_SIZE Kilobytes(64)
+#define BENCHMARK_BASE_PORT 18080
+
+const char *benchmark_request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+int benchmark_max_threads[] = { 3, 4, 8 };
+int benchmark_max_connections[] = { 64, 256 };
+
+struct BenchmarkOptions
+{
+    double rate;
+    int duration_seconds;
+    int warmup_seconds;
+    int connections;
+    int pipeline;
+    int threads;
+    NsNumaPlacement placement;
+    int processes;
+};
+
+struct LoadConnection
+{
+    NsSocket socket;
+    bool is_open;
+
+    // when each request in flight was sent (closed loop) or due (open loop), oldest first.
+    // responses come back in order, so the head always matches the next response.
+    uint64_t send_nanos[BENCHMARK_MAX_OUTSTANDING];
+    uint32_t head;
+    uint32_t tail;
+
+    // requests at the end of the ring that haven't been written to the socket yet, and how
+    // much of the first of them has been
+    uint32_t num_unsent;
+    uint32_t unsent_offset;
+
+    uint64_t next_send_nanos; // open loop only
+
+    char read_buffer[BENCHMARK_READ_BUFFER_SIZE];
+    uint32_t read_length;
+};
+
+struct LoadThread
+{
+    NsThread thread;
+    BenchmarkOptions *options;
+    LoadConnection *connections;
+    int num_connections;
+    int total_connections;
+    int first_connection_index;
+
+    NsHistogram histogram;
+    uint64_t num_completed;
+    uint64_t num_errors;
+
+    NsSemaphore *done_semaphore;
+};
+
+/* ns_common.h leaves logging to the program. */
+internal void _Log(const char *Format, ...)
+{
+    va_list args;
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+}
+
+/* ns_common.h leaves allocation to the program too. */
+internal void *ns_memory_allocate(size_t size)
+{
+    void *result = malloc(size);
+    return result;
+}
+
+internal void ns_memory_free(void *memory)
+{
+    free(memory);
+}
+
+int connect_with_retry(NsSocket *socket, const char *port)
+{
+    int status;
+
+    // the child might not be listening yet
+    for(int attempt = 0; attempt < 500; attempt++)
+    {
+        status = ns_socket_connect(socket, "127.0.0.1", port);
+        if(status == NS_SUCCESS)
+        {
+            status = ns_socket_set_no_delay(socket, true);
+            if(status != NS_SUCCESS)
+            {
+                return status;
+            }
+            return ns_socket_set_blocking(socket, false);
+        }
+        if(status != NS_SOCKET_CONNECTION_REFUSED)
+        {
+            return status;
+        }
+        ns_thread_sleep(10);
+    }
+
+    DebugPrintInfo();
+    return NS_ERROR;
+}
+
+void queue_request(LoadConnection *connection, uint64_t nanos)
+{
+    connection->send_nanos[connection->tail % BENCHMARK_MAX_OUTSTANDING] = nanos;
+    connection->tail++;
+    connection->num_unsent++;
+}
+
+/* Writes as many unsent requests as the socket takes, in one send where possible. */
+void flush_requests(LoadThread *load_thread, LoadConnection *connection)
+{
+    uint32_t request_length = strlen(benchmark_request);
+    char buffer[Kilobytes(8)];
+
+    while(connection->num_unsent > 0)
+    {
+        uint32_t num_requests = ns_math_min((int)connection->num_unsent, (int)(sizeof(buffer)/request_length));
+        for(uint32_t i = 0; i < num_requests; i++)
+        {
+            memcpy(&buffer[i*request_length], benchmark_request, request_length);
+        }
+
+        uint32_t length = (num_requests*request_length - connection->unsent_offset);
+        int bytes_sent = ns_socket_send(&connection->socket, &buffer[connection->unsent_offset], length);
+        if(bytes_sent == NS_SOCKET_WOULD_BLOCK)
+        {
+            return;
+        }
+        if(bytes_sent < 0)
+        {
+            connection->is_open = false;
+            load_thread->num_errors++;
+            return;
+        }
+
+        uint32_t total_sent = (connection->unsent_offset + bytes_sent);
+        connection->num_unsent -= (total_sent / request_length);
+        connection->unsent_offset = (total_sent % request_length);
+        if((uint32_t)bytes_sent < length)
+        {
+            return;
+        }
+    }
+}
+
+/* Reads whatever's there and records a latency for every complete response. */
+void receive_responses(LoadThread *load_thread, LoadConnection *connection, bool is_measuring)
+{
+    while(1)
+    {
+        uint32_t space = (BENCHMARK_READ_BUFFER_SIZE - 1 - connection->read_length);
+        int bytes_received = ns_socket_receive(&connection->socket, &connection->read_buffer[connection->read_length], space);
+        if(bytes_received == NS_SOCKET_WOULD_BLOCK)
+        {
+            return;
+        }
+        if(bytes_received <= 0)
+        {
+            connection->is_open = false;
+            load_thread->num_errors++;
+            return;
+        }
+
+        connection->read_length += bytes_received;
+        connection->read_buffer[connection->read_length] = 0;
+
+        uint64_t now_nanos = ns_time_get_nanos();
+        uint32_t parsed_length = 0;
+        while(connection->head != connection->tail)
+        {
+            char *response = &connection->read_buffer[parsed_length];
+            char *header_end = strstr(response, "\r\n\r\n");
+            if(header_end == NULL)
+            {
+                break;
+            }
+
+            uint32_t content_length = 0;
+            char *content_length_header = strstr(response, "Content-Length: ");
+            if(content_length_header != NULL && content_length_header < header_end)
+            {
+                content_length = atoi(content_length_header + strlen("Content-Length: "));
+            }
+
+            uint32_t response_length = (uint32_t)(header_end + 4 - response) + content_length;
+            if(parsed_length + response_length > connection->read_length)
+            {
+                break;
+            }
+            parsed_length += response_length;
+
+            uint64_t send_nanos = connection->send_nanos[connection->head % BENCHMARK_MAX_OUTSTANDING];
+            connection->head++;
+            if(is_measuring)
+            {
+                ns_histogram_record(&load_thread->histogram, now_nanos - send_nanos);
+                load_thread->num_completed++;
+            }
+        }
+
+        connection->read_length -= parsed_length;
+        memmove(connection->read_buffer, &connection->read_buffer[parsed_length], connection->read_length);
+    }
+}
+
+void *load_thread_entry(void *thread_input)
+{
+    LoadThread *load_thread = (LoadThread *)thread_input;
+    BenchmarkOptions *options = load_thread->options;
+    bool is_open_loop = (options->rate > 0);
+
+    NsPollFd *pollfds = (NsPollFd *)ns_memory_allocate(sizeof(NsPollFd)*load_thread->num_connections);
+
+    uint64_t start_nanos = ns_time_get_nanos();
+    uint64_t measure_nanos = start_nanos + (uint64_t)options->warmup_seconds*1000000000;
+    uint64_t end_nanos = measure_nanos + (uint64_t)options->duration_seconds*1000000000;
+
+    // each connection gets an equal share of the rate, and the connections are staggered
+    uint64_t interval_nanos = 0;
+    if(is_open_loop)
+    {
+        interval_nanos = (uint64_t)(1e9*load_thread->total_connections/options->rate);
+        for(int i = 0; i < load_thread->num_connections; i++)
+        {
+            int connection_index = (load_thread->first_connection_index + i);
+            load_thread->connections[i].next_send_nanos = start_nanos + interval_nanos*connection_index/load_thread->total_connections;
+        }
+    }
+
+    bool is_measuring = false;
+    while(1)
+    {
+        uint64_t now_nanos = ns_time_get_nanos();
+        if(now_nanos >= end_nanos)
+        {
+            break;
+        }
+        if(!is_measuring && now_nanos >= measure_nanos)
+        {
+            is_measuring = true;
+        }
+
+        uint64_t wake_nanos = ns_math_min(end_nanos, now_nanos + 100000000);
+        for(int i = 0; i < load_thread->num_connections; i++)
+        {
+            LoadConnection *connection = &load_thread->connections[i];
+            if(!connection->is_open)
+            {
+                pollfds[i].fd = -1;
+                continue;
+            }
+
+            if(is_open_loop)
+            {
+                // if the ring's full the schedule stalls rather than skips, and the late
+                // requests are still timed from when they were due
+                while(connection->next_send_nanos <= now_nanos &&
+                      (connection->tail - connection->head) < BENCHMARK_MAX_OUTSTANDING)
+                {
+                    queue_request(connection, connection->next_send_nanos);
+                    connection->next_send_nanos += interval_nanos;
+                }
+                wake_nanos = ns_math_min(wake_nanos, connection->next_send_nanos);
+            }
+            else
+            {
+                while((int)(connection->tail - connection->head) < options->pipeline)
+                {
+                    queue_request(connection, now_nanos);
+                }
+            }
+
+            flush_requests(load_thread, connection);
+
+            pollfds[i].fd = connection->socket.internal_socket;
+            pollfds[i].events = (POLLIN | ((connection->num_unsent > 0) ? POLLOUT : 0));
+            pollfds[i].revents = 0;
+        }
+
+        uint64_t timeout_nanos = (wake_nanos > now_nanos) ? (wake_nanos - now_nanos) : 0;
+        timespec timeout;
+        timeout.tv_sec = (timeout_nanos / 1000000000);
+        timeout.tv_nsec = (timeout_nanos % 1000000000);
+        int num_fds_ready = ppoll(pollfds, load_thread->num_connections, &timeout, NULL);
+        if(num_fds_ready < 0)
+        {
+            DebugPrintInfo();
+            break;
+        }
+
+        for(int i = 0; i < load_thread->num_connections && num_fds_ready > 0; i++)
+        {
+            if(pollfds[i].fd < 0 || pollfds[i].revents == 0)
+            {
+                continue;
+            }
+            num_fds_ready--;
+
+            LoadConnection *connection = &load_thread->connections[i];
+            if((pollfds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0)
+            {
+                receive_responses(load_thread, connection, is_measuring);
+            }
+        }
+    }
+
+    ns_memory_free(pollfds);
+    ns_semaphore_put(load_thread->done_semaphore);
+
+    return NULL;
+}
+
+struct BenchmarkResult
+{
+    double requests_per_second;
+    NsHistogram histogram;
+    uint64_t num_errors;
+};
+
+int run_load(BenchmarkOptions *options, const char *port, int num_connections, BenchmarkResult *result)
+{
+    int status;
+
+    LoadConnection *connections = (LoadConnection *)ns_memory_allocate(sizeof(LoadConnection)*num_connections);
+    memset(connections, 0, sizeof(LoadConnection)*num_connections);
+    for(int i = 0; i < num_connections; i++)
+    {
+        status = connect_with_retry(&connections[i].socket, port);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        connections[i].is_open = true;
+    }
+
+    NsSemaphore done_semaphore;
+    ns_semaphore_create(&done_semaphore, 0);
+
+    int num_threads = ns_math_min(options->threads, num_connections);
+    LoadThread *load_threads = (LoadThread *)ns_memory_allocate(sizeof(LoadThread)*num_threads);
+    int first_connection_index = 0;
+    for(int i = 0; i < num_threads; i++)
+    {
+        LoadThread *load_thread = &load_threads[i];
+        int num_thread_connections = (num_connections / num_threads) + ((i < num_connections % num_threads) ? 1 : 0);
+
+        load_thread->options = options;
+        load_thread->connections = &connections[first_connection_index];
+        load_thread->num_connections = num_thread_connections;
+        load_thread->total_connections = num_connections;
+        load_thread->first_connection_index = first_connection_index;
+        load_thread->num_completed = 0;
+        load_thread->num_errors = 0;
+        load_thread->done_semaphore = &done_semaphore;
+        ns_histogram_create(&load_thread->histogram);
+
+        first_connection_index += num_thread_connections;
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        status = ns_thread_create(&load_threads[i].thread, load_thread_entry, &load_threads[i]);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_semaphore_get(&done_semaphore);
+    }
+
+    uint64_t num_completed = 0;
+    result->num_errors = 0;
+    ns_histogram_create(&result->histogram);
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_histogram_merge(&result->histogram, &load_threads[i].histogram);
+        ns_histogram_destroy(&load_threads[i].histogram);
+        num_completed += load_threads[i].num_completed;
+        result->num_errors += load_threads[i].num_errors;
+    }
+    result->requests_per_second = (double)num_completed/options->duration_seconds;
+
+    for(int i = 0; i < num_connections; i++)
+    {
+        ns_socket_close(&connections[i].socket);
+    }
+    ns_memory_free(load_threads);
+    ns_memory_free(connections);
+
+    return NS_SUCCESS;
+}
+
+/* Somewhere for the server to serve from; it looks in the working directory. */
+int create_document_root(char *dir_name)
+{
+    if(mkdtemp(dir_name) == NULL || chdir(dir_name) != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    const char *files[][2] = {
+        { "index.html", "<!DOCTYPE html>\n<html><head><title>ns</title></head>\n<body><p>hello from ns_http_server</p></body></html>\n" },
+        { "404.html", "<!DOCTYPE html>\n<html><body><p>not found</p></body></html>\n" },
+    };
+    for(uint32_t i = 0; i < ArrayCount(files); i++)
+    {
+        FILE *file = fopen(files[i][0], "wb");
+        if(file == NULL)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+        fputs(files[i][1], file);
+        fclose(file);
+    }
+
+    return NS_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options = {};
+    options.rate = 0;
+    options.duration_seconds = 5;
+    options.warmup_seconds = 1;
+    options.connections = 64;
+    options.pipeline = 4;
+    options.threads = 2;
+    options.placement = NS_NUMA_PLACEMENT_NONE;
+    options.processes = 0;
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "--rate")) options.rate = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "--duration")) options.duration_seconds = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--warmup")) options.warmup_seconds = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--connections")) options.connections = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--pipeline")) options.pipeline = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--threads")) options.threads = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--placement") && !strcmp(argv[i + 1], "spread")) options.placement = NS_NUMA_PLACEMENT_SPREAD;
+        else if(!strcmp(argv[i], "--placement") && !strcmp(argv[i + 1], "compact")) options.placement = NS_NUMA_PLACEMENT_COMPACT;
+        else if(!strcmp(argv[i], "--placement") && !strcmp(argv[i + 1], "none")) options.placement = NS_NUMA_PLACEMENT_NONE;
+        else if(!strcmp(argv[i], "--processes")) options.processes = atoi(argv[i + 1]);
+        else
+        {
+            printf("unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    options.pipeline = ns_math_max(1, ns_math_min(options.pipeline, BENCHMARK_MAX_OUTSTANDING));
+    options.duration_seconds = ns_math_max(1, options.duration_seconds);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if(options.placement != NS_NUMA_PLACEMENT_NONE && ns_numa_startup() != NS_SUCCESS)
+    {
+        return 1;
+    }
+
+    char dir_name[] = "/tmp/ns_http_server_benchmark_XXXXXX";
+    if(create_document_root(dir_name) != NS_SUCCESS)
+    {
+        return 1;
+    }
+
+    if(options.rate > 0)
+    {
+        printf("open loop, %.0f requests/s, %d client threads\n", options.rate, options.threads);
+    }
+    else
+    {
+        printf("closed loop, %d in flight per connection, %d client threads\n", options.pipeline, options.threads);
+    }
+    printf("%-12s %-16s %-12s %12s %10s %10s %10s %10s %8s\n", "max_threads", "max_connections", "connections",
+           "requests/s", "p50 us", "p99 us", "p99.9 us", "max us", "errors");
+
+    int configuration_index = 0;
+    for(uint32_t t = 0; t < ArrayCount(benchmark_max_threads); t++)
+    {
+        for(uint32_t c = 0; c < ArrayCount(benchmark_max_connections); c++)
+        {
+            int max_threads = benchmark_max_threads[t];
+            int max_connections = benchmark_max_connections[c];
+            int num_connections = ns_math_min(options.connections, max_connections);
+
+            // a port per configuration, so one server's leftovers can't get in the next's way
+            char port[16];
+            snprintf(port, sizeof(port), "%d", BENCHMARK_BASE_PORT + configuration_index++);
+
+            fflush(stdout);
+            pid_t pid = fork();
+            if(pid == 0)
+            {
+                // the server talks a lot
+                if(freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL)
+                {
+                    _exit(1);
+                }
+                if(options.processes > 0)
+                {
+                    // the workers die with the supervisor, so the SIGKILL below gets them too
+                    NsSocket listen_socket;
+                    NsHttpServerForkOptions fork_options = { max_connections, max_threads };
+                    NsForkSupervisor supervisor;
+                    if(ns_socket_listen(&listen_socket, port, 128) != NS_SUCCESS ||
+                       ns_fork_supervisor_create(&supervisor, &listen_socket, options.processes,
+                                                 ns_http_server_fork_worker_entry, &fork_options) != NS_SUCCESS ||
+                       ns_fork_supervisor_run(&supervisor) != NS_SUCCESS)
+                    {
+                        _exit(1);
+                    }
+                    _exit(0);
+                }
+                if(ns_http_server_startup(port, max_connections, max_threads, options.placement) != NS_SUCCESS)
+                {
+                    _exit(1);
+                }
+                while(1)
+                {
+                    pause();
+                }
+            }
+            if(pid < 0)
+            {
+                DebugPrintInfo();
+                return 1;
+            }
+
+            BenchmarkResult result;
+            int status = run_load(&options, port, num_connections, &result);
+
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+
+            if(status != NS_SUCCESS)
+            {
+                printf("%-12d %-16d failed\n", max_threads, max_connections);
+                continue;
+            }
+
+            printf("%-12d %-16d %-12d %12.0f %10.1f %10.1f %10.1f %10.1f %8llu\n",
+                   max_threads, max_connections, num_connections, result.requests_per_second,
+                   ns_histogram_get_percentile(&result.histogram, 50.0)/1000.0,
+                   ns_histogram_get_percentile(&result.histogram, 99.0)/1000.0,
+                   ns_histogram_get_percentile(&result.histogram, 99.9)/1000.0,
+                   ns_histogram_get_max(&result.histogram)/1000.0,
+                   (unsigned long long)result.num_errors);
+
+            ns_histogram_destroy(&result.histogram);
+        }
+    }
+
+    unlink("index.html");
+    unlink("404.html");
+    if(chdir("/") == 0)
+    {
+        rmdir(dir_name);
+    }
+
+    return 0;
+}
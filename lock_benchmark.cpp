@@ -0,0 +1,310 @@
+#include "ns_common.h"
+#include "ns_time.h"
+#include "ns_atomic.h"
+#include "ns_thread.h"
+#include "ns_mutex.h"
+#include "ns_condv.h"
+#include "ns_semaphore.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* Build: g++ -O2 -o lock_benchmark lock_benchmark.cpp -lpthread
+          g++ -O2 -DNS_FUTEX -o lock_benchmark_futex lock_benchmark.cpp -lpthread
+   Times NsMutex, NsCondv and NsSemaphore uncontended, contended and handing off between
+   threads. Build it both ways and compare the pthread and futex implementations. Add
+   -DNS_LOCK_PROFILE to also get a per call site report at the end.
+
+   Options:
+     --threads N     threads in the contended and round robin tests (default 4)
+     --iterations N  lock/unlock or put/get pairs per thread (default 2000000)
+     --handoffs N    handoffs in the ping pong and round robin tests (default 100000) */
+
+#if defined(NS_FUTEX)
+    #define BENCHMARK_IMPLEMENTATION "futex"
+#else
+    #define BENCHMARK_IMPLEMENTATION "pthread"
+#endif
+
+struct BenchmarkOptions
+{
+    int threads;
+    int iterations;
+    int handoffs;
+};
+
+struct BenchmarkShared
+{
+    BenchmarkOptions *options;
+    NsMutex mutex;
+    NsCondv condv;
+    NsSemaphore semaphores[2];
+    NsSemaphore done_semaphore;
+    NsSemaphore idle_semaphore; // never put
+
+    uint32_t num_ready;
+    uint32_t is_go;
+
+    uint64_t counter; // guarded by mutex
+    uint32_t turn; // guarded by mutex
+};
+
+struct BenchmarkThread
+{
+    NsThread thread;
+    BenchmarkShared *shared;
+    uint32_t index;
+};
+
+/* ns_common.h leaves logging to the program. */
+internal void _Log(const char *Format, ...)
+{
+    va_list args;
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+}
+
+#if defined(NS_LOCK_PROFILE)
+/* The profile's buckets come from ns_histogram.h, which leaves allocating to the program
+   too. */
+internal void *ns_memory_allocate(size_t size)
+{
+    void *result = malloc(size);
+    return result;
+}
+
+internal void ns_memory_free(void *memory)
+{
+    free(memory);
+}
+#endif
+
+/* Lines everyone up so the timed part starts together. */
+void wait_for_go(BenchmarkShared *shared)
+{
+    ns_atomic_fetch_add(&shared->num_ready, (uint32_t)1);
+    while(!ns_atomic_load(&shared->is_go))
+    {
+        ns_atomic_pause();
+    }
+}
+
+void print_result(const char *name, int num_threads, uint64_t num_ops, uint64_t nanos)
+{
+    printf("  %-32s threads: %2d  %8.1f ns/op  %8.2f Mops/s\n", name, num_threads,
+           (double)nanos/num_ops, num_ops*1e3/nanos);
+}
+
+/* Starts num_threads threads on entry, lets them go at once and returns how long it took
+   until the last one finished. */
+uint64_t run_threads(BenchmarkShared *shared, int num_threads, void *(*entry)(void *))
+{
+    shared->num_ready = 0;
+    shared->is_go = 0;
+
+    BenchmarkThread *threads = (BenchmarkThread *)malloc(sizeof(BenchmarkThread)*num_threads);
+    for(int i = 0; i < num_threads; i++)
+    {
+        threads[i].shared = shared;
+        threads[i].index = i;
+        ns_thread_create(&threads[i].thread, entry, &threads[i]);
+    }
+
+    while(ns_atomic_load(&shared->num_ready) < (uint32_t)num_threads)
+    {
+        ns_thread_sleep(1);
+    }
+
+    uint64_t start_nanos = ns_time_get_nanos();
+    ns_atomic_store(&shared->is_go, (uint32_t)1);
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_semaphore_get(&shared->done_semaphore);
+    }
+    uint64_t nanos = (ns_time_get_nanos() - start_nanos);
+
+    // the threads have put their last semaphore, but may not have returned yet
+    ns_thread_sleep(10);
+    free(threads);
+    return nanos;
+}
+
+void *idle_thread_entry(void *thread_input)
+{
+    BenchmarkShared *shared = (BenchmarkShared *)thread_input;
+    ns_semaphore_get(&shared->idle_semaphore);
+    return NULL;
+}
+
+void *contended_mutex_entry(void *thread_input)
+{
+    BenchmarkThread *thread = (BenchmarkThread *)thread_input;
+    BenchmarkShared *shared = thread->shared;
+    wait_for_go(shared);
+
+    for(int i = 0; i < shared->options->iterations; i++)
+    {
+        ns_mutex_lock(&shared->mutex);
+        shared->counter++;
+        ns_mutex_unlock(&shared->mutex);
+    }
+
+    ns_semaphore_put(&shared->done_semaphore);
+    return NULL;
+}
+
+void *ping_pong_entry(void *thread_input)
+{
+    BenchmarkThread *thread = (BenchmarkThread *)thread_input;
+    BenchmarkShared *shared = thread->shared;
+    wait_for_go(shared);
+
+    // thread 0 serves first
+    NsSemaphore *mine = &shared->semaphores[thread->index];
+    NsSemaphore *theirs = &shared->semaphores[thread->index ^ 1];
+    for(int i = 0; i < shared->options->handoffs; i++)
+    {
+        if(thread->index == 0)
+        {
+            ns_semaphore_put(theirs);
+            ns_semaphore_get(mine);
+        }
+        else
+        {
+            ns_semaphore_get(mine);
+            ns_semaphore_put(theirs);
+        }
+    }
+
+    ns_semaphore_put(&shared->done_semaphore);
+    return NULL;
+}
+
+/* Every thread waits on one condv for its turn, and each turn ends with a broadcast, so
+   all but one of the woken threads go straight back to sleep. */
+void *round_robin_entry(void *thread_input)
+{
+    BenchmarkThread *thread = (BenchmarkThread *)thread_input;
+    BenchmarkShared *shared = thread->shared;
+    wait_for_go(shared);
+
+    uint32_t num_threads = (uint32_t)shared->options->threads;
+    uint32_t num_turns = (uint32_t)shared->options->handoffs;
+
+    ns_mutex_lock(&shared->mutex);
+    while(1)
+    {
+        while(shared->turn < num_turns && (shared->turn % num_threads) != thread->index)
+        {
+            ns_condv_wait(&shared->condv, &shared->mutex);
+        }
+        if(shared->turn >= num_turns)
+        {
+            break;
+        }
+
+        shared->turn++;
+        ns_condv_broadcast(&shared->condv);
+    }
+    ns_mutex_unlock(&shared->mutex);
+
+    ns_semaphore_put(&shared->done_semaphore);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options;
+    options.threads = 4;
+    options.iterations = 2000000;
+    options.handoffs = 100000;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--iterations") && i + 1 < argc)
+        {
+            options.iterations = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--handoffs") && i + 1 < argc)
+        {
+            options.handoffs = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--threads N] [--iterations N] [--handoffs N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchmarkShared *shared = (BenchmarkShared *)calloc(1, sizeof(BenchmarkShared));
+    shared->options = &options;
+    ns_mutex_create(&shared->mutex);
+    ns_condv_create(&shared->condv);
+    ns_semaphore_create(&shared->semaphores[0], 0);
+    ns_semaphore_create(&shared->semaphores[1], 0);
+    ns_semaphore_create(&shared->done_semaphore, 0);
+    ns_semaphore_create(&shared->idle_semaphore, 0);
+
+    printf("implementation: %s\n", BENCHMARK_IMPLEMENTATION);
+
+    // glibc skips the atomics while a process only has one thread, which a server never is
+    NsThread idle_thread;
+    ns_thread_create(&idle_thread, idle_thread_entry, shared);
+
+    // uncontended: one thread, nobody else touching them
+    {
+        uint64_t start_nanos = ns_time_get_nanos();
+        for(int i = 0; i < options.iterations; i++)
+        {
+            ns_mutex_lock(&shared->mutex);
+            shared->counter++;
+            ns_mutex_unlock(&shared->mutex);
+        }
+        print_result("mutex lock/unlock, uncontended", 1, options.iterations, ns_time_get_nanos() - start_nanos);
+
+        start_nanos = ns_time_get_nanos();
+        for(int i = 0; i < options.iterations; i++)
+        {
+            ns_semaphore_put(&shared->semaphores[0]);
+            ns_semaphore_get(&shared->semaphores[0]);
+        }
+        print_result("semaphore put/get, uncontended", 1, options.iterations, ns_time_get_nanos() - start_nanos);
+    }
+
+    // contended: every thread hammering one mutex
+    for(int num_threads = 2; num_threads <= options.threads; num_threads *= 2)
+    {
+        shared->counter = 0;
+        uint64_t nanos = run_threads(shared, num_threads, contended_mutex_entry);
+        uint64_t num_ops = (uint64_t)num_threads*options.iterations;
+        print_result("mutex lock/unlock, contended", num_threads, num_ops, nanos);
+        if(shared->counter != num_ops)
+        {
+            printf("  counter is %llu, expected %llu!\n", (unsigned long long)shared->counter, (unsigned long long)num_ops);
+        }
+    }
+
+    // handoffs: how fast a waiting thread gets going again
+    {
+        uint64_t nanos = run_threads(shared, 2, ping_pong_entry);
+        print_result("semaphore ping pong, per handoff", 2, 2*(uint64_t)options.handoffs, nanos);
+
+        shared->turn = 0;
+        nanos = run_threads(shared, options.threads, round_robin_entry);
+        print_result("condv broadcast round robin", options.threads, options.handoffs, nanos);
+    }
+
+#if defined(NS_LOCK_PROFILE)
+    printf("\n");
+    ns_lock_profile_print_report();
+#endif
+
+    return 0;
+}
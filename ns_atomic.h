@@ -0,0 +1,125 @@
+#ifndef NS_ATOMIC_H
+#define NS_ATOMIC_H
+
+#include "ns_common.h"
+
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #define NS_CACHE_LINE_SIZE 64
+#endif
+
+
+/* API */
+
+/* Thin wrappers over the compiler's atomic builtins. Plain loads and stores are
+   acquire/release; read-modify-writes are acq_rel. */
+
+template <typename type>
+inline type
+ns_atomic_load(type *ptr)
+{
+    type result = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    return result;
+}
+
+template <typename type>
+inline type
+ns_atomic_load_relaxed(type *ptr)
+{
+    type result = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+    return result;
+}
+
+template <typename type>
+inline void
+ns_atomic_store(type *ptr, type value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+template <typename type>
+inline void
+ns_atomic_store_relaxed(type *ptr, type value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELAXED);
+}
+
+/* Returns the value before the add. */
+template <typename type>
+inline type
+ns_atomic_fetch_add(type *ptr, type value)
+{
+    type result = __atomic_fetch_add(ptr, value, __ATOMIC_ACQ_REL);
+    return result;
+}
+
+/* For counters and the like, where nothing else is ordered by the add. */
+template <typename type>
+inline type
+ns_atomic_fetch_add_relaxed(type *ptr, type value)
+{
+    type result = __atomic_fetch_add(ptr, value, __ATOMIC_RELAXED);
+    return result;
+}
+
+/* Returns the value before the subtract. */
+template <typename type>
+inline type
+ns_atomic_fetch_sub(type *ptr, type value)
+{
+    type result = __atomic_fetch_sub(ptr, value, __ATOMIC_ACQ_REL);
+    return result;
+}
+
+template <typename type>
+inline type
+ns_atomic_exchange(type *ptr, type value)
+{
+    type result = __atomic_exchange_n(ptr, value, __ATOMIC_ACQ_REL);
+    return result;
+}
+
+/* On failure, *expected is updated to the current value. */
+template <typename type>
+inline bool
+ns_atomic_compare_exchange(type *ptr, type *expected, type desired)
+{
+    bool result = __atomic_compare_exchange_n(ptr, expected, desired, false,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return result;
+}
+
+/* Orders the relaxed loads before it with the loads after it, the way an acquire load
+   would if there were one to hang it on. */
+inline void
+ns_atomic_fence_acquire()
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+/* Orders the stores before it with the stores after it. */
+inline void
+ns_atomic_fence_release()
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Orders everything before it with everything after it, stores before loads included,
+   which is what "set my flag, then check yours" needs. */
+inline void
+ns_atomic_fence()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Hint to the cpu that we're in a spin loop. */
+inline void
+ns_atomic_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif
@@ -0,0 +1,495 @@
+#ifndef NS_BASE64_H
+#define NS_BASE64_H
+
+#include "ns_common.h"
+#include "ns_util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define NS_BASE64_X86
+    #include <immintrin.h>
+#endif
+
+
+#define NS_BASE64_INVALID_INPUT -4
+
+enum NsBase64Implementation
+{
+    NS_BASE64_BEST, // pick the fastest the cpu supports
+    NS_BASE64_SCALAR,
+    NS_BASE64_SSE, // ssse3 + sse4.1
+    NS_BASE64_AVX2,
+};
+
+
+/* Internal */
+
+internal const char ns_base64_alphabet[64] = {
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+    'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/',
+};
+
+/* Inverse of ns_base64_alphabet; 0xff for anything that isn't in it. */
+internal uint8_t ns_base64_decode_table[256];
+internal bool ns_base64_is_decode_table_initialized;
+
+internal void
+ns_base64_init_decode_table()
+{
+    if(ns_base64_is_decode_table_initialized)
+    {
+        return;
+    }
+
+    // racing initializers all write the same values, so this is benign
+    memset(ns_base64_decode_table, 0xff, sizeof(ns_base64_decode_table));
+    for(int i = 0; i < 64; i++)
+    {
+        ns_base64_decode_table[(uint8_t)ns_base64_alphabet[i]] = (uint8_t)i;
+    }
+    ns_base64_is_decode_table_initialized = true;
+}
+
+internal NsBase64Implementation
+ns_base64_resolve_implementation(NsBase64Implementation implementation)
+{
+    if(implementation != NS_BASE64_BEST)
+    {
+        return implementation;
+    }
+
+#if defined(NS_BASE64_X86)
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return NS_BASE64_AVX2;
+    }
+    else if(__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1"))
+    {
+        return NS_BASE64_SSE;
+    }
+#endif
+
+    return NS_BASE64_SCALAR;
+}
+
+internal uint64_t
+ns_base64_encode_scalar(const uint8_t *src, uint64_t length, char *dest)
+{
+    char *dest_start = dest;
+
+    uint64_t i;
+    for(i = 0; (i + 3) <= length; i += 3, dest += 4)
+    {
+        uint32_t three_set = ((src[i + 0] << 16) |
+                              (src[i + 1] <<  8) |
+                              (src[i + 2] <<  0));
+
+        dest[0] = ns_base64_alphabet[(three_set >> 18) & 0x3f];
+        dest[1] = ns_base64_alphabet[(three_set >> 12) & 0x3f];
+        dest[2] = ns_base64_alphabet[(three_set >>  6) & 0x3f];
+        dest[3] = ns_base64_alphabet[(three_set >>  0) & 0x3f];
+    }
+
+    // handle remainder
+    uint64_t remainder = (length - i);
+    if(remainder > 0)
+    {
+        uint32_t three_set = (src[i + 0] << 16);
+        if(remainder == 2)
+        {
+            three_set |= (src[i + 1] << 8);
+        }
+
+        dest[0] = ns_base64_alphabet[(three_set >> 18) & 0x3f];
+        dest[1] = ns_base64_alphabet[(three_set >> 12) & 0x3f];
+        dest[2] = (remainder == 2) ? ns_base64_alphabet[(three_set >> 6) & 0x3f] : '=';
+        dest[3] = '=';
+        dest += 4;
+    }
+
+    uint64_t result = (uint64_t)(dest - dest_start);
+    return result;
+}
+
+/* Length must be a multiple of 4. Returns NS_BASE64_INVALID_INPUT on any character outside
+   the alphabet or misplaced padding. */
+internal int
+ns_base64_decode_scalar(const char *src, uint64_t length, uint8_t *dest, uint64_t *decoded_length)
+{
+    uint8_t *dest_start = dest;
+
+    for(uint64_t i = 0; i < length; i += 4)
+    {
+        bool is_last_quad = ((i + 4) == length);
+
+        // padding can only show up in the last two characters of the last quad
+        int num_padding = 0;
+        if(is_last_quad && src[i + 3] == '=')
+        {
+            num_padding = (src[i + 2] == '=') ? 2 : 1;
+        }
+
+        uint8_t a = ns_base64_decode_table[(uint8_t)src[i + 0]];
+        uint8_t b = ns_base64_decode_table[(uint8_t)src[i + 1]];
+        uint8_t c = (num_padding >= 2) ? 0 : ns_base64_decode_table[(uint8_t)src[i + 2]];
+        uint8_t d = (num_padding >= 1) ? 0 : ns_base64_decode_table[(uint8_t)src[i + 3]];
+        if((a | b | c | d) & 0xc0)
+        {
+            return NS_BASE64_INVALID_INPUT;
+        }
+
+        uint32_t three_set = ((a << 18) | (b << 12) | (c << 6) | (d << 0));
+        *dest++ = (uint8_t)(three_set >> 16);
+        if(num_padding < 2)
+        {
+            *dest++ = (uint8_t)(three_set >> 8);
+        }
+        if(num_padding < 1)
+        {
+            *dest++ = (uint8_t)(three_set >> 0);
+        }
+    }
+
+    *decoded_length = (uint64_t)(dest - dest_start);
+    return NS_SUCCESS;
+}
+
+#if defined(NS_BASE64_X86)
+/* The vector kernels follow Muła and Lemire, "Faster Base64 Encoding and Decoding using
+   AVX2 Instructions". Encoding splits every 3 bytes into 4 6-bit indices with two
+   multiplies, then turns indices into ascii by adding an offset picked with pshufb.
+   Decoding does the reverse, using two nibble lookups to spot invalid characters. */
+
+inline internal __attribute__((target("ssse3,sse4.1"))) __m128i
+ns_base64_encode_sse_kernel(__m128i input)
+{
+    // 12 bytes -> 16 6-bit indices, one per byte
+    input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+
+    // indices -> ascii
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0);
+    __m128i lut_index = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    lut_index = _mm_or_si128(lut_index, _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+    __m128i result = _mm_add_epi8(indices, _mm_shuffle_epi8(shift_lut, lut_index));
+    return result;
+}
+
+inline internal __attribute__((target("avx2"))) __m256i
+ns_base64_encode_avx2_kernel(__m256i input)
+{
+    input = _mm256_shuffle_epi8(input, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                       10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m256i t0 = _mm256_and_si256(input, _mm256_set1_epi32(0x0fc0fc00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(input, _mm256_set1_epi32(0x003f03f0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i indices = _mm256_or_si256(t1, t3);
+
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0);
+    __m256i lut_index = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    __m256i is_upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    lut_index = _mm256_or_si256(lut_index, _mm256_and_si256(is_upper, _mm256_set1_epi8(13)));
+    __m256i result = _mm256_add_epi8(indices, _mm256_shuffle_epi8(shift_lut, lut_index));
+    return result;
+}
+
+/* 16 ascii characters -> 16 6-bit values. Returns false if any character is outside the
+   alphabet (padding included; that's left to the scalar tail). */
+inline internal __attribute__((target("ssse3,sse4.1"))) bool
+ns_base64_decode_sse_kernel(__m128i input, __m128i *values)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(input, 4), _mm_set1_epi8(0x0f));
+    __m128i lo_nibbles = _mm_and_si128(input, _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if(!_mm_testz_si128(lo, hi))
+    {
+        return false;
+    }
+
+    __m128i is_slash = _mm_cmpeq_epi8(input, _mm_set1_epi8('/'));
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(is_slash, hi_nibbles));
+    *values = _mm_add_epi8(input, roll);
+    return true;
+}
+
+inline internal __attribute__((target("avx2"))) bool
+ns_base64_decode_avx2_kernel(__m256i input, __m256i *values)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(input, 4), _mm256_set1_epi8(0x0f));
+    __m256i lo_nibbles = _mm256_and_si256(input, _mm256_set1_epi8(0x0f));
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if(!_mm256_testz_si256(lo, hi))
+    {
+        return false;
+    }
+
+    __m256i is_slash = _mm256_cmpeq_epi8(input, _mm256_set1_epi8('/'));
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(is_slash, hi_nibbles));
+    *values = _mm256_add_epi8(input, roll);
+    return true;
+}
+
+/* Reads 16 bytes per 12 it encodes, so the loop stops while there's still slack. */
+internal __attribute__((target("ssse3,sse4.1"))) uint64_t
+ns_base64_encode_sse(const uint8_t *src, uint64_t length, char *dest)
+{
+    uint64_t i = 0;
+    char *dest_start = dest;
+    for(; (i + 16) <= length; i += 12, dest += 16)
+    {
+        __m128i input = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)dest, ns_base64_encode_sse_kernel(input));
+    }
+
+    dest += ns_base64_encode_scalar(&src[i], (length - i), dest);
+
+    uint64_t result = (uint64_t)(dest - dest_start);
+    return result;
+}
+
+internal __attribute__((target("avx2"))) uint64_t
+ns_base64_encode_avx2(const uint8_t *src, uint64_t length, char *dest)
+{
+    uint64_t i = 0;
+    char *dest_start = dest;
+    for(; (i + 28) <= length; i += 24, dest += 32)
+    {
+        // 12 bytes into each lane, since pshufb can't cross lanes
+        __m128i lo = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *)&src[i + 12]);
+        __m256i input = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *)dest, ns_base64_encode_avx2_kernel(input));
+    }
+
+    dest += ns_base64_encode_scalar(&src[i], (length - i), dest);
+
+    uint64_t result = (uint64_t)(dest - dest_start);
+    return result;
+}
+
+/* Writes 16 bytes per 12 it decodes, so the loop stops early enough that the scalar tail
+   overwrites the excess and we never write past the decoded length. */
+internal __attribute__((target("ssse3,sse4.1"))) int
+ns_base64_decode_sse(const char *src, uint64_t length, uint8_t *dest, uint64_t *decoded_length)
+{
+    uint64_t i = 0;
+    uint8_t *dest_start = dest;
+    for(; (i + 24) <= length; i += 16, dest += 12)
+    {
+        __m128i values;
+        __m128i input = _mm_loadu_si128((const __m128i *)&src[i]);
+        if(!ns_base64_decode_sse_kernel(input, &values))
+        {
+            return NS_BASE64_INVALID_INPUT;
+        }
+
+        // pack 4 6-bit values into 3 bytes
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        merged = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)dest, merged);
+    }
+
+    uint64_t tail_length;
+    int status = ns_base64_decode_scalar(&src[i], (length - i), dest, &tail_length);
+    if(status != NS_SUCCESS)
+    {
+        return status;
+    }
+
+    *decoded_length = ((uint64_t)(dest - dest_start) + tail_length);
+    return NS_SUCCESS;
+}
+
+internal __attribute__((target("avx2"))) int
+ns_base64_decode_avx2(const char *src, uint64_t length, uint8_t *dest, uint64_t *decoded_length)
+{
+    uint64_t i = 0;
+    uint8_t *dest_start = dest;
+    for(; (i + 48) <= length; i += 32, dest += 24)
+    {
+        __m256i values;
+        __m256i input = _mm256_loadu_si256((const __m256i *)&src[i]);
+        if(!ns_base64_decode_avx2_kernel(input, &values))
+        {
+            return NS_BASE64_INVALID_INPUT;
+        }
+
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        // 12 bytes at the bottom of each lane; squeeze them together
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *)dest, merged);
+    }
+
+    uint64_t tail_length;
+    int status = ns_base64_decode_scalar(&src[i], (length - i), dest, &tail_length);
+    if(status != NS_SUCCESS)
+    {
+        return status;
+    }
+
+    *decoded_length = ((uint64_t)(dest - dest_start) + tail_length);
+    return NS_SUCCESS;
+}
+#endif
+
+/* API */
+
+bool
+ns_base64_check_supported(NsBase64Implementation implementation)
+{
+    switch(implementation)
+    {
+        case NS_BASE64_BEST:
+        case NS_BASE64_SCALAR:
+        {
+            return true;
+        } break;
+
+#if defined(NS_BASE64_X86)
+        case NS_BASE64_SSE:
+        {
+            return (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1"));
+        } break;
+
+        case NS_BASE64_AVX2:
+        {
+            return __builtin_cpu_supports("avx2");
+        } break;
+#endif
+
+        default:
+        {
+            return false;
+        } break;
+    }
+}
+
+/* Not including a null terminator. */
+uint64_t
+ns_base64_get_encoded_length(uint64_t length)
+{
+    uint64_t result = (4*((length + 2)/3));
+    return result;
+}
+
+/* An upper bound; padding makes the actual length up to 2 less. */
+uint64_t
+ns_base64_get_max_decoded_length(uint64_t encoded_length)
+{
+    uint64_t result = (3*(encoded_length/4));
+    return result;
+}
+
+/* Padded, and not null terminated. dest must hold ns_base64_get_encoded_length(length)
+   characters. Returns the number of characters written. */
+uint64_t
+ns_base64_encode(const void *src, uint64_t length, char *dest,
+                 NsBase64Implementation implementation = NS_BASE64_BEST)
+{
+    const uint8_t *bytes = (const uint8_t *)src;
+
+    uint64_t result;
+    switch(ns_base64_resolve_implementation(implementation))
+    {
+#if defined(NS_BASE64_X86)
+        case NS_BASE64_SSE:
+        {
+            result = ns_base64_encode_sse(bytes, length, dest);
+        } break;
+
+        case NS_BASE64_AVX2:
+        {
+            result = ns_base64_encode_avx2(bytes, length, dest);
+        } break;
+#endif
+
+        default:
+        {
+            result = ns_base64_encode_scalar(bytes, length, dest);
+        } break;
+    }
+
+    return result;
+}
+
+/* Padding is required. dest must hold ns_base64_get_max_decoded_length(length) bytes.
+   Returns NS_BASE64_INVALID_INPUT if the input isn't valid base64; dest may have been
+   partially written in that case. */
+int
+ns_base64_decode(const char *src, uint64_t length, void *dest, uint64_t *decoded_length,
+                 NsBase64Implementation implementation = NS_BASE64_BEST)
+{
+    if((length & 3) != 0)
+    {
+        return NS_BASE64_INVALID_INPUT;
+    }
+
+    ns_base64_init_decode_table();
+
+    uint8_t *bytes = (uint8_t *)dest;
+
+    int status;
+    switch(ns_base64_resolve_implementation(implementation))
+    {
+#if defined(NS_BASE64_X86)
+        case NS_BASE64_SSE:
+        {
+            status = ns_base64_decode_sse(src, length, bytes, decoded_length);
+        } break;
+
+        case NS_BASE64_AVX2:
+        {
+            status = ns_base64_decode_avx2(src, length, bytes, decoded_length);
+        } break;
+#endif
+
+        default:
+        {
+            status = ns_base64_decode_scalar(src, length, bytes, decoded_length);
+        } break;
+    }
+
+    return status;
+}
+
+#endif
@@ -22,6 +22,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
 
 typedef uint64_t u64;
 typedef int64_t s64;
@@ -40,9 +43,20 @@ typedef int8_t s8;
 #define NS_MULTIPLE_ERRORS -2
 #define NS_TIMED_OUT -3
 
+#define NS_LOG_LEVEL_DEBUG 0
+#define NS_LOG_LEVEL_INFO 1
+#define NS_LOG_LEVEL_WARN 2
+#define NS_LOG_LEVEL_ERROR 3
+#define NS_LOG_LEVEL_NONE 4
+
+/* Log records below this level compile to nothing. See ns_log.h. */
+#if !defined(NS_LOG_LEVEL)
+    #define NS_LOG_LEVEL NS_LOG_LEVEL_INFO
+#endif
+
 // TODO: print stack trace instead. use backtrace() and addr2line.
-#define DebugPrintInfo() fprintf(stderr, "thread: %lu. %s %s line: %d\n", \
-                                 GetThread(), __FILE__, __PRETTY_FUNCTION__, __LINE__)
+#define DebugPrintInfo() \
+    do { if(NS_LOG_LEVEL_ERROR >= NS_LOG_LEVEL) ns_debug_print_info(__FILE__, __PRETTY_FUNCTION__, __LINE__, 0); } while(0)
 
 #if defined(WINDOWS)
     #define GetThread() GetCurrentThreadId()
@@ -50,13 +64,28 @@ typedef int8_t s8;
 #elif defined(LINUX)
     #define GetThread() pthread_self()
     //#define __PRETTY_FUNCTION__ __PRETTY_FUNCTION__
-    #define DebugPrintOsInfo() DebugPrintInfo(); perror("    error")
+    #define DebugPrintOsInfo() \
+        do { if(NS_LOG_LEVEL_ERROR >= NS_LOG_LEVEL) ns_debug_print_info(__FILE__, __PRETTY_FUNCTION__, __LINE__, errno); } while(0)
 #endif
 
 #define local static
 #define global static
 #define internal static
 
+internal void
+ns_debug_print_info_to_stderr(const char *file, const char *function, int line, int os_error)
+{
+    fprintf(stderr, "thread: %lu. %s %s line: %d\n", (unsigned long)GetThread(), file, function, line);
+    if(os_error != 0)
+    {
+        fprintf(stderr, "    error: %s\n", strerror(os_error));
+    }
+}
+
+/* ns_log_startup() points this at the logger, so DebugPrintInfo() stops writing to stderr
+   synchronously from whatever thread hit the error. */
+global void (*ns_debug_print_info)(const char *file, const char *function, int line, int os_error) = ns_debug_print_info_to_stderr;
+
 #define Kilobytes(NumberOfKbs) (NumberOfKbs * 1024)
 #define Megabytes(NumberOfMbs) (NumberOfMbs * 1024 * 1024)
 #define Gigabytes(NumberOfGbs) (NumberOfGbs * 1024 * 1024 * 1024)
@@ -76,6 +105,10 @@ void ErrorHandler()
 #define Log(Format, ...) _Log("%s line %d. " Format, __FILE__, __LINE__, __VA_ARGS__)
 internal void _Log(const char *Format, ...);
 
+// like _Log, the program supplies these; the benchmarks show the simplest version
+internal void *ns_memory_allocate(size_t size);
+internal void ns_memory_free(void *memory);
+
 #define _CheckEquals(Actual, Expected, Action, WhatToReturn) \
     { \
         long ErrorActual = (long)(Actual); \
@@ -4,12 +4,21 @@
 #include "ns_mutex.h"
 
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    #include "ns_atomic.h"
+    #include "ns_futex.h"
 #elif defined(LINUX)
     #include <pthread.h>
 #endif
 
 
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    struct InternalCondv
+    {
+        uint32_t sequence; // bumped by every signal, so a waiter can't miss one
+        NsMutex *mutex; // what the waiters hold, so broadcast can move them onto it
+    };
 #elif defined(LINUX)
     typedef pthread_cond_t InternalCondv;
 #endif
@@ -25,11 +34,34 @@ struct NsCondv
 int
 ns_condv_create(NsCondv *condv)
 {
+#if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    condv->internal_condv.sequence = 0;
+    condv->internal_condv.mutex = NULL;
+#elif defined(LINUX)
     int status;
 
+    status = pthread_cond_init(&condv->internal_condv, NULL);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+
+    return NS_SUCCESS;
+}
+
+/* Nobody can be waiting on it. */
+int
+ns_condv_destroy(NsCondv *condv)
+{
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
 #elif defined(LINUX)
-    status = pthread_cond_init(&condv->internal_condv, NULL);
+    int status;
+
+    status = pthread_cond_destroy(&condv->internal_condv);
     if(status != 0)
     {
         DebugPrintInfo();
@@ -41,12 +73,43 @@ ns_condv_create(NsCondv *condv)
 }
 
 int
-ns_condv_wait(NsCondv *condv, NsMutex *mutex)
+ns_condv_wait(NsCondv *condv, NsMutex *mutex NS_LOCK_PROFILE_SITE_PARAMS)
 {
     int status;
 
+#if defined(NS_LOCK_PROFILE)
+    uint64_t start_nanos = ns_time_get_nanos();
+
+    // whoever has the mutex while we wait overwrites this
+    NsLockProfileSite *profile_site = mutex->profile_site;
+#endif
+
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    InternalCondv *internal_condv = &condv->internal_condv;
+    ns_atomic_store_relaxed(&internal_condv->mutex, mutex);
+
+    // read before unlocking, so a signal between the unlock and the wait makes the wait
+    // return right away
+    uint32_t sequence = ns_atomic_load(&internal_condv->sequence);
+
+    status = ns_mutex_unlock(mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_futex_wait(&internal_condv->sequence, sequence);
+
+    // a broadcast may have moved us onto the mutex's futex, in which case others may be
+    // asleep there too
+    ns_mutex_lock_contended(&mutex->internal_mutex);
 #elif defined(LINUX)
+#if defined(NS_LOCK_PROFILE)
+    // the futex version's unlock does this for us
+    ns_lock_profile_record_hold(profile_site, start_nanos - mutex->acquire_nanos);
+#endif
     status = pthread_cond_wait(&condv->internal_condv, &mutex->internal_mutex);
     if(status != 0)
     {
@@ -55,17 +118,66 @@ ns_condv_wait(NsCondv *condv, NsMutex *mutex)
     }
 #endif
 
+#if defined(NS_LOCK_PROFILE)
+    // we have the mutex back, but the hold starts over. it stays charged to where it was
+    // locked, not to here.
+    uint64_t end_nanos = ns_time_get_nanos();
+    ns_lock_profile_record_acquire(NS_LOCK_PROFILE_CONDV, site_file, site_function, site_line,
+                                   true, end_nanos - start_nanos);
+    mutex->profile_site = profile_site;
+    mutex->acquire_nanos = end_nanos;
+#endif
+
     return NS_SUCCESS;
 }
 
 int
 ns_condv_signal(NsCondv *condv)
 {
+#if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    ns_atomic_fetch_add(&condv->internal_condv.sequence, (uint32_t)1);
+    ns_futex_wake(&condv->internal_condv.sequence, 1);
+#elif defined(LINUX)
     int status;
 
+    status = pthread_cond_signal(&condv->internal_condv);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+
+    return NS_SUCCESS;
+}
+
+int
+ns_condv_broadcast(NsCondv *condv)
+{
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    InternalCondv *internal_condv = &condv->internal_condv;
+    uint32_t sequence = (ns_atomic_fetch_add(&internal_condv->sequence, (uint32_t)1) + 1);
+
+    // nobody's ever waited
+    NsMutex *waiters_mutex = ns_atomic_load_relaxed(&internal_condv->mutex);
+    if(waiters_mutex == NULL)
+    {
+        return NS_SUCCESS;
+    }
+
+    // wake one and move the rest straight onto the mutex. they'd only all wake up to fight
+    // over it, and all but one go back to sleep.
+    if(ns_futex_requeue(&internal_condv->sequence, sequence, 1, &waiters_mutex->internal_mutex.state) < 0)
+    {
+        // someone signaled in between; just wake everybody
+        ns_futex_wake(&internal_condv->sequence, INT_MAX);
+    }
 #elif defined(LINUX)
-    status = pthread_cond_signal(&condv->internal_condv);
+    int status;
+
+    status = pthread_cond_broadcast(&condv->internal_condv);
     if(status != 0)
     {
         DebugPrintInfo();
@@ -0,0 +1,238 @@
+#ifndef NS_CONNECTION_TABLE_H
+#define NS_CONNECTION_TABLE_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_memory.h"
+#include "ns_index_stack.h"
+#include "ns_metrics.h"
+#include "ns_socket.h"
+#include "ns_timer_wheel.h"
+
+
+#if !defined(NS_CONNECTION_READ_BUFFER_SIZE)
+    #define NS_CONNECTION_READ_BUFFER_SIZE Kilobytes(4)
+#endif
+
+#if !defined(NS_CONNECTION_WRITE_BUFFER_SIZE)
+    #define NS_CONNECTION_WRITE_BUFFER_SIZE Kilobytes(4)
+#endif
+
+#define NS_CONNECTION_INVALID_HANDLE 0
+
+
+enum NsConnectionState
+{
+    NS_CONNECTION_FREE,
+    NS_CONNECTION_READING, // the poller owns the connection
+    NS_CONNECTION_PROCESSING, // a worker owns the connection, buffers included
+};
+
+/* Everything about one connection in one place. The fields touched on every readiness
+   event are packed into the first cache line; the buffers follow. */
+struct alignas(NS_CACHE_LINE_SIZE) NsConnection
+{
+    NsSocket socket;
+    uint32_t state;
+    uint32_t generation;
+    uint32_t index;
+    uint32_t next_free; // index + 1, for the free stack
+    int pollfd_idx;
+    uint32_t read_length;
+    uint32_t write_length;
+    void *user_data;
+    uint64_t receive_nanos; // when the read_buffer was last added to
+
+    NsTimer idle_timer;
+
+    alignas(NS_CACHE_LINE_SIZE) uint8_t read_buffer[NS_CONNECTION_READ_BUFFER_SIZE];
+    alignas(NS_CACHE_LINE_SIZE) uint8_t write_buffer[NS_CONNECTION_WRITE_BUFFER_SIZE];
+};
+
+/* Generation in the high 32 bits, index in the low 32. A handle to a connection that's
+   since been released (and maybe reused) won't resolve, so it's safe to hand handles
+   across threads where a raw pointer might dangle. */
+typedef uint64_t NsConnectionHandle;
+
+struct NsConnectionTable
+{
+    NsConnection *connections;
+    uint32_t capacity;
+    NsIndexStack free_stack;
+
+    // sharded, so gets and releases on different threads don't share a cache line
+    NsMetricsGauge num_in_use;
+    NsMetricsGauge capacity_gauge;
+};
+
+
+/* Internal */
+
+internal void
+ns_connection_table_push_free(NsConnectionTable *table, uint32_t index)
+{
+    ns_index_stack_push(&table->free_stack, index, [table](uint32_t i) {
+        return &table->connections[i].next_free;
+    });
+}
+
+/* API */
+
+int
+ns_connection_table_create(NsConnectionTable *table, uint32_t capacity,
+                           void (*idle_timer_callback)(NsTimer *, void *))
+{
+    NsConnection *connections = (NsConnection *)ns_memory_map(sizeof(NsConnection)*capacity);
+    if(connections == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    table->connections = connections;
+    table->capacity = capacity;
+    ns_index_stack_create(&table->free_stack);
+    memset(&table->num_in_use, 0, sizeof(table->num_in_use));
+    memset(&table->capacity_gauge, 0, sizeof(table->capacity_gauge));
+
+    // pushed in reverse so low indices come out first
+    for(uint32_t i = capacity; i > 0; i--)
+    {
+        NsConnection *connection = &connections[i - 1];
+        connection->state = NS_CONNECTION_FREE;
+        connection->generation = 1;
+        connection->index = (i - 1);
+        connection->pollfd_idx = -1;
+        ns_timer_init(&connection->idle_timer, idle_timer_callback, connection);
+
+        ns_connection_table_push_free(table, i - 1);
+    }
+
+    return NS_SUCCESS;
+}
+
+/* No connections may be in use. */
+int
+ns_connection_table_destroy(NsConnectionTable *table)
+{
+    ns_memory_unmap(table->connections, sizeof(NsConnection)*table->capacity);
+    table->connections = NULL;
+    return NS_SUCCESS;
+}
+
+/* Returns NS_ERROR if every connection is in use. The connection comes back in the
+   READING state with empty buffers. */
+int
+ns_connection_table_get(NsConnectionTable *table, NsConnection **connection_ptr)
+{
+    uint32_t index;
+    bool popped = ns_index_stack_pop(&table->free_stack, &index, [table](uint32_t i) {
+        return &table->connections[i].next_free;
+    });
+    if(!popped)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    NsConnection *connection = &table->connections[index];
+    connection->pollfd_idx = -1;
+    connection->read_length = 0;
+    connection->write_length = 0;
+    connection->user_data = NULL;
+    ns_atomic_store(&connection->state, (uint32_t)NS_CONNECTION_READING);
+    ns_metrics_gauge_add(&table->num_in_use, 1);
+
+    *connection_ptr = connection;
+
+    return NS_SUCCESS;
+}
+
+/* Invalidates every outstanding handle to the connection. */
+int
+ns_connection_table_release(NsConnectionTable *table, NsConnection *connection)
+{
+    ns_atomic_store(&connection->state, (uint32_t)NS_CONNECTION_FREE);
+    ns_atomic_fetch_add(&connection->generation, (uint32_t)1);
+    ns_connection_table_push_free(table, connection->index);
+    ns_metrics_gauge_add(&table->num_in_use, -1);
+    return NS_SUCCESS;
+}
+
+NsConnectionHandle
+ns_connection_table_get_handle(NsConnection *connection)
+{
+    NsConnectionHandle result = (((uint64_t)ns_atomic_load(&connection->generation) << 32) | connection->index);
+    return result;
+}
+
+/* Returns NULL if the handle's connection has been released since the handle was made. */
+NsConnection *
+ns_connection_table_lookup(NsConnectionTable *table, NsConnectionHandle handle)
+{
+    uint32_t index = (uint32_t)handle;
+    uint32_t generation = (uint32_t)(handle >> 32);
+    if(index >= table->capacity)
+    {
+        return NULL;
+    }
+
+    NsConnection *connection = &table->connections[index];
+    if(ns_atomic_load(&connection->generation) != generation)
+    {
+        return NULL;
+    }
+
+    return connection;
+}
+
+/* Stable for the life of the table, and always less than its capacity. */
+uint32_t
+ns_connection_table_get_index(NsConnection *connection)
+{
+    return connection->index;
+}
+
+/* Connections handed out and not yet released. */
+int64_t
+ns_connection_table_get_num_in_use(NsConnectionTable *table)
+{
+    int64_t result = ns_metrics_gauge_get(&table->num_in_use);
+    return result;
+}
+
+internal int64_t
+ns_connection_table_get_capacity_callback(void *data)
+{
+    int64_t result = ((NsConnectionTable *)data)->capacity;
+    return result;
+}
+
+/* Exports the table's occupancy and capacity. labels (e.g. table="http") tells tables
+   apart and must outlive the table. */
+int
+ns_connection_table_register_metrics(NsConnectionTable *table, const char *labels = NULL)
+{
+    int status;
+
+    status = ns_metrics_register_gauge(&table->num_in_use, "ns_connection_table_connections_in_use",
+                                       "Connection records handed out and not yet released.", labels);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_gauge(&table->capacity_gauge, "ns_connection_table_capacity",
+                                       "Connection records in the table.",
+                                       ns_connection_table_get_capacity_callback, table, labels);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,507 @@
+#ifndef NS_COROUTINE_H
+#define NS_COROUTINE_H
+
+#include "ns_common.h"
+#include "ns_socket.h"
+#include "ns_time.h"
+#include "ns_timer_wheel.h"
+
+#if !defined(__cpp_impl_coroutine)
+    #error "ns_coroutine.h needs c++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <sys/epoll.h>
+    #include <unistd.h>
+#endif
+
+
+/* Socket handlers as coroutines on a single-threaded event loop, so one thread can have
+   thousands of slow connections in flight while the handlers still read top to bottom:
+
+       NsTask handle_peer(NsAsyncSocket *peer)
+       {
+           char buffer[1024];
+           while(1)
+           {
+               int bytes_received = co_await ns_async_receive(peer, buffer, sizeof(buffer), 5000);
+               if(bytes_received <= 0) break; // closed, timed out or failed
+               co_await ns_async_send(peer, buffer, bytes_received);
+           }
+           ns_async_socket_close(peer);
+           co_return NS_SUCCESS;
+       }
+
+   An NsTask doesn't start until it's either co_awaited (and then co_await gives back what it
+   co_returned) or handed to ns_event_loop_spawn(), which runs it on its own. Everything on a
+   loop, the loop included, has to stay on the thread that runs ns_event_loop_run(). */
+
+#if !defined(NS_EVENT_LOOP_MAX_EVENTS)
+    #define NS_EVENT_LOOP_MAX_EVENTS 256
+#endif
+
+
+struct NsEventLoop;
+
+struct NsTask
+{
+    struct promise_type
+    {
+        int result;
+        std::coroutine_handle<> continuation; // whoever's co_awaiting us
+        NsEventLoop *spawned_loop; // set if nobody is, and we clean up after ourselves
+
+        NsTask get_return_object()
+        {
+            return NsTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(int value) { result = value; }
+
+        // we don't use exceptions
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit NsTask(std::coroutine_handle<promise_type> task_handle) : handle(task_handle) {}
+    NsTask(NsTask &&other) : handle(other.handle) { other.handle = nullptr; }
+    NsTask(const NsTask &) = delete;
+    NsTask &operator=(const NsTask &) = delete;
+    ~NsTask()
+    {
+        if(handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    // co_await starts it, and picks up where we left off when it's done
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting_handle)
+    {
+        handle.promise().continuation = awaiting_handle;
+        return handle;
+    }
+    int await_resume() { return handle.promise().result; }
+};
+
+/* What a suspended coroutine is waiting on: a socket being ready, a timer, or both. Lives
+   in the waiting coroutine's frame, so it stays put for as long as it's waited on. */
+struct NsAsyncWait
+{
+    std::coroutine_handle<> handle;
+    NsEventLoop *loop;
+    struct NsAsyncSocket *socket; // NULL for a plain sleep
+    bool is_write;
+
+    uint64_t timeout_millis; // 0 for none
+    NsTimer timer;
+    bool is_timed_out;
+
+    NsAsyncWait *next_ready;
+};
+
+struct NsAsyncSocket
+{
+    NsSocket socket;
+    NsEventLoop *loop;
+    NsAsyncWait *read_wait;
+    NsAsyncWait *write_wait;
+};
+
+struct NsEventLoop
+{
+    int epoll_fd;
+    NsTimerWheel timer_wheel;
+
+    // resumed by the loop rather than from inside epoll or timer processing
+    NsAsyncWait *ready_head;
+    NsAsyncWait *ready_tail;
+
+    uint32_t num_spawned_tasks;
+    bool is_stopping;
+};
+
+
+/* Internal */
+
+std::coroutine_handle<>
+NsTask::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+    promise_type &promise = handle.promise();
+    if(promise.continuation)
+    {
+        return promise.continuation;
+    }
+
+    if(promise.spawned_loop != NULL)
+    {
+        promise.spawned_loop->num_spawned_tasks--;
+        handle.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+internal void
+ns_event_loop_push_ready(NsEventLoop *loop, NsAsyncWait *wait)
+{
+    wait->next_ready = NULL;
+    if(loop->ready_tail != NULL)
+    {
+        loop->ready_tail->next_ready = wait;
+    }
+    else
+    {
+        loop->ready_head = wait;
+    }
+    loop->ready_tail = wait;
+}
+
+internal void
+ns_async_wait_timer_callback(NsTimer *timer, void *data)
+{
+    NsAsyncWait *wait = (NsAsyncWait *)data;
+    wait->is_timed_out = true;
+
+    // the socket can't wake it now
+    if(wait->socket != NULL)
+    {
+        NsAsyncWait **socket_wait = wait->is_write ? &wait->socket->write_wait : &wait->socket->read_wait;
+        *socket_wait = NULL;
+    }
+
+    ns_event_loop_push_ready(wait->loop, wait);
+}
+
+internal void
+ns_async_socket_wake(NsAsyncSocket *async_socket, NsAsyncWait **socket_wait)
+{
+    NsAsyncWait *wait = *socket_wait;
+    if(wait == NULL)
+    {
+        return;
+    }
+
+    *socket_wait = NULL;
+    ns_timer_wheel_cancel(&async_socket->loop->timer_wheel, &wait->timer);
+    ns_event_loop_push_ready(async_socket->loop, wait);
+}
+
+/* The awaitable behind everything else. co_await gives back true, or false on timeout. */
+struct NsAsyncWaitAwaiter
+{
+    NsAsyncWait wait;
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        wait.handle = handle;
+        wait.is_timed_out = false;
+        if(wait.socket != NULL)
+        {
+            NsAsyncWait **socket_wait = wait.is_write ? &wait.socket->write_wait : &wait.socket->read_wait;
+            *socket_wait = &wait;
+        }
+
+        ns_timer_init(&wait.timer, ns_async_wait_timer_callback, &wait);
+        if(wait.timeout_millis > 0 || wait.socket == NULL)
+        {
+            ns_timer_wheel_arm(&wait.loop->timer_wheel, &wait.timer, ns_time_get_millis(), wait.timeout_millis);
+        }
+    }
+
+    // a sleep is meant to time out
+    bool await_resume() { return (wait.socket == NULL) || !wait.is_timed_out; }
+};
+
+inline internal NsAsyncWaitAwaiter
+ns_async_wait_for_socket(NsAsyncSocket *async_socket, bool is_write, uint64_t timeout_millis)
+{
+    NsAsyncWaitAwaiter awaiter = {};
+    awaiter.wait.loop = async_socket->loop;
+    awaiter.wait.socket = async_socket;
+    awaiter.wait.is_write = is_write;
+    awaiter.wait.timeout_millis = timeout_millis;
+    return awaiter;
+}
+
+/* API */
+
+int
+ns_event_loop_create(NsEventLoop *loop)
+{
+    int status;
+
+    memset(loop, 0, sizeof(NsEventLoop));
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epoll_fd == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+
+    status = ns_timer_wheel_create(&loop->timer_wheel, ns_time_get_millis());
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+int
+ns_event_loop_destroy(NsEventLoop *loop)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(close(loop->epoll_fd) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* Starts the task, which runs until its first co_await before this returns, and frees
+   it when it's done. */
+void
+ns_event_loop_spawn(NsEventLoop *loop, NsTask task)
+{
+    std::coroutine_handle<NsTask::promise_type> handle = task.handle;
+    task.handle = nullptr;
+
+    handle.promise().spawned_loop = loop;
+    loop->num_spawned_tasks++;
+    handle.resume();
+}
+
+/* Makes ns_event_loop_run() return after the current round of events. */
+void
+ns_event_loop_stop(NsEventLoop *loop)
+{
+    loop->is_stopping = true;
+}
+
+/* Runs coroutines as what they're waiting on comes in, until every spawned task is done
+   or ns_event_loop_stop() is called. */
+int
+ns_event_loop_run(NsEventLoop *loop)
+{
+    loop->is_stopping = false;
+    while(loop->num_spawned_tasks > 0 && !loop->is_stopping)
+    {
+        int timeout_millis = ns_timer_wheel_get_timeout_millis(&loop->timer_wheel, ns_time_get_millis());
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+        epoll_event events[NS_EVENT_LOOP_MAX_EVENTS];
+        int num_events = epoll_wait(loop->epoll_fd, events, NS_EVENT_LOOP_MAX_EVENTS, timeout_millis);
+        if(num_events == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+
+        for(int i = 0; i < num_events; i++)
+        {
+            NsAsyncSocket *async_socket = (NsAsyncSocket *)events[i].data.ptr;
+            uint32_t flags = events[i].events;
+
+            // errors and hangups wake both sides; the retried call says what happened
+            if(flags & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            {
+                ns_async_socket_wake(async_socket, &async_socket->read_wait);
+            }
+            if(flags & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            {
+                ns_async_socket_wake(async_socket, &async_socket->write_wait);
+            }
+        }
+#endif
+
+        ns_timer_wheel_advance(&loop->timer_wheel, ns_time_get_millis());
+
+        // anything that's ready again by the time it's resumed waits for the next round
+        NsAsyncWait *wait = loop->ready_head;
+        loop->ready_head = NULL;
+        loop->ready_tail = NULL;
+        while(wait != NULL)
+        {
+            NsAsyncWait *next_wait = wait->next_ready;
+            wait->handle.resume();
+            wait = next_wait;
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Takes over socket, which is made non-blocking and watched by the loop until
+   ns_async_socket_close(). async_socket must not move after this. */
+int
+ns_async_socket_create(NsEventLoop *loop, NsAsyncSocket *async_socket, NsSocket *socket)
+{
+    int status;
+
+    async_socket->socket = *socket;
+    async_socket->loop = loop;
+    async_socket->read_wait = NULL;
+    async_socket->write_wait = NULL;
+
+    status = ns_socket_set_blocking(&async_socket->socket, false);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    // edge triggered, so a socket nobody's waiting on costs nothing
+    epoll_event event = {};
+    event.events = (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    event.data.ptr = async_socket;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, async_socket->socket.internal_socket, &event) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+
+    return NS_SUCCESS;
+}
+
+/* Nothing can be waiting on it. */
+int
+ns_async_socket_close(NsAsyncSocket *async_socket)
+{
+    int status;
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(epoll_ctl(async_socket->loop->epoll_fd, EPOLL_CTL_DEL, async_socket->socket.internal_socket, NULL) == -1)
+    {
+        DebugPrintOsInfo();
+    }
+#endif
+
+    status = ns_socket_close(&async_socket->socket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* co_await gives back true once the time's up. */
+inline NsAsyncWaitAwaiter
+ns_async_sleep(NsEventLoop *loop, uint64_t millis)
+{
+    NsAsyncWaitAwaiter awaiter = {};
+    awaiter.wait.loop = loop;
+    awaiter.wait.timeout_millis = millis;
+    return awaiter;
+}
+
+/* Whatever ns_socket_receive() would give back once there's something to receive: the
+   number of bytes, 0 if the peer closed, or an error. NS_TIMED_OUT if nothing came within
+   timeout_millis (0 waits forever). */
+NsTask
+ns_async_receive(NsAsyncSocket *async_socket, char *buffer, uint32_t buffer_size, uint64_t timeout_millis = 0)
+{
+    while(1)
+    {
+        int bytes_received = ns_socket_receive(&async_socket->socket, buffer, buffer_size);
+        if(bytes_received != NS_SOCKET_WOULD_BLOCK)
+        {
+            co_return bytes_received;
+        }
+
+        if(!co_await ns_async_wait_for_socket(async_socket, false, timeout_millis))
+        {
+            co_return NS_TIMED_OUT;
+        }
+    }
+}
+
+/* Sends all of buffer. Gives back buffer_size, NS_SOCKET_CONNECTION_CLOSED, an error, or
+   NS_TIMED_OUT if the peer stopped taking data for timeout_millis (0 waits forever). */
+NsTask
+ns_async_send(NsAsyncSocket *async_socket, char *buffer, uint32_t buffer_size, uint64_t timeout_millis = 0)
+{
+    uint32_t total_bytes_sent = 0;
+    while(total_bytes_sent < buffer_size)
+    {
+        int bytes_sent = ns_socket_send(&async_socket->socket, buffer + total_bytes_sent, buffer_size - total_bytes_sent);
+        if(bytes_sent == NS_SOCKET_WOULD_BLOCK)
+        {
+            if(!co_await ns_async_wait_for_socket(async_socket, true, timeout_millis))
+            {
+                co_return NS_TIMED_OUT;
+            }
+            continue;
+        }
+        if(bytes_sent < 0)
+        {
+            co_return bytes_sent;
+        }
+        total_bytes_sent += bytes_sent;
+    }
+    co_return (int)total_bytes_sent;
+}
+
+/* Waits for a connection on a listening async socket and puts it in peer_socket, which can
+   then go to ns_async_socket_create(). */
+NsTask
+ns_async_accept(NsAsyncSocket *listen_socket, NsSocket *peer_socket, uint64_t timeout_millis = 0)
+{
+    while(1)
+    {
+        int status = ns_socket_accept(&listen_socket->socket, peer_socket);
+        if(status == NS_SUCCESS)
+        {
+            // accept only fills in the fd
+            peer_socket->completion_callback = NULL;
+            peer_socket->extra_data_void_ptr = NULL;
+        }
+        if(status != NS_SOCKET_WOULD_BLOCK)
+        {
+            co_return status;
+        }
+
+        if(!co_await ns_async_wait_for_socket(listen_socket, false, timeout_millis))
+        {
+            co_return NS_TIMED_OUT;
+        }
+    }
+}
+
+#endif
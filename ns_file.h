@@ -4,7 +4,6 @@
 #include "ns_common.h"
 #include "ns_memory.h"
 
-#if 0 /* Just use the standard library FFS. */
 #if defined(WINDOWS)
 #elif defined(LINUX)
     #include <unistd.h>
@@ -106,7 +105,6 @@ ns_file_load(NsFile *file, char *buffer, int buffer_size)
 
     return bytes_read;
 }
-#endif
 
 struct ns_file
 {
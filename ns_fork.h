@@ -2,18 +2,540 @@
 #define NS_FORK_H
 
 #include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_socket.h"
+#include "ns_thread.h"
+#include "ns_time.h"
+#include "ns_log.h"
+#include "ns_math.h"
+
+#include <stdio.h>
+#include <stdlib.h>
 
 #if defined(WINDOWS)
 #elif defined(LINUX)
     #include <unistd.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/prctl.h>
+    #include <sys/wait.h>
+    #include <fcntl.h>
+    #include <errno.h>
+    #include <sys/uio.h>
+    #include <poll.h>
+#endif
+
+
+/* A supervisor process that pre-forks workers around one listening socket, so a crash
+   only takes out one worker's connections:
+
+       int worker_entry(NsForkWorker *worker)
+       {
+           // serve on worker->listen_socket, then
+           ns_fork_worker_set_ready(worker);
+           while(!ns_fork_worker_is_stopping(worker))
+           {
+               // fill in worker->stats now and then
+           }
+           return NS_SUCCESS; // after finishing off what's in flight
+       }
+
+       ns_socket_listen(&listen_socket, "8080");
+       ns_fork_supervisor_create(&supervisor, &listen_socket, 4, worker_entry, NULL);
+       ns_fork_supervisor_run(&supervisor); // until SIGTERM or SIGINT
+
+   Workers that die are restarted. SIGHUP does a rolling restart: each worker in turn gets
+   a replacement, which has to say it's ready before the old one is told to stop, so there's
+   always someone accepting and nobody's refused. The socket is never closed in between;
+   new workers are forked with it, and a worker that wants to be a new binary can pass it on
+   with ns_fork_worker_exec(). SIGUSR1 prints every worker's stats.
+
+   Workers are forked from the supervisor's thread, and fork only brings that thread along,
+   so start the supervisor before any other threads. */
+
+#if !defined(NS_FORK_MAX_WORKERS)
+    #define NS_FORK_MAX_WORKERS 64
+#endif
+
+/* A replacement that isn't ready in this long is stopped, and the rolling restart given up. */
+#if !defined(NS_FORK_READY_TIMEOUT_MILLIS)
+    #define NS_FORK_READY_TIMEOUT_MILLIS 10000
+#endif
+
+/* A worker that's been asked to stop is killed if it hasn't in this long. */
+#if !defined(NS_FORK_STOP_TIMEOUT_MILLIS)
+    #define NS_FORK_STOP_TIMEOUT_MILLIS 10000
+#endif
+
+/* A worker that dies sooner than this after starting is probably going to again, so its
+   restart waits, twice as long each time up to the max. */
+#if !defined(NS_FORK_MIN_UPTIME_MILLIS)
+    #define NS_FORK_MIN_UPTIME_MILLIS 1000
+#endif
+
+#if !defined(NS_FORK_MAX_RESTART_DELAY_MILLIS)
+    #define NS_FORK_MAX_RESTART_DELAY_MILLIS 5000
+#endif
+
+/* What ns_fork_process_with_pipe() asks for. Unprivileged processes can't go past
+   /proc/sys/fs/pipe-max-size, 1MB by default; the kernel's default is 64KB. */
+#if !defined(NS_FORK_PIPE_SIZE)
+    #define NS_FORK_PIPE_SIZE Megabytes(1)
+#endif
+
+// what ns_fork_pipe_splice() copies through when dest_fd can't be spliced to
+#if !defined(NS_FORK_PIPE_COPY_SIZE)
+    #define NS_FORK_PIPE_COPY_SIZE Kilobytes(64)
+#endif
+
+#define NS_FORK_PIPE_WOULD_BLOCK -4
+
+#if !defined(NS_FORK_SUPERVISOR_TICK_MILLIS)
+    #define NS_FORK_SUPERVISOR_TICK_MILLIS 50
+#endif
+
+// a worker and its replacement are both around during a rolling restart
+#define NS_FORK_MAX_STATS (2*NS_FORK_MAX_WORKERS)
+
+
+/* A child's stdout, left for us to read rather than put over our stdin. fd is
+   non-blocking, so it can go in a poll or epoll set with everything else. */
+struct NsForkPipe
+{
+    int fd;
+    int child_pid;
+    uint32_t size; // what the kernel actually gave us
+
+    // read from the pipe by ns_fork_pipe_splice() but not yet taken by dest_fd. it goes
+    // out before anything else does.
+    uint8_t copy_buffer[NS_FORK_PIPE_COPY_SIZE];
+    uint32_t copy_start;
+    uint32_t copy_end;
+};
+
+/* One per worker process, in memory shared by the supervisor and every worker. The
+   supervisor fills in the top part; the counters are the worker's to keep up to date. */
+struct alignas(NS_CACHE_LINE_SIZE) NsForkWorkerStats
+{
+    int pid; // 0 if the slot's free
+    uint32_t worker_idx;
+    uint32_t generation; // how many times this worker's been started before
+    uint32_t is_ready;
+    uint32_t is_stopping;
+    uint64_t start_millis;
+    uint64_t stop_millis;
+
+    uint64_t num_requests;
+    uint64_t num_connections_accepted;
+    int64_t num_connections_open;
+    uint64_t num_bytes_received;
+    uint64_t num_bytes_sent;
+};
+
+/* What a worker gets to go on. */
+struct NsForkWorker
+{
+    uint32_t idx;
+    uint32_t generation;
+    NsSocket listen_socket;
+    NsForkWorkerStats *stats;
+    void *data;
+
+    // for passing it all on to ns_fork_worker_exec()
+    int stats_fd;
+    uint32_t stats_idx;
+};
+
+struct NsForkSupervisor
+{
+    NsSocket listen_socket;
+    int (*worker_entry)(NsForkWorker *worker);
+    void *data;
+    uint32_t num_workers;
+
+    // memfd backed rather than anonymous, so workers that exec can map it too
+    int stats_fd;
+    NsForkWorkerStats *stats;
+
+    int stats_idxs[NS_FORK_MAX_WORKERS]; // the current process of each worker, or -1
+    uint32_t generations[NS_FORK_MAX_WORKERS];
+    uint32_t num_restarts[NS_FORK_MAX_WORKERS];
+    uint32_t num_quick_deaths[NS_FORK_MAX_WORKERS]; // in a row
+    uint64_t restart_millis[NS_FORK_MAX_WORKERS]; // when a dead worker's due back
+
+    int rolling_worker_idx; // -1 unless a rolling restart is going
+    int rolling_stats_idx; // the replacement we're waiting on, or -1
+    uint64_t rolling_deadline_millis;
+};
+
+/* Set by the supervisor's signal handlers, and looked at between ticks. */
+struct NsForkSignals
+{
+    volatile sig_atomic_t is_stop_requested;
+    volatile sig_atomic_t is_restart_requested;
+    volatile sig_atomic_t is_print_requested;
+};
+
+global NsForkSignals ns_fork_signals;
+
+
+/* Internal */
+
+internal void
+ns_fork_signal_handler(int signal_number)
+{
+    if(signal_number == SIGHUP)
+    {
+        ns_fork_signals.is_restart_requested = 1;
+    }
+    else if(signal_number == SIGUSR1)
+    {
+        ns_fork_signals.is_print_requested = 1;
+    }
+    else
+    {
+        ns_fork_signals.is_stop_requested = 1;
+    }
+}
+
+internal int
+ns_fork_set_signal_handler(int signal_number, void (*handler)(int))
+{
+    // no SA_RESTART, so the tick's sleep is cut short
+    struct sigaction action = {};
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(signal_number, &action, NULL) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+    return NS_SUCCESS;
+}
+
+/* Grows the pipe fd is an end of. A bigger pipe means fewer trips through the scheduler
+   per megabyte, since the writer can get further ahead before it blocks. Not getting it
+   isn't fatal; we carry on with what we've got. */
+internal uint32_t
+ns_fork_set_pipe_size(int fd, uint32_t size)
+{
+    uint32_t result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(size > 0 && fcntl(fd, F_SETPIPE_SZ, (int)size) == -1)
+    {
+        LogWarn("ns_fork: couldn't grow pipe to %u bytes: %s", size, strerror(errno));
+    }
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    result = (pipe_size > 0) ? (uint32_t)pipe_size : 0;
+#endif
+    return result;
+}
+
+/* A signal cuts it short, which is what we want, so that's not an error. */
+internal void
+ns_fork_supervisor_sleep()
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    usleep(1000*NS_FORK_SUPERVISOR_TICK_MILLIS);
 #endif
+}
+
+/* Never returns. */
+internal void
+ns_fork_worker_run(NsForkSupervisor *supervisor, uint32_t stats_idx, int supervisor_pid)
+{
+    // the flusher thread didn't come with us, so log straight out
+    ns_atomic_store(&ns_log_context.is_running, (uint32_t)0);
+
+    // ctrl-c goes to the whole process group, but stopping is the supervisor's call. if the
+    // supervisor dies without stopping us, we go too.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != supervisor_pid)
+    {
+        _exit(1);
+    }
+
+    NsForkWorkerStats *stats = &supervisor->stats[stats_idx];
+
+    NsForkWorker worker;
+    worker.idx = stats->worker_idx;
+    worker.generation = stats->generation;
+    worker.listen_socket = supervisor->listen_socket;
+    worker.stats = stats;
+    worker.data = supervisor->data;
+    worker.stats_fd = supervisor->stats_fd;
+    worker.stats_idx = stats_idx;
+
+    int status = supervisor->worker_entry(&worker);
+    _exit((status == NS_SUCCESS) ? 0 : 1);
+}
+
+internal int
+ns_fork_supervisor_spawn(NsForkSupervisor *supervisor, uint32_t worker_idx, int *stats_idx_ptr)
+{
+    int stats_idx = -1;
+    for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+    {
+        if(supervisor->stats[i].pid == 0)
+        {
+            stats_idx = i;
+            break;
+        }
+    }
+    if(stats_idx == -1)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    NsForkWorkerStats *stats = &supervisor->stats[stats_idx];
+    memset(stats, 0, sizeof(NsForkWorkerStats));
+    stats->worker_idx = worker_idx;
+    stats->generation = supervisor->generations[worker_idx]++;
+    stats->start_millis = ns_time_get_millis();
+
+    fflush(NULL); // or the child writes out our buffered output again
+    int supervisor_pid = getpid();
+    int pid = fork();
+    if(pid < 0)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+    if(pid == 0)
+    {
+        ns_fork_worker_run(supervisor, stats_idx, supervisor_pid);
+    }
+
+    stats->pid = pid;
+    *stats_idx_ptr = stats_idx;
+
+    LogInfo("fork supervisor: started worker %u (pid %d, generation %u)", worker_idx, pid, stats->generation);
+
+    return NS_SUCCESS;
+}
+
+internal void
+ns_fork_supervisor_stop_worker(NsForkSupervisor *supervisor, int stats_idx)
+{
+    NsForkWorkerStats *stats = &supervisor->stats[stats_idx];
+    if(stats->pid == 0 || stats->is_stopping)
+    {
+        return;
+    }
+
+    stats->stop_millis = ns_time_get_millis();
+    ns_atomic_store(&stats->is_stopping, (uint32_t)1);
+}
+
+internal void
+ns_fork_supervisor_schedule_restart(NsForkSupervisor *supervisor, uint32_t worker_idx, uint64_t uptime_millis)
+{
+    uint64_t delay_millis = 0;
+    if(uptime_millis < NS_FORK_MIN_UPTIME_MILLIS)
+    {
+        uint32_t num_doublings = ns_math_min(supervisor->num_quick_deaths[worker_idx], (uint32_t)16);
+        delay_millis = ns_math_min((uint64_t)100 << num_doublings, (uint64_t)NS_FORK_MAX_RESTART_DELAY_MILLIS);
+        supervisor->num_quick_deaths[worker_idx]++;
+    }
+    else
+    {
+        supervisor->num_quick_deaths[worker_idx] = 0;
+    }
+
+    // 0 means not due, so never schedule for it
+    supervisor->restart_millis[worker_idx] = ns_time_get_millis() + delay_millis + 1;
+}
+
+/* Collects workers that have exited, and works out what to do about each. */
+internal void
+ns_fork_supervisor_reap(NsForkSupervisor *supervisor)
+{
+    for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+    {
+        NsForkWorkerStats *stats = &supervisor->stats[i];
+        if(stats->pid == 0)
+        {
+            continue;
+        }
+
+        int wait_status;
+        int wait_result = waitpid(stats->pid, &wait_status, WNOHANG);
+        if(wait_result == 0)
+        {
+            continue;
+        }
+        if(wait_result == -1 && errno == EINTR)
+        {
+            i--;
+            continue;
+        }
+
+        uint32_t worker_idx = stats->worker_idx;
+        if(i == supervisor->rolling_stats_idx)
+        {
+            // keep the old one, and don't go replacing the rest with whatever this was
+            LogError("fork supervisor: replacement for worker %u (pid %d) died before it was ready, stopping the rolling restart",
+                     worker_idx, stats->pid);
+            supervisor->rolling_worker_idx = -1;
+            supervisor->rolling_stats_idx = -1;
+        }
+        else if(!stats->is_stopping)
+        {
+            if(wait_result != -1 && WIFSIGNALED(wait_status))
+            {
+                LogError("fork supervisor: worker %u (pid %d) killed by signal %d", worker_idx, stats->pid,
+                         WTERMSIG(wait_status));
+            }
+            else
+            {
+                LogError("fork supervisor: worker %u (pid %d) exited with %d", worker_idx, stats->pid,
+                         (wait_result != -1) ? WEXITSTATUS(wait_status) : -1);
+            }
+
+            if(supervisor->stats_idxs[worker_idx] == i)
+            {
+                supervisor->stats_idxs[worker_idx] = -1;
+                ns_fork_supervisor_schedule_restart(supervisor, worker_idx, ns_time_get_millis() - stats->start_millis);
+            }
+        }
+
+        memset(stats, 0, sizeof(NsForkWorkerStats));
+    }
+}
+
+internal int
+ns_fork_supervisor_restart_dead_workers(NsForkSupervisor *supervisor)
+{
+    int status;
+
+    uint64_t now_millis = ns_time_get_millis();
+    for(uint32_t i = 0; i < supervisor->num_workers; i++)
+    {
+        if(supervisor->restart_millis[i] == 0 || supervisor->restart_millis[i] > now_millis)
+        {
+            continue;
+        }
+
+        status = ns_fork_supervisor_spawn(supervisor, i, &supervisor->stats_idxs[i]);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        supervisor->restart_millis[i] = 0;
+        supervisor->num_restarts[i]++;
+    }
+
+    return NS_SUCCESS;
+}
+
+internal void
+ns_fork_supervisor_kill_stuck_workers(NsForkSupervisor *supervisor)
+{
+    uint64_t now_millis = ns_time_get_millis();
+    for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+    {
+        NsForkWorkerStats *stats = &supervisor->stats[i];
+        if(stats->pid != 0 && stats->is_stopping && (now_millis - stats->stop_millis) > NS_FORK_STOP_TIMEOUT_MILLIS)
+        {
+            LogWarn("fork supervisor: worker %u (pid %d) didn't stop, killing it", stats->worker_idx, stats->pid);
+            kill(stats->pid, SIGKILL);
+        }
+    }
+}
+
+/* One step of a rolling restart: start a worker's replacement, or swap it in once it's
+   ready and move on to the next worker. */
+internal int
+ns_fork_supervisor_roll(NsForkSupervisor *supervisor)
+{
+    int status;
+
+    uint32_t worker_idx = supervisor->rolling_worker_idx;
+    if(worker_idx >= supervisor->num_workers)
+    {
+        LogInfo("fork supervisor: rolling restart done");
+        supervisor->rolling_worker_idx = -1;
+        return NS_SUCCESS;
+    }
+
+    if(supervisor->rolling_stats_idx == -1)
+    {
+        // a dead worker's restart is as good as a replacement
+        if(supervisor->stats_idxs[worker_idx] == -1)
+        {
+            supervisor->rolling_worker_idx++;
+            return NS_SUCCESS;
+        }
+
+        status = ns_fork_supervisor_spawn(supervisor, worker_idx, &supervisor->rolling_stats_idx);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        supervisor->rolling_deadline_millis = ns_time_get_millis() + NS_FORK_READY_TIMEOUT_MILLIS;
+        return NS_SUCCESS;
+    }
+
+    NsForkWorkerStats *replacement = &supervisor->stats[supervisor->rolling_stats_idx];
+    if(ns_atomic_load(&replacement->is_ready))
+    {
+        // whatever's in the slot now, not what was there when the roll started: if the old
+        // one died in the meantime, this is its restart, which would otherwise be orphaned
+        int current_stats_idx = supervisor->stats_idxs[worker_idx];
+        if(current_stats_idx != -1)
+        {
+            LogInfo("fork supervisor: replacing worker %u (pid %d) with pid %d", worker_idx,
+                    supervisor->stats[current_stats_idx].pid, replacement->pid);
+            ns_fork_supervisor_stop_worker(supervisor, current_stats_idx);
+        }
+
+        // and if it died and its restart isn't due yet, the replacement takes its place
+        supervisor->stats_idxs[worker_idx] = supervisor->rolling_stats_idx;
+        supervisor->restart_millis[worker_idx] = 0;
+
+        supervisor->rolling_stats_idx = -1;
+        supervisor->rolling_worker_idx++;
+    }
+    else if(ns_time_get_millis() > supervisor->rolling_deadline_millis)
+    {
+        LogError("fork supervisor: replacement for worker %u (pid %d) wasn't ready in time, stopping the rolling restart",
+                 worker_idx, replacement->pid);
+        ns_fork_supervisor_stop_worker(supervisor, supervisor->rolling_stats_idx);
+        supervisor->rolling_stats_idx = -1;
+        supervisor->rolling_worker_idx = -1;
+    }
 
+    return NS_SUCCESS;
+}
+
+internal bool
+ns_fork_supervisor_check_any_alive(NsForkSupervisor *supervisor)
+{
+    for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+    {
+        if(supervisor->stats[i].pid != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
 /* API */
 
-/* Spawns a process and sets its stdout to point to our stdin. */
+/* Spawns a process and sets its stdout to point to our stdin. pipe_size of 0 leaves the
+   pipe at the kernel's default. */
 int
-ns_fork_process(const char *filename, char *const *argv, int *child_pid = NULL)
+ns_fork_process(const char *filename, char *const *argv, int *child_pid = NULL, uint32_t pipe_size = 0)
 {
     int status;
 
@@ -30,6 +552,7 @@ ns_fork_process(const char *filename, char *const *argv, int *child_pid = NULL)
 
     int pipe_read = fd[0];
     int pipe_write = fd[1];
+    ns_fork_set_pipe_size(pipe_read, pipe_size);
 
     // fork the fuck out of the child
     int fork_result = fork();
@@ -91,4 +614,509 @@ ns_fork_process(const char *filename, char *const *argv, int *child_pid = NULL)
     return NS_SUCCESS;
 }
 
+/* Spawns a process with its stdout going into pipe->fd, and leaves our stdin alone. */
+int
+ns_fork_process_with_pipe(const char *filename, char *const *argv, NsForkPipe *fork_pipe,
+                          uint32_t pipe_size = NS_FORK_PIPE_SIZE)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    // close-on-exec, so whatever else we spawn doesn't hold the write end open and keep us
+    // from ever seeing eof. the child's dup2 onto stdout doesn't carry the flag over.
+    int fd[2];
+    if(pipe2(fd, O_CLOEXEC) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    int pipe_read = fd[0];
+    int pipe_write = fd[1];
+    fork_pipe->size = ns_fork_set_pipe_size(pipe_read, pipe_size);
+
+    fflush(NULL);
+    int fork_result = fork();
+    if(fork_result < 0)
+    {
+        DebugPrintOsInfo();
+        close(pipe_read);
+        close(pipe_write);
+        return NS_ERROR;
+    }
+
+    if(fork_result == 0)
+    {
+        if(dup2(pipe_write, STDOUT_FILENO) == -1)
+        {
+            _exit(127);
+        }
+        execvp(filename, argv);
+        _exit(127);
+    }
+
+    close(pipe_write);
+
+    // only our end; the child's stdout stays blocking
+    int flags = fcntl(pipe_read, F_GETFL, 0);
+    if(flags == -1 || fcntl(pipe_read, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        DebugPrintOsInfo();
+        close(pipe_read);
+        return NS_ERROR;
+    }
+
+    fork_pipe->fd = pipe_read;
+    fork_pipe->child_pid = fork_result;
+    fork_pipe->copy_start = 0;
+    fork_pipe->copy_end = 0;
+#endif
+    return NS_SUCCESS;
+}
+
+/* Returns the number of bytes read, 0 once the child's closed its stdout, or
+   NS_FORK_PIPE_WOULD_BLOCK if there's nothing yet. */
+int
+ns_fork_pipe_read(NsForkPipe *fork_pipe, uint8_t *buffer, uint32_t buffer_size)
+{
+    int result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    // what a splice left behind came out of the pipe first
+    if(fork_pipe->copy_start < fork_pipe->copy_end)
+    {
+        uint32_t copy_size = ns_math_min(buffer_size, fork_pipe->copy_end - fork_pipe->copy_start);
+        memcpy(buffer, &fork_pipe->copy_buffer[fork_pipe->copy_start], copy_size);
+        fork_pipe->copy_start += copy_size;
+        return (int)copy_size;
+    }
+
+    ssize_t bytes_read = read(fork_pipe->fd, buffer, buffer_size);
+    if(bytes_read == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return NS_FORK_PIPE_WOULD_BLOCK;
+        }
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+    result = (int)bytes_read;
+#endif
+    return result;
+}
+
+/* Moves up to max_size bytes of the child's output to dest_fd (a file or a socket) without
+   them passing through our memory. If dest_fd can't be spliced to, they're copied through
+   the pipe's copy_buffer instead. Same returns as ns_fork_pipe_read(); if dest_fd is
+   non-blocking and full, that's NS_FORK_PIPE_WOULD_BLOCK too, or however many bytes went
+   before it filled up. Bytes read that dest_fd had no room for are kept and go first next
+   time, so while copy_start < copy_end it's dest_fd being writable that's worth waiting
+   for, not the pipe. */
+int
+ns_fork_pipe_splice(NsForkPipe *fork_pipe, int dest_fd, uint32_t max_size)
+{
+    int result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(fork_pipe->copy_start == fork_pipe->copy_end)
+    {
+        ssize_t bytes_moved = splice(fork_pipe->fd, NULL, dest_fd, NULL, max_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(bytes_moved >= 0)
+        {
+            return (int)bytes_moved;
+        }
+        if(errno == EAGAIN)
+        {
+            return NS_FORK_PIPE_WOULD_BLOCK;
+        }
+        if(errno != EINVAL)
+        {
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+
+        // dest_fd's something splice doesn't do, like a tty or a file opened O_APPEND
+        int bytes_read = ns_fork_pipe_read(fork_pipe, fork_pipe->copy_buffer,
+                                           ns_math_min(max_size, (uint32_t)NS_FORK_PIPE_COPY_SIZE));
+        if(bytes_read <= 0)
+        {
+            return bytes_read;
+        }
+        fork_pipe->copy_start = 0;
+        fork_pipe->copy_end = (uint32_t)bytes_read;
+    }
+
+    uint32_t bytes_written = 0;
+    while(fork_pipe->copy_start < fork_pipe->copy_end && bytes_written < max_size)
+    {
+        uint32_t write_size = ns_math_min(fork_pipe->copy_end - fork_pipe->copy_start, max_size - bytes_written);
+        ssize_t write_result = write(dest_fd, &fork_pipe->copy_buffer[fork_pipe->copy_start], write_size);
+        if(write_result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN)
+            {
+                break;
+            }
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+        fork_pipe->copy_start += (uint32_t)write_result;
+        bytes_written += (uint32_t)write_result;
+    }
+
+    if(bytes_written == 0)
+    {
+        return NS_FORK_PIPE_WOULD_BLOCK;
+    }
+    result = (int)bytes_written;
+#endif
+    return result;
+}
+
+/* Closes our end and waits for the child. exit_status is the child's exit code, or -1 if
+   it was killed. */
+int
+ns_fork_pipe_close(NsForkPipe *fork_pipe, int *exit_status = NULL)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(close(fork_pipe->fd) == -1)
+    {
+        DebugPrintOsInfo();
+    }
+
+    int wait_status;
+    while(waitpid(fork_pipe->child_pid, &wait_status, 0) == -1)
+    {
+        if(errno != EINTR)
+        {
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+    }
+
+    if(exit_status != NULL)
+    {
+        *exit_status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : -1;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* For the child's side, when it's one of ours: writes all of buffer to fd, a pipe, by
+   handing the kernel the pages rather than copying them. The pages are read whenever the
+   reader gets to them, so buffer mustn't be written to again until then; write output into
+   a buffer you're done with, or one big enough to cycle through. Blocks until it's all
+   in the pipe. */
+int
+ns_fork_vmsplice(int fd, uint8_t *buffer, uint32_t size)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    uint32_t total_bytes_written = 0;
+    while(total_bytes_written < size)
+    {
+        iovec iov;
+        iov.iov_base = buffer + total_bytes_written;
+        iov.iov_len = size - total_bytes_written;
+        ssize_t bytes_written = vmsplice(fd, &iov, 1, 0);
+        if(bytes_written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+        total_bytes_written += (uint32_t)bytes_written;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* listen_socket is shared by every worker; the supervisor only keeps it open. */
+int
+ns_fork_supervisor_create(NsForkSupervisor *supervisor, NsSocket *listen_socket, uint32_t num_workers,
+                          int (*worker_entry)(NsForkWorker *worker), void *data)
+{
+    if(num_workers == 0 || num_workers > NS_FORK_MAX_WORKERS)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    memset(supervisor, 0, sizeof(NsForkSupervisor));
+    supervisor->listen_socket = *listen_socket;
+    supervisor->worker_entry = worker_entry;
+    supervisor->data = data;
+    supervisor->num_workers = num_workers;
+    supervisor->rolling_worker_idx = -1;
+    supervisor->rolling_stats_idx = -1;
+    for(uint32_t i = 0; i < num_workers; i++)
+    {
+        supervisor->stats_idxs[i] = -1;
+    }
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    // not close-on-exec, so it's still there for workers that exec
+    uint64_t stats_size = sizeof(NsForkWorkerStats)*NS_FORK_MAX_STATS;
+    supervisor->stats_fd = memfd_create("ns_fork_stats", 0);
+    if(supervisor->stats_fd == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    if(ftruncate(supervisor->stats_fd, stats_size) == -1)
+    {
+        DebugPrintOsInfo();
+        close(supervisor->stats_fd);
+        return NS_ERROR;
+    }
+
+    void *stats = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED, supervisor->stats_fd, 0);
+    if(stats == MAP_FAILED)
+    {
+        DebugPrintOsInfo();
+        close(supervisor->stats_fd);
+        return NS_ERROR;
+    }
+    supervisor->stats = (NsForkWorkerStats *)stats;
+#endif
+
+    return NS_SUCCESS;
+}
+
+int
+ns_fork_supervisor_destroy(NsForkSupervisor *supervisor)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    munmap(supervisor->stats, sizeof(NsForkWorkerStats)*NS_FORK_MAX_STATS);
+    if(close(supervisor->stats_fd) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* Every worker process, plus a line adding them all up. */
+void
+ns_fork_supervisor_print_stats(NsForkSupervisor *supervisor, FILE *file = stdout)
+{
+    fprintf(file, "%-8s %-8s %-6s %-10s %-10s %12s %12s %8s %14s %14s\n", "worker", "pid", "gen", "restarts", "state",
+            "requests", "accepted", "open", "received", "sent");
+
+    NsForkWorkerStats total = {};
+    for(uint32_t worker_idx = 0; worker_idx < supervisor->num_workers; worker_idx++)
+    {
+        for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+        {
+            NsForkWorkerStats *stats = &supervisor->stats[i];
+            if(stats->pid == 0 || stats->worker_idx != worker_idx)
+            {
+                continue;
+            }
+
+            uint64_t num_requests = ns_atomic_load_relaxed(&stats->num_requests);
+            uint64_t num_connections_accepted = ns_atomic_load_relaxed(&stats->num_connections_accepted);
+            int64_t num_connections_open = ns_atomic_load_relaxed(&stats->num_connections_open);
+            uint64_t num_bytes_received = ns_atomic_load_relaxed(&stats->num_bytes_received);
+            uint64_t num_bytes_sent = ns_atomic_load_relaxed(&stats->num_bytes_sent);
+
+            const char *state = stats->is_stopping ? "stopping" : (ns_atomic_load(&stats->is_ready) ? "ready" : "starting");
+            fprintf(file, "%-8u %-8d %-6u %-10u %-10s %12llu %12llu %8lld %14llu %14llu\n", worker_idx, stats->pid,
+                    stats->generation, supervisor->num_restarts[worker_idx], state,
+                    (unsigned long long)num_requests, (unsigned long long)num_connections_accepted,
+                    (long long)num_connections_open, (unsigned long long)num_bytes_received,
+                    (unsigned long long)num_bytes_sent);
+
+            total.num_requests += num_requests;
+            total.num_connections_accepted += num_connections_accepted;
+            total.num_connections_open += num_connections_open;
+            total.num_bytes_received += num_bytes_received;
+            total.num_bytes_sent += num_bytes_sent;
+        }
+    }
+
+    fprintf(file, "%-8s %-8s %-6s %-10s %-10s %12llu %12llu %8lld %14llu %14llu\n", "total", "", "", "", "",
+            (unsigned long long)total.num_requests, (unsigned long long)total.num_connections_accepted,
+            (long long)total.num_connections_open, (unsigned long long)total.num_bytes_received,
+            (unsigned long long)total.num_bytes_sent);
+    fflush(file);
+}
+
+/* Starts the workers and looks after them until SIGTERM or SIGINT, then stops them all and
+   returns once they're gone. */
+int
+ns_fork_supervisor_run(NsForkSupervisor *supervisor)
+{
+    int status;
+
+    memset(&ns_fork_signals, 0, sizeof(ns_fork_signals));
+    int signal_numbers[] = { SIGTERM, SIGINT, SIGHUP, SIGUSR1 };
+    for(uint32_t i = 0; i < ArrayCount(signal_numbers); i++)
+    {
+        status = ns_fork_set_signal_handler(signal_numbers[i], ns_fork_signal_handler);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    for(uint32_t i = 0; i < supervisor->num_workers; i++)
+    {
+        status = ns_fork_supervisor_spawn(supervisor, i, &supervisor->stats_idxs[i]);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    while(!ns_fork_signals.is_stop_requested)
+    {
+        ns_fork_supervisor_reap(supervisor);
+
+        status = ns_fork_supervisor_restart_dead_workers(supervisor);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        ns_fork_supervisor_kill_stuck_workers(supervisor);
+
+        if(ns_fork_signals.is_restart_requested)
+        {
+            ns_fork_signals.is_restart_requested = 0;
+            if(supervisor->rolling_worker_idx == -1)
+            {
+                LogInfo("fork supervisor: rolling restart");
+                supervisor->rolling_worker_idx = 0;
+            }
+        }
+
+        if(supervisor->rolling_worker_idx != -1)
+        {
+            status = ns_fork_supervisor_roll(supervisor);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+        }
+
+        if(ns_fork_signals.is_print_requested)
+        {
+            ns_fork_signals.is_print_requested = 0;
+            ns_fork_supervisor_print_stats(supervisor);
+        }
+
+        ns_fork_supervisor_sleep();
+    }
+
+    LogInfo("fork supervisor: stopping workers");
+    for(int i = 0; i < NS_FORK_MAX_STATS; i++)
+    {
+        ns_fork_supervisor_stop_worker(supervisor, i);
+    }
+    while(ns_fork_supervisor_check_any_alive(supervisor))
+    {
+        ns_fork_supervisor_reap(supervisor);
+        ns_fork_supervisor_kill_stuck_workers(supervisor);
+        ns_fork_supervisor_sleep();
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Lets the supervisor know we're taking connections. Until then, a rolling restart keeps
+   the worker we're replacing. */
+void
+ns_fork_worker_set_ready(NsForkWorker *worker)
+{
+    ns_atomic_store(&worker->stats->is_ready, (uint32_t)1);
+}
+
+/* The supervisor wants us gone: stop accepting, finish what's in flight, and return from
+   the worker entry. */
+bool
+ns_fork_worker_is_stopping(NsForkWorker *worker)
+{
+    bool result = (ns_atomic_load(&worker->stats->is_stopping) != 0);
+    return result;
+}
+
+/* Replaces the worker process with filename, keeping the listening socket and stats. The
+   new program picks them up with ns_fork_worker_attach(). Only returns on failure. */
+int
+ns_fork_worker_exec(NsForkWorker *worker, const char *filename, char *const *argv)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    char value[32];
+    snprintf(value, sizeof(value), "%d", worker->listen_socket.internal_socket);
+    setenv("NS_FORK_LISTEN_FD", value, 1);
+    snprintf(value, sizeof(value), "%d", worker->stats_fd);
+    setenv("NS_FORK_STATS_FD", value, 1);
+    snprintf(value, sizeof(value), "%u", worker->stats_idx);
+    setenv("NS_FORK_STATS_IDX", value, 1);
+
+    execvp(filename, argv);
+    DebugPrintOsInfo();
+#endif
+    return NS_ERROR;
+}
+
+/* For a program started by ns_fork_worker_exec(): fills in worker from what it passed on.
+   NS_ERROR if we weren't started that way. */
+int
+ns_fork_worker_attach(NsForkWorker *worker, void *data = NULL)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    const char *listen_fd = getenv("NS_FORK_LISTEN_FD");
+    const char *stats_fd = getenv("NS_FORK_STATS_FD");
+    const char *stats_idx = getenv("NS_FORK_STATS_IDX");
+    if(listen_fd == NULL || stats_fd == NULL || stats_idx == NULL)
+    {
+        return NS_ERROR;
+    }
+
+    memset(worker, 0, sizeof(NsForkWorker));
+    worker->listen_socket.internal_socket = atoi(listen_fd);
+    worker->stats_fd = atoi(stats_fd);
+    worker->stats_idx = atoi(stats_idx);
+    worker->data = data;
+    if(worker->stats_idx >= NS_FORK_MAX_STATS)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    void *stats = mmap(NULL, sizeof(NsForkWorkerStats)*NS_FORK_MAX_STATS, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       worker->stats_fd, 0);
+    if(stats == MAP_FAILED)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    worker->stats = (NsForkWorkerStats *)stats + worker->stats_idx;
+    worker->idx = worker->stats->worker_idx;
+    worker->generation = worker->stats->generation;
+#endif
+    return NS_SUCCESS;
+}
+
 #endif
@@ -0,0 +1,116 @@
+#ifndef NS_FUTEX_H
+#define NS_FUTEX_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+    #include <limits.h>
+    #include <time.h>
+    #include <errno.h>
+#endif
+
+
+/* How many times a lock spins before it sleeps, at most. Each lock learns how long it's
+   usually held and spins about that long. */
+#if !defined(NS_FUTEX_MAX_SPINS)
+    #define NS_FUTEX_MAX_SPINS 100
+#endif
+
+
+global int32_t ns_futex_max_spins = -1;
+
+
+/* API */
+
+/* NS_FUTEX_MAX_SPINS, or 0 on a single cpu, where whoever we'd be waiting on can't run
+   until we stop spinning. */
+inline int32_t
+ns_futex_get_max_spins()
+{
+    int32_t max_spins = ns_atomic_load_relaxed(&ns_futex_max_spins);
+    if(max_spins < 0)
+    {
+#if defined(WINDOWS)
+#elif defined(LINUX)
+        max_spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? NS_FUTEX_MAX_SPINS : 0;
+#endif
+        ns_atomic_store_relaxed(&ns_futex_max_spins, max_spins);
+    }
+    return max_spins;
+}
+
+/* Thin wrappers over the futex syscall, process private. Waits can return early (a signal,
+   or the value already changed), so callers always recheck. */
+
+/* Sleeps if *address is still expected. */
+inline void
+ns_futex_wait(uint32_t *address, uint32_t expected)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#endif
+}
+
+/* Returns how many were woken. */
+inline int
+ns_futex_wake(uint32_t *address, int num_to_wake)
+{
+    int result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    result = (int)syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, num_to_wake, NULL, NULL, 0);
+#endif
+    return result;
+}
+
+/* Wakes num_to_wake waiters on address and moves the rest onto to_address without waking
+   them, as long as *address is still expected. */
+inline int
+ns_futex_requeue(uint32_t *address, uint32_t expected, int num_to_wake, uint32_t *to_address)
+{
+    int result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    result = (int)syscall(SYS_futex, address, FUTEX_CMP_REQUEUE_PRIVATE, num_to_wake,
+                          (void *)(uintptr_t)INT_MAX, to_address, expected);
+#endif
+    return result;
+}
+
+/* For futexes in memory shared between processes, which the private ones above can't
+   see across. timeout_millis of 0 waits as long as it takes; NS_TIMED_OUT if it runs out. */
+inline int
+ns_futex_wait_shared(uint32_t *address, uint32_t expected, uint32_t timeout_millis = 0)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    timespec timeout;
+    timeout.tv_sec = timeout_millis/1000;
+    timeout.tv_nsec = (timeout_millis%1000)*1000000;
+    long result = syscall(SYS_futex, address, FUTEX_WAIT, expected, (timeout_millis > 0) ? &timeout : NULL, NULL, 0);
+    if(result == -1 && errno == ETIMEDOUT)
+    {
+        return NS_TIMED_OUT;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+inline int
+ns_futex_wake_shared(uint32_t *address, int num_to_wake)
+{
+    int result = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    result = (int)syscall(SYS_futex, address, FUTEX_WAKE, num_to_wake, NULL, NULL, 0);
+#endif
+    return result;
+}
+
+#endif
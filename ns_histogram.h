@@ -0,0 +1,251 @@
+#ifndef NS_HISTOGRAM_H
+#define NS_HISTOGRAM_H
+
+#include "ns_common.h"
+#include "ns_memory.h"
+
+#include <string.h>
+
+
+/* Each power of two range is split into 2^(bits - 1) linear sub buckets, so a recorded
+   value is off by at most 1 part in 2^(bits - 1). 8 bits is better than 1%. */
+#if !defined(NS_HISTOGRAM_SUB_BUCKET_BITS)
+    #define NS_HISTOGRAM_SUB_BUCKET_BITS 8
+#endif
+
+#define NS_HISTOGRAM_SUB_BUCKET_COUNT ((uint64_t)1 << NS_HISTOGRAM_SUB_BUCKET_BITS)
+#define NS_HISTOGRAM_SUB_BUCKET_HALF_COUNT (NS_HISTOGRAM_SUB_BUCKET_COUNT >> 1)
+#define NS_HISTOGRAM_NUM_COUNTS ((64 - NS_HISTOGRAM_SUB_BUCKET_BITS + 3)*NS_HISTOGRAM_SUB_BUCKET_HALF_COUNT)
+
+
+/* Log-linear (HDR style) histogram over the whole uint64_t range. Recording is a couple of
+   shifts and an increment; not thread safe, so give each thread its own and merge them. */
+struct NsHistogram
+{
+    uint64_t *counts;
+    uint64_t total_count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+
+/* Internal */
+
+/* The index math works for any precision, so other log-linear histograms (like the metrics
+   ones, which trade precision for size) can share it. */
+inline internal uint32_t
+ns_histogram_get_index(uint64_t value, int sub_bucket_bits)
+{
+    uint64_t sub_bucket_count = ((uint64_t)1 << sub_bucket_bits);
+    if(value < sub_bucket_count)
+    {
+        return (uint32_t)value;
+    }
+
+    // shift the top sub_bucket_bits bits of the value down to the bottom
+    int msb = (63 - __builtin_clzll(value));
+    int shift = (msb - (sub_bucket_bits - 1));
+    uint64_t sub_bucket = (value >> shift);
+    uint32_t result = (uint32_t)(shift*(sub_bucket_count >> 1) + sub_bucket);
+    return result;
+}
+
+/* The largest value that maps to the index. */
+inline internal uint64_t
+ns_histogram_get_value(uint32_t index, int sub_bucket_bits)
+{
+    uint64_t sub_bucket_count = ((uint64_t)1 << sub_bucket_bits);
+    if(index < sub_bucket_count)
+    {
+        return index;
+    }
+
+    uint64_t sub_bucket_half_count = (sub_bucket_count >> 1);
+    uint64_t shift = ((index / sub_bucket_half_count) - 1);
+    uint64_t sub_bucket = (index - shift*sub_bucket_half_count);
+    uint64_t result = (((sub_bucket + 1) << shift) - 1);
+    return result;
+}
+
+inline internal uint32_t
+ns_histogram_get_index(uint64_t value)
+{
+    return ns_histogram_get_index(value, NS_HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+inline internal uint64_t
+ns_histogram_get_value(uint32_t index)
+{
+    return ns_histogram_get_value(index, NS_HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+/* API */
+
+int
+ns_histogram_create(NsHistogram *histogram)
+{
+    histogram->counts = (uint64_t *)ns_memory_allocate(sizeof(uint64_t)*NS_HISTOGRAM_NUM_COUNTS);
+    if(histogram->counts == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    memset(histogram->counts, 0, sizeof(uint64_t)*NS_HISTOGRAM_NUM_COUNTS);
+    histogram->total_count = 0;
+    histogram->min = UINT64_MAX;
+    histogram->max = 0;
+    histogram->sum = 0.0;
+
+    return NS_SUCCESS;
+}
+
+int
+ns_histogram_destroy(NsHistogram *histogram)
+{
+    ns_memory_free(histogram->counts);
+    histogram->counts = NULL;
+    return NS_SUCCESS;
+}
+
+void
+ns_histogram_reset(NsHistogram *histogram)
+{
+    memset(histogram->counts, 0, sizeof(uint64_t)*NS_HISTOGRAM_NUM_COUNTS);
+    histogram->total_count = 0;
+    histogram->min = UINT64_MAX;
+    histogram->max = 0;
+    histogram->sum = 0.0;
+}
+
+void
+ns_histogram_record(NsHistogram *histogram, uint64_t value, uint64_t count = 1)
+{
+    histogram->counts[ns_histogram_get_index(value)] += count;
+    histogram->total_count += count;
+    histogram->sum += ((double)value*count);
+    if(value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/* For latencies measured by something that waits for each response before sending the
+   next request: a stall hides all the requests that would have been sent during it. If
+   value is more than expected_interval, this also records the latencies those missing
+   requests would have seen (value - expected_interval, value - 2*expected_interval, ...). */
+void
+ns_histogram_record_corrected(NsHistogram *histogram, uint64_t value, uint64_t expected_interval)
+{
+    ns_histogram_record(histogram, value);
+
+    if(expected_interval == 0)
+    {
+        return;
+    }
+
+    for(uint64_t missing_value = (value > expected_interval) ? (value - expected_interval) : 0;
+        missing_value >= expected_interval;
+        missing_value -= expected_interval)
+    {
+        ns_histogram_record(histogram, missing_value);
+    }
+}
+
+void
+ns_histogram_merge(NsHistogram *dest, NsHistogram *src)
+{
+    for(uint32_t i = 0; i < NS_HISTOGRAM_NUM_COUNTS; i++)
+    {
+        dest->counts[i] += src->counts[i];
+    }
+
+    dest->total_count += src->total_count;
+    dest->sum += src->sum;
+    if(src->min < dest->min)
+    {
+        dest->min = src->min;
+    }
+    if(src->max > dest->max)
+    {
+        dest->max = src->max;
+    }
+}
+
+/* percentile is in [0, 100]. Returns the upper end of the bucket it falls in, so it may
+   overstate by up to the histogram's precision but never understates. */
+uint64_t
+ns_histogram_get_percentile(NsHistogram *histogram, double percentile)
+{
+    if(histogram->total_count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target_count = (uint64_t)((percentile/100.0)*histogram->total_count + 0.5);
+    if(target_count < 1)
+    {
+        target_count = 1;
+    }
+
+    uint64_t running_count = 0;
+    for(uint32_t i = 0; i < NS_HISTOGRAM_NUM_COUNTS; i++)
+    {
+        running_count += histogram->counts[i];
+        if(running_count >= target_count)
+        {
+            uint64_t value = ns_histogram_get_value(i);
+            uint64_t result = (value < histogram->max) ? value : histogram->max;
+            return result;
+        }
+    }
+
+    return histogram->max;
+}
+
+double
+ns_histogram_get_mean(NsHistogram *histogram)
+{
+    double result = (histogram->total_count > 0) ? (histogram->sum/histogram->total_count) : 0.0;
+    return result;
+}
+
+uint64_t
+ns_histogram_get_total_count(NsHistogram *histogram)
+{
+    return histogram->total_count;
+}
+
+uint64_t
+ns_histogram_get_max(NsHistogram *histogram)
+{
+    return histogram->max;
+}
+
+uint64_t
+ns_histogram_get_min(NsHistogram *histogram)
+{
+    uint64_t result = (histogram->total_count > 0) ? histogram->min : 0;
+    return result;
+}
+
+/* Visits every nonempty bucket with its upper value, lowest first. */
+template <typename lambda>
+void
+ns_histogram_for_each_bucket(NsHistogram *histogram, lambda visit)
+{
+    for(uint32_t i = 0; i < NS_HISTOGRAM_NUM_COUNTS; i++)
+    {
+        if(histogram->counts[i] > 0)
+        {
+            visit(ns_histogram_get_value(i), histogram->counts[i]);
+        }
+    }
+}
+
+#endif
@@ -6,23 +6,88 @@
 #include "ns_thread.h"
 #include "ns_file.h"
 #include "ns_string.h"
-#include "ns_socket_pool.h"
+#include "ns_connection_table.h"
 #include "ns_worker_threads.h"
+#include "ns_numa.h"
 #include "ns_pollfd.h"
 #include "ns_poll_fds.h"
+#include "ns_timer_wheel.h"
+#include "ns_time.h"
+#include "ns_metrics.h"
+#include "ns_log.h"
+#include "ns_trace.h"
+#include "ns_fork.h"
 
 
+#if !defined(NS_HTTP_SERVER_KEEP_ALIVE_TIMEOUT_MILLIS)
+    #define NS_HTTP_SERVER_KEEP_ALIVE_TIMEOUT_MILLIS 30000
+#endif
+
+/* GET /metrics renders into a buffer this big, so it has to hold every registered metric. */
+#if !defined(NS_HTTP_SERVER_METRICS_BUFFER_SIZE)
+    #define NS_HTTP_SERVER_METRICS_BUFFER_SIZE Kilobytes(256)
+#endif
+
+/* With a listening socket that's shared with other processes, how often the peer getter
+   thread looks up from accepting to see if it should stop. */
+#if !defined(NS_HTTP_SERVER_ACCEPT_POLL_MILLIS)
+    #define NS_HTTP_SERVER_ACCEPT_POLL_MILLIS 100
+#endif
+
+/* How long a forked worker that's been told to stop waits for its connections to close. */
+#if !defined(NS_HTTP_SERVER_DRAIN_MILLIS)
+    #define NS_HTTP_SERVER_DRAIN_MILLIS 5000
+#endif
+
+
+struct NsHttpServerMetrics
+{
+    NsMetricsCounter requests;
+    NsMetricsCounter responses_ok;
+    NsMetricsCounter responses_not_found;
+    NsMetricsCounter connections_accepted;
+    NsMetricsCounter connections_closed;
+    NsMetricsCounter bytes_received;
+    NsMetricsCounter bytes_sent;
+    NsMetricsGauge connections_open;
+    NsMetricsGauge work_queue_depth;
+    NsMetricsHistogram request_duration; // from the read that completed the request to the response going out
+    NsMetricsHistogram work_queue_wait_time;
+};
+
+/* The data for ns_http_server_fork_worker_entry(). */
+struct NsHttpServerForkOptions
+{
+    int max_connections;
+    int max_threads;
+};
+
 struct NsHttpServer
 {
     int max_connections;
     const char *port;
 
+    // set if we were given a socket to accept on, rather than listening on port ourselves
+    NsSocket *listen_socket;
+    uint32_t is_accepting_stopped;
+
     NsThread ns_http_server_peer_getter_thread;
     NsThread ns_http_server_peer_receiver_thread;
     NsWorkerThreads worker_threads;
 
-    NsSocketPool socket_pool;
+    NsConnectionTable connection_table;
     NsPollFds poll_fds;
+
+    // closes keep-alive connections that have gone quiet. the peer getter thread and the
+    // workers arm, and the receiver thread fires, so everyone locks around the wheel.
+    NsTimerWheel timer_wheel;
+    NsMutex timer_mutex;
+
+    NsHttpServerMetrics metrics;
+
+    // scrapes are rare, so they take turns with the one buffer
+    char metrics_buffer[NS_HTTP_SERVER_METRICS_BUFFER_SIZE];
+    NsMutex metrics_mutex;
 };
 
 
@@ -31,15 +96,193 @@ global NsHttpServer ns_http_server_context;
 
 /* Internal */
 
-internal void *
-ns_http_server_peer_thread_entry(void *thread_input)
+internal int ns_http_server_arm_idle_timer(NsConnection *connection);
+
+/* Returns the number of bytes sent, or an error. */
+internal int
+ns_http_server_send_metrics(NsSocket *socket)
+{
+    int status;
+
+    status = ns_mutex_lock(&ns_http_server_context.metrics_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    char *body = ns_http_server_context.metrics_buffer;
+    int body_length = ns_metrics_render(body, NS_HTTP_SERVER_METRICS_BUFFER_SIZE);
+    if(body_length < 0)
+    {
+        DebugPrintInfo();
+        ns_mutex_unlock(&ns_http_server_context.metrics_mutex);
+        return body_length;
+    }
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Connection: keep-alive\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Cache-Control: no-cache\r\n"
+                                 "Content-Length: %d\r\n\r\n", body_length);
+
+    int result = NS_ERROR;
+    int bytes_sent = ns_socket_send(socket, header, header_length);
+    if(bytes_sent == header_length)
+    {
+        bytes_sent = ns_socket_send(socket, body, body_length);
+        if(bytes_sent == body_length)
+        {
+            result = (header_length + body_length);
+        }
+        else
+        {
+            DebugPrintInfo();
+        }
+    }
+    else
+    {
+        DebugPrintInfo();
+    }
+
+    status = ns_mutex_unlock(&ns_http_server_context.metrics_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return result;
+}
+
+internal int64_t
+ns_http_server_get_work_queue_depth(void *data)
+{
+    int64_t result = ns_work_queue_get_depth(&ns_http_server_context.worker_threads.work_queue);
+    return result;
+}
+
+internal int
+ns_http_server_register_metrics()
+{
+    int status;
+
+    NsHttpServerMetrics *metrics = &ns_http_server_context.metrics;
+    memset(metrics, 0, sizeof(*metrics));
+
+    status = ns_metrics_register_counter(&metrics->requests, "ns_http_server_requests_total",
+                                         "Requests received.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    // same name back to back, so they're rendered as one metric
+    status = ns_metrics_register_counter(&metrics->responses_ok, "ns_http_server_responses_total",
+                                         "Responses sent, by status code.", "status=\"200\"");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->responses_not_found, "ns_http_server_responses_total",
+                                         "Responses sent, by status code.", "status=\"404\"");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->connections_accepted, "ns_http_server_connections_accepted_total",
+                                         "Connections accepted.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->connections_closed, "ns_http_server_connections_closed_total",
+                                         "Connections closed, by the peer or for being idle.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->bytes_received, "ns_http_server_received_bytes_total",
+                                         "Bytes read from peers.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->bytes_sent, "ns_http_server_sent_bytes_total",
+                                         "Bytes written to peers.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_gauge(&metrics->connections_open, "ns_http_server_connections_open",
+                                       "Connections currently open.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_gauge(&metrics->work_queue_depth, "ns_http_server_work_queue_depth",
+                                       "Reads waiting for a worker.",
+                                       ns_http_server_get_work_queue_depth, NULL);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_histogram(&metrics->request_duration, "ns_http_server_request_duration_seconds",
+                                           "Time from reading a request to sending its response.", 1e-9);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_histogram(&metrics->work_queue_wait_time, "ns_http_server_work_queue_wait_seconds",
+                                           "Time reads spend waiting for a worker.", 1e-9);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_connection_table_register_metrics(&ns_http_server_context.connection_table, "table=\"http\"");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Handles one null terminated request. The response goes out before we return, so
+   pipelined requests are answered in order. */
+internal void
+ns_http_server_handle_request(NsConnection *connection, char *peer_request)
 {
     int status;
     char token[256]; // TODO: len?
 
-    uint8_t *mem = (uint8_t *)thread_input;
-    NsSocket *socket = *(NsSocket **)mem;
-    char *peer_request = (char *)((NsSocket **)mem + 1);
+    NsSocket *socket = &connection->socket;
+    NsHttpServerMetrics *metrics = &ns_http_server_context.metrics;
+    ns_metrics_counter_add(&metrics->requests);
 
     // get request
     int len = ns_string_get_token(token, peer_request, sizeof(token), ' ');
@@ -51,8 +294,23 @@ ns_http_server_peer_thread_entry(void *thread_input)
         {
             // get resource
             len = ns_string_get_token(token, peer_request, sizeof(token), ' ');
-            if(len > 0)
+            if(len > 0 && !strcmp(token, "/metrics"))
             {
+                NsTraceSpan("send");
+                int bytes_sent = ns_http_server_send_metrics(socket);
+                if(bytes_sent > 0)
+                {
+                    ns_metrics_counter_add(&metrics->responses_ok);
+                    ns_metrics_counter_add(&metrics->bytes_sent, bytes_sent);
+                }
+                else
+                {
+                    DebugPrintInfo();
+                }
+            }
+            else if(len > 0)
+            {
+                NsMetricsCounter *responses = &metrics->responses_ok;
                 const char *header_status;
                 char *resource_filename = !strcmp(token, "/") ? (char *)"index.html" : token;
                 if(ns_file_check_exists(resource_filename))
@@ -63,6 +321,7 @@ ns_http_server_peer_thread_entry(void *thread_input)
                 {
                     header_status = "HTTP/1.1 404 Not Found\r\n";
                     resource_filename = (char *)"404.html";
+                    responses = &metrics->responses_not_found;
                 }
 
                 NsFile file;
@@ -74,7 +333,7 @@ ns_http_server_peer_thread_entry(void *thread_input)
                     {
                         // construct response
 
-                        char response[Kilobytes(4)]; // TODO: len?
+                        char *response = (char *)connection->write_buffer;
                         int response_length = 0;
 
                         strcpy(&response[response_length], header_status);
@@ -96,7 +355,12 @@ ns_http_server_peer_thread_entry(void *thread_input)
                         strcpy(&response[response_length], end);
                         response_length += strlen(end);
 
-                        int bytes_read = ns_file_load(&file, &response[response_length], sizeof(response) - response_length);
+                        uint64_t file_read_start_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
+                        int bytes_read = ns_file_load(&file, &response[response_length], NS_CONNECTION_WRITE_BUFFER_SIZE - response_length);
+                        if(file_read_start_ticks != 0)
+                        {
+                            ns_trace_record("file read", file_read_start_ticks, ns_trace_get_ticks());
+                        }
                         if(bytes_read == resource_size)
                         {
                             response_length += resource_size;
@@ -104,8 +368,18 @@ ns_http_server_peer_thread_entry(void *thread_input)
                             status = ns_file_close(&file);
                             if(status == NS_SUCCESS)
                             {
+                                uint64_t send_start_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
                                 int bytes_sent = ns_socket_send(socket, response, response_length);
-                                if(bytes_sent != response_length) 
+                                if(send_start_ticks != 0)
+                                {
+                                    ns_trace_record("send", send_start_ticks, ns_trace_get_ticks());
+                                }
+                                if(bytes_sent == response_length) 
+                                {
+                                    ns_metrics_counter_add(responses);
+                                    ns_metrics_counter_add(&metrics->bytes_sent, bytes_sent);
+                                }
+                                else
                                 {
                                     DebugPrintInfo();
                                 }
@@ -137,7 +411,7 @@ ns_http_server_peer_thread_entry(void *thread_input)
         }
         else
         {
-            printf("unknown request\n");
+            LogWarn("http server: unknown request");
         }
     }
     else
@@ -145,88 +419,297 @@ ns_http_server_peer_thread_entry(void *thread_input)
         DebugPrintInfo();
     }
 
-    ns_memory_free(mem);
+    ns_metrics_histogram_record(&metrics->request_duration, ns_time_get_nanos() - connection->receive_nanos);
+}
+
+/* Runs on a worker, which owns the connection (buffers and all) until it hands it back to
+   the receiver thread at the end. */
+internal void *
+ns_http_server_peer_thread_entry(void *thread_input)
+{
+    int status;
+
+    NsTraceSpan("handler");
+
+    NsConnectionHandle handle = (NsConnectionHandle)thread_input;
+    NsConnection *connection = ns_connection_table_lookup(&ns_http_server_context.connection_table, handle);
+    if(connection == NULL)
+    {
+        DebugPrintInfo();
+        return (void *)NS_SUCCESS;
+    }
+
+    // a client may pipeline several requests into one read, and the last may be cut off
+    char *buffer = (char *)connection->read_buffer;
+    uint32_t read_length = connection->read_length;
+    uint32_t request_start = 0;
+    while(1)
+    {
+        char *request_end = strstr(&buffer[request_start], "\r\n\r\n");
+        if(request_end == NULL)
+        {
+            break;
+        }
+
+        uint32_t next_request_start = (uint32_t)(request_end - buffer) + 4;
+        char saved = buffer[next_request_start];
+        buffer[next_request_start] = 0;
+
+        ns_http_server_handle_request(connection, &buffer[request_start]);
+
+        buffer[next_request_start] = saved;
+        request_start = next_request_start;
+    }
+
+    // keep the partial request for the next read
+    uint32_t leftover_length = (read_length - request_start);
+    memmove(buffer, &buffer[request_start], leftover_length);
+    buffer[leftover_length] = 0;
+    connection->read_length = leftover_length;
+
+    // the connection's still alive, so push back its idle timeout
+    status = ns_http_server_arm_idle_timer(connection);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+
+    // hand the connection back to the receiver thread. we can't touch it after this.
+    ns_poll_fds_set_events(&ns_http_server_context.poll_fds, connection->pollfd_idx, NS_SOCKET_POLL_IN);
+    ns_atomic_store(&connection->state, (uint32_t)NS_CONNECTION_READING);
 
     return (void *)NS_SUCCESS;
 }
 
+/* Must be called from the receiver thread, while it owns the connection. */
+internal int
+ns_http_server_close_connection(NsConnection *connection)
+{
+    int status;
+
+    LogInfo("http server: connection closed");
+    ns_metrics_counter_add(&ns_http_server_context.metrics.connections_closed);
+    ns_metrics_gauge_add(&ns_http_server_context.metrics.connections_open, -1);
+
+    status = ns_poll_fds_remove(&ns_http_server_context.poll_fds, connection);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_socket_close(&connection->socket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_connection_table_release(&ns_http_server_context.connection_table, connection);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+internal void
+ns_http_server_idle_timer_callback(NsTimer *timer, void *data)
+{
+    int status;
+
+    // a worker has it; the worker re-arms the timer once it's done
+    NsConnection *connection = (NsConnection *)data;
+    if(ns_atomic_load(&connection->state) != NS_CONNECTION_READING)
+    {
+        return;
+    }
+
+    status = ns_http_server_close_connection(connection);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+}
+
+internal int
+ns_http_server_arm_idle_timer(NsConnection *connection)
+{
+    int status;
+
+    status = ns_mutex_lock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_timer_wheel_arm(&ns_http_server_context.timer_wheel, &connection->idle_timer,
+                       ns_time_get_millis(), NS_HTTP_SERVER_KEEP_ALIVE_TIMEOUT_MILLIS);
+
+    status = ns_mutex_unlock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+internal int
+ns_http_server_cancel_idle_timer(NsConnection *connection)
+{
+    int status;
+
+    status = ns_mutex_lock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_timer_wheel_cancel(&ns_http_server_context.timer_wheel, &connection->idle_timer);
+
+    status = ns_mutex_unlock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Fires expired timers and returns how long we can sleep until the next one, or -1. */
+internal int
+ns_http_server_fire_timers(int *timeout_millis_ptr)
+{
+    int status;
+
+    status = ns_mutex_lock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    uint64_t now_millis = ns_time_get_millis();
+    ns_timer_wheel_advance(&ns_http_server_context.timer_wheel, now_millis);
+    *timeout_millis_ptr = ns_timer_wheel_get_timeout_millis(&ns_http_server_context.timer_wheel, now_millis);
+
+    status = ns_mutex_unlock(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
 internal void *
-ns_http_server_peer_receiver_thread_entry(void *thread_input)
+ns_http_server_peer_receive_loop(void *thread_input)
 {
     int status;
+    ns_trace_set_thread_name("http receiver");
 
     while(1)
     {
         NsPollFd *pollfds = ns_poll_fds_get(&ns_http_server_context.poll_fds);
         int pollfds_capacity = ns_poll_fds_get_capacity(&ns_http_server_context.poll_fds);
 
-        status = ns_poll_fds_wait_till_nonempty_and_lock(&ns_http_server_context.poll_fds);
+        int timeout_millis;
+        status = ns_http_server_fire_timers(&timeout_millis);
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return (void *)status;
+            return (void *)(intptr_t)status;
         }
 
-        int num_fds_ready = ns_socket_poll(pollfds, pollfds_capacity, 10);
+        // new connections, workers handing connections back and newly armed timers all
+        // wake us, so we can sleep until the next timer
+        int num_fds_ready = ns_poll_fds_poll(&ns_http_server_context.poll_fds, timeout_millis);
         if(num_fds_ready < 0)
         {
             DebugPrintInfo();
             return (void *)NS_ERROR;
         }
 
-        status = ns_poll_fds_unlock(&ns_http_server_context.poll_fds);
-        if(status != NS_SUCCESS)
-        {
-            DebugPrintInfo();
-            return (void *)status;
-        }
-
         if(num_fds_ready > 0)
         {
+            NsTraceSpan("poll wakeup");
+
             for(int i = 0; i < pollfds_capacity; i++)
             {
                 if(pollfds[i].fd >= 0)
                 {
                     if((pollfds[i].revents & NS_SOCKET_POLL_IN) != 0)
                     {
-                        NsSocket *socket = (NsSocket *)ns_poll_fds_get_container(&ns_http_server_context.poll_fds, i);
+                        NsConnection *connection = (NsConnection *)ns_poll_fds_get_container(&ns_http_server_context.poll_fds, i);
+
+                        // a worker still owns it; we'll see this again once it's handed back
+                        if(ns_atomic_load(&connection->state) != NS_CONNECTION_READING)
+                        {
+                            continue;
+                        }
 
                         bool closed = false;
-                        int message_size = ns_socket_get_bytes_available(socket);
+                        int message_size = ns_socket_get_bytes_available(&connection->socket);
                         if(message_size > 0)
                         {
-                            uint8_t *mem = (uint8_t *)ns_memory_allocate(sizeof(NsSocket *) + message_size);
-                            *(NsSocket **)mem = socket;
-                            uint8_t *buf = (uint8_t *)((NsSocket **)mem + 1);
-
-                            int bytes_received = ns_socket_receive(socket, buf, message_size);
-                            if(bytes_received == message_size)
+                            // append to whatever partial request the worker left behind, leaving
+                            // room for a null terminator. anything that doesn't fit is picked up
+                            // on the next poll.
+                            int buffer_space = (NS_CONNECTION_READ_BUFFER_SIZE - 1 - connection->read_length);
+                            int bytes_to_receive = ns_math_min(message_size, buffer_space);
+                            if(bytes_to_receive == 0)
                             {
-                                // sanity check
-                                if(bytes_received != message_size)
+                                // a request that doesn't fit in the buffer
+                                DebugPrintInfo();
+                                closed = true;
+                            }
+                            else
+                            {
+                                uint64_t receive_start_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
+                                int bytes_received = ns_socket_receive(&connection->socket, &connection->read_buffer[connection->read_length], bytes_to_receive);
+                                if(receive_start_ticks != 0)
                                 {
-                                    DebugPrintInfo();
-                                    return (void *)NS_ERROR;
+                                    ns_trace_record("receive", receive_start_ticks, ns_trace_get_ticks());
                                 }
-
-                                status = ns_worker_threads_add_work(&ns_http_server_context.worker_threads, 
-                                                                    ns_http_server_peer_thread_entry, mem);
-                                if(status != NS_SUCCESS)
+                                if(bytes_received == bytes_to_receive)
+                                {
+                                    connection->read_length += bytes_received;
+                                    connection->read_buffer[connection->read_length] = 0;
+                                    connection->receive_nanos = ns_time_get_nanos();
+                                    ns_metrics_counter_add(&ns_http_server_context.metrics.bytes_received, bytes_received);
+
+                                    // hand it to a worker, and stop polling it until it comes back
+                                    ns_poll_fds_set_events(&ns_http_server_context.poll_fds, i, 0);
+                                    ns_atomic_store(&connection->state, (uint32_t)NS_CONNECTION_PROCESSING);
+
+                                    NsConnectionHandle handle = ns_connection_table_get_handle(connection);
+                                    NsTraceSpan("enqueue");
+                                    status = ns_worker_threads_add_work(&ns_http_server_context.worker_threads, 
+                                                                        ns_http_server_peer_thread_entry, (void *)handle);
+                                    if(status != NS_SUCCESS)
+                                    {
+                                        DebugPrintInfo();
+                                        return (void *)(intptr_t)status;
+                                    }
+                                }
+                                else if(bytes_received == 0)
+                                {
+                                    closed = true;
+                                }
+                                else
                                 {
                                     DebugPrintInfo();
-                                    return (void *)status;
+                                    return (void *)(intptr_t)bytes_received;
                                 }
                             }
-                            else if(bytes_received == 0)
-                            {
-                                closed = true;
-                            }
-                            else
-                            {
-                                DebugPrintInfo();
-                                ns_memory_free(mem);
-                                return (void *)bytes_received;
-                            }
                         }
                         else if(message_size == 0)
                         {
@@ -235,32 +718,23 @@ ns_http_server_peer_receiver_thread_entry(void *thread_input)
                         else
                         {
                             DebugPrintInfo();
-                            return (void *)message_size;
+                            return (void *)(intptr_t)message_size;
                         }
 
                         if(closed)
                         {
-                            printf("http server: connection closed\n");
-
-                            status = ns_socket_close(socket);
+                            status = ns_http_server_cancel_idle_timer(connection);
                             if(status != NS_SUCCESS)
                             {
                                 DebugPrintInfo();
-                                return (void *)status;
+                                return (void *)(intptr_t)status;
                             }
 
-                            status = ns_socket_pool_release(&ns_http_server_context.socket_pool, socket);
+                            status = ns_http_server_close_connection(connection);
                             if(status != NS_SUCCESS)
                             {
                                 DebugPrintInfo();
-                                return (void *)status;
-                            }
-
-                            status = ns_poll_fds_remove(&ns_http_server_context.poll_fds, socket);
-                            if(status != NS_SUCCESS)
-                            {
-                                DebugPrintInfo();
-                                return (void *)status;
+                                return (void *)(intptr_t)status;
                             }
                         }
                     }
@@ -272,43 +746,99 @@ ns_http_server_peer_receiver_thread_entry(void *thread_input)
     return (void *)NS_SUCCESS;
 }
 
+internal void *
+ns_http_server_peer_receiver_thread_entry(void *thread_input)
+{
+    void *result = ns_http_server_peer_receive_loop(thread_input);
+
+    // however we got out, removes shouldn't wait on us anymore
+    if(ns_poll_fds_stop_polling(&ns_http_server_context.poll_fds) != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+
+    return result;
+}
+
 internal void *
 ns_http_server_peer_getter_thread_entry(void *thread_input)
 {
     int status;
+    ns_trace_set_thread_name("http getter");
 
     NsSocket socket;
-    status = ns_socket_listen(&socket, ns_http_server_context.port);
-    if(status != NS_SUCCESS)
+    if(ns_http_server_context.listen_socket != NULL)
     {
-        DebugPrintInfo();
-        return (void *)status;
+        socket = *ns_http_server_context.listen_socket;
+    }
+    else
+    {
+        status = ns_socket_listen(&socket, ns_http_server_context.port);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
+        }
     }
 
-	printf("http server: waiting for connections...\n");
+    LogInfo("http server: waiting for connections...");
 
     while(1)
     {
-        NsSocket *peer_socket;
-        status = ns_socket_pool_get(&ns_http_server_context.socket_pool, &peer_socket);
+        NsConnection *connection;
+        status = ns_connection_table_get(&ns_http_server_context.connection_table, &connection);
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return (void *)status;
+            return (void *)(intptr_t)status;
         }
 
-        status = ns_socket_accept(&socket, peer_socket, 0, "http server");
+        // a shared socket is non-blocking, since whoever else is accepting on it can take
+        // the peer we were woken for. we wake up now and then to see if we should stop.
+        uint32_t accept_timeout_millis = (ns_http_server_context.listen_socket != NULL) ? NS_HTTP_SERVER_ACCEPT_POLL_MILLIS : 0;
+        status = ns_socket_accept(&socket, &connection->socket, accept_timeout_millis, "http server");
+        while(status == NS_TIMED_OUT || status == NS_SOCKET_WOULD_BLOCK)
+        {
+            if(ns_atomic_load(&ns_http_server_context.is_accepting_stopped))
+            {
+                ns_connection_table_release(&ns_http_server_context.connection_table, connection);
+                return (void *)NS_SUCCESS;
+            }
+            status = ns_socket_accept(&socket, &connection->socket, accept_timeout_millis, "http server");
+        }
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return (void *)status;
+            return (void *)(intptr_t)status;
         }
 
-        status = ns_poll_fds_add(&ns_http_server_context.poll_fds, peer_socket);
+        // the accept itself mostly waits for a peer, so only trace setting the connection up
+        NsTraceSpan("accept");
+        ns_metrics_counter_add(&ns_http_server_context.metrics.connections_accepted);
+        ns_metrics_gauge_add(&ns_http_server_context.metrics.connections_open, 1);
+
+        // responses are written whole, so there's nothing for nagle to coalesce; it'd just
+        // hold pipelined responses back waiting on the client's delayed acks
+        status = ns_socket_set_no_delay(&connection->socket, true);
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return (void *)status;
+            return (void *)(intptr_t)status;
+        }
+
+        // arm first so the add's wakeup also gets the receiver to notice the new timer
+        status = ns_http_server_arm_idle_timer(connection);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
+        }
+
+        status = ns_poll_fds_add(&ns_http_server_context.poll_fds, connection);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
         }
     }
 }
@@ -316,8 +846,12 @@ ns_http_server_peer_getter_thread_entry(void *thread_input)
 
 /* API */
 
+/* With a placement, the peer getter and receiver threads are pinned to its first two cpus
+   and the workers to the ones after. With a listen_socket, we accept on that instead of
+   listening on port, so several processes can share one; it's made non-blocking. */
 int
-ns_http_server_startup(const char *port, int max_connections, int max_threads)
+ns_http_server_startup(const char *port, int max_connections, int max_threads,
+                       NsNumaPlacement placement = NS_NUMA_PLACEMENT_NONE, NsSocket *listen_socket = NULL)
 {
     int status;
 
@@ -328,14 +862,36 @@ ns_http_server_startup(const char *port, int max_connections, int max_threads)
         return NS_ERROR;
     }
 
-    status = ns_poll_fds_create(&ns_http_server_context.poll_fds, NS_SOCKET, max_connections);
+    status = ns_poll_fds_create(&ns_http_server_context.poll_fds, NS_CONNECTION, max_connections);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_connection_table_create(&ns_http_server_context.connection_table, max_connections,
+                                        ns_http_server_idle_timer_callback);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_timer_wheel_create(&ns_http_server_context.timer_wheel, ns_time_get_millis());
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    status = ns_socket_pool_create(&ns_http_server_context.socket_pool, max_connections);
+    status = ns_mutex_create(&ns_http_server_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_mutex_create(&ns_http_server_context.metrics_mutex);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
@@ -343,26 +899,53 @@ ns_http_server_startup(const char *port, int max_connections, int max_threads)
     }
 
     int max_work = ns_math_max(2*max_connections, 64);
-    status = ns_worker_threads_create(&ns_http_server_context.worker_threads, max_threads - 2, max_work);
+    status = ns_worker_threads_create(&ns_http_server_context.worker_threads, max_threads - 2, max_work,
+                                      placement, 2);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    status = ns_http_server_register_metrics();
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_work_queue_set_wait_time_histogram(&ns_http_server_context.worker_threads.work_queue,
+                                          &ns_http_server_context.metrics.work_queue_wait_time);
+
+    if(listen_socket != NULL)
+    {
+        status = ns_socket_set_blocking(listen_socket, false);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
     ns_http_server_context.max_connections = max_connections;
     ns_http_server_context.port = port;
+    ns_http_server_context.listen_socket = listen_socket;
+
+    NsThreadAttributes attributes;
+    ns_thread_attributes_init(&attributes);
 
+    ns_numa_set_thread_attributes(&attributes, 0, placement);
     status = ns_thread_create(&ns_http_server_context.ns_http_server_peer_getter_thread, 
-                              ns_http_server_peer_getter_thread_entry, NULL);
+                              ns_http_server_peer_getter_thread_entry, NULL, &attributes);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    ns_numa_set_thread_attributes(&attributes, 1, placement);
     status = ns_thread_create(&ns_http_server_context.ns_http_server_peer_receiver_thread, 
-                              ns_http_server_peer_receiver_thread_entry, NULL);
+                              ns_http_server_peer_receiver_thread_entry, NULL, &attributes);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
@@ -372,4 +955,62 @@ ns_http_server_startup(const char *port, int max_connections, int max_threads)
     return NS_SUCCESS;
 }
 
+/* Stops taking new connections; the ones already open carry on. Only for a server started
+   with a listen_socket, since otherwise the peer getter thread blocks in accept. */
+void
+ns_http_server_stop_accepting()
+{
+    ns_atomic_store(&ns_http_server_context.is_accepting_stopped, (uint32_t)1);
+}
+
+/* Copies our metrics into the worker's slot of the supervisor's stats. */
+void
+ns_http_server_publish_fork_stats(NsForkWorker *worker)
+{
+    NsHttpServerMetrics *metrics = &ns_http_server_context.metrics;
+    NsForkWorkerStats *stats = worker->stats;
+    ns_atomic_store_relaxed(&stats->num_requests, ns_metrics_counter_get(&metrics->requests));
+    ns_atomic_store_relaxed(&stats->num_connections_accepted, ns_metrics_counter_get(&metrics->connections_accepted));
+    ns_atomic_store_relaxed(&stats->num_connections_open, ns_metrics_gauge_get(&metrics->connections_open));
+    ns_atomic_store_relaxed(&stats->num_bytes_received, ns_metrics_counter_get(&metrics->bytes_received));
+    ns_atomic_store_relaxed(&stats->num_bytes_sent, ns_metrics_counter_get(&metrics->bytes_sent));
+}
+
+/* A worker entry for ns_fork_supervisor_create(), with an NsHttpServerForkOptions as the
+   data. Serves on the supervisor's socket until told to stop, then gives open connections
+   up to NS_HTTP_SERVER_DRAIN_MILLIS to finish. */
+int
+ns_http_server_fork_worker_entry(NsForkWorker *worker)
+{
+    int status;
+
+    NsHttpServerForkOptions *options = (NsHttpServerForkOptions *)worker->data;
+    status = ns_http_server_startup(NULL, options->max_connections, options->max_threads,
+                                    NS_NUMA_PLACEMENT_NONE, &worker->listen_socket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_fork_worker_set_ready(worker);
+    while(!ns_fork_worker_is_stopping(worker))
+    {
+        ns_http_server_publish_fork_stats(worker);
+        ns_thread_sleep(NS_FORK_SUPERVISOR_TICK_MILLIS);
+    }
+
+    ns_http_server_stop_accepting();
+    uint64_t drain_end_millis = ns_time_get_millis() + NS_HTTP_SERVER_DRAIN_MILLIS;
+    while(ns_metrics_gauge_get(&ns_http_server_context.metrics.connections_open) > 0 &&
+          ns_time_get_millis() < drain_end_millis)
+    {
+        ns_http_server_publish_fork_stats(worker);
+        ns_thread_sleep(NS_FORK_SUPERVISOR_TICK_MILLIS);
+    }
+    ns_http_server_publish_fork_stats(worker);
+
+    return NS_SUCCESS;
+}
+
 #endif
@@ -0,0 +1,92 @@
+#ifndef NS_INDEX_STACK_H
+#define NS_INDEX_STACK_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+
+
+#define NS_INDEX_STACK_EMPTY 0
+
+
+/* Lock-free stack of indices, i.e. a free list for an array. The 'next' links live in
+   the elements themselves, so the caller passes a lambda that maps an index to a
+   pointer to that element's uint32_t next field. The head carries a tag that's bumped
+   on every change so a pop can't be fooled by ABA. */
+struct NsIndexStack
+{
+    // low 32 bits: (top index + 1), or NS_INDEX_STACK_EMPTY. high 32 bits: tag.
+    uint64_t head;
+};
+
+
+/* Internal */
+
+inline internal uint64_t
+ns_index_stack_make_head(uint64_t old_head, uint32_t top)
+{
+    uint64_t tag = ((old_head >> 32) + 1);
+    uint64_t result = ((tag << 32) | top);
+    return result;
+}
+
+/* API */
+
+void
+ns_index_stack_create(NsIndexStack *stack)
+{
+    stack->head = NS_INDEX_STACK_EMPTY;
+}
+
+template <typename lambda>
+void
+ns_index_stack_push(NsIndexStack *stack, uint32_t index, lambda get_next_ptr)
+{
+    uint32_t *next_ptr = get_next_ptr(index);
+
+    uint64_t old_head = ns_atomic_load(&stack->head);
+    while(1)
+    {
+        ns_atomic_store_relaxed(next_ptr, (uint32_t)old_head);
+
+        uint64_t new_head = ns_index_stack_make_head(old_head, index + 1);
+        if(ns_atomic_compare_exchange(&stack->head, &old_head, new_head))
+        {
+            break;
+        }
+    }
+}
+
+/* Returns whether the stack was nonempty. */
+template <typename lambda>
+bool
+ns_index_stack_pop(NsIndexStack *stack, uint32_t *index_ptr, lambda get_next_ptr)
+{
+    uint64_t old_head = ns_atomic_load(&stack->head);
+    while(1)
+    {
+        uint32_t top = (uint32_t)old_head;
+        if(top == NS_INDEX_STACK_EMPTY)
+        {
+            return false;
+        }
+
+        // this may be stale if someone else pops 'top' first, but then the tag won't match
+        uint32_t next = ns_atomic_load_relaxed(get_next_ptr(top - 1));
+
+        uint64_t new_head = ns_index_stack_make_head(old_head, next);
+        if(ns_atomic_compare_exchange(&stack->head, &old_head, new_head))
+        {
+            *index_ptr = (top - 1);
+            return true;
+        }
+    }
+}
+
+bool
+ns_index_stack_check_empty(NsIndexStack *stack)
+{
+    bool result = ((uint32_t)ns_atomic_load(&stack->head) == NS_INDEX_STACK_EMPTY);
+    return result;
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef NS_LOCK_PROFILE_H
+#define NS_LOCK_PROFILE_H
+
+#include "ns_common.h"
+
+/* Define NS_LOCK_PROFILE to have NsMutex, NsSemaphore and NsCondv keep count of what
+   happens at each place they're locked or waited on: how often, how often someone else had
+   it first, and how long we waited for it and then held it. ns_lock_profile_print_report()
+   lists the sites worst first. The call site comes from gcc's __builtin_FILE() and
+   __builtin_LINE() as default arguments, so callers don't change; a lock taken inside one
+   of our own headers (say NsWorkQueue's) shows up under that header's line.
+
+   Without NS_LOCK_PROFILE, none of this is compiled in. With it, every lock and unlock reads
+   the clock twice and touches a shared site, so it's for finding convoys, not for
+   shipping. */
+#if defined(NS_LOCK_PROFILE)
+    #define NS_LOCK_PROFILE_SITE_PARAMS , const char *site_file = __builtin_FILE(), \
+        const char *site_function = __builtin_FUNCTION(), int site_line = __builtin_LINE()
+#else
+    #define NS_LOCK_PROFILE_SITE_PARAMS
+#endif
+
+#if defined(NS_LOCK_PROFILE)
+
+#include "ns_atomic.h"
+#include "ns_math.h"
+#include "ns_time.h"
+#include "ns_histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Sites past this many are counted as dropped rather than recorded. A power of two. */
+#if !defined(NS_LOCK_PROFILE_MAX_SITES)
+    #define NS_LOCK_PROFILE_MAX_SITES 256
+#endif
+
+/* Bucketed like NsHistogram, with four linear sub buckets per power of two, so a
+   percentile is within about 25%. */
+#define NS_LOCK_PROFILE_SUB_BUCKET_BITS 3
+#define NS_LOCK_PROFILE_NUM_BUCKETS ((64 - NS_LOCK_PROFILE_SUB_BUCKET_BITS + 3)*(1 << (NS_LOCK_PROFILE_SUB_BUCKET_BITS - 1)))
+
+
+enum NsLockProfileKind
+{
+    NS_LOCK_PROFILE_MUTEX,
+    NS_LOCK_PROFILE_SEMAPHORE,
+    NS_LOCK_PROFILE_CONDV,
+};
+
+enum NsLockProfileSiteState
+{
+    NS_LOCK_PROFILE_SITE_EMPTY,
+    NS_LOCK_PROFILE_SITE_CLAIMED, // someone's filling it in
+    NS_LOCK_PROFILE_SITE_READY,
+};
+
+/* What ns_lock_profile_print_report() puts first. */
+enum NsLockProfileSort
+{
+    NS_LOCK_PROFILE_SORT_WAIT,
+    NS_LOCK_PROFILE_SORT_HOLD,
+    NS_LOCK_PROFILE_SORT_CONTENDED,
+};
+
+struct NsLockProfileHistogram
+{
+    uint64_t counts[NS_LOCK_PROFILE_NUM_BUCKETS];
+    uint64_t total_nanos;
+    uint64_t max_nanos;
+};
+
+/* Waits are from calling lock (or get, or wait) to getting it. Holds are from getting a
+   mutex to unlocking it, less any time spent in a condv wait in between. Semaphores and
+   condvs only have waits. */
+struct NsLockProfileSite
+{
+    uint32_t state; // NsLockProfileSiteState
+    uint32_t kind; // NsLockProfileKind
+    const char *file;
+    const char *function;
+    int line;
+
+    uint64_t num_acquires;
+    uint64_t num_contended; // someone else had it, or there was nothing to get
+    NsLockProfileHistogram wait;
+    NsLockProfileHistogram hold;
+};
+
+struct NsLockProfile
+{
+    NsLockProfileSite sites[NS_LOCK_PROFILE_MAX_SITES];
+    uint64_t num_dropped;
+};
+
+global NsLockProfile ns_lock_profile;
+
+
+/* Internal */
+
+internal void
+ns_lock_profile_histogram_record(NsLockProfileHistogram *histogram, uint64_t nanos)
+{
+    ns_atomic_fetch_add_relaxed(&histogram->counts[ns_histogram_get_index(nanos, NS_LOCK_PROFILE_SUB_BUCKET_BITS)], (uint64_t)1);
+    ns_atomic_fetch_add_relaxed(&histogram->total_nanos, nanos);
+
+    uint64_t max_nanos = ns_atomic_load_relaxed(&histogram->max_nanos);
+    while(nanos > max_nanos &&
+          !ns_atomic_compare_exchange(&histogram->max_nanos, &max_nanos, nanos))
+    {
+    }
+}
+
+internal uint64_t
+ns_lock_profile_histogram_get_percentile(NsLockProfileHistogram *histogram, double percentile)
+{
+    // not the site's acquires: a mutex held across condv waits records a hold per wait
+    uint64_t num_values = 0;
+    for(uint32_t i = 0; i < NS_LOCK_PROFILE_NUM_BUCKETS; i++)
+    {
+        num_values += ns_atomic_load_relaxed(&histogram->counts[i]);
+    }
+    if(num_values == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)((percentile/100.0)*(num_values - 1)) + 1;
+    uint64_t num_seen = 0;
+    for(uint32_t i = 0; i < NS_LOCK_PROFILE_NUM_BUCKETS; i++)
+    {
+        num_seen += ns_atomic_load_relaxed(&histogram->counts[i]);
+        if(num_seen >= rank)
+        {
+            uint64_t result = ns_math_min(ns_histogram_get_value(i, NS_LOCK_PROFILE_SUB_BUCKET_BITS), ns_atomic_load_relaxed(&histogram->max_nanos));
+            return result;
+        }
+    }
+    return ns_atomic_load_relaxed(&histogram->max_nanos);
+}
+
+internal uint64_t
+ns_lock_profile_get_sort_key(NsLockProfileSite *site, NsLockProfileSort sort)
+{
+    uint64_t result = 0;
+    switch(sort)
+    {
+        case NS_LOCK_PROFILE_SORT_WAIT: result = ns_atomic_load_relaxed(&site->wait.total_nanos); break;
+        case NS_LOCK_PROFILE_SORT_HOLD: result = ns_atomic_load_relaxed(&site->hold.total_nanos); break;
+        case NS_LOCK_PROFILE_SORT_CONTENDED: result = ns_atomic_load_relaxed(&site->num_contended); break;
+    }
+    return result;
+}
+
+internal const char *
+ns_lock_profile_get_kind_name(uint32_t kind)
+{
+    switch(kind)
+    {
+        case NS_LOCK_PROFILE_MUTEX: return "mutex";
+        case NS_LOCK_PROFILE_SEMAPHORE: return "semaphore";
+        case NS_LOCK_PROFILE_CONDV: return "condv";
+    }
+    return "?";
+}
+
+/* Finds the site's slot, filling it in the first time we see it. Lock free, since it's
+   what the locks themselves call. */
+internal NsLockProfileSite *
+ns_lock_profile_get_site(NsLockProfileKind kind, const char *file, const char *function, int line)
+{
+    // by where the file name is, not what it says, since this runs on every lock. the
+    // linker merges identical literals, but one that's left with two addresses just shows
+    // up as two rows.
+    uint64_t key = (uint64_t)(uintptr_t)file + (uint64_t)line*40503u;
+    uint32_t hash = (uint32_t)((key*0x9E3779B97F4A7C15ull) >> 32);
+    for(uint32_t i = 0; i < NS_LOCK_PROFILE_MAX_SITES; i++)
+    {
+        NsLockProfileSite *site = &ns_lock_profile.sites[(hash + i) & (NS_LOCK_PROFILE_MAX_SITES - 1)];
+
+        uint32_t state = ns_atomic_load(&site->state);
+        if(state == NS_LOCK_PROFILE_SITE_EMPTY)
+        {
+            if(ns_atomic_compare_exchange(&site->state, &state, (uint32_t)NS_LOCK_PROFILE_SITE_CLAIMED))
+            {
+                site->kind = kind;
+                site->file = file;
+                site->function = function;
+                site->line = line;
+                ns_atomic_store(&site->state, (uint32_t)NS_LOCK_PROFILE_SITE_READY);
+                return site;
+            }
+        }
+
+        // someone's claimed it, but we can't tell whose until they're done
+        while(state != NS_LOCK_PROFILE_SITE_READY)
+        {
+            ns_atomic_pause();
+            state = ns_atomic_load(&site->state);
+        }
+
+        if(site->file == file && site->line == line && site->kind == (uint32_t)kind)
+        {
+            return site;
+        }
+    }
+
+    ns_atomic_fetch_add_relaxed(&ns_lock_profile.num_dropped, (uint64_t)1);
+    return NULL;
+}
+
+internal NsLockProfileSite *
+ns_lock_profile_record_acquire(NsLockProfileKind kind, const char *file, const char *function, int line,
+                               bool is_contended, uint64_t wait_nanos)
+{
+    NsLockProfileSite *site = ns_lock_profile_get_site(kind, file, function, line);
+    if(site != NULL)
+    {
+        ns_atomic_fetch_add_relaxed(&site->num_acquires, (uint64_t)1);
+        if(is_contended)
+        {
+            ns_atomic_fetch_add_relaxed(&site->num_contended, (uint64_t)1);
+        }
+        ns_lock_profile_histogram_record(&site->wait, wait_nanos);
+    }
+    return site;
+}
+
+internal void
+ns_lock_profile_record_hold(NsLockProfileSite *site, uint64_t hold_nanos)
+{
+    if(site != NULL)
+    {
+        ns_lock_profile_histogram_record(&site->hold, hold_nanos);
+    }
+}
+
+internal void
+ns_lock_profile_print_histogram(FILE *file, NsLockProfileHistogram *histogram)
+{
+    fprintf(file, " %10.3f %9.1f %9.1f %9.1f", ns_atomic_load_relaxed(&histogram->total_nanos)/1e6,
+            ns_lock_profile_histogram_get_percentile(histogram, 50.0)/1e3,
+            ns_lock_profile_histogram_get_percentile(histogram, 99.0)/1e3,
+            ns_atomic_load_relaxed(&histogram->max_nanos)/1e3);
+}
+
+/* API */
+
+/* One line per site, sorted worst first, with totals in milliseconds and percentiles in
+   microseconds. Fine to call while the locks are in use; the numbers just won't all be from
+   the same instant. */
+void
+ns_lock_profile_print_report(FILE *file = stdout, NsLockProfileSort sort = NS_LOCK_PROFILE_SORT_WAIT)
+{
+    uint32_t site_idxs[NS_LOCK_PROFILE_MAX_SITES];
+    uint64_t sort_keys[NS_LOCK_PROFILE_MAX_SITES];
+    uint32_t num_sites = 0;
+    for(uint32_t i = 0; i < NS_LOCK_PROFILE_MAX_SITES; i++)
+    {
+        NsLockProfileSite *site = &ns_lock_profile.sites[i];
+        if(ns_atomic_load(&site->state) != NS_LOCK_PROFILE_SITE_READY)
+        {
+            continue;
+        }
+
+        // insertion sort; there aren't many
+        uint64_t sort_key = ns_lock_profile_get_sort_key(site, sort);
+        uint32_t j = num_sites++;
+        for(; j > 0 && sort_keys[j - 1] < sort_key; j--)
+        {
+            site_idxs[j] = site_idxs[j - 1];
+            sort_keys[j] = sort_keys[j - 1];
+        }
+        site_idxs[j] = i;
+        sort_keys[j] = sort_key;
+    }
+
+    fprintf(file, "%-44s %-9s %10s %10s %6s | %10s %9s %9s %9s | %10s %9s %9s %9s\n",
+            "site", "kind", "acquires", "contended", "%",
+            "wait ms", "p50 us", "p99 us", "max us", "hold ms", "p50 us", "p99 us", "max us");
+
+    for(uint32_t i = 0; i < num_sites; i++)
+    {
+        NsLockProfileSite *site = &ns_lock_profile.sites[site_idxs[i]];
+
+        // just the file's name, which is enough to find it and keeps the columns lined up
+        const char *file_name = strrchr(site->file, '/');
+        file_name = (file_name != NULL) ? (file_name + 1) : site->file;
+
+        char site_name[128];
+        snprintf(site_name, sizeof(site_name), "%s:%d %s", file_name, site->line, site->function);
+
+        uint64_t num_acquires = ns_atomic_load_relaxed(&site->num_acquires);
+        uint64_t num_contended = ns_atomic_load_relaxed(&site->num_contended);
+        fprintf(file, "%-44.44s %-9s %10llu %10llu %6.2f |", site_name, ns_lock_profile_get_kind_name(site->kind),
+                (unsigned long long)num_acquires, (unsigned long long)num_contended,
+                (num_acquires > 0) ? (100.0*num_contended/num_acquires) : 0.0);
+        ns_lock_profile_print_histogram(file, &site->wait);
+        if(site->kind == NS_LOCK_PROFILE_MUTEX)
+        {
+            fprintf(file, " |");
+            ns_lock_profile_print_histogram(file, &site->hold);
+        }
+        fprintf(file, "\n");
+    }
+
+    uint64_t num_dropped = ns_atomic_load_relaxed(&ns_lock_profile.num_dropped);
+    if(num_dropped > 0)
+    {
+        fprintf(file, "%llu acquires at sites past NS_LOCK_PROFILE_MAX_SITES weren't recorded\n",
+                (unsigned long long)num_dropped);
+    }
+    fflush(file);
+}
+
+/* Zeroes the counts, keeping the sites. Counts from locks held across the reset can
+   land on either side of it. */
+void
+ns_lock_profile_reset()
+{
+    for(uint32_t i = 0; i < NS_LOCK_PROFILE_MAX_SITES; i++)
+    {
+        NsLockProfileSite *site = &ns_lock_profile.sites[i];
+        if(ns_atomic_load(&site->state) != NS_LOCK_PROFILE_SITE_READY)
+        {
+            continue;
+        }
+        ns_atomic_store_relaxed(&site->num_acquires, (uint64_t)0);
+        ns_atomic_store_relaxed(&site->num_contended, (uint64_t)0);
+        memset(&site->wait, 0, sizeof(site->wait));
+        memset(&site->hold, 0, sizeof(site->hold));
+    }
+    ns_atomic_store_relaxed(&ns_lock_profile.num_dropped, (uint64_t)0);
+}
+
+#endif
+
+#endif
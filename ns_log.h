@@ -0,0 +1,581 @@
+#ifndef NS_LOG_H
+#define NS_LOG_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_mutex.h"
+#include "ns_thread.h"
+#include "ns_thread_slots.h"
+#include "ns_time.h"
+#include "ns_math.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+
+
+/* Records are fixed size. Arguments (strings included) that don't fit are left off and
+   their conversions printed as is. */
+#if !defined(NS_LOG_RECORD_SIZE)
+    #define NS_LOG_RECORD_SIZE 256
+#endif
+
+// per thread. must be a power of 2. a thread that fills its ring drops records until the
+// flusher catches up, rather than block.
+#if !defined(NS_LOG_RING_CAPACITY)
+    #define NS_LOG_RING_CAPACITY 1024
+#endif
+
+// threads alive at once beyond this many write synchronously. a ring goes to the next
+// thread once its owner exits.
+#if !defined(NS_LOG_MAX_THREADS)
+    #define NS_LOG_MAX_THREADS 64
+#endif
+
+#if !defined(NS_LOG_FLUSH_INTERVAL_MILLIS)
+    #define NS_LOG_FLUSH_INTERVAL_MILLIS 10
+#endif
+
+#define NS_LOG_MAX_LINE_LENGTH 1024
+
+/* Levels below NS_LOG_LEVEL (see ns_common.h) compile to nothing; the arguments aren't
+   even evaluated. Format must be a string literal, since only the pointer is kept. */
+#define NsLog(Level, Format, ...) \
+    do { if((Level) >= NS_LOG_LEVEL) ns_log_write((Level), __FILE__, __LINE__, Format, ##__VA_ARGS__); } while(0)
+
+#define LogDebug(Format, ...) NsLog(NS_LOG_LEVEL_DEBUG, Format, ##__VA_ARGS__)
+#define LogInfo(Format, ...) NsLog(NS_LOG_LEVEL_INFO, Format, ##__VA_ARGS__)
+#define LogWarn(Format, ...) NsLog(NS_LOG_LEVEL_WARN, Format, ##__VA_ARGS__)
+#define LogError(Format, ...) NsLog(NS_LOG_LEVEL_ERROR, Format, ##__VA_ARGS__)
+
+
+enum NsLogArgType
+{
+    NS_LOG_ARG_INT,
+    NS_LOG_ARG_UINT,
+    NS_LOG_ARG_DOUBLE,
+    NS_LOG_ARG_POINTER,
+    NS_LOG_ARG_STRING, // null terminated copy follows the type
+};
+
+struct NsLogRecordHeader
+{
+    uint64_t nanos;
+    uint64_t thread;
+    const char *format;
+    const char *file;
+    uint32_t line;
+    uint16_t data_length;
+    uint8_t level;
+    uint8_t num_args;
+};
+
+/* The arguments are captured as raw bytes and only formatted on the flusher thread. */
+struct NsLogRecord
+{
+    NsLogRecordHeader header;
+    uint8_t data[NS_LOG_RECORD_SIZE - sizeof(NsLogRecordHeader)];
+};
+
+/* Single producer (the owning thread), single consumer (whoever holds the flush mutex).
+   When the owner exits, the next thread to get the ring carries on producing from where it
+   left off, so nothing it hadn't flushed yet is lost. */
+struct NsLogRing
+{
+    alignas(NS_CACHE_LINE_SIZE) uint64_t head; // consumer
+    alignas(NS_CACHE_LINE_SIZE) uint64_t tail; // producer
+    uint64_t num_dropped;
+    NsLogRecord records[NS_LOG_RING_CAPACITY];
+};
+
+struct NsLogContext
+{
+    NsLogRing rings[NS_LOG_MAX_THREADS];
+    NsThreadSlots ring_slots;
+
+    FILE *file;
+    NsThread flusher_thread;
+    NsMutex flush_mutex;
+    uint32_t is_running;
+};
+
+
+global NsLogContext ns_log_context;
+internal thread_local NsThreadSlot ns_log_thread_slot;
+
+
+/* Internal */
+
+internal const char *
+ns_log_get_level_name(int level)
+{
+    switch(level)
+    {
+        case NS_LOG_LEVEL_DEBUG: return "DEBUG";
+        case NS_LOG_LEVEL_INFO: return "INFO";
+        case NS_LOG_LEVEL_WARN: return "WARN";
+        case NS_LOG_LEVEL_ERROR: return "ERROR";
+    }
+    return "?";
+}
+
+/* Returns NULL if every ring's taken by a live thread. */
+internal NsLogRing *
+ns_log_get_thread_ring()
+{
+    uint32_t ring_idx = ns_thread_slot_get(&ns_log_thread_slot, &ns_log_context.ring_slots);
+    if(ring_idx == NS_THREAD_SLOT_NONE)
+    {
+        return NULL;
+    }
+
+    NsLogRing *ring = &ns_log_context.rings[ring_idx];
+    return ring;
+}
+
+template <typename T>
+inline internal void
+ns_log_capture_arg(NsLogRecord *record, bool *is_full_ptr, T value)
+{
+    if(*is_full_ptr)
+    {
+        return;
+    }
+
+    uint8_t *data = &record->data[record->header.data_length];
+    uint32_t space = (sizeof(record->data) - record->header.data_length);
+
+    uint32_t arg_length;
+    if constexpr(std::is_same<T, char *>::value || std::is_same<T, const char *>::value)
+    {
+        const char *string = (value != NULL) ? value : "(null)";
+        uint32_t string_length = (uint32_t)strlen(string);
+        arg_length = (1 + string_length + 1);
+        if(arg_length <= space)
+        {
+            data[0] = NS_LOG_ARG_STRING;
+            memcpy(&data[1], string, string_length + 1);
+        }
+    }
+    else
+    {
+        arg_length = (1 + sizeof(uint64_t));
+        if(arg_length <= space)
+        {
+            uint64_t raw;
+            if constexpr(std::is_floating_point<T>::value)
+            {
+                data[0] = NS_LOG_ARG_DOUBLE;
+                double d = (double)value;
+                memcpy(&raw, &d, sizeof(raw));
+            }
+            else if constexpr(std::is_pointer<T>::value)
+            {
+                data[0] = NS_LOG_ARG_POINTER;
+                raw = (uint64_t)(uintptr_t)value;
+            }
+            else if constexpr(std::is_enum<T>::value || std::is_signed<T>::value)
+            {
+                static_assert(std::is_enum<T>::value || std::is_integral<T>::value, "can't log this type");
+                data[0] = NS_LOG_ARG_INT;
+                raw = (uint64_t)(int64_t)value;
+            }
+            else
+            {
+                static_assert(std::is_integral<T>::value, "can't log this type");
+                data[0] = NS_LOG_ARG_UINT;
+                raw = (uint64_t)value;
+            }
+            memcpy(&data[1], &raw, sizeof(raw));
+        }
+    }
+
+    // once one doesn't fit, drop the rest so they can't land against the wrong conversions
+    if(arg_length > space)
+    {
+        *is_full_ptr = true;
+        return;
+    }
+
+    record->header.data_length += arg_length;
+    record->header.num_args++;
+}
+
+template <typename... Args>
+internal void
+ns_log_fill_record(NsLogRecord *record, int level, const char *file, int line, const char *format, Args... args)
+{
+    record->header.nanos = ns_time_get_nanos();
+    record->header.thread = (uint64_t)GetThread();
+    record->header.format = format;
+    record->header.file = file;
+    record->header.line = (uint32_t)line;
+    record->header.data_length = 0;
+    record->header.level = (uint8_t)level;
+    record->header.num_args = 0;
+
+    bool is_full = false;
+    (ns_log_capture_arg(record, &is_full, args), ...);
+}
+
+/* Formats one argument with the conversion spec at spec (up to spec_length). Returns the
+   number of bytes written to dest, or would have been. */
+internal int
+ns_log_format_arg(char *dest, int dest_size, const char *spec, int spec_length, uint8_t **arg_ptr)
+{
+    // keep the flags, width and precision, but drop the length modifier; every integer
+    // was widened to 64 bits. a '*' width or precision takes the next arg, which we
+    // write into the spec so snprintf doesn't go looking for it.
+    char new_spec[64];
+    int new_spec_length = 0;
+    char conversion = spec[spec_length - 1];
+    for(int i = 0; i < (spec_length - 1) && new_spec_length < (int)sizeof(new_spec) - 16; i++)
+    {
+        if(spec[i] == '*')
+        {
+            uint8_t *star_arg = *arg_ptr;
+            int value = 0;
+            if(star_arg[0] == NS_LOG_ARG_STRING)
+            {
+                *arg_ptr = (star_arg + 1 + strlen((const char *)&star_arg[1]) + 1);
+            }
+            else
+            {
+                uint64_t raw;
+                memcpy(&raw, &star_arg[1], sizeof(raw));
+                *arg_ptr = (star_arg + 1 + sizeof(raw));
+                if(star_arg[0] == NS_LOG_ARG_INT || star_arg[0] == NS_LOG_ARG_UINT)
+                {
+                    value = (int)raw;
+                }
+            }
+
+            // a negative precision is as if there were none
+            bool is_precision = (new_spec_length > 0 && new_spec[new_spec_length - 1] == '.');
+            if(is_precision && value < 0)
+            {
+                new_spec_length--;
+                continue;
+            }
+            new_spec_length += snprintf(&new_spec[new_spec_length], sizeof(new_spec) - new_spec_length,
+                                        "%d", value);
+        }
+        else if(strchr("hlLqjzt", spec[i]) == NULL)
+        {
+            new_spec[new_spec_length++] = spec[i];
+        }
+    }
+
+    uint8_t *arg = *arg_ptr;
+    uint8_t type = arg[0];
+    int result;
+    if(type == NS_LOG_ARG_STRING)
+    {
+        const char *string = (const char *)&arg[1];
+        memcpy(&new_spec[new_spec_length], "s", 2);
+        result = snprintf(dest, dest_size, new_spec, string);
+        *arg_ptr = (arg + 1 + strlen(string) + 1);
+        return result;
+    }
+
+    uint64_t raw;
+    memcpy(&raw, &arg[1], sizeof(raw));
+    *arg_ptr = (arg + 1 + sizeof(raw));
+
+    if(type == NS_LOG_ARG_DOUBLE)
+    {
+        double value;
+        memcpy(&value, &raw, sizeof(value));
+        new_spec[new_spec_length++] = (strchr("fFeEgGaA", conversion) != NULL) ? conversion : 'g';
+        new_spec[new_spec_length] = 0;
+        result = snprintf(dest, dest_size, new_spec, value);
+    }
+    else if(type == NS_LOG_ARG_POINTER)
+    {
+        memcpy(&new_spec[new_spec_length], "p", 2);
+        result = snprintf(dest, dest_size, new_spec, (void *)(uintptr_t)raw);
+    }
+    else if(conversion == 'c')
+    {
+        memcpy(&new_spec[new_spec_length], "c", 2);
+        result = snprintf(dest, dest_size, new_spec, (int)raw);
+    }
+    else
+    {
+        if(strchr("diouxX", conversion) == NULL)
+        {
+            conversion = (type == NS_LOG_ARG_INT) ? 'd' : 'u';
+        }
+        new_spec[new_spec_length++] = 'l';
+        new_spec[new_spec_length++] = 'l';
+        new_spec[new_spec_length++] = conversion;
+        new_spec[new_spec_length] = 0;
+        if(type == NS_LOG_ARG_INT)
+        {
+            result = snprintf(dest, dest_size, new_spec, (long long)(int64_t)raw);
+        }
+        else
+        {
+            result = snprintf(dest, dest_size, new_spec, (unsigned long long)raw);
+        }
+    }
+    return result;
+}
+
+/* Returns the length of the line, newline included. Lines that don't fit are cut short. */
+internal int
+ns_log_format_record(NsLogRecord *record, char *line, int line_size)
+{
+    NsLogRecordHeader *header = &record->header;
+
+    const char *file_name = strrchr(header->file, '/');
+    file_name = (file_name != NULL) ? (file_name + 1) : header->file;
+
+    int length = snprintf(line, line_size, "%llu.%06llu %s thread %llu %s:%u ",
+                          (unsigned long long)(header->nanos / 1000000000),
+                          (unsigned long long)((header->nanos / 1000) % 1000000),
+                          ns_log_get_level_name(header->level),
+                          (unsigned long long)header->thread, file_name, header->line);
+
+    uint8_t *arg = record->data;
+    uint32_t num_args_left = header->num_args;
+    const char *c = header->format;
+    while(*c != 0 && length < (line_size - 1))
+    {
+        if(c[0] != '%')
+        {
+            line[length++] = *c++;
+            continue;
+        }
+        if(c[1] == '%')
+        {
+            line[length++] = '%';
+            c += 2;
+            continue;
+        }
+
+        // find the conversion
+        int spec_length = 1;
+        while(c[spec_length] != 0 && strchr("diouxXcsfFeEgGaAp", c[spec_length]) == NULL)
+        {
+            spec_length++;
+        }
+        if(c[spec_length] != 0)
+        {
+            spec_length++;
+        }
+
+        uint32_t num_spec_args = 1;
+        for(int i = 0; i < spec_length; i++)
+        {
+            num_spec_args += (c[i] == '*');
+        }
+
+        if(num_args_left >= num_spec_args && c[spec_length - 1] != 0)
+        {
+            int arg_length = ns_log_format_arg(&line[length], line_size - length, c, spec_length, &arg);
+            length += ns_math_min(arg_length, line_size - 1 - length);
+            num_args_left -= num_spec_args;
+        }
+        else
+        {
+            int copy_length = ns_math_min(spec_length, line_size - 1 - length);
+            memcpy(&line[length], c, copy_length);
+            length += copy_length;
+        }
+        c += spec_length;
+    }
+
+    // the format usually has a newline of its own
+    if(length > (line_size - 1))
+    {
+        length = (line_size - 1);
+    }
+    if(length == 0 || line[length - 1] != '\n')
+    {
+        if(length == (line_size - 1))
+        {
+            length--;
+        }
+        line[length++] = '\n';
+    }
+    line[length] = 0;
+    return length;
+}
+
+/* Must hold the flush mutex. Returns the number of records written. */
+internal uint32_t
+ns_log_drain()
+{
+    char line[NS_LOG_MAX_LINE_LENGTH];
+    FILE *file = (ns_log_context.file != NULL) ? ns_log_context.file : stderr;
+
+    // rings whose owner has exited still get drained
+    uint32_t num_written = 0;
+    uint32_t num_rings = ns_thread_slots_get_num_used(&ns_log_context.ring_slots);
+    for(uint32_t i = 0; i < num_rings; i++)
+    {
+        NsLogRing *ring = &ns_log_context.rings[i];
+
+        uint64_t head = ring->head;
+        uint64_t tail = ns_atomic_load(&ring->tail);
+        for(; head != tail; head++)
+        {
+            NsLogRecord *record = &ring->records[head & (NS_LOG_RING_CAPACITY - 1)];
+            int line_length = ns_log_format_record(record, line, sizeof(line));
+            fwrite(line, 1, line_length, file);
+            num_written++;
+        }
+        ns_atomic_store(&ring->head, head);
+
+        uint64_t num_dropped = ns_atomic_exchange(&ring->num_dropped, (uint64_t)0);
+        if(num_dropped > 0)
+        {
+            fprintf(file, "log: dropped %llu records from a full ring\n", (unsigned long long)num_dropped);
+        }
+    }
+
+    if(num_written > 0)
+    {
+        fflush(file);
+    }
+    return num_written;
+}
+
+internal void *
+ns_log_flusher_thread_entry(void *)
+{
+    while(ns_atomic_load(&ns_log_context.is_running))
+    {
+        ns_mutex_lock(&ns_log_context.flush_mutex);
+        uint32_t num_written = ns_log_drain();
+        ns_mutex_unlock(&ns_log_context.flush_mutex);
+
+        if(num_written == 0)
+        {
+            ns_thread_sleep(NS_LOG_FLUSH_INTERVAL_MILLIS);
+        }
+    }
+
+    return (void *)NS_SUCCESS;
+}
+
+/* API */
+
+/* Use the Log* macros, so disabled levels compile out. */
+template <typename... Args>
+void
+ns_log_write(int level, const char *file, int line, const char *format, Args... args)
+{
+    NsLogRing *ring = ns_atomic_load_relaxed(&ns_log_context.is_running) ? ns_log_get_thread_ring() : NULL;
+    if(ring == NULL)
+    {
+        NsLogRecord record;
+        ns_log_fill_record(&record, level, file, line, format, args...);
+
+        char line_buffer[NS_LOG_MAX_LINE_LENGTH];
+        int line_length = ns_log_format_record(&record, line_buffer, sizeof(line_buffer));
+        fwrite(line_buffer, 1, line_length, (ns_log_context.file != NULL) ? ns_log_context.file : stderr);
+        return;
+    }
+
+    uint64_t tail = ring->tail;
+    if((tail - ns_atomic_load(&ring->head)) == NS_LOG_RING_CAPACITY)
+    {
+        ns_atomic_fetch_add_relaxed(&ring->num_dropped, (uint64_t)1);
+        return;
+    }
+
+    ns_log_fill_record(&ring->records[tail & (NS_LOG_RING_CAPACITY - 1)], level, file, line, format, args...);
+    ns_atomic_store(&ring->tail, tail + 1);
+}
+
+internal void
+ns_log_debug_info(const char *file, const char *function, int line, int os_error)
+{
+    if(os_error != 0)
+    {
+        // the string's copied, so strerror's buffer being reused later doesn't matter
+        ns_log_write(NS_LOG_LEVEL_ERROR, file, line, "%s: %s", function, strerror(os_error));
+    }
+    else
+    {
+        ns_log_write(NS_LOG_LEVEL_ERROR, file, line, "%s", function);
+    }
+}
+
+/* Until this is called (and after ns_log_shutdown()) records are formatted and written
+   on the spot, like they always were. file defaults to stderr. */
+int
+ns_log_startup(FILE *file = NULL)
+{
+    int status;
+
+    ns_log_context.file = file;
+    ns_thread_slots_create(&ns_log_context.ring_slots, NS_LOG_MAX_THREADS);
+
+    status = ns_mutex_create(&ns_log_context.flush_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_atomic_store(&ns_log_context.is_running, (uint32_t)1);
+    ns_debug_print_info = ns_log_debug_info;
+
+    status = ns_thread_create(&ns_log_context.flusher_thread, ns_log_flusher_thread_entry, NULL);
+    if(status != NS_SUCCESS)
+    {
+        ns_atomic_store(&ns_log_context.is_running, (uint32_t)0);
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Writes out everything logged so far. */
+void
+ns_log_flush()
+{
+    if(!ns_atomic_load(&ns_log_context.is_running))
+    {
+        return;
+    }
+
+    ns_mutex_lock(&ns_log_context.flush_mutex);
+    ns_log_drain();
+    ns_mutex_unlock(&ns_log_context.flush_mutex);
+}
+
+/* Stops the flusher, writes out what's left and goes back to writing synchronously.
+   Records from threads still logging right as this is called can land either side of
+   the last drain; only ones that land before it are written. */
+int
+ns_log_shutdown()
+{
+    int status;
+
+    if(!ns_atomic_exchange(&ns_log_context.is_running, (uint32_t)0))
+    {
+        return NS_SUCCESS;
+    }
+
+    // it only notices is_running between drains, so this waits out the one it's in
+    status = ns_thread_join(&ns_log_context.flusher_thread);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    // ns_log_flush() may still be in here
+    ns_mutex_lock(&ns_log_context.flush_mutex);
+    ns_log_drain();
+    ns_mutex_unlock(&ns_log_context.flush_mutex);
+
+    return NS_SUCCESS;
+}
+
+#endif
@@ -286,6 +286,34 @@ ns_math_max(uint32_t A, uint32_t B)
     return Result;
 }
 
+inline internal uint64_t
+ns_math_min(uint64_t A, uint64_t B)
+{
+    uint64_t Result = A < B ? A : B;
+    return Result;
+}
+
+inline internal uint64_t
+ns_math_max(uint64_t A, uint64_t B)
+{
+    uint64_t Result = A > B ? A : B;
+    return Result;
+}
+
+inline internal int64_t
+ns_math_min(int64_t A, int64_t B)
+{
+    int64_t Result = A < B ? A : B;
+    return Result;
+}
+
+inline internal int64_t
+ns_math_max(int64_t A, int64_t B)
+{
+    int64_t Result = A > B ? A : B;
+    return Result;
+}
+
 int Max(int A, int B)
 {
     int Result = A > B ? A : B;
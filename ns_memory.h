@@ -4,6 +4,11 @@
 #include "stdlib.h"
 #include "ns_common.h"
 
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <sys/mman.h>
+#endif
+
 /* @race_condition */
 internal uint8_t GlobalStackMemory[Megabytes(512)];
 internal uint8_t *GlobalEndStackMemory = GlobalStackMemory + sizeof(GlobalStackMemory);
@@ -81,4 +86,33 @@ MemSet0(void *Memory, int Size)
     memset(Memory, 0, Size);
 }
 
+/* Page aligned and zeroed, straight from the OS. For big or long-lived blocks that
+   want their own pages. */
+internal void *
+ns_memory_map(uint64_t size)
+{
+#if defined(WINDOWS)
+    void *memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return memory;
+#elif defined(LINUX)
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        DebugPrintOsInfo();
+        return NULL;
+    }
+    return memory;
+#endif
+}
+
+internal void
+ns_memory_unmap(void *memory, uint64_t size)
+{
+#if defined(WINDOWS)
+    VirtualFree(memory, 0, MEM_RELEASE);
+#elif defined(LINUX)
+    munmap(memory, size);
+#endif
+}
+
 #endif
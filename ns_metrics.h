@@ -0,0 +1,399 @@
+#ifndef NS_METRICS_H
+#define NS_METRICS_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+
+/* Writers add to their thread's shard and readers sum the shards, so hot counters don't
+   bounce a cache line between cores. Threads beyond this many share shards. */
+#if !defined(NS_METRICS_NUM_SHARDS)
+    #define NS_METRICS_NUM_SHARDS 16
+#endif
+
+#if !defined(NS_METRICS_MAX_METRICS)
+    #define NS_METRICS_MAX_METRICS 128
+#endif
+
+/* Two linear sub buckets per power of two. Coarser than NsHistogram, but a histogram is
+   about 1KB per shard instead of 60. */
+#if !defined(NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS)
+    #define NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS 2
+#endif
+
+#define NS_METRICS_HISTOGRAM_NUM_COUNTS ((64 - NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS + 3)*(1 << (NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS - 1)))
+#define NS_METRICS_NO_SHARD 0xffffffff
+
+
+struct alignas(NS_CACHE_LINE_SIZE) NsMetricsCounterShard
+{
+    uint64_t value;
+};
+
+struct NsMetricsCounter
+{
+    NsMetricsCounterShard shards[NS_METRICS_NUM_SHARDS];
+};
+
+struct alignas(NS_CACHE_LINE_SIZE) NsMetricsGaugeShard
+{
+    int64_t value;
+};
+
+/* Either added to from anywhere (the shards sum to the value) or, if it has a callback,
+   read from whatever it describes when it's rendered. */
+struct NsMetricsGauge
+{
+    NsMetricsGaugeShard shards[NS_METRICS_NUM_SHARDS];
+    int64_t (*callback)(void *);
+    void *callback_data;
+};
+
+struct alignas(NS_CACHE_LINE_SIZE) NsMetricsHistogramShard
+{
+    uint64_t counts[NS_METRICS_HISTOGRAM_NUM_COUNTS];
+    uint64_t sum;
+};
+
+struct NsMetricsHistogram
+{
+    NsMetricsHistogramShard shards[NS_METRICS_NUM_SHARDS];
+};
+
+enum NsMetricType
+{
+    NS_METRIC_COUNTER,
+    NS_METRIC_GAUGE,
+    NS_METRIC_HISTOGRAM,
+};
+
+struct NsMetric
+{
+    NsMetricType type;
+    const char *name;
+    const char *labels; // e.g. status="200", or NULL
+    const char *help;
+    double scale; // histograms: recorded values are multiplied by this on the way out
+    void *metric;
+};
+
+/* Metrics register once, usually at startup, and are never unregistered, so rendering
+   only needs the count to be published after the entry. */
+struct NsMetricsRegistry
+{
+    NsMetric metrics[NS_METRICS_MAX_METRICS];
+    uint32_t num_metrics;
+    uint32_t register_lock;
+};
+
+
+global NsMetricsRegistry ns_metrics_registry;
+global uint32_t ns_metrics_next_shard;
+internal thread_local uint32_t ns_metrics_thread_shard = NS_METRICS_NO_SHARD;
+
+
+/* Internal */
+
+inline internal uint32_t
+ns_metrics_get_shard()
+{
+    uint32_t shard = ns_metrics_thread_shard;
+    if(shard == NS_METRICS_NO_SHARD)
+    {
+        shard = (ns_atomic_fetch_add(&ns_metrics_next_shard, (uint32_t)1) % NS_METRICS_NUM_SHARDS);
+        ns_metrics_thread_shard = shard;
+    }
+    return shard;
+}
+
+internal int
+ns_metrics_register(NsMetricType type, void *metric, const char *name, const char *help,
+                    const char *labels, double scale)
+{
+    uint32_t expected = 0;
+    while(!ns_atomic_compare_exchange(&ns_metrics_registry.register_lock, &expected, (uint32_t)1))
+    {
+        expected = 0;
+        ns_atomic_pause();
+    }
+
+    int result = NS_SUCCESS;
+    uint32_t num_metrics = ns_atomic_load_relaxed(&ns_metrics_registry.num_metrics);
+
+    // registering twice is harmless; whatever registers it doesn't have to know
+    bool is_registered = false;
+    for(uint32_t i = 0; i < num_metrics; i++)
+    {
+        if(ns_metrics_registry.metrics[i].metric == metric)
+        {
+            is_registered = true;
+            break;
+        }
+    }
+
+    if(!is_registered)
+    {
+        if(num_metrics < NS_METRICS_MAX_METRICS)
+        {
+            NsMetric *entry = &ns_metrics_registry.metrics[num_metrics];
+            entry->type = type;
+            entry->name = name;
+            entry->labels = labels;
+            entry->help = help;
+            entry->scale = scale;
+            entry->metric = metric;
+            ns_atomic_store(&ns_metrics_registry.num_metrics, num_metrics + 1);
+        }
+        else
+        {
+            DebugPrintInfo();
+            result = NS_ERROR;
+        }
+    }
+
+    ns_atomic_store(&ns_metrics_registry.register_lock, (uint32_t)0);
+
+    return result;
+}
+
+/* Appends to the buffer, and returns false once it's out of room. */
+internal bool
+ns_metrics_append(char *buffer, int buffer_size, int *length_ptr, const char *format, ...)
+{
+    if(*length_ptr >= buffer_size)
+    {
+        return false;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(&buffer[*length_ptr], buffer_size - *length_ptr, format, args);
+    va_end(args);
+
+    if(length < 0 || length >= (buffer_size - *length_ptr))
+    {
+        *length_ptr = buffer_size;
+        return false;
+    }
+
+    *length_ptr += length;
+    return true;
+}
+
+/* API */
+
+/* name and help (and labels) must outlive the registry; string literals are the idea. */
+int
+ns_metrics_register_counter(NsMetricsCounter *counter, const char *name, const char *help,
+                            const char *labels = NULL)
+{
+    int status = ns_metrics_register(NS_METRIC_COUNTER, counter, name, help, labels, 1.0);
+    return status;
+}
+
+int
+ns_metrics_register_gauge(NsMetricsGauge *gauge, const char *name, const char *help,
+                          const char *labels = NULL)
+{
+    int status = ns_metrics_register(NS_METRIC_GAUGE, gauge, name, help, labels, 1.0);
+    return status;
+}
+
+/* For things that already know their value, like a queue's depth. The callback is run
+   on whatever thread renders the metrics. */
+int
+ns_metrics_register_gauge(NsMetricsGauge *gauge, const char *name, const char *help,
+                          int64_t (*callback)(void *), void *callback_data, const char *labels = NULL)
+{
+    gauge->callback = callback;
+    gauge->callback_data = callback_data;
+    int status = ns_metrics_register(NS_METRIC_GAUGE, gauge, name, help, labels, 1.0);
+    return status;
+}
+
+/* Latencies are best recorded in nanoseconds with a scale of 1e-9, so they come out in
+   seconds like Prometheus expects. */
+int
+ns_metrics_register_histogram(NsMetricsHistogram *histogram, const char *name, const char *help,
+                              double scale = 1.0, const char *labels = NULL)
+{
+    int status = ns_metrics_register(NS_METRIC_HISTOGRAM, histogram, name, help, labels, scale);
+    return status;
+}
+
+inline void
+ns_metrics_counter_add(NsMetricsCounter *counter, uint64_t value = 1)
+{
+    ns_atomic_fetch_add_relaxed(&counter->shards[ns_metrics_get_shard()].value, value);
+}
+
+uint64_t
+ns_metrics_counter_get(NsMetricsCounter *counter)
+{
+    uint64_t result = 0;
+    for(int i = 0; i < NS_METRICS_NUM_SHARDS; i++)
+    {
+        result += ns_atomic_load_relaxed(&counter->shards[i].value);
+    }
+    return result;
+}
+
+inline void
+ns_metrics_gauge_add(NsMetricsGauge *gauge, int64_t value)
+{
+    ns_atomic_fetch_add_relaxed(&gauge->shards[ns_metrics_get_shard()].value, value);
+}
+
+/* Only for gauges with a single writer; a concurrent add may be lost. */
+void
+ns_metrics_gauge_set(NsMetricsGauge *gauge, int64_t value)
+{
+    for(int i = 1; i < NS_METRICS_NUM_SHARDS; i++)
+    {
+        ns_atomic_store_relaxed(&gauge->shards[i].value, (int64_t)0);
+    }
+    ns_atomic_store_relaxed(&gauge->shards[0].value, value);
+}
+
+int64_t
+ns_metrics_gauge_get(NsMetricsGauge *gauge)
+{
+    if(gauge->callback != NULL)
+    {
+        return gauge->callback(gauge->callback_data);
+    }
+
+    int64_t result = 0;
+    for(int i = 0; i < NS_METRICS_NUM_SHARDS; i++)
+    {
+        result += ns_atomic_load_relaxed(&gauge->shards[i].value);
+    }
+    return result;
+}
+
+inline void
+ns_metrics_histogram_record(NsMetricsHistogram *histogram, uint64_t value)
+{
+    NsMetricsHistogramShard *shard = &histogram->shards[ns_metrics_get_shard()];
+    uint32_t index = ns_histogram_get_index(value, NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS);
+    ns_atomic_fetch_add_relaxed(&shard->counts[index], (uint64_t)1);
+    ns_atomic_fetch_add_relaxed(&shard->sum, value);
+}
+
+/* Merges the shards into counts, which must hold NS_METRICS_HISTOGRAM_NUM_COUNTS. */
+void
+ns_metrics_histogram_get(NsMetricsHistogram *histogram, uint64_t *counts, uint64_t *sum_ptr)
+{
+    memset(counts, 0, sizeof(uint64_t)*NS_METRICS_HISTOGRAM_NUM_COUNTS);
+    uint64_t sum = 0;
+    for(int i = 0; i < NS_METRICS_NUM_SHARDS; i++)
+    {
+        NsMetricsHistogramShard *shard = &histogram->shards[i];
+        for(int j = 0; j < NS_METRICS_HISTOGRAM_NUM_COUNTS; j++)
+        {
+            counts[j] += ns_atomic_load_relaxed(&shard->counts[j]);
+        }
+        sum += ns_atomic_load_relaxed(&shard->sum);
+    }
+    *sum_ptr = sum;
+}
+
+/* Writes every registered metric in the Prometheus text format. Returns the length, or
+   NS_ERROR if it didn't fit. Histograms only list the buckets between their lowest and
+   highest nonempty ones, plus +Inf. */
+int
+ns_metrics_render(char *buffer, int buffer_size)
+{
+    int length = 0;
+    bool fits = true;
+
+    const char *previous_name = NULL;
+    uint32_t num_metrics = ns_atomic_load(&ns_metrics_registry.num_metrics);
+    for(uint32_t i = 0; i < num_metrics && fits; i++)
+    {
+        NsMetric *metric = &ns_metrics_registry.metrics[i];
+
+        // a name with several label sets only gets one header, so register those together
+        if(previous_name == NULL || strcmp(previous_name, metric->name) != 0)
+        {
+            const char *type_names[] = { "counter", "gauge", "histogram" };
+            fits = ns_metrics_append(buffer, buffer_size, &length, "# HELP %s %s\n# TYPE %s %s\n",
+                                     metric->name, metric->help, metric->name, type_names[metric->type]);
+            previous_name = metric->name;
+        }
+
+        const char *labels = (metric->labels != NULL) ? metric->labels : "";
+        const char *open_brace = (metric->labels != NULL) ? "{" : "";
+        const char *close_brace = (metric->labels != NULL) ? "}" : "";
+        switch(metric->type)
+        {
+            case NS_METRIC_COUNTER:
+            {
+                uint64_t value = ns_metrics_counter_get((NsMetricsCounter *)metric->metric);
+                fits = fits && ns_metrics_append(buffer, buffer_size, &length, "%s%s%s%s %llu\n", metric->name,
+                                                 open_brace, labels, close_brace, (unsigned long long)value);
+            } break;
+
+            case NS_METRIC_GAUGE:
+            {
+                int64_t value = ns_metrics_gauge_get((NsMetricsGauge *)metric->metric);
+                fits = fits && ns_metrics_append(buffer, buffer_size, &length, "%s%s%s%s %lld\n", metric->name,
+                                                 open_brace, labels, close_brace, (long long)value);
+            } break;
+
+            case NS_METRIC_HISTOGRAM:
+            {
+                uint64_t counts[NS_METRICS_HISTOGRAM_NUM_COUNTS];
+                uint64_t sum;
+                ns_metrics_histogram_get((NsMetricsHistogram *)metric->metric, counts, &sum);
+
+                int first_index = -1;
+                int last_index = -1;
+                for(int j = 0; j < NS_METRICS_HISTOGRAM_NUM_COUNTS; j++)
+                {
+                    if(counts[j] > 0)
+                    {
+                        first_index = (first_index < 0) ? j : first_index;
+                        last_index = j;
+                    }
+                }
+
+                const char *separator = (metric->labels != NULL) ? "," : "";
+                uint64_t cumulative_count = 0;
+                for(int j = 0; j <= last_index && fits; j++)
+                {
+                    cumulative_count += counts[j];
+                    if(j >= first_index)
+                    {
+                        double le = (double)ns_histogram_get_value(j, NS_METRICS_HISTOGRAM_SUB_BUCKET_BITS)*metric->scale;
+                        fits = ns_metrics_append(buffer, buffer_size, &length, "%s_bucket{%s%sle=\"%.9g\"} %llu\n",
+                                                 metric->name, labels, separator, le, (unsigned long long)cumulative_count);
+                    }
+                }
+
+                fits = fits && ns_metrics_append(buffer, buffer_size, &length,
+                                                 "%s_bucket{%s%sle=\"+Inf\"} %llu\n"
+                                                 "%s_sum%s%s%s %.9g\n"
+                                                 "%s_count%s%s%s %llu\n",
+                                                 metric->name, labels, separator, (unsigned long long)cumulative_count,
+                                                 metric->name, open_brace, labels, close_brace, (double)sum*metric->scale,
+                                                 metric->name, open_brace, labels, close_brace, (unsigned long long)cumulative_count);
+            } break;
+        }
+    }
+
+    if(!fits)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    return length;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef NS_MPSC_QUEUE_H
+#define NS_MPSC_QUEUE_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_memory.h"
+
+
+/* Bounded, lock-free, multi-producer single-consumer queue of pointers. Each cell
+   carries a sequence number that tells producers and the consumer whose turn it is,
+   so nobody ever waits on anyone else's lock. */
+struct NsMpscQueueCell
+{
+    uint64_t sequence;
+    void *value;
+};
+
+struct NsMpscQueue
+{
+    NsMpscQueueCell *cells;
+    uint64_t mask;
+
+    // producers and the consumer each get their own cache line
+    alignas(NS_CACHE_LINE_SIZE) uint64_t tail;
+    alignas(NS_CACHE_LINE_SIZE) uint64_t head;
+};
+
+
+/* API */
+
+/* The capacity is rounded up to a power of 2. */
+int
+ns_mpsc_queue_create(NsMpscQueue *queue, uint32_t capacity)
+{
+    uint32_t rounded_capacity = 2;
+    while(rounded_capacity < capacity)
+    {
+        rounded_capacity <<= 1;
+    }
+
+    NsMpscQueueCell *cells = (NsMpscQueueCell *)ns_memory_allocate(sizeof(NsMpscQueueCell)*rounded_capacity);
+    if(cells == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    for(uint32_t i = 0; i < rounded_capacity; i++)
+    {
+        cells[i].sequence = i;
+        cells[i].value = NULL;
+    }
+
+    queue->cells = cells;
+    queue->mask = (rounded_capacity - 1);
+    queue->tail = 0;
+    queue->head = 0;
+
+    return NS_SUCCESS;
+}
+
+int
+ns_mpsc_queue_destroy(NsMpscQueue *queue)
+{
+    ns_memory_free(queue->cells);
+    queue->cells = NULL;
+    return NS_SUCCESS;
+}
+
+/* Safe to call from any number of threads. Returns false if the queue is full. */
+bool
+ns_mpsc_queue_try_add(NsMpscQueue *queue, void *value)
+{
+    NsMpscQueueCell *cell;
+    uint64_t pos = ns_atomic_load_relaxed(&queue->tail);
+    while(1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        uint64_t sequence = ns_atomic_load(&cell->sequence);
+        int64_t diff = (int64_t)(sequence - pos);
+        if(diff == 0)
+        {
+            // the cell is free; try to claim it
+            if(ns_atomic_compare_exchange(&queue->tail, &pos, pos + 1))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            // the consumer hasn't gotten to this cell yet, so we're full
+            return false;
+        }
+        else
+        {
+            // another producer beat us to it
+            pos = ns_atomic_load_relaxed(&queue->tail);
+        }
+    }
+
+    cell->value = value;
+    ns_atomic_store(&cell->sequence, pos + 1);
+
+    return true;
+}
+
+/* Only one thread may call this at a time. Returns false if the queue is empty. */
+bool
+ns_mpsc_queue_try_get(NsMpscQueue *queue, void **value_ptr)
+{
+    uint64_t pos = queue->head;
+    NsMpscQueueCell *cell = &queue->cells[pos & queue->mask];
+    uint64_t sequence = ns_atomic_load(&cell->sequence);
+
+    // has the producer published this cell yet?
+    if((int64_t)(sequence - (pos + 1)) < 0)
+    {
+        return false;
+    }
+
+    *value_ptr = cell->value;
+
+    // hand the cell back to the producers for the next lap
+    ns_atomic_store(&cell->sequence, pos + queue->mask + 1);
+    ns_atomic_store(&queue->head, pos + 1);
+
+    return true;
+}
+
+/* Approximate when called concurrently with adds or gets. */
+uint32_t
+ns_mpsc_queue_get_size(NsMpscQueue *queue)
+{
+    uint64_t tail = ns_atomic_load(&queue->tail);
+    uint64_t head = ns_atomic_load(&queue->head);
+    uint32_t result = (tail > head) ? (uint32_t)(tail - head) : 0;
+    return result;
+}
+
+uint32_t
+ns_mpsc_queue_get_capacity(NsMpscQueue *queue)
+{
+    uint32_t result = (uint32_t)(queue->mask + 1);
+    return result;
+}
+
+#endif
@@ -2,14 +2,26 @@
 #define NS_MUTEX_H
 
 #include "ns_common.h"
+#include "ns_lock_profile.h"
 
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    #include "ns_atomic.h"
+    #include "ns_futex.h"
 #else
     #include <pthread.h>
 #endif
 
 
+/* Define NS_FUTEX (linux only) to build the mutex, condv and semaphore straight on futexes
+   instead of pthreads and posix semaphores. */
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    struct NsInternalMutex
+    {
+        uint32_t state; // 0: unlocked, 1: locked, 2: locked and someone may be asleep on it
+        int32_t spin_estimate; // how long we've had to spin lately
+    };
 #elif defined(LINUX)
     typedef pthread_mutex_t NsInternalMutex;
 #endif
@@ -20,18 +32,107 @@
 struct NsMutex
 {
     NsInternalMutex internal_mutex;
+
+#if defined(NS_LOCK_PROFILE)
+    // whoever has it
+    NsLockProfileSite *profile_site;
+    uint64_t acquire_nanos;
+#endif
 };
 
+#if defined(NS_FUTEX)
+/* Marks the mutex contended and sleeps until it's ours. Since we can't tell whether anyone
+   else is asleep on it, our unlock will always wake someone. */
+internal void
+ns_mutex_lock_contended(NsInternalMutex *internal_mutex)
+{
+    uint32_t state = ns_atomic_exchange(&internal_mutex->state, (uint32_t)2);
+    while(state != 0)
+    {
+        ns_futex_wait(&internal_mutex->state, 2);
+        state = ns_atomic_exchange(&internal_mutex->state, (uint32_t)2);
+    }
+}
+#endif
+
+internal bool
+ns_mutex_try_lock_internal(NsInternalMutex *internal_mutex)
+{
+    bool result = false;
+#if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    uint32_t state = 0;
+    result = ns_atomic_compare_exchange(&internal_mutex->state, &state, (uint32_t)1);
+#elif defined(LINUX)
+    result = (pthread_mutex_trylock(internal_mutex) == 0);
+#endif
+    return result;
+}
+
+internal int
+ns_mutex_lock_internal(NsMutex *mutex)
+{
+#if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    NsInternalMutex *internal_mutex = &mutex->internal_mutex;
+
+    uint32_t state = 0;
+    if(ns_atomic_compare_exchange(&internal_mutex->state, &state, (uint32_t)1))
+    {
+        return NS_SUCCESS;
+    }
+
+    // most critical sections are short, so the owner's likely to be done before a trip
+    // through the kernel would be. spin for about as long as it's taken lately.
+    // only ever written by whoever holds it, so it's a hint more than a count
+    int32_t spin_estimate = ns_atomic_load_relaxed(&internal_mutex->spin_estimate);
+    int32_t max_spins = (2*spin_estimate + 10);
+    if(max_spins > ns_futex_get_max_spins())
+    {
+        max_spins = ns_futex_get_max_spins();
+    }
+
+    int32_t spins = 0;
+    for(; spins < max_spins; spins++)
+    {
+        ns_atomic_pause();
+        state = ns_atomic_load_relaxed(&internal_mutex->state);
+        if(state == 0 && 
+           ns_atomic_compare_exchange(&internal_mutex->state, &state, (uint32_t)1))
+        {
+            ns_atomic_store_relaxed(&internal_mutex->spin_estimate, spin_estimate + ((spins - spin_estimate) / 8));
+            return NS_SUCCESS;
+        }
+    }
+
+    ns_mutex_lock_contended(internal_mutex);
+    ns_atomic_store_relaxed(&internal_mutex->spin_estimate, spin_estimate + ((spins - spin_estimate) / 8));
+#elif defined(LINUX)
+    int status;
+
+    status = pthread_mutex_lock(&mutex->internal_mutex);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
 
 /* API */
 
 int
 ns_mutex_create(NsMutex *mutex)
 {
-    int status;
-
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    mutex->internal_mutex.state = 0;
+    mutex->internal_mutex.spin_estimate = 0;
 #elif defined(LINUX)
+    int status;
+
     status = pthread_mutex_init(&mutex->internal_mutex, NULL);
     if(status != 0)
     {
@@ -39,16 +140,22 @@ ns_mutex_create(NsMutex *mutex)
         return status;
     }
 #endif
+
+#if defined(NS_LOCK_PROFILE)
+    mutex->profile_site = NULL;
+    mutex->acquire_nanos = 0;
+#endif
     return NS_SUCCESS;
 }
 
 int
 ns_mutex_destroy(NsMutex *mutex)
 {
-    int status;
-
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
 #elif defined(LINUX)
+    int status;
+
     status = pthread_mutex_destroy(&mutex->internal_mutex);
     if(status != 0)
     {
@@ -59,15 +166,33 @@ ns_mutex_destroy(NsMutex *mutex)
     return NS_SUCCESS;
 }
 
-int 
-ns_mutex_lock(NsMutex *mutex)
+/* With NS_LOCK_PROFILE, each place this is called from gets its own line in
+   ns_lock_profile_print_report(). */
+int
+ns_mutex_lock(NsMutex *mutex NS_LOCK_PROFILE_SITE_PARAMS)
 {
     int status;
 
-#if defined(WINDOWS)
-#elif defined(LINUX)
-    status = pthread_mutex_lock(&mutex->internal_mutex);
-    if(status != 0)
+#if defined(NS_LOCK_PROFILE)
+    uint64_t start_nanos = ns_time_get_nanos();
+    bool is_contended = !ns_mutex_try_lock_internal(&mutex->internal_mutex);
+    if(is_contended)
+    {
+        status = ns_mutex_lock_internal(mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    uint64_t acquire_nanos = ns_time_get_nanos();
+    mutex->profile_site = ns_lock_profile_record_acquire(NS_LOCK_PROFILE_MUTEX, site_file, site_function, site_line,
+                                                         is_contended, acquire_nanos - start_nanos);
+    mutex->acquire_nanos = acquire_nanos;
+#else
+    status = ns_mutex_lock_internal(mutex);
+    if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
@@ -76,13 +201,38 @@ ns_mutex_lock(NsMutex *mutex)
     return NS_SUCCESS;
 }
 
+/* Returns whether we got it, without waiting if we didn't. */
+bool
+ns_mutex_try_lock(NsMutex *mutex NS_LOCK_PROFILE_SITE_PARAMS)
+{
+    bool result = ns_mutex_try_lock_internal(&mutex->internal_mutex);
+#if defined(NS_LOCK_PROFILE)
+    if(result)
+    {
+        mutex->acquire_nanos = ns_time_get_nanos();
+        mutex->profile_site = ns_lock_profile_record_acquire(NS_LOCK_PROFILE_MUTEX, site_file, site_function, site_line,
+                                                             false, 0);
+    }
+#endif
+    return result;
+}
+
 int 
 ns_mutex_unlock(NsMutex *mutex)
 {
-    int status;
+#if defined(NS_LOCK_PROFILE)
+    ns_lock_profile_record_hold(mutex->profile_site, ns_time_get_nanos() - mutex->acquire_nanos);
+#endif
 
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    if(ns_atomic_exchange(&mutex->internal_mutex.state, (uint32_t)0) == 2)
+    {
+        ns_futex_wake(&mutex->internal_mutex.state, 1);
+    }
 #elif defined(LINUX)
+    int status;
+
     status = pthread_mutex_unlock(&mutex->internal_mutex);
     if(status != 0)
     {
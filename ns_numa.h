@@ -0,0 +1,335 @@
+#ifndef NS_NUMA_H
+#define NS_NUMA_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_thread.h"
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <unistd.h>
+#endif
+
+#include <stdio.h>
+
+
+/* Where the cpus are (which node, which physical core), so threads can be spread across or
+   packed onto them. Read from sysfs by ns_numa_startup(), which has to be called before any
+   pinned threads are created; without sysfs everything is one node and every cpu its own core.
+
+   Memory a thread touches first is put on that thread's node (first touch), so a pinned
+   thread that fills its own buffers gets local memory without any help from here. */
+
+#if !defined(NS_NUMA_MAX_CPUS)
+    #define NS_NUMA_MAX_CPUS 256
+#endif
+
+#if !defined(NS_NUMA_MAX_NODES)
+    #define NS_NUMA_MAX_NODES 16
+#endif
+
+
+enum NsNumaPlacement
+{
+    NS_NUMA_PLACEMENT_NONE, // don't pin
+    NS_NUMA_PLACEMENT_SPREAD, // one per physical core, alternating nodes, then the hyperthreads
+    NS_NUMA_PLACEMENT_COMPACT, // fill a node's physical cores, then its hyperthreads, then the next node
+};
+
+struct NsNumaCpu
+{
+    int cpu;
+    int node;
+    int package;
+    int core;
+    int sibling_idx; // 0 for a core's first hardware thread, 1 for its hyperthread
+};
+
+struct NsNumaTopology
+{
+    NsNumaCpu cpus[NS_NUMA_MAX_CPUS];
+    int num_cpus;
+    int num_nodes;
+
+    // indices into cpus
+    int spread_order[NS_NUMA_MAX_CPUS];
+    int compact_order[NS_NUMA_MAX_CPUS];
+};
+
+struct NsNumaContext
+{
+    NsNumaTopology topology;
+    uint32_t is_discovered;
+};
+
+
+global NsNumaContext ns_numa_context;
+
+
+/* Internal */
+
+internal int
+ns_numa_read_int(const char *path, int default_value)
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return default_value;
+    }
+
+    int value;
+    if(fscanf(file, "%d", &value) != 1)
+    {
+        value = default_value;
+    }
+    fclose(file);
+    return value;
+}
+
+/* Calls cpu_callback for every cpu in a sysfs list like "0-3,8-11". */
+internal void
+ns_numa_parse_cpu_list(const char *path, int node, void (*cpu_callback)(int cpu, int node))
+{
+    FILE *file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return;
+    }
+
+    int first;
+    while(fscanf(file, "%d", &first) == 1)
+    {
+        int last = first;
+        int c = fgetc(file);
+        if(c == '-')
+        {
+            if(fscanf(file, "%d", &last) != 1)
+            {
+                break;
+            }
+            c = fgetc(file);
+        }
+
+        for(int cpu = first; cpu <= last; cpu++)
+        {
+            cpu_callback(cpu, node);
+        }
+
+        if(c != ',')
+        {
+            break;
+        }
+    }
+    fclose(file);
+}
+
+internal void
+ns_numa_set_cpu_node(int cpu, int node)
+{
+    NsNumaTopology *topology = &ns_numa_context.topology;
+    for(int i = 0; i < topology->num_cpus; i++)
+    {
+        if(topology->cpus[i].cpu == cpu)
+        {
+            topology->cpus[i].node = node;
+        }
+    }
+}
+
+internal void
+ns_numa_add_online_cpu(int cpu, int node)
+{
+    NsNumaTopology *topology = &ns_numa_context.topology;
+    if(topology->num_cpus == NS_NUMA_MAX_CPUS)
+    {
+        return;
+    }
+
+    char path[128];
+    NsNumaCpu *numa_cpu = &topology->cpus[topology->num_cpus++];
+    numa_cpu->cpu = cpu;
+    numa_cpu->node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    numa_cpu->package = ns_numa_read_int(path, 0);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+    numa_cpu->core = ns_numa_read_int(path, cpu);
+}
+
+/* Sorts order by key, keeping ties in cpu order. There are only a few hundred cpus at most. */
+internal void
+ns_numa_sort_order(int *order, int num_cpus, int64_t *keys)
+{
+    for(int i = 0; i < num_cpus; i++)
+    {
+        order[i] = i;
+    }
+    for(int i = 1; i < num_cpus; i++)
+    {
+        int idx = order[i];
+        int j = i - 1;
+        for(; j >= 0 && keys[order[j]] > keys[idx]; j--)
+        {
+            order[j + 1] = order[j];
+        }
+        order[j + 1] = idx;
+    }
+}
+
+/* Fills in sibling_idx and the placement orders from the rest. */
+internal void
+ns_numa_compute_orders(NsNumaTopology *topology)
+{
+    // which hardware thread of its core each cpu is, then how many of its node's cpus come
+    // before it with the same sibling_idx
+    int64_t spread_keys[NS_NUMA_MAX_CPUS];
+    int64_t compact_keys[NS_NUMA_MAX_CPUS];
+    for(int i = 0; i < topology->num_cpus; i++)
+    {
+        NsNumaCpu *numa_cpu = &topology->cpus[i];
+        numa_cpu->sibling_idx = 0;
+        for(int j = 0; j < i; j++)
+        {
+            NsNumaCpu *other = &topology->cpus[j];
+            if(other->package == numa_cpu->package && other->core == numa_cpu->core)
+            {
+                numa_cpu->sibling_idx++;
+            }
+        }
+
+        int core_idx = 0;
+        for(int j = 0; j < i; j++)
+        {
+            NsNumaCpu *other = &topology->cpus[j];
+            if(other->node == numa_cpu->node && other->sibling_idx == numa_cpu->sibling_idx)
+            {
+                core_idx++;
+            }
+        }
+
+        spread_keys[i] = ((int64_t)numa_cpu->sibling_idx << 40) | ((int64_t)core_idx << 20) | numa_cpu->node;
+        compact_keys[i] = ((int64_t)numa_cpu->node << 40) | ((int64_t)numa_cpu->sibling_idx << 20) | core_idx;
+    }
+
+    ns_numa_sort_order(topology->spread_order, topology->num_cpus, spread_keys);
+    ns_numa_sort_order(topology->compact_order, topology->num_cpus, compact_keys);
+}
+
+/* Reads the topology. */
+internal int
+ns_numa_discover()
+{
+    NsNumaTopology *topology = &ns_numa_context.topology;
+    memset(topology, 0, sizeof(NsNumaTopology));
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    ns_numa_parse_cpu_list("/sys/devices/system/cpu/online", 0, ns_numa_add_online_cpu);
+    for(int node = 0; node < NS_NUMA_MAX_NODES; node++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if(access(path, R_OK) != 0)
+        {
+            continue;
+        }
+        ns_numa_parse_cpu_list(path, node, ns_numa_set_cpu_node);
+        topology->num_nodes = node + 1;
+    }
+#endif
+
+    if(topology->num_cpus == 0)
+    {
+        int num_cpus = ns_thread_get_num_cpus();
+        if(num_cpus > NS_NUMA_MAX_CPUS)
+        {
+            num_cpus = NS_NUMA_MAX_CPUS;
+        }
+        for(int i = 0; i < num_cpus; i++)
+        {
+            NsNumaCpu *numa_cpu = &topology->cpus[topology->num_cpus++];
+            numa_cpu->cpu = i;
+            numa_cpu->node = 0;
+            numa_cpu->package = 0;
+            numa_cpu->core = i;
+        }
+    }
+    if(topology->num_nodes == 0)
+    {
+        topology->num_nodes = 1;
+    }
+
+    ns_numa_compute_orders(topology);
+    return NS_SUCCESS;
+}
+
+/* API */
+
+/* Reads the topology. Call it once, before anything's pinned and before any other threads
+   that might be asking. */
+int
+ns_numa_startup()
+{
+    int status;
+
+    status = ns_numa_discover();
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_atomic_store(&ns_numa_context.is_discovered, (uint32_t)1);
+    return NS_SUCCESS;
+}
+
+/* The cpu for the thread_idx'th thread placed this way, or -1 (don't pin) for
+   NS_NUMA_PLACEMENT_NONE or before ns_numa_startup(). More threads than cpus wrap around. */
+int
+ns_numa_get_cpu(int thread_idx, NsNumaPlacement placement)
+{
+    if(placement == NS_NUMA_PLACEMENT_NONE)
+    {
+        return -1;
+    }
+
+    if(!ns_atomic_load(&ns_numa_context.is_discovered))
+    {
+        DebugPrintInfo();
+        return -1;
+    }
+
+    NsNumaTopology *topology = &ns_numa_context.topology;
+    int *order = (placement == NS_NUMA_PLACEMENT_SPREAD) ? topology->spread_order : topology->compact_order;
+    int result = topology->cpus[order[thread_idx % topology->num_cpus]].cpu;
+    return result;
+}
+
+/* 0 before ns_numa_startup(). */
+int
+ns_numa_get_node_of_cpu(int cpu)
+{
+    if(!ns_atomic_load(&ns_numa_context.is_discovered))
+    {
+        return 0;
+    }
+
+    NsNumaTopology *topology = &ns_numa_context.topology;
+    for(int i = 0; i < topology->num_cpus; i++)
+    {
+        if(topology->cpus[i].cpu == cpu)
+        {
+            return topology->cpus[i].node;
+        }
+    }
+    return 0;
+}
+
+/* Fills in the attributes to pin the thread_idx'th thread placed this way. */
+void
+ns_numa_set_thread_attributes(NsThreadAttributes *attributes, int thread_idx, NsNumaPlacement placement)
+{
+    attributes->cpu = ns_numa_get_cpu(thread_idx, placement);
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef NS_PARALLEL_H
+#define NS_PARALLEL_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_semaphore.h"
+#include "ns_worker_threads.h"
+
+
+// a loop's never cut into more chunks than this; the grain's raised to fit. parallel_reduce
+// keeps one result per chunk on the caller's stack.
+#if !defined(NS_PARALLEL_MAX_CHUNKS)
+    #define NS_PARALLEL_MAX_CHUNKS 1024
+#endif
+
+// how many loops can be running at once, counting ones nested in others. past that, a loop
+// runs on the calling thread alone.
+#if !defined(NS_PARALLEL_MAX_JOBS)
+    #define NS_PARALLEL_MAX_JOBS 16
+#endif
+
+
+/* Data-parallel loops on an NsWorkerThreads.
+
+   [begin, end) is cut into chunks of grain indices, which are the unit of work. The range of
+   chunks is split in half over and over, each right half queued for the workers, until a
+   thread is down to a single chunk. The calling thread takes part, both in running chunks
+   and in picking up halves nobody's got to yet, so a parallel loop from inside a worker (or
+   with every worker busy) still finishes, just with fewer hands.
+
+       void add_one(int64_t begin, int64_t end, void *data)
+       {
+           float *values = (float *)data;
+           for(int64_t i = begin; i < end; i++) values[i] += 1.0f;
+       }
+       ns_parallel_for(&worker_threads, 0, num_values, 4096, add_one, values);
+
+   A grain of 0 picks one that gives each thread a few chunks. Too small a grain is mostly
+   overhead; a chunk should be at least a few microseconds of work. Either way there are at
+   most NS_PARALLEL_MAX_CHUNKS chunks. */
+
+enum NsParallelRangeState
+{
+    NS_PARALLEL_RANGE_EMPTY,
+    NS_PARALLEL_RANGE_READY,
+    NS_PARALLEL_RANGE_CLAIMED,
+};
+
+struct NsParallelRange
+{
+    struct NsParallelJob *job;
+    int64_t first_chunk;
+    int64_t end_chunk;
+    uint32_t state; // NsParallelRangeState
+};
+
+struct NsParallelJob
+{
+    // runs one chunk. chunk_idx is what parallel_reduce files its result under.
+    void (*chunk_entry)(int64_t begin, int64_t end, int64_t chunk_idx, void *data);
+    void *data;
+    int64_t begin;
+    int64_t end;
+    int64_t grain;
+
+    NsWorkerThreads *worker_threads;
+
+    // every queued half ends up in here, so whoever's idle can claim one without going
+    // through the queue. at most one per chunk, since every split starts at a new chunk.
+    NsParallelRange ranges[NS_PARALLEL_MAX_CHUNKS];
+    uint32_t num_ranges;
+
+    int64_t num_chunks_left;
+    NsSemaphore done_semaphore; // put when num_chunks_left hits 0
+
+    // the caller plus one per queued work item. the work items can be picked up after the
+    // caller's returned, so the last one out gives the job back.
+    uint32_t num_refs;
+    uint32_t is_used;
+};
+
+template <typename type>
+struct NsParallelReduce
+{
+    type (*map)(int64_t begin, int64_t end, void *data);
+    void *data;
+    type *results; // one per chunk, combined in order at the end
+};
+
+
+global NsParallelJob ns_parallel_jobs[NS_PARALLEL_MAX_JOBS];
+
+
+/* Internal */
+
+internal void ns_parallel_run_range(NsParallelJob *job, int64_t first_chunk, int64_t end_chunk);
+
+/* NULL if they're all in use. */
+internal NsParallelJob *
+ns_parallel_job_get()
+{
+    for(int i = 0; i < NS_PARALLEL_MAX_JOBS; i++)
+    {
+        NsParallelJob *job = &ns_parallel_jobs[i];
+        uint32_t is_used = 0;
+        if(ns_atomic_load_relaxed(&job->is_used) == 0 &&
+           ns_atomic_compare_exchange(&job->is_used, &is_used, (uint32_t)1))
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+internal void
+ns_parallel_job_release(NsParallelJob *job)
+{
+    if(ns_atomic_fetch_sub(&job->num_refs, (uint32_t)1) == 1)
+    {
+        ns_semaphore_destroy(&job->done_semaphore);
+
+        // every range got claimed on the way to num_chunks_left hitting 0, but the next
+        // loop shouldn't have to rely on that
+        for(uint32_t i = 0; i < job->num_ranges; i++)
+        {
+            job->ranges[i].state = NS_PARALLEL_RANGE_EMPTY;
+        }
+        ns_atomic_store(&job->is_used, (uint32_t)0);
+    }
+}
+
+internal void
+ns_parallel_run_chunk(NsParallelJob *job, int64_t chunk_idx)
+{
+    int64_t begin = job->begin + chunk_idx*job->grain;
+    int64_t end = ns_math_min(begin + job->grain, job->end);
+    job->chunk_entry(begin, end, chunk_idx, job->data);
+
+    if(ns_atomic_fetch_sub(&job->num_chunks_left, (int64_t)1) == 1)
+    {
+        ns_semaphore_put(&job->done_semaphore);
+    }
+}
+
+internal bool
+ns_parallel_try_claim(NsParallelRange *range)
+{
+    uint32_t state = NS_PARALLEL_RANGE_READY;
+    bool result = ns_atomic_compare_exchange(&range->state, &state, (uint32_t)NS_PARALLEL_RANGE_CLAIMED);
+    return result;
+}
+
+/* Runs whatever ranges nobody's claimed yet until there aren't any. */
+internal void
+ns_parallel_help(NsParallelJob *job)
+{
+    bool did_claim = true;
+    while(did_claim)
+    {
+        did_claim = false;
+        uint32_t num_ranges = ns_atomic_load(&job->num_ranges);
+        for(uint32_t i = 0; i < num_ranges; i++)
+        {
+            NsParallelRange *range = &job->ranges[i];
+            if(ns_parallel_try_claim(range))
+            {
+                ns_parallel_run_range(job, range->first_chunk, range->end_chunk);
+                did_claim = true;
+            }
+        }
+    }
+}
+
+internal void *
+ns_parallel_range_entry(void *input)
+{
+    NsParallelRange *range = (NsParallelRange *)input;
+    NsParallelJob *job = range->job;
+
+    // the caller or another worker may have beaten us to it
+    if(ns_parallel_try_claim(range))
+    {
+        ns_parallel_run_range(job, range->first_chunk, range->end_chunk);
+    }
+    ns_parallel_help(job);
+
+    ns_parallel_job_release(job);
+    return (void *)NS_SUCCESS;
+}
+
+/* Hands off the right halves and keeps the left, until it's down to a chunk. */
+internal void
+ns_parallel_run_range(NsParallelJob *job, int64_t first_chunk, int64_t end_chunk)
+{
+    while(end_chunk - first_chunk > 1)
+    {
+        int64_t mid_chunk = first_chunk + (end_chunk - first_chunk)/2;
+
+        uint32_t range_idx = ns_atomic_fetch_add(&job->num_ranges, (uint32_t)1);
+        NsParallelRange *range = &job->ranges[range_idx];
+        range->job = job;
+        range->first_chunk = mid_chunk;
+        range->end_chunk = end_chunk;
+        ns_atomic_store(&range->state, (uint32_t)NS_PARALLEL_RANGE_READY);
+
+        // if the queue's full, the range is still there for ns_parallel_help() to find
+        ns_atomic_fetch_add(&job->num_refs, (uint32_t)1);
+        bool is_added = false;
+        ns_work_queue_try_add(&job->worker_threads->work_queue, ns_parallel_range_entry, range, &is_added);
+        if(!is_added)
+        {
+            ns_parallel_job_release(job);
+        }
+
+        end_chunk = mid_chunk;
+    }
+
+    if(first_chunk < end_chunk)
+    {
+        ns_parallel_run_chunk(job, first_chunk);
+    }
+}
+
+internal int64_t
+ns_parallel_get_grain(NsWorkerThreads *worker_threads, int64_t num_indices, int64_t grain)
+{
+    if(grain <= 0)
+    {
+        // a few chunks per thread, counting the caller, so an uneven one doesn't hold
+        // everyone up
+        int64_t num_threads = (worker_threads != NULL) ? (worker_threads->thread_capacity + 1) : 1;
+        grain = num_indices/(4*num_threads);
+    }
+    grain = ns_math_max(grain, (num_indices + NS_PARALLEL_MAX_CHUNKS - 1)/NS_PARALLEL_MAX_CHUNKS);
+    return ns_math_max(grain, (int64_t)1);
+}
+
+internal int
+ns_parallel_run(NsWorkerThreads *worker_threads, int64_t begin, int64_t end, int64_t grain,
+                void (*chunk_entry)(int64_t, int64_t, int64_t, void *), void *data)
+{
+    int status;
+
+    int64_t num_chunks = (end - begin + grain - 1)/grain;
+
+    // nobody to share with, nothing worth sharing, or too many loops going already
+    NsParallelJob *job = NULL;
+    if(worker_threads != NULL && num_chunks > 1)
+    {
+        job = ns_parallel_job_get();
+    }
+    if(job == NULL)
+    {
+        for(int64_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++)
+        {
+            int64_t chunk_begin = begin + chunk_idx*grain;
+            chunk_entry(chunk_begin, ns_math_min(chunk_begin + grain, end), chunk_idx, data);
+        }
+        return NS_SUCCESS;
+    }
+
+    job->chunk_entry = chunk_entry;
+    job->data = data;
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain;
+    job->worker_threads = worker_threads;
+    job->num_ranges = 0;
+    job->num_chunks_left = num_chunks;
+    job->num_refs = 1;
+
+    status = ns_semaphore_create(&job->done_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        ns_atomic_store(&job->is_used, (uint32_t)0);
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_parallel_run_range(job, 0, num_chunks);
+    ns_parallel_help(job);
+
+    // what's left is already running on the workers
+    status = ns_semaphore_get(&job->done_semaphore);
+    ns_parallel_job_release(job);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+internal void
+ns_parallel_for_chunk_entry(int64_t begin, int64_t end, int64_t chunk_idx, void *data)
+{
+    void **for_data = (void **)data;
+    void (*entry)(int64_t, int64_t, void *) = (void (*)(int64_t, int64_t, void *))for_data[0];
+    entry(begin, end, for_data[1]);
+}
+
+template <typename type>
+internal void
+ns_parallel_reduce_chunk_entry(int64_t begin, int64_t end, int64_t chunk_idx, void *data)
+{
+    NsParallelReduce<type> *reduce = (NsParallelReduce<type> *)data;
+    reduce->results[chunk_idx] = reduce->map(begin, end, reduce->data);
+}
+
+/* API */
+
+/* Calls entry on pieces of [begin, end) from the workers and the calling thread, and
+   returns once they've all been done. worker_threads can be NULL, which just loops here. */
+int
+ns_parallel_for(NsWorkerThreads *worker_threads, int64_t begin, int64_t end, int64_t grain,
+                void (*entry)(int64_t begin, int64_t end, void *data), void *data)
+{
+    int status;
+
+    if(end <= begin)
+    {
+        return NS_SUCCESS;
+    }
+    grain = ns_parallel_get_grain(worker_threads, end - begin, grain);
+
+    void *for_data[2] = { (void *)entry, data };
+    status = ns_parallel_run(worker_threads, begin, end, grain, ns_parallel_for_chunk_entry, for_data);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Maps each piece of [begin, end) to a value, then folds them together with combine,
+   starting from identity. The pieces are combined in index order whichever thread ran
+   them, so a float sum comes out the same every time for the same grain. */
+template <typename type>
+int
+ns_parallel_reduce(NsWorkerThreads *worker_threads, int64_t begin, int64_t end, int64_t grain,
+                   type identity, type (*map)(int64_t begin, int64_t end, void *data),
+                   type (*combine)(type a, type b), void *data, type *result)
+{
+    int status;
+
+    *result = identity;
+    if(end <= begin)
+    {
+        return NS_SUCCESS;
+    }
+    grain = ns_parallel_get_grain(worker_threads, end - begin, grain);
+
+    int64_t num_chunks = (end - begin + grain - 1)/grain;
+    type results[NS_PARALLEL_MAX_CHUNKS];
+
+    NsParallelReduce<type> reduce;
+    reduce.map = map;
+    reduce.data = data;
+    reduce.results = results;
+
+    status = ns_parallel_run(worker_threads, begin, end, grain, ns_parallel_reduce_chunk_entry<type>, &reduce);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    for(int64_t i = 0; i < num_chunks; i++)
+    {
+        *result = combine(*result, results[i]);
+    }
+
+    return NS_SUCCESS;
+}
+
+#endif
@@ -1,42 +1,68 @@
-#if 0
-TODO: add ns_poll_fds_poll()
-#endif
-
 #ifndef NS_POLL_FDS_H
 #define NS_POLL_FDS_H
 
 #include "ns_pollfd.h"
 #include "ns_socket.h"
 #include "ns_condv.h"
+#include "ns_atomic.h"
+#include "ns_mpsc_queue.h"
+#include "ns_connection_table.h"
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <sys/eventfd.h>
+    #include <unistd.h>
+    #include <errno.h>
+#endif
 
 
 enum NsPollFdsContainerType
 {
-    NS_SOCKET, NS_WEBSOCKET
+    NS_SOCKET, NS_WEBSOCKET, NS_CONNECTION
 };
 
+/* Adds and removes from other threads are posted to the polling thread through a
+   lock-free queue, and an eventfd in an extra pollfd slot wakes it up, so nobody ever
+   waits for a poll() to time out. Only one thread may call ns_poll_fds_poll(). */
 struct NsPollFds
 {
+    // capacity + 1 entries; the last one is the wakeup eventfd
     NsPollFd *pollfds;
-    NsCondv empty_condv;
-    NsMutex mutex;
-
     int capacity;
-    int size;
+    int size; // includes adds that have been posted but not applied yet
 
     // array to link pollfd back to its container (websocket, socket, etc.)
     void **containers;
     NsPollFdsContainerType container_type;
+
+    NsMpscQueue commands;
+    int wakeup_fd;
+    uint32_t is_wakeup_pending;
+    pthread_t poll_thread; // set on the first poll
+    bool has_poll_thread; // only changes under mutex
+
+    // removes from other threads wait on this until the polling thread has let go; with no
+    // polling thread, whoever holds it drains the commands
+    NsMutex mutex;
+    NsCondv removed_condv;
+};
+
+struct NsPollFdsRemoval
+{
+    void *container;
+    bool is_done;
 };
 
 
 int ns_poll_fds_add(NsPollFds *poll_fds, void *container);
 int ns_poll_fds_remove(NsPollFds *poll_fds, void *container);
-int ns_poll_fds_wait_till_nonempty_and_lock(NsPollFds *poll_fds);
-int ns_poll_fds_unlock(NsPollFds *poll_fds);
+int ns_poll_fds_poll(NsPollFds *poll_fds, int timeout_millis);
+int ns_poll_fds_stop_polling(NsPollFds *poll_fds);
+int ns_poll_fds_wake(NsPollFds *poll_fds);
 NsPollFd * ns_poll_fds_get(NsPollFds *poll_fds);
 int ns_poll_fds_get_capacity(NsPollFds *poll_fds);
 void *ns_poll_fds_get_container(NsPollFds *poll_fds, int idx);
+void ns_poll_fds_set_events(NsPollFds *poll_fds, int pollfd_idx, short events);
 bool ns_poll_fds_is_full(NsPollFds *poll_fds);
 int ns_poll_fds_create(NsPollFds *poll_fds, NsPollFdsContainerType container_type, int capacity);
 
@@ -47,6 +73,199 @@ int ns_poll_fds_create(NsPollFds *poll_fds, NsPollFdsContainerType container_typ
 internal NsInternalSocket ns_websocket_get_internal(struct NsWebSocket *websocket);
 
 
+/* Internal */
+
+// commands are container pointers; removals point at an NsPollFdsRemoval instead and are
+// tagged in the low bit
+#define NS_POLL_FDS_REMOVAL_TAG ((uintptr_t)1)
+
+inline internal bool
+ns_poll_fds_check_poll_thread(NsPollFds *poll_fds)
+{
+    bool result = (ns_atomic_load(&poll_fds->has_poll_thread) && pthread_equal(poll_fds->poll_thread, pthread_self()));
+    return result;
+}
+
+internal int
+ns_poll_fds_post(NsPollFds *poll_fds, void *command)
+{
+    int status;
+
+    // can't fail: size caps pending adds at capacity and removals at the number of adds
+    if(!ns_mpsc_queue_try_add(&poll_fds->commands, command))
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    status = ns_poll_fds_wake(poll_fds);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+internal int
+ns_poll_fds_apply_add(NsPollFds *poll_fds, void *container)
+{
+    NsPollFd *pollfds = poll_fds->pollfds;
+    int capacity = poll_fds->capacity;
+
+    int pollfd_idx = 0;
+    for(; pollfd_idx < capacity; pollfd_idx++)
+    {
+        NsPollFd *pfd = &pollfds[pollfd_idx];
+        if(pfd->fd < 0)
+        {
+            break;
+        }
+    }
+
+    if(pollfd_idx == capacity)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    NsPollFd *pollfd = &pollfds[pollfd_idx];
+
+    switch(poll_fds->container_type)
+    {
+        case NS_SOCKET:
+        {
+            pollfd->fd = ns_socket_get_internal((NsSocket *)container);
+        } break;
+
+        case NS_WEBSOCKET:
+        {
+            pollfd->fd = ns_websocket_get_internal((NsWebSocket *)container);
+        } break;
+
+        case NS_CONNECTION:
+        {
+            NsConnection *connection = (NsConnection *)container;
+            pollfd->fd = ns_socket_get_internal(&connection->socket);
+            connection->pollfd_idx = pollfd_idx;
+        } break;
+
+        default:
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        } break;
+    }
+
+    pollfd->events = NS_SOCKET_POLL_IN;
+    pollfd->revents = 0;
+    poll_fds->containers[pollfd_idx] = container;
+
+    return NS_SUCCESS;
+}
+
+internal int
+ns_poll_fds_apply_remove(NsPollFds *poll_fds, void *container)
+{
+    NsPollFd *pollfds = poll_fds->pollfds;
+    void **containers = poll_fds->containers;
+    int capacity = poll_fds->capacity;
+    NsPollFd *pollfd = NULL;
+
+    for(int pollfds_idx = 0; pollfds_idx < capacity; pollfds_idx++)
+    {
+        if(container == containers[pollfds_idx] && pollfds[pollfds_idx].fd >= 0)
+        {
+            pollfd = &pollfds[pollfds_idx];
+            containers[pollfds_idx] = NULL;
+            break;
+        }
+    }
+
+    // sanity check
+    if(pollfd == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    // set to negative so poll() ignores it.
+    pollfd->fd = -1;
+
+    // in case the caller is still looking at this round's results
+    pollfd->revents = 0;
+
+    ns_atomic_fetch_sub(&poll_fds->size, 1);
+
+    return NS_SUCCESS;
+}
+
+/* Runs on the polling thread, or under mutex when there isn't one. */
+internal int
+ns_poll_fds_apply_commands(NsPollFds *poll_fds, bool has_mutex = false)
+{
+    int status;
+
+    void *command;
+    while(ns_mpsc_queue_try_get(&poll_fds->commands, &command))
+    {
+        if(((uintptr_t)command & NS_POLL_FDS_REMOVAL_TAG) == 0)
+        {
+            status = ns_poll_fds_apply_add(poll_fds, command);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+            continue;
+        }
+
+        NsPollFdsRemoval *removal = (NsPollFdsRemoval *)((uintptr_t)command & ~NS_POLL_FDS_REMOVAL_TAG);
+        status = ns_poll_fds_apply_remove(poll_fds, removal->container);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+        }
+
+        // the remover's waiting on its stack for this
+        if(!has_mutex)
+        {
+            status = ns_mutex_lock(&poll_fds->mutex);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+        }
+
+        removal->is_done = true;
+
+        status = ns_condv_broadcast(&poll_fds->removed_condv);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            if(!has_mutex)
+            {
+                ns_mutex_unlock(&poll_fds->mutex);
+            }
+            return status;
+        }
+
+        if(!has_mutex)
+        {
+            status = ns_mutex_unlock(&poll_fds->mutex);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
 /* API */
 
 int
@@ -54,7 +273,7 @@ ns_poll_fds_create(NsPollFds *poll_fds, NsPollFdsContainerType container_type, i
 {
     int status;
 
-    NsPollFd *pollfds = (NsPollFd *)ns_memory_allocate(sizeof(NsPollFd)*capacity);
+    NsPollFd *pollfds = (NsPollFd *)ns_memory_allocate(sizeof(NsPollFd)*(capacity + 1));
     if(pollfds == NULL)
     {
         DebugPrintInfo();
@@ -68,7 +287,15 @@ ns_poll_fds_create(NsPollFds *poll_fds, NsPollFdsContainerType container_type, i
         return NS_ERROR;
     }
 
-    status = ns_condv_create(&poll_fds->empty_condv);
+    // every container can have an add and a remove in flight
+    status = ns_mpsc_queue_create(&poll_fds->commands, 2*capacity);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_condv_create(&poll_fds->removed_condv);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
@@ -82,88 +309,164 @@ ns_poll_fds_create(NsPollFds *poll_fds, NsPollFdsContainerType container_type, i
         return status;
     }
 
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    poll_fds->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(poll_fds->wakeup_fd == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+
     for(int i = 0; i < capacity; i++)
     {
         pollfds[i].fd = -1;
+        poll_fds->containers[i] = NULL;
     }
 
+    pollfds[capacity].fd = poll_fds->wakeup_fd;
+    pollfds[capacity].events = NS_SOCKET_POLL_IN;
+    pollfds[capacity].revents = 0;
+
     poll_fds->pollfds = pollfds;
     poll_fds->capacity = capacity;
     poll_fds->size = 0;
     poll_fds->container_type = container_type;
+    poll_fds->is_wakeup_pending = 0;
+    poll_fds->has_poll_thread = false;
 
     return NS_SUCCESS;
 }
 
+/* Doesn't wait for the polling thread; the container is polled from its next poll on. */
 int
 ns_poll_fds_add(NsPollFds *poll_fds, void *container)
 {
     int status;
 
-    if(poll_fds->size >= poll_fds->capacity)
+    if(ns_atomic_fetch_add(&poll_fds->size, 1) >= poll_fds->capacity)
     {
+        ns_atomic_fetch_sub(&poll_fds->size, 1);
         DebugPrintInfo();
         return NS_ERROR;
     }
 
-    status = ns_mutex_lock(&poll_fds->mutex);
+    if(ns_poll_fds_check_poll_thread(poll_fds))
+    {
+        status = ns_poll_fds_apply_commands(poll_fds);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        status = ns_poll_fds_apply_add(poll_fds, container);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        return NS_SUCCESS;
+    }
+
+    status = ns_poll_fds_post(poll_fds, container);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    NsPollFd *pollfds = poll_fds->pollfds;
-    int capacity = poll_fds->capacity;
+    return NS_SUCCESS;
+}
 
-    int pollfd_idx = 0;
-    for(; pollfd_idx < capacity; pollfd_idx++)
+/* When this returns the polling thread is done with the container, so it's safe to close
+   or free. From the polling thread itself that's immediate; anyone else waits for the
+   polling thread to get to it, which is at most one wakeup away. With no polling thread
+   (none has started, or it's called ns_poll_fds_stop_polling()) it's applied here. */
+int
+ns_poll_fds_remove(NsPollFds *poll_fds, void *container)
+{
+    int status;
+
+    if(ns_poll_fds_check_poll_thread(poll_fds))
     {
-        NsPollFd *pfd = &pollfds[pollfd_idx];
-        if(pfd->fd < 0)
+        // an add for this container may still be queued
+        status = ns_poll_fds_apply_commands(poll_fds);
+        if(status != NS_SUCCESS)
         {
-            break;
+            DebugPrintInfo();
+            return status;
         }
+
+        status = ns_poll_fds_apply_remove(poll_fds, container);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        return NS_SUCCESS;
     }
 
-    if(pollfd_idx == capacity)
+    status = ns_mutex_lock(&poll_fds->mutex);
+    if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
-        return NS_ERROR;
+        return status;
     }
 
-    NsPollFd *pollfd = &pollfds[pollfd_idx];
-
-    switch(poll_fds->container_type)
+    // nobody would ever get to a posted removal
+    if(!poll_fds->has_poll_thread)
     {
-        case NS_SOCKET:
+        status = ns_poll_fds_apply_commands(poll_fds, true);
+        if(status == NS_SUCCESS)
         {
-            pollfd->fd = ns_socket_get_internal((NsSocket *)container);
-        } break;
+            status = ns_poll_fds_apply_remove(poll_fds, container);
+        }
 
-        case NS_WEBSOCKET:
+        if(status != NS_SUCCESS)
         {
-            pollfd->fd = ns_websocket_get_internal((NsWebSocket *)container);
-        } break;
+            DebugPrintInfo();
+            ns_mutex_unlock(&poll_fds->mutex);
+            return status;
+        }
 
-        default:
+        status = ns_mutex_unlock(&poll_fds->mutex);
+        if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return NS_ERROR;
-        } break;
+            return status;
+        }
+
+        return NS_SUCCESS;
     }
 
-    pollfd->events = NS_SOCKET_POLL_IN;
-    poll_fds->containers[pollfd_idx] = container;
-    poll_fds->size++;
+    // posted under mutex, so a polling thread that stops after this still drains it
+    NsPollFdsRemoval removal;
+    removal.container = container;
+    removal.is_done = false;
 
-    status = ns_condv_signal(&poll_fds->empty_condv);
+    status = ns_poll_fds_post(poll_fds, (void *)((uintptr_t)&removal | NS_POLL_FDS_REMOVAL_TAG));
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
+        ns_mutex_unlock(&poll_fds->mutex);
         return status;
     }
 
+    while(!removal.is_done)
+    {
+        status = ns_condv_wait(&poll_fds->removed_condv, &poll_fds->mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            ns_mutex_unlock(&poll_fds->mutex);
+            return status;
+        }
+    }
+
     status = ns_mutex_unlock(&poll_fds->mutex);
     if(status != NS_SUCCESS)
     {
@@ -174,76 +477,92 @@ ns_poll_fds_add(NsPollFds *poll_fds, void *container)
     return NS_SUCCESS;
 }
 
+/* Applies posted adds and removes, then polls. A timeout of -1 waits forever; adds,
+   removes and ns_poll_fds_wake() all cut the wait short. Returns the number of ready
+   containers. */
 int
-ns_poll_fds_remove(NsPollFds *poll_fds, void *container)
+ns_poll_fds_poll(NsPollFds *poll_fds, int timeout_millis)
 {
     int status;
 
-    if(poll_fds->size <= 0)
-    {
-        DebugPrintInfo();
-        return NS_ERROR;
-    }
-
-    status = ns_mutex_lock(&poll_fds->mutex);
-    if(status != NS_SUCCESS)
+    if(!poll_fds->has_poll_thread)
     {
-        DebugPrintInfo();
-        return status;
-    }
+        // a remover may be draining the commands in our place
+        status = ns_mutex_lock(&poll_fds->mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
 
-    NsPollFd *pollfds = poll_fds->pollfds;
-    void **containers = poll_fds->containers;
-    int capacity = poll_fds->capacity;
-    NsPollFd *pollfd = NULL;
+        poll_fds->poll_thread = pthread_self();
+        ns_atomic_store(&poll_fds->has_poll_thread, true);
 
-    for(int pollfds_idx = 0; pollfds_idx < capacity; pollfds_idx++)
-    {
-        if(container == containers[pollfds_idx])
+        status = ns_mutex_unlock(&poll_fds->mutex);
+        if(status != NS_SUCCESS)
         {
-            pollfd = &pollfds[pollfds_idx];
-            break;
+            DebugPrintInfo();
+            return status;
         }
     }
 
-    // sanity check
-    if(pollfd == NULL)
+    // clear the flag before draining, so anything posted after this wakes us again
+    ns_atomic_store(&poll_fds->is_wakeup_pending, (uint32_t)0);
+
+    status = ns_poll_fds_apply_commands(poll_fds);
+    if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
-        return NS_ERROR;
+        return status;
     }
 
-    // sanity check
-    if(pollfd->fd < 0)
+    int num_fds_ready = ns_socket_poll(poll_fds->pollfds, poll_fds->capacity + 1, timeout_millis);
+    if(num_fds_ready < 0)
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
 
-    // set to negative so poll() ignores it.
-    pollfd->fd = -1;
-
-    // in case we add at an inopportune time and revent is still set
-    pollfd->revents = 0;
-
-    poll_fds->size--;
+    NsPollFd *wakeup_pollfd = &poll_fds->pollfds[poll_fds->capacity];
+    if((wakeup_pollfd->revents & NS_SOCKET_POLL_IN) != 0)
+    {
+#if defined(WINDOWS)
+#elif defined(LINUX)
+        uint64_t value;
+        if(read(poll_fds->wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        {
+            DebugPrintOsInfo();
+            return NS_ERROR;
+        }
+#endif
+        wakeup_pollfd->revents = 0;
+        num_fds_ready--;
+    }
 
-    status = ns_mutex_unlock(&poll_fds->mutex);
+    // removals waiting on us shouldn't have to wait for another round
+    status = ns_poll_fds_apply_commands(poll_fds);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    return NS_SUCCESS;
+    return num_fds_ready;
 }
 
-/* Waits until the poll_fds is nonempty and locks the mutex. */
+/* The polling thread calls this when it's done polling, so removes from other threads
+   don't wait on it anymore. Removals it hasn't gotten to yet are applied here. */
 int
-ns_poll_fds_wait_till_nonempty_and_lock(NsPollFds *poll_fds)
+ns_poll_fds_stop_polling(NsPollFds *poll_fds)
 {
     int status;
 
+    // may have failed before its first poll
+    if(!ns_poll_fds_check_poll_thread(poll_fds))
+    {
+        return NS_SUCCESS;
+    }
+
     status = ns_mutex_lock(&poll_fds->mutex);
     if(status != NS_SUCCESS)
     {
@@ -251,30 +570,45 @@ ns_poll_fds_wait_till_nonempty_and_lock(NsPollFds *poll_fds)
         return status;
     }
 
-    while(poll_fds->size == 0)
+    ns_atomic_store(&poll_fds->has_poll_thread, false);
+
+    status = ns_poll_fds_apply_commands(poll_fds, true);
+    if(status != NS_SUCCESS)
     {
-        status = ns_condv_wait(&poll_fds->empty_condv, &poll_fds->mutex);
-        if(status != NS_SUCCESS)
-        {
-            DebugPrintInfo();
-            return status;
-        }
+        DebugPrintInfo();
+        ns_mutex_unlock(&poll_fds->mutex);
+        return status;
+    }
+
+    status = ns_mutex_unlock(&poll_fds->mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
     }
 
     return NS_SUCCESS;
 }
 
+/* Cuts the polling thread's current poll short. Cheap to call often; only the first call
+   since the last poll makes a syscall. */
 int
-ns_poll_fds_unlock(NsPollFds *poll_fds)
+ns_poll_fds_wake(NsPollFds *poll_fds)
 {
-    int status;
+    if(ns_atomic_exchange(&poll_fds->is_wakeup_pending, (uint32_t)1) != 0)
+    {
+        return NS_SUCCESS;
+    }
 
-    status = ns_mutex_unlock(&poll_fds->mutex);
-    if(status != NS_SUCCESS)
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    uint64_t value = 1;
+    if(write(poll_fds->wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
     {
-        DebugPrintInfo();
-        return status;
+        DebugPrintOsInfo();
+        return NS_ERROR;
     }
+#endif
 
     return NS_SUCCESS;
 }
@@ -285,6 +619,7 @@ ns_poll_fds_get(NsPollFds *poll_fds)
     return poll_fds->pollfds;
 }
 
+/* Not counting the wakeup fd, which callers never see. */
 int
 ns_poll_fds_get_capacity(NsPollFds *poll_fds)
 {
@@ -297,10 +632,23 @@ ns_poll_fds_get_container(NsPollFds *poll_fds, int idx)
     return poll_fds->containers[idx];
 }
 
+/* Lets a thread that isn't polling stop or resume polling for a container, e.g. while a
+   worker owns a connection. */
+void
+ns_poll_fds_set_events(NsPollFds *poll_fds, int pollfd_idx, short events)
+{
+    ns_atomic_store(&poll_fds->pollfds[pollfd_idx].events, events);
+
+    if(!ns_poll_fds_check_poll_thread(poll_fds))
+    {
+        ns_poll_fds_wake(poll_fds);
+    }
+}
+
 bool
 ns_poll_fds_is_full(NsPollFds *poll_fds)
 {
-    return poll_fds->size >= poll_fds->capacity;
+    return ns_atomic_load(&poll_fds->size) >= poll_fds->capacity;
 }
 
 #endif
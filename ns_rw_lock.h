@@ -0,0 +1,184 @@
+#ifndef NS_RW_LOCK_H
+#define NS_RW_LOCK_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_thread.h"
+#include "ns_mutex.h"
+
+
+/* A big-reader lock: each reader only touches its own slot's count, so readers on
+   different cores never share a cache line and read locking scales like no lock at all.
+   The price is on the writer, which has to visit every slot. Threads beyond this many
+   share slots. */
+#if !defined(NS_RW_LOCK_NUM_SLOTS)
+    #define NS_RW_LOCK_NUM_SLOTS 16
+#endif
+
+// how long a writer spins waiting for readers to leave before it starts yielding
+#if !defined(NS_RW_LOCK_MAX_SPINS)
+    #define NS_RW_LOCK_MAX_SPINS 1000
+#endif
+
+#define NS_RW_LOCK_NO_SLOT 0xffffffff
+
+
+struct alignas(NS_CACHE_LINE_SIZE) NsRwLockSlot
+{
+    uint32_t num_readers;
+};
+
+struct NsRwLock
+{
+    NsRwLockSlot slots[NS_RW_LOCK_NUM_SLOTS];
+    alignas(NS_CACHE_LINE_SIZE) uint32_t is_writing;
+    NsMutex writer_mutex; // held for the whole write; waiting readers sleep on it
+};
+
+
+global uint32_t ns_rw_lock_next_slot;
+internal thread_local uint32_t ns_rw_lock_thread_slot = NS_RW_LOCK_NO_SLOT;
+
+
+/* Internal */
+
+/* A thread keeps its slot for life, so it unlocks the same slot it locked. */
+inline internal uint32_t
+ns_rw_lock_get_slot()
+{
+    uint32_t slot = ns_rw_lock_thread_slot;
+    if(slot == NS_RW_LOCK_NO_SLOT)
+    {
+        slot = (ns_atomic_fetch_add(&ns_rw_lock_next_slot, (uint32_t)1) % NS_RW_LOCK_NUM_SLOTS);
+        ns_rw_lock_thread_slot = slot;
+    }
+    return slot;
+}
+
+/* API */
+
+int
+ns_rw_lock_create(NsRwLock *lock)
+{
+    int status;
+
+    memset(lock, 0, sizeof(NsRwLock));
+    status = ns_mutex_create(&lock->writer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+int
+ns_rw_lock_destroy(NsRwLock *lock)
+{
+    int status;
+
+    status = ns_mutex_destroy(&lock->writer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Not recursive, and a reader can't upgrade to a writer. */
+int
+ns_rw_lock_read_lock(NsRwLock *lock)
+{
+    int status;
+
+    uint32_t *num_readers = &lock->slots[ns_rw_lock_get_slot()].num_readers;
+    while(1)
+    {
+        ns_atomic_fetch_add(num_readers, (uint32_t)1);
+        if(!ns_atomic_load(&lock->is_writing))
+        {
+            return NS_SUCCESS;
+        }
+
+        // writers go first. get out of its way and wait for it on the writer mutex.
+        ns_atomic_fetch_sub(num_readers, (uint32_t)1);
+
+        status = ns_mutex_lock(&lock->writer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        status = ns_mutex_unlock(&lock->writer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+}
+
+int
+ns_rw_lock_read_unlock(NsRwLock *lock)
+{
+    ns_atomic_fetch_sub(&lock->slots[ns_rw_lock_get_slot()].num_readers, (uint32_t)1);
+    return NS_SUCCESS;
+}
+
+int
+ns_rw_lock_write_lock(NsRwLock *lock)
+{
+    int status;
+
+    status = ns_mutex_lock(&lock->writer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_atomic_exchange(&lock->is_writing, (uint32_t)1);
+
+    // the counts are read with an rmw rather than a load. a reader's increment then either
+    // comes before ours in the slot's order, and we see it, or after, and it sees
+    // is_writing; plain acquire loads wouldn't rule out both of us missing the other.
+    for(uint32_t i = 0; i < NS_RW_LOCK_NUM_SLOTS; i++)
+    {
+        uint32_t *num_readers = &lock->slots[i].num_readers;
+        for(uint32_t spins = 0; ns_atomic_fetch_add(num_readers, (uint32_t)0) != 0; spins++)
+        {
+            if(spins < NS_RW_LOCK_MAX_SPINS)
+            {
+                ns_atomic_pause();
+            }
+            else
+            {
+                ns_thread_yield();
+            }
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
+int
+ns_rw_lock_write_unlock(NsRwLock *lock)
+{
+    int status;
+
+    ns_atomic_store(&lock->is_writing, (uint32_t)0);
+
+    status = ns_mutex_unlock(&lock->writer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+#endif
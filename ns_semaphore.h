@@ -1,14 +1,27 @@
 #ifndef NS_SEMAPHORE_H
 #define NS_SEMAPHORE_H
 
+#include "ns_common.h"
+#include "ns_lock_profile.h"
+
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    #include "ns_atomic.h"
+    #include "ns_futex.h"
 #else
     #include <semaphore.h>
+    #include <errno.h>
 #endif
 
 
 #if defined(WINDOWS)
     //typedef sem_t InternalSemaphore;
+#elif defined(NS_FUTEX)
+    struct InternalSemaphore
+    {
+        int32_t count; // what's available, or if negative, how many are waiting
+        uint32_t wakeups; // the futex. puts that found someone waiting, not yet picked up.
+    };
 #else
     typedef sem_t InternalSemaphore;
 #endif
@@ -20,13 +33,80 @@ struct NsSemaphore
 };
 
 
+/* Internal */
+
+#if defined(NS_FUTEX)
+internal bool
+ns_semaphore_try_decrement(InternalSemaphore *internal_semaphore)
+{
+    int32_t count = ns_atomic_load_relaxed(&internal_semaphore->count);
+    while(count > 0)
+    {
+        if(ns_atomic_compare_exchange(&internal_semaphore->count, &count, count - 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+internal int
+ns_semaphore_get_internal(NsSemaphore *semaphore)
+{
+#if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    InternalSemaphore *internal_semaphore = &semaphore->internal_semaphore;
+
+    // a put is often just around the corner, so spin a little before sleeping
+    int32_t max_spins = ns_futex_get_max_spins();
+    for(int32_t spins = 0; spins < max_spins; spins++)
+    {
+        if(ns_semaphore_try_decrement(internal_semaphore))
+        {
+            return NS_SUCCESS;
+        }
+        ns_atomic_pause();
+    }
+
+    if(ns_atomic_fetch_sub(&internal_semaphore->count, (int32_t)1) > 0)
+    {
+        return NS_SUCCESS;
+    }
+
+    // we're counted as waiting, so exactly one put will leave a wakeup for us
+    while(1)
+    {
+        uint32_t wakeups = ns_atomic_load(&internal_semaphore->wakeups);
+        while(wakeups > 0)
+        {
+            if(ns_atomic_compare_exchange(&internal_semaphore->wakeups, &wakeups, wakeups - 1))
+            {
+                return NS_SUCCESS;
+            }
+        }
+        ns_futex_wait(&internal_semaphore->wakeups, 0);
+    }
+#else
+    if(sem_wait(&semaphore->internal_semaphore) == -1)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
 /* API */
 
 int ns_semaphore_create(NsSemaphore *semaphore, int initial_value = 0)
 {
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    semaphore->internal_semaphore.count = initial_value;
+    semaphore->internal_semaphore.wakeups = 0;
 #else
-    if(sem_init(&semaphore->internal_semaphore, 0, 0) == -1)
+    if(sem_init(&semaphore->internal_semaphore, 0, initial_value) == -1)
     {
         return NS_ERROR;
     }
@@ -37,6 +117,7 @@ int ns_semaphore_create(NsSemaphore *semaphore, int initial_value = 0)
 int ns_semaphore_destroy(NsSemaphore *semaphore, int initial_value = 0)
 {
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
 #else
     if(sem_destroy(&semaphore->internal_semaphore) == -1)
     {
@@ -49,6 +130,7 @@ int ns_semaphore_destroy(NsSemaphore *semaphore, int initial_value = 0)
 int ns_semaphore_close(NsSemaphore *semaphore)
 {
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
 #else
     sem_close(&semaphore->internal_semaphore);
 #endif
@@ -58,6 +140,14 @@ int ns_semaphore_close(NsSemaphore *semaphore)
 int ns_semaphore_put(NsSemaphore *semaphore)
 {
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    // only goes into the kernel if someone's waiting
+    InternalSemaphore *internal_semaphore = &semaphore->internal_semaphore;
+    if(ns_atomic_fetch_add(&internal_semaphore->count, (int32_t)1) < 0)
+    {
+        ns_atomic_fetch_add(&internal_semaphore->wakeups, (uint32_t)1);
+        ns_futex_wake(&internal_semaphore->wakeups, 1);
+    }
 #else
     if(sem_post(&semaphore->internal_semaphore) == -1)
     {
@@ -68,12 +158,23 @@ int ns_semaphore_put(NsSemaphore *semaphore)
     return NS_SUCCESS;
 }
 
-int ns_semaphore_get(NsSemaphore *semaphore)
+/* Returns NS_TIMED_OUT instead of blocking if the semaphore is zero. */
+int ns_semaphore_try_get(NsSemaphore *semaphore)
 {
 #if defined(WINDOWS)
+#elif defined(NS_FUTEX)
+    if(!ns_semaphore_try_decrement(&semaphore->internal_semaphore))
+    {
+        return NS_TIMED_OUT;
+    }
 #else
-    if(sem_wait(&semaphore->internal_semaphore) == -1)
+    if(sem_trywait(&semaphore->internal_semaphore) == -1)
     {
+        if(errno == EAGAIN)
+        {
+            return NS_TIMED_OUT;
+        }
+
         DebugPrintInfo();
         return NS_ERROR;
     }
@@ -81,4 +182,34 @@ int ns_semaphore_get(NsSemaphore *semaphore)
     return NS_SUCCESS;
 }
 
+int ns_semaphore_get(NsSemaphore *semaphore NS_LOCK_PROFILE_SITE_PARAMS)
+{
+    int status;
+
+#if defined(NS_LOCK_PROFILE)
+    // contended means there was nothing to get yet
+    uint64_t start_nanos = ns_time_get_nanos();
+    bool is_contended = (ns_semaphore_try_get(semaphore) != NS_SUCCESS);
+    if(is_contended)
+    {
+        status = ns_semaphore_get_internal(semaphore);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+    ns_lock_profile_record_acquire(NS_LOCK_PROFILE_SEMAPHORE, site_file, site_function, site_line,
+                                   is_contended, ns_time_get_nanos() - start_nanos);
+#else
+    status = ns_semaphore_get_internal(semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
 #endif
@@ -0,0 +1,133 @@
+#ifndef NS_SEQ_LOCK_H
+#define NS_SEQ_LOCK_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+
+
+/* For small plain-data snapshots (a config, a routing table entry, some stats) that are read
+   far more often than they're written. Readers never write to shared memory at all, so
+   they don't slow each other down. Instead they copy the data and retry if a writer was
+   in the middle of changing it. Only use it on data that's safe to copy half-written, i.e.
+   no pointers a reader would follow before knowing the copy is good.
+
+   Read:
+       NsConfig config;
+       ns_seq_lock_read(&lock, &config, &shared_config);
+
+   Write:
+       ns_seq_lock_write(&lock, &shared_config, &config); */
+
+struct NsSeqLock
+{
+    uint32_t sequence; // odd while a write is in progress
+};
+
+
+/* Internal */
+
+/* The copies are done with relaxed atomics, a word at a time where the type allows it, so a
+   reader racing a writer is torn but not undefined. */
+template <typename type>
+inline internal void
+ns_seq_lock_copy(type *dest, type *src)
+{
+    if(sizeof(type) % sizeof(uint64_t) == 0 && alignof(type) >= alignof(uint64_t))
+    {
+        uint64_t *dest_words = (uint64_t *)dest;
+        uint64_t *src_words = (uint64_t *)src;
+        for(size_t i = 0; i < sizeof(type)/sizeof(uint64_t); i++)
+        {
+            ns_atomic_store_relaxed(&dest_words[i], ns_atomic_load_relaxed(&src_words[i]));
+        }
+    }
+    else
+    {
+        uint8_t *dest_bytes = (uint8_t *)dest;
+        uint8_t *src_bytes = (uint8_t *)src;
+        for(size_t i = 0; i < sizeof(type); i++)
+        {
+            ns_atomic_store_relaxed(&dest_bytes[i], ns_atomic_load_relaxed(&src_bytes[i]));
+        }
+    }
+}
+
+/* API */
+
+void
+ns_seq_lock_create(NsSeqLock *lock)
+{
+    lock->sequence = 0;
+}
+
+/* Returns the sequence to hand to ns_seq_lock_read_retry(), waiting out any write in
+   progress. */
+inline uint32_t
+ns_seq_lock_read_begin(NsSeqLock *lock)
+{
+    uint32_t sequence = ns_atomic_load(&lock->sequence);
+    while(sequence & 1)
+    {
+        ns_atomic_pause();
+        sequence = ns_atomic_load(&lock->sequence);
+    }
+    return sequence;
+}
+
+/* True if a write overlapped the reads since ns_seq_lock_read_begin(), meaning what was
+   read may be torn and has to be read again. */
+inline bool
+ns_seq_lock_read_retry(NsSeqLock *lock, uint32_t sequence)
+{
+    // keeps the reads of the data from drifting past the second read of the sequence
+    ns_atomic_fence_acquire();
+    bool result = (ns_atomic_load_relaxed(&lock->sequence) != sequence);
+    return result;
+}
+
+/* Writers exclude each other, so there can be more than one; they spin though, so writes
+   should be short and rare. */
+inline void
+ns_seq_lock_write_begin(NsSeqLock *lock)
+{
+    uint32_t sequence = ns_atomic_load_relaxed(&lock->sequence);
+    while((sequence & 1) ||
+          !ns_atomic_compare_exchange(&lock->sequence, &sequence, sequence + 1))
+    {
+        ns_atomic_pause();
+        sequence = ns_atomic_load_relaxed(&lock->sequence);
+    }
+
+    // keeps the writes to the data from being seen before the sequence goes odd
+    ns_atomic_fence_release();
+}
+
+inline void
+ns_seq_lock_write_end(NsSeqLock *lock)
+{
+    ns_atomic_store(&lock->sequence, lock->sequence + 1);
+}
+
+/* Copies a consistent snapshot of *src into *dest. */
+template <typename type>
+void
+ns_seq_lock_read(NsSeqLock *lock, type *dest, type *src)
+{
+    uint32_t sequence;
+    do
+    {
+        sequence = ns_seq_lock_read_begin(lock);
+        ns_seq_lock_copy(dest, src);
+    } while(ns_seq_lock_read_retry(lock, sequence));
+}
+
+template <typename type>
+void
+ns_seq_lock_write(NsSeqLock *lock, type *dest, type *src)
+{
+    ns_seq_lock_write_begin(lock);
+    ns_seq_lock_copy(dest, src);
+    ns_seq_lock_write_end(lock);
+}
+
+#endif
@@ -2,217 +2,518 @@
 #define NS_SHA1_H
 
 #include "ns_util.h"
+#include "ns_base64.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define NS_SHA1_X86
+    #include <immintrin.h>
+#endif
 
 
-/* From pseudo code on Wikipedia. Returns sha1 hash as a base64 string (28 bytes). */
-int ns_sha1(char *string, char *dest)
+#define NS_SHA1_DIGEST_SIZE 20
+#define NS_SHA1_BLOCK_SIZE 64
+
+enum NsSha1Implementation
 {
-    if(strlen(string) > 1024)
-    {
-        return NS_ERROR;
+    NS_SHA1_BEST, // pick the fastest the cpu supports
+    NS_SHA1_SCALAR,
+    NS_SHA1_SSSE3, // vectorized message schedule, scalar rounds
+    NS_SHA1_SHANI,
+};
+
+/* Streaming context: ns_sha1_init(), then ns_sha1_update() as many times as you like,
+   then ns_sha1_final(). */
+struct NsSha1
+{
+    uint32_t state[5];
+    uint8_t block[NS_SHA1_BLOCK_SIZE];
+    uint32_t block_length;
+    uint64_t total_length;
+
+    void (*process_blocks)(uint32_t *state, const uint8_t *data, uint64_t num_blocks);
+};
+
+
+/* Internal */
+
+internal const uint32_t ns_sha1_round_constants[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+inline internal uint32_t
+ns_sha1_get32be(const uint8_t *src)
+{
+    uint32_t result = (((uint32_t)src[0] << 24) |
+                       ((uint32_t)src[1] << 16) |
+                       ((uint32_t)src[2] <<  8) |
+                       ((uint32_t)src[3] <<  0));
+    return result;
+}
+
+/* The 80 rounds, given the expanded message schedule with the round constants already
+   added in. */
+inline internal void
+ns_sha1_do_rounds(uint32_t *state, const uint32_t *wk)
+{
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+
+#define NS_SHA1_ROUND(f, j) \
+    { \
+        uint32_t temp = (ns_left_rotate(a, 5) + (f) + e + wk[j]); \
+        e = d; \
+        d = c; \
+        c = ns_left_rotate(b, 30); \
+        b = a; \
+        a = temp; \
     }
 
-    char message[1024];
-    strcpy(message, string);
+    // one loop per round function so there's no branching inside them
+    for(int j = 0; j < 20; j++) NS_SHA1_ROUND((d ^ (b & (c ^ d))), j);
+    for(int j = 20; j < 40; j++) NS_SHA1_ROUND((b ^ c ^ d), j);
+    for(int j = 40; j < 60; j++) NS_SHA1_ROUND(((b & c) | (d & (b | c))), j);
+    for(int j = 60; j < 80; j++) NS_SHA1_ROUND((b ^ c ^ d), j);
 
-    uint32_t message_length = strlen(message);
-    const uint64_t ml = 8*message_length; // message length in bits
+#undef NS_SHA1_ROUND
 
-    // magic variables
-    uint32_t h0 = 0x67452301;
-    uint32_t h1 = 0xEFCDAB89;
-    uint32_t h2 = 0x98BADCFE;
-    uint32_t h3 = 0x10325476;
-    uint32_t h4 = 0xC3D2E1F0;
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
 
-    // pre processing:
+/* From pseudo code on Wikipedia. */
+internal void
+ns_sha1_process_blocks_scalar(uint32_t *state, const uint8_t *data, uint64_t num_blocks)
+{
+    for(uint64_t i = 0; i < num_blocks; i++, data += NS_SHA1_BLOCK_SIZE)
     {
-        // append 0x80 to message
+        uint32_t w[80];
+        for(int j = 0; j < 16; j++)
         {
-            message[message_length++] = 0x80;
+            w[j] = ns_sha1_get32be(&data[4*j]);
         }
 
-        // append 0 bits until (ml % 512) == 448
+        for(int j = 16; j < 80; j++)
         {
-            // compute number of bits to append
-            int num_appends_bits;
-            {
-                // we add 8 since we added the 0x80
-                int mod = (ml + 8) & 511;
-                if(mod == 448)
-                {
-                    num_appends_bits = 0;
-                }
-                else if(mod < 448)
-                {
-                    num_appends_bits = 448 - mod;
-                }
-                else//if(mod > 448)
-                {
-                    num_appends_bits = (512 - mod) + 448;
-                }
-
-                Assert((num_appends_bits & 0x07) == 0);
-            }
-
-            // append 0 bytes
-            {
-                int num_appends = (num_appends_bits >> 3);
-                for(int i = 0; i < num_appends; i++)
-                {
-                    message[message_length++] = 0x00;
-                }
-            }
+            w[j] = ns_left_rotate((w[j - 3] ^ w[j - 8] ^ w[j - 14] ^ w[j - 16]), 1);
         }
 
-        // append message length
+        for(int j = 0; j < 80; j++)
         {
-            uint64_t mask = (((uint64_t)0xff) << 56);
-            for(int i = 0; i < 8; i++)
-            {
-                message[message_length++] = ((ml & mask) >> (56 - 8*i));
-                mask >>= 8;
-            }
+            w[j] += ns_sha1_round_constants[j / 20];
         }
+
+        ns_sha1_do_rounds(state, w);
     }
+}
+
+#if defined(NS_SHA1_X86)
+inline internal __attribute__((target("ssse3"))) __m128i
+ns_sha1_rotate_left1_sse(__m128i x)
+{
+    __m128i result = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+    return result;
+}
 
-    // process message in successive 512-bit chunks
-    uint32_t num_chunks = (message_length/64);
-    for(uint32_t i = 0; i < num_chunks; i++)
+/* Computes the message schedule four words at a time. w[i + 3] depends on w[i], so we
+   compute it without that term and patch it in afterwards; rotate distributes over xor. */
+internal __attribute__((target("ssse3"))) void
+ns_sha1_process_blocks_ssse3(uint32_t *state, const uint8_t *data, uint64_t num_blocks)
+{
+    const __m128i byte_swap_mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+    for(uint64_t i = 0; i < num_blocks; i++, data += NS_SHA1_BLOCK_SIZE)
     {
-        uint32_t w[80];
-        for(int j = 0; j < 16; j++)
+        alignas(16) uint32_t w[80];
+        alignas(16) uint32_t wk[80];
+
+        for(int j = 0; j < 16; j += 4)
         {
-            w[j] = ((message[64*i + 4*j + 0] << 24) |
-                    (message[64*i + 4*j + 1] << 16) |
-                    (message[64*i + 4*j + 2] <<  8) |
-                    (message[64*i + 4*j + 3] <<  0));
+            __m128i words = _mm_loadu_si128((const __m128i *)&data[4*j]);
+            words = _mm_shuffle_epi8(words, byte_swap_mask);
+            _mm_store_si128((__m128i *)&w[j], words);
+
+            __m128i k = _mm_set1_epi32(ns_sha1_round_constants[0]);
+            _mm_store_si128((__m128i *)&wk[j], _mm_add_epi32(words, k));
         }
 
-        for(uint32_t j = 16; j < ArrayCount(w); j++)
+        for(int j = 16; j < 80; j += 4)
         {
-            w[j] = (w[j - 3] ^ w[j - 8] ^ w[j - 14] ^ w[j - 16]);
-            w[j] = ns_left_rotate(w[j], 1);
-        }
+            // (w[j - 3], w[j - 2], w[j - 1], 0)
+            __m128i w3 = _mm_srli_si128(_mm_load_si128((const __m128i *)&w[j - 4]), 4);
+            __m128i w8 = _mm_loadu_si128((const __m128i *)&w[j - 8]);
+            __m128i w14 = _mm_loadu_si128((const __m128i *)&w[j - 14]);
+            __m128i w16 = _mm_load_si128((const __m128i *)&w[j - 16]);
 
-        // initialize hash value for this chunk:
-        uint32_t a = h0;
-        uint32_t b = h1;
-        uint32_t c = h2;
-        uint32_t d = h3;
-        uint32_t e = h4;
+            __m128i words = ns_sha1_rotate_left1_sse(_mm_xor_si128(_mm_xor_si128(w3, w8), _mm_xor_si128(w14, w16)));
 
-        uint32_t f;
-        uint32_t k;
+            // lane 3 still needs rotate(w[j]), which is lane 0 rotated once more
+            __m128i fixup = ns_sha1_rotate_left1_sse(_mm_slli_si128(words, 12));
+            words = _mm_xor_si128(words, fixup);
+            _mm_store_si128((__m128i *)&w[j], words);
 
-        // main loop:
-        for(uint32_t j = 0; j < ArrayCount(w); j++)
-        {
-            if(j < 20)
-            {
-                f = ((b & c) | ((~b) & d));
-                k = 0x5A827999;
-            }
-            else if(j < 40)
-            {
-                f = (b ^ c ^ d);
-                k = 0x6ED9EBA1;
-            }
-            else if(j < 60)
-            {
-                f = ((b & c) | (b & d) | (c & d));
-                k = 0x8F1BBCDC;
-            }
-            else if(j < 80)
-            {
-                f = (b ^ c ^ d);
-                k = 0xCA62C1D6;
-            }
-
-            int temp = (ns_left_rotate(a, 5) + f + e + k + w[j]);
-            e = d;
-            d = c;
-            c = ns_left_rotate(b, 30);
-            b = a;
-            a = temp;
+            __m128i k = _mm_set1_epi32(ns_sha1_round_constants[j / 20]);
+            _mm_store_si128((__m128i *)&wk[j], _mm_add_epi32(words, k));
         }
 
-        h0 += a;
-        h1 += b;
-        h2 += c;
-        h3 += d;
-        h4 += e;
+        ns_sha1_do_rounds(state, wk);
     }
+}
+
+/* Intel's SHA extensions. Four rounds per sha1rnds4; the message schedule is done with
+   sha1msg1/sha1msg2 as we go. */
+internal __attribute__((target("sha,sse4.1"))) void
+ns_sha1_process_blocks_shani(uint32_t *state, const uint8_t *data, uint64_t num_blocks)
+{
+    const __m128i byte_swap_mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_loadu_si128((const __m128i *)state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1;
+    __m128i msg0, msg1, msg2, msg3;
 
-    uint8_t final_hash[20];
+    for(uint64_t i = 0; i < num_blocks; i++, data += NS_SHA1_BLOCK_SIZE)
     {
-        final_hash[0]  = ((h0 & 0xff000000) >> 24);
-        final_hash[1]  = ((h0 & 0x00ff0000) >> 16);
-        final_hash[2]  = ((h0 & 0x0000ff00) >> 8 );
-        final_hash[3]  = ((h0 & 0x000000ff) >> 0 );
-
-        final_hash[4]  = ((h1 & 0xff000000) >> 24);
-        final_hash[5]  = ((h1 & 0x00ff0000) >> 16);
-        final_hash[6]  = ((h1 & 0x0000ff00) >> 8 );
-        final_hash[7]  = ((h1 & 0x000000ff) >> 0 );
-
-        final_hash[8]  = ((h2 & 0xff000000) >> 24);
-        final_hash[9]  = ((h2 & 0x00ff0000) >> 16);
-        final_hash[10] = ((h2 & 0x0000ff00) >> 8 );
-        final_hash[11] = ((h2 & 0x000000ff) >> 0 );
-
-        final_hash[12] = ((h3 & 0xff000000) >> 24);
-        final_hash[13] = ((h3 & 0x00ff0000) >> 16);
-        final_hash[14] = ((h3 & 0x0000ff00) >> 8 );
-        final_hash[15] = ((h3 & 0x000000ff) >> 0 );
-
-        final_hash[16] = ((h4 & 0xff000000) >> 24);
-        final_hash[17] = ((h4 & 0x00ff0000) >> 16);
-        final_hash[18] = ((h4 & 0x0000ff00) >> 8 );
-        final_hash[19] = ((h4 & 0x000000ff) >> 0 );
+        __m128i saved_abcd = abcd;
+        __m128i saved_e0 = e0;
+
+        // rounds 0-3
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), byte_swap_mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        // rounds 4-7
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), byte_swap_mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        // rounds 8-11
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), byte_swap_mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        // rounds 12-15
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), byte_swap_mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        // rounds 16-19
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        // rounds 20-23
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        // rounds 24-27
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        // rounds 28-31
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        // rounds 32-35
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        // rounds 36-39
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        // rounds 40-43
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        // rounds 44-47
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        // rounds 48-51
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        // rounds 52-55
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        // rounds 56-59
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        // rounds 60-63
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        // rounds 64-67
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        // rounds 68-71
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        // rounds 72-75
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        // rounds 76-79
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, saved_e0);
+        abcd = _mm_add_epi32(abcd, saved_abcd);
     }
 
-    // convert to base64
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+/* API */
+
+bool
+ns_sha1_check_supported(NsSha1Implementation implementation)
+{
+    switch(implementation)
     {
-        int i, dest_idx;
-        for(i = 0, dest_idx = 0; i < 18; i += 3, dest_idx += 4)
+        case NS_SHA1_BEST:
+        case NS_SHA1_SCALAR:
         {
-            uint32_t three_set = ((final_hash[i + 0] << 16) | 
-                                  (final_hash[i + 1] <<  8) | 
-                                  (final_hash[i + 2] <<  0));
-
-            uint8_t first =  ((three_set >> 18) & 0x3f);
-            uint8_t second = ((three_set >> 12) & 0x3f);
-            uint8_t third =  ((three_set >>  6) & 0x3f);
-            uint8_t fourth = ((three_set >>  0) & 0x3f);
-
-            dest[dest_idx + 0] = ns_to_base64(first);
-            dest[dest_idx + 1] = ns_to_base64(second);
-            dest[dest_idx + 2] = ns_to_base64(third);
-            dest[dest_idx + 3] = ns_to_base64(fourth);
-        }
+            return true;
+        } break;
 
-        Assert(i == 18);
+#if defined(NS_SHA1_X86)
+        case NS_SHA1_SSSE3:
+        {
+            return __builtin_cpu_supports("ssse3");
+        } break;
 
-        // handle remainder
+        case NS_SHA1_SHANI:
         {
-            uint32_t three_set = ((final_hash[i + 0] << 16) | 
-                                  (final_hash[i + 1] <<  8));
+            return (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"));
+        } break;
+#endif
 
-            uint8_t first =  ((three_set >> 18) & 0x3f);
-            uint8_t second = ((three_set >> 12) & 0x3f);
-            uint8_t third =  ((three_set >>  6) & 0x3f);
+        default:
+        {
+            return false;
+        } break;
+    }
+}
 
-            dest[dest_idx + 0] = ns_to_base64(first);
-            dest[dest_idx + 1] = ns_to_base64(second);
-            dest[dest_idx + 2] = ns_to_base64(third);
-            dest[dest_idx + 3] = '=';
+int
+ns_sha1_init(NsSha1 *sha1, NsSha1Implementation implementation = NS_SHA1_BEST)
+{
+    if(!ns_sha1_check_supported(implementation))
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    // magic variables
+    sha1->state[0] = 0x67452301;
+    sha1->state[1] = 0xEFCDAB89;
+    sha1->state[2] = 0x98BADCFE;
+    sha1->state[3] = 0x10325476;
+    sha1->state[4] = 0xC3D2E1F0;
+    sha1->block_length = 0;
+    sha1->total_length = 0;
+
+    sha1->process_blocks = ns_sha1_process_blocks_scalar;
+#if defined(NS_SHA1_X86)
+    if(implementation == NS_SHA1_SHANI ||
+       (implementation == NS_SHA1_BEST && ns_sha1_check_supported(NS_SHA1_SHANI)))
+    {
+        sha1->process_blocks = ns_sha1_process_blocks_shani;
+    }
+    else if(implementation == NS_SHA1_SSSE3 ||
+            (implementation == NS_SHA1_BEST && ns_sha1_check_supported(NS_SHA1_SSSE3)))
+    {
+        sha1->process_blocks = ns_sha1_process_blocks_ssse3;
+    }
+#endif
+
+    return NS_SUCCESS;
+}
+
+void
+ns_sha1_update(NsSha1 *sha1, const void *data, uint64_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    sha1->total_length += length;
+
+    // top off the partial block first
+    if(sha1->block_length > 0)
+    {
+        uint32_t bytes_to_copy = (NS_SHA1_BLOCK_SIZE - sha1->block_length);
+        if(length < bytes_to_copy)
+        {
+            bytes_to_copy = (uint32_t)length;
+        }
+        memcpy(&sha1->block[sha1->block_length], bytes, bytes_to_copy);
+        sha1->block_length += bytes_to_copy;
+        bytes += bytes_to_copy;
+        length -= bytes_to_copy;
+
+        if(sha1->block_length < NS_SHA1_BLOCK_SIZE)
+        {
+            return;
         }
 
-        // null terminate
-        dest[dest_idx + 4] = 0;
+        sha1->process_blocks(sha1->state, sha1->block, 1);
+        sha1->block_length = 0;
+    }
+
+    // whole blocks straight from the caller's buffer
+    uint64_t num_blocks = (length / NS_SHA1_BLOCK_SIZE);
+    if(num_blocks > 0)
+    {
+        sha1->process_blocks(sha1->state, bytes, num_blocks);
+        bytes += (num_blocks*NS_SHA1_BLOCK_SIZE);
+        length -= (num_blocks*NS_SHA1_BLOCK_SIZE);
     }
 
+    memcpy(sha1->block, bytes, length);
+    sha1->block_length = (uint32_t)length;
+}
+
+void
+ns_sha1_final(NsSha1 *sha1, uint8_t *digest)
+{
+    const uint64_t ml = (8*sha1->total_length); // message length in bits
+
+    // append 0x80, then 0 bytes until there's exactly room for the length
+    uint8_t padding[2*NS_SHA1_BLOCK_SIZE] = { 0x80 };
+    uint32_t padding_length = ((sha1->block_length < 56) ? (56 - sha1->block_length) : (120 - sha1->block_length));
+    ns_put64be(&padding[padding_length], ml);
+    padding_length += 8;
+
+    // don't count the padding towards the length
+    ns_sha1_update(sha1, padding, padding_length);
+
+    for(int i = 0; i < 5; i++)
+    {
+        digest[4*i + 0] = (uint8_t)(sha1->state[i] >> 24);
+        digest[4*i + 1] = (uint8_t)(sha1->state[i] >> 16);
+        digest[4*i + 2] = (uint8_t)(sha1->state[i] >>  8);
+        digest[4*i + 3] = (uint8_t)(sha1->state[i] >>  0);
+    }
+}
+
+/* One shot. */
+int
+ns_sha1(const void *data, uint64_t length, uint8_t *digest)
+{
+    int status;
+
+    NsSha1 sha1;
+    status = ns_sha1_init(&sha1);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_sha1_update(&sha1, data, length);
+    ns_sha1_final(&sha1, digest);
+
+    return NS_SUCCESS;
+}
+
+/* Returns sha1 hash as a base64 string (28 bytes). */
+int
+ns_sha1(char *string, char *dest)
+{
+    int status;
+
+    uint8_t final_hash[NS_SHA1_DIGEST_SIZE];
+    status = ns_sha1(string, strlen(string), final_hash);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    uint64_t dest_length = ns_base64_encode(final_hash, sizeof(final_hash), dest);
+    Assert(dest_length == 28);
+
+    // null terminate
+    dest[dest_length] = 0;
+
     return NS_SUCCESS;
 }
 
@@ -0,0 +1,489 @@
+#ifndef NS_SHARED_MESSAGE_QUEUE_H
+#define NS_SHARED_MESSAGE_QUEUE_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_futex.h"
+#include "ns_math.h"
+
+#include <string.h>
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <unistd.h>
+    #include <signal.h>
+    #include <poll.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+
+/* An NsMessageQueue for one writer process and one reader process, in shared memory, so a
+   message costs a copy in and a copy out and no syscalls while both sides keep up. Only a
+   side that runs out (of messages, or of room) goes to sleep on a futex, and the other only
+   makes the wake syscall when it knows someone's asleep.
+
+       // parent
+       ns_shared_message_queue_create(&queue, Kilobytes(64));
+       if(fork() == 0)
+       {
+           ns_shared_message_queue_attach(&queue, NS_SHARED_MESSAGE_QUEUE_READER);
+           while(ns_shared_message_queue_get(&queue, buffer, sizeof(buffer)) >= 0) ...
+       }
+       ns_shared_message_queue_attach(&queue, NS_SHARED_MESSAGE_QUEUE_WRITER);
+       ns_shared_message_queue_add(&queue, message, message_size);
+
+   A process that didn't fork from the creator can map it from the fd with
+   ns_shared_message_queue_open(), e.g. one started with ns_fork_worker_exec().
+
+   A message only becomes visible once it's all there, so a writer that crashes halfway
+   through one leaves nothing torn behind. A side waiting on a peer that's died gets
+   NS_SHARED_MESSAGE_QUEUE_PEER_DIED instead of waiting forever. */
+
+#define NS_SHARED_MESSAGE_QUEUE_WOULD_BLOCK -4 // empty, or full, and we were told not to wait
+#define NS_SHARED_MESSAGE_QUEUE_PEER_DIED -5
+#define NS_SHARED_MESSAGE_QUEUE_CLOSED -6 // the writer closed it and everything's been read
+
+/* How often a side that's asleep waiting on its peer checks the peer's still alive. */
+#if !defined(NS_SHARED_MESSAGE_QUEUE_PEER_CHECK_MILLIS)
+    #define NS_SHARED_MESSAGE_QUEUE_PEER_CHECK_MILLIS 100
+#endif
+
+#define NS_SHARED_MESSAGE_QUEUE_MAGIC 0x5153534e // "NSSQ"
+
+
+enum NsSharedMessageQueueEnd
+{
+    NS_SHARED_MESSAGE_QUEUE_WRITER,
+    NS_SHARED_MESSAGE_QUEUE_READER,
+};
+
+/* At the start of the shared memory, followed by the ring. head and tail only ever go up;
+   the ring's a power of two, so they're masked to index it. */
+struct NsSharedMessageQueueHeader
+{
+    uint32_t magic;
+    uint32_t size;
+
+    alignas(NS_CACHE_LINE_SIZE) uint64_t tail; // written by the writer
+    int writer_pid;
+    uint32_t is_closed;
+    uint32_t num_added; // the reader sleeps on this
+    uint32_t is_reader_waiting;
+
+    alignas(NS_CACHE_LINE_SIZE) uint64_t head; // written by the reader
+    int reader_pid;
+    uint32_t num_removed; // the writer sleeps on this
+    uint32_t is_writer_waiting;
+};
+
+/* This process's handle on it. */
+struct NsSharedMessageQueue
+{
+    int fd;
+    uint32_t size;
+    NsSharedMessageQueueHeader *header;
+    uint8_t *buffer;
+
+    NsSharedMessageQueueEnd end;
+    int peer_pidfd; // -1 until we've seen the peer
+};
+
+
+/* Internal */
+
+internal uint64_t
+ns_shared_message_queue_get_mapping_size(uint32_t size)
+{
+    uint64_t result = sizeof(NsSharedMessageQueueHeader) + size;
+    return result;
+}
+
+internal int
+ns_shared_message_queue_map(NsSharedMessageQueue *queue, int fd, uint32_t size)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    void *memory = mmap(NULL, ns_shared_message_queue_get_mapping_size(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(memory == MAP_FAILED)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    queue->fd = fd;
+    queue->size = size;
+    queue->header = (NsSharedMessageQueueHeader *)memory;
+    queue->buffer = (uint8_t *)memory + sizeof(NsSharedMessageQueueHeader);
+    queue->peer_pidfd = -1;
+#endif
+    return NS_SUCCESS;
+}
+
+/* Records go in at 8 byte boundaries, so a record's size never wraps. */
+internal uint64_t
+ns_shared_message_queue_get_record_size(uint32_t message_size)
+{
+    uint64_t result = (sizeof(uint32_t) + message_size + 7) & ~(uint64_t)7;
+    return result;
+}
+
+internal void
+ns_shared_message_queue_copy_in(NsSharedMessageQueue *queue, uint64_t position, uint8_t *src, uint32_t size)
+{
+    uint32_t offset = (uint32_t)(position & (queue->size - 1));
+    uint32_t first_size = ns_math_min(size, queue->size - offset);
+    memcpy(queue->buffer + offset, src, first_size);
+    memcpy(queue->buffer, src + first_size, size - first_size);
+}
+
+internal void
+ns_shared_message_queue_copy_out(NsSharedMessageQueue *queue, uint64_t position, uint8_t *dest, uint32_t size)
+{
+    uint32_t offset = (uint32_t)(position & (queue->size - 1));
+    uint32_t first_size = ns_math_min(size, queue->size - offset);
+    memcpy(dest, queue->buffer + offset, first_size);
+    memcpy(dest + first_size, queue->buffer, size - first_size);
+}
+
+/* A peer that hasn't attached yet counts as alive. Goes by a pidfd rather than kill(pid, 0),
+   since a crashed child we haven't reaped yet still has a pid. */
+internal bool
+ns_shared_message_queue_check_peer_alive(NsSharedMessageQueue *queue)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(queue->peer_pidfd == -1)
+    {
+        int *peer_pid_ptr = (queue->end == NS_SHARED_MESSAGE_QUEUE_WRITER) ? &queue->header->reader_pid : &queue->header->writer_pid;
+        int peer_pid = ns_atomic_load(peer_pid_ptr);
+        if(peer_pid == 0)
+        {
+            return true;
+        }
+
+        queue->peer_pidfd = (int)syscall(SYS_pidfd_open, peer_pid, 0);
+        if(queue->peer_pidfd == -1)
+        {
+            // already reaped and gone, or a kernel without pidfds
+            return (kill(peer_pid, 0) == 0 || errno != ESRCH);
+        }
+    }
+
+    // readable once the process has exited
+    pollfd pidfd_pollfd = {};
+    pidfd_pollfd.fd = queue->peer_pidfd;
+    pidfd_pollfd.events = POLLIN;
+    int num_ready = poll(&pidfd_pollfd, 1, 0);
+    if(num_ready == 1)
+    {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/* Waits for *counter to move on from expected, which the peer does after it sets the
+   flag we care about. is_waiting is set first, so the peer knows to wake us. */
+internal int
+ns_shared_message_queue_wait(NsSharedMessageQueue *queue, uint32_t *counter, uint32_t expected, uint32_t *is_waiting)
+{
+    int status;
+
+    ns_atomic_store(is_waiting, (uint32_t)1);
+    ns_atomic_fence();
+
+    status = ns_futex_wait_shared(counter, expected, NS_SHARED_MESSAGE_QUEUE_PEER_CHECK_MILLIS);
+    if(status == NS_TIMED_OUT && !ns_shared_message_queue_check_peer_alive(queue))
+    {
+        return NS_SHARED_MESSAGE_QUEUE_PEER_DIED;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* After moving our end on. Costs a fence, and a syscall only if the peer's asleep. */
+internal void
+ns_shared_message_queue_wake(uint32_t *counter, uint32_t *is_waiting)
+{
+    ns_atomic_fetch_add(counter, (uint32_t)1);
+    ns_atomic_fence();
+    if(ns_atomic_load_relaxed(is_waiting) && ns_atomic_exchange(is_waiting, (uint32_t)0))
+    {
+        ns_futex_wake_shared(counter, 1);
+    }
+}
+
+/* API */
+
+/* size is rounded up to a power of two, and the biggest message is a bit under it. */
+int
+ns_shared_message_queue_create(NsSharedMessageQueue *queue, uint32_t size = Kilobytes(64))
+{
+    int status;
+
+    uint32_t rounded_size = 64;
+    while(rounded_size < size)
+    {
+        rounded_size *= 2;
+    }
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    // not close-on-exec, so it can be handed on
+    int fd = memfd_create("ns_shared_message_queue", 0);
+    if(fd == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    if(ftruncate(fd, ns_shared_message_queue_get_mapping_size(rounded_size)) == -1)
+    {
+        DebugPrintOsInfo();
+        close(fd);
+        return NS_ERROR;
+    }
+
+    status = ns_shared_message_queue_map(queue, fd, rounded_size);
+    if(status != NS_SUCCESS)
+    {
+        close(fd);
+        DebugPrintInfo();
+        return status;
+    }
+#endif
+
+    // memfd pages come zeroed, so that's everything else
+    queue->header->size = rounded_size;
+    ns_atomic_store(&queue->header->magic, (uint32_t)NS_SHARED_MESSAGE_QUEUE_MAGIC);
+
+    return NS_SUCCESS;
+}
+
+/* Maps a queue someone else created, from its fd. */
+int
+ns_shared_message_queue_open(NsSharedMessageQueue *queue, int fd)
+{
+    int status;
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    NsSharedMessageQueueHeader header;
+    if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != NS_SHARED_MESSAGE_QUEUE_MAGIC)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    status = ns_shared_message_queue_map(queue, fd, header.size);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+#endif
+
+    return NS_SUCCESS;
+}
+
+/* Says which end we are, so the other end can tell if we die. Each end is attached by one
+   process, once. */
+int
+ns_shared_message_queue_attach(NsSharedMessageQueue *queue, NsSharedMessageQueueEnd end)
+{
+    queue->end = end;
+    queue->peer_pidfd = -1;
+
+    int *pid_ptr = (end == NS_SHARED_MESSAGE_QUEUE_WRITER) ? &queue->header->writer_pid : &queue->header->reader_pid;
+    int expected_pid = 0;
+    if(!ns_atomic_compare_exchange(pid_ptr, &expected_pid, (int)getpid()))
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Unmaps it in this process. The memory goes once every process has, and closed the fd. */
+int
+ns_shared_message_queue_destroy(NsSharedMessageQueue *queue)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    if(queue->peer_pidfd != -1)
+    {
+        close(queue->peer_pidfd);
+    }
+
+    munmap(queue->header, ns_shared_message_queue_get_mapping_size(queue->size));
+    if(close(queue->fd) == -1)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* Writer only. The reader gets what's left, then NS_SHARED_MESSAGE_QUEUE_CLOSED. */
+void
+ns_shared_message_queue_close(NsSharedMessageQueue *queue)
+{
+    NsSharedMessageQueueHeader *header = queue->header;
+    ns_atomic_store(&header->is_closed, (uint32_t)1);
+    ns_shared_message_queue_wake(&header->num_added, &header->is_reader_waiting);
+}
+
+/* Writer only. Returns message_size, NS_SHARED_MESSAGE_QUEUE_WOULD_BLOCK if it's full and
+   we're not blocking, or NS_SHARED_MESSAGE_QUEUE_PEER_DIED. */
+int
+ns_shared_message_queue_add(NsSharedMessageQueue *queue, uint8_t *message, uint32_t message_size,
+                            bool is_blocking = true)
+{
+    int status;
+
+    NsSharedMessageQueueHeader *header = queue->header;
+    uint64_t record_size = ns_shared_message_queue_get_record_size(message_size);
+    if(record_size > queue->size)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    // we're the only one moving the tail
+    uint64_t tail = ns_atomic_load_relaxed(&header->tail);
+    int32_t num_spins = 0;
+    while(1)
+    {
+        uint32_t num_removed = ns_atomic_load(&header->num_removed);
+        uint64_t head = ns_atomic_load(&header->head);
+        if(tail + record_size - head <= queue->size)
+        {
+            break;
+        }
+
+        if(!is_blocking)
+        {
+            return NS_SHARED_MESSAGE_QUEUE_WOULD_BLOCK;
+        }
+
+        if(num_spins < ns_futex_get_max_spins())
+        {
+            num_spins++;
+            ns_atomic_pause();
+            continue;
+        }
+
+        status = ns_shared_message_queue_wait(queue, &header->num_removed, num_removed, &header->is_writer_waiting);
+        if(status == NS_SHARED_MESSAGE_QUEUE_PEER_DIED && ns_atomic_load(&header->head) != head)
+        {
+            continue;
+        }
+        if(status != NS_SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    ns_shared_message_queue_copy_in(queue, tail, (uint8_t *)&message_size, sizeof(uint32_t));
+    ns_shared_message_queue_copy_in(queue, tail + sizeof(uint32_t), message, message_size);
+
+    // only now can the reader see it
+    ns_atomic_store(&header->tail, tail + record_size);
+    ns_shared_message_queue_wake(&header->num_added, &header->is_reader_waiting);
+
+    return message_size;
+}
+
+int
+ns_shared_message_queue_add(NsSharedMessageQueue *queue, char *message, uint32_t message_size,
+                            bool is_blocking = true)
+{
+    int result = ns_shared_message_queue_add(queue, (uint8_t *)message, message_size, is_blocking);
+    return result;
+}
+
+/* Reader only. Returns the message's size, NS_SHARED_MESSAGE_QUEUE_WOULD_BLOCK if there's
+   nothing and we're not blocking, NS_SHARED_MESSAGE_QUEUE_CLOSED, or
+   NS_SHARED_MESSAGE_QUEUE_PEER_DIED once everything the writer got in before it died has
+   been read. A message bigger than dest_size is left where it is, and we return NS_ERROR. */
+int
+ns_shared_message_queue_get(NsSharedMessageQueue *queue, uint8_t *dest, uint32_t dest_size,
+                            bool is_blocking = true)
+{
+    int status;
+
+    NsSharedMessageQueueHeader *header = queue->header;
+
+    // we're the only one moving the head
+    uint64_t head = ns_atomic_load_relaxed(&header->head);
+    int32_t num_spins = 0;
+    while(1)
+    {
+        uint32_t num_added = ns_atomic_load(&header->num_added);
+        uint64_t tail = ns_atomic_load(&header->tail);
+        if(tail != head)
+        {
+            break;
+        }
+
+        if(ns_atomic_load(&header->is_closed))
+        {
+            // a message could have gone in just before the close
+            if(ns_atomic_load(&header->tail) != head)
+            {
+                continue;
+            }
+            return NS_SHARED_MESSAGE_QUEUE_CLOSED;
+        }
+
+        if(!is_blocking)
+        {
+            return NS_SHARED_MESSAGE_QUEUE_WOULD_BLOCK;
+        }
+
+        if(num_spins < ns_futex_get_max_spins())
+        {
+            num_spins++;
+            ns_atomic_pause();
+            continue;
+        }
+
+        status = ns_shared_message_queue_wait(queue, &header->num_added, num_added, &header->is_reader_waiting);
+        if(status == NS_SHARED_MESSAGE_QUEUE_PEER_DIED && ns_atomic_load(&header->tail) != head)
+        {
+            // it got some last ones in before it went
+            continue;
+        }
+        if(status != NS_SUCCESS)
+        {
+            return status;
+        }
+    }
+
+    uint32_t message_size;
+    ns_shared_message_queue_copy_out(queue, head, (uint8_t *)&message_size, sizeof(uint32_t));
+    if(message_size > dest_size)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+    ns_shared_message_queue_copy_out(queue, head + sizeof(uint32_t), dest, message_size);
+
+    ns_atomic_store(&header->head, head + ns_shared_message_queue_get_record_size(message_size));
+    ns_shared_message_queue_wake(&header->num_removed, &header->is_writer_waiting);
+
+    return message_size;
+}
+
+int
+ns_shared_message_queue_get(NsSharedMessageQueue *queue, char *dest, uint32_t dest_size,
+                            bool is_blocking = true)
+{
+    int result = ns_shared_message_queue_get(queue, (uint8_t *)dest, dest_size, is_blocking);
+    return result;
+}
+
+#endif
@@ -7,6 +7,7 @@ TODO: change 'peer' to 'peer'
 
 #include "ns_common.h"
 #include "ns_pollfd.h"
+#include "ns_log.h"
 
 #if defined(WINDOWS)
     #include <winsock2.h>
@@ -22,6 +23,8 @@ TODO: change 'peer' to 'peer'
     #include <netdb.h>
     #include <arpa/inet.h>
     #include <sys/ioctl.h>
+    #include <fcntl.h>
+    #include <netinet/tcp.h>
 #endif
 
 #include <string.h>
@@ -43,6 +46,7 @@ TODO: change 'peer' to 'peer'
 
     // send()
     #define NS_SOCKET_SEND_MSG_NOSIGNAL MSG_NOSIGNAL 
+    #define NS_SOCKET_SEND_MSG_DONTWAIT MSG_DONTWAIT
 
     // shutdown()
     #define NS_SOCKET_SHUT_RDWR SHUT_RDWR
@@ -55,6 +59,8 @@ TODO: change 'peer' to 'peer'
 
 #define NS_SOCKET_CONNECTION_CLOSED -2
 #define NS_SOCKET_BAD_FD -3
+#define NS_SOCKET_WOULD_BLOCK -4 // only from non-blocking sockets
+#define NS_SOCKET_CONNECTION_REFUSED -5
 
 
 struct NsSocket
@@ -185,7 +191,7 @@ ns_socket_get_bytes_available(NsSocket *socket)
     if(status == -1)
     {
         DebugSocketPrintInfo();
-        printf("    internal socket: %d\n", socket->internal_socket);
+        LogError("    internal socket: %d", socket->internal_socket);
 
         if(errno == EBADF)
         {
@@ -257,6 +263,11 @@ ns_socket_accept(NsSocket *ns_socket, NsSocket *peer_socket, uint32_t timeout_mi
     NsInternalSocket internal_peer_socket = accept(internal_socket, (sockaddr *)&their_addr, &sin_size);
     if(internal_peer_socket == NS_INVALID_SOCKET)
     {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return NS_SOCKET_WOULD_BLOCK;
+        }
+
         DebugSocketPrintInfo();
         return NS_ERROR;
     }
@@ -265,7 +276,7 @@ ns_socket_accept(NsSocket *ns_socket, NsSocket *peer_socket, uint32_t timeout_mi
     {
         char s[INET6_ADDRSTRLEN];
         inet_ntop(their_addr.ss_family, ns_get_in_addr((sockaddr *)&their_addr), s, sizeof(s));
-        printf("%s: got connection from %s\n", name, s);
+        LogInfo("%s: got connection from %s", name, s);
     }
 
     peer_socket->internal_socket = internal_peer_socket;
@@ -273,10 +284,65 @@ ns_socket_accept(NsSocket *ns_socket, NsSocket *peer_socket, uint32_t timeout_mi
     return NS_SUCCESS;
 }
 
+/* Returns NS_SOCKET_CONNECTION_REFUSED if nothing's listening yet, so callers can retry. */
+int
+ns_socket_connect(NsSocket *ns_socket, const char *host, const char *port)
+{
+    int status;
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *servinfo;
+    status = getaddrinfo(host, port, &hints, &servinfo);
+	if(status != 0)
+    {
+        DebugSocketPrintInfo();
+		return NS_ERROR;
+	}
+
+    NsInternalSocket internal_socket = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if(internal_socket == NS_INVALID_SOCKET)
+    {
+        DebugSocketPrintInfo();
+        freeaddrinfo(servinfo);
+        return NS_ERROR;
+    }
+
+    status = connect(internal_socket, servinfo->ai_addr, servinfo->ai_addrlen);
+	freeaddrinfo(servinfo);
+    if(status == NS_SOCKET_ERROR)
+    {
+        bool is_refused = (errno == ECONNREFUSED);
+        if(!is_refused)
+        {
+            DebugSocketPrintInfo();
+        }
+        close(internal_socket);
+        return is_refused ? NS_SOCKET_CONNECTION_REFUSED : NS_ERROR;
+    }
+
+    ns_socket->internal_socket = internal_socket;
+    ns_socket->completion_callback = NULL;
+    ns_socket->extra_data_void_ptr = NULL;
+
+    return NS_SUCCESS;
+}
+
+/* With is_blocking false, returns NS_SOCKET_WOULD_BLOCK rather than waiting for room, even
+   on a blocking socket. */
 int 
-ns_socket_send(NsSocket *socket, char *buffer, uint32_t buffer_size)
+ns_socket_send(NsSocket *socket, char *buffer, uint32_t buffer_size, bool is_blocking = true)
 {
-    int bytes_sent = send(socket->internal_socket, buffer, buffer_size, NS_SOCKET_SEND_MSG_NOSIGNAL);
+    int flags = NS_SOCKET_SEND_MSG_NOSIGNAL;
+    if(!is_blocking)
+    {
+        flags |= NS_SOCKET_SEND_MSG_DONTWAIT;
+    }
+
+    int bytes_sent = send(socket->internal_socket, buffer, buffer_size, flags);
     if(bytes_sent < 0)
     {
         if(errno == EPIPE || // EPIPE means the peer closed gracefully
@@ -285,19 +351,23 @@ ns_socket_send(NsSocket *socket, char *buffer, uint32_t buffer_size)
         {
             return NS_SOCKET_CONNECTION_CLOSED;
         }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return NS_SOCKET_WOULD_BLOCK;
+        }
         else
         {
             DebugSocketPrintInfo();
-            printf("    fd: %d\n", socket->internal_socket);
+            LogError("    fd: %d", socket->internal_socket);
         }
     }
     return bytes_sent;
 }
 
 int 
-ns_socket_send(NsSocket *socket, uint8_t *buffer, uint32_t buffer_size)
+ns_socket_send(NsSocket *socket, uint8_t *buffer, uint32_t buffer_size, bool is_blocking = true)
 {
-    int bytes_sent = ns_socket_send(socket, (char *)buffer, buffer_size);
+    int bytes_sent = ns_socket_send(socket, (char *)buffer, buffer_size, is_blocking);
     return bytes_sent;
 }
 
@@ -307,8 +377,13 @@ ns_socket_receive(NsSocket *socket, char *buffer, uint32_t buffer_size)
     int bytes_received = recv(socket->internal_socket, buffer, buffer_size, 0);
     if(bytes_received < 0)
     {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return NS_SOCKET_WOULD_BLOCK;
+        }
+
         DebugSocketPrintInfo();
-        printf("    fd: %d\n", socket->internal_socket);
+        LogError("    fd: %d", socket->internal_socket);
     }
     return bytes_received;
 }
@@ -320,6 +395,45 @@ ns_socket_receive(NsSocket *socket, uint8_t *buffer, uint32_t buffer_size)
     return bytes_received;
 }
 
+int
+ns_socket_set_blocking(NsSocket *socket, bool is_blocking)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    int flags = fcntl(socket->internal_socket, F_GETFL, 0);
+    if(flags == -1)
+    {
+        DebugSocketPrintInfo();
+        return NS_ERROR;
+    }
+
+    flags = is_blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    if(fcntl(socket->internal_socket, F_SETFL, flags) == -1)
+    {
+        DebugSocketPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* Turns off Nagle, so small writes go out immediately instead of waiting on the ack for
+   the last one (which the peer might be delaying). */
+int
+ns_socket_set_no_delay(NsSocket *socket, bool is_no_delay)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    int value = is_no_delay ? 1 : 0;
+    if(setsockopt(socket->internal_socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&value, sizeof(value)) == NS_SOCKET_ERROR)
+    {
+        DebugSocketPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
 int 
 ns_socket_shutdown(NsSocket *socket, int how)
 {
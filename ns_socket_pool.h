@@ -1,141 +1,387 @@
-#if 0
-TODO: use a free list
-#endif
-
 #ifndef NS_SOCKET_POOL_H
 #define NS_SOCKET_POOL_H
 
 #include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_math.h"
+#include "ns_index_stack.h"
 #include "ns_socket.h"
 #include "ns_memory.h"
 #include "ns_mutex.h"
+#include "ns_metrics.h"
+
+
+/* Sockets are mapped in chunks of this many, only when the pool runs dry. */
+#if !defined(NS_SOCKET_POOL_CHUNK_SIZE)
+    #define NS_SOCKET_POOL_CHUNK_SIZE 256
+#endif
+
+#if !defined(NS_SOCKET_POOL_MAX_CHUNKS)
+    #define NS_SOCKET_POOL_MAX_CHUNKS 4096
+#endif
+
+#define NS_SOCKET_POOL_MAX_CAPACITY (NS_SOCKET_POOL_CHUNK_SIZE*NS_SOCKET_POOL_MAX_CHUNKS)
+
+/* How many free sockets each thread keeps to itself. Gets and releases that hit the
+   thread's magazine don't touch any shared cache lines. */
+#if !defined(NS_SOCKET_POOL_MAGAZINE_SIZE)
+    #define NS_SOCKET_POOL_MAGAZINE_SIZE 16
+#endif
 
 
 struct NsSocketPoolSocket
 {
     NsSocket socket;
-    NsSocketPoolSocket *next;
-    NsSocketPoolSocket *prev;
+    uint32_t index;
+    uint32_t next_free; // index + 1, for the free stack
 };
 
+/* For programs that manage plain sockets themselves. The HTTP server keeps its connections
+   in an NsConnectionTable instead, which holds their buffers and timers as well. */
 struct NsSocketPool
 {
-    NsMutex mutex;
-    NsSocketPoolSocket *sp_sockets;
-    NsSocketPoolSocket *free_list_head;
+    // identifies the pool to the thread magazines; never reused, unlike the pool's address
+    uint64_t id;
+
+    NsSocketPoolSocket *chunks[NS_SOCKET_POOL_MAX_CHUNKS];
+    uint32_t num_chunks;
+    uint32_t max_capacity;
+
+    NsIndexStack free_stack;
+
+    // only taken to map a new chunk
+    NsMutex grow_mutex;
+
+    // sharded, so the magazine fast paths still don't share a cache line
+    NsMetricsGauge num_in_use;
+    NsMetricsGauge capacity_gauge;
 
     int offset_from_socket_to_pool_socket;
 };
 
+struct NsSocketPoolMagazine
+{
+    uint64_t pool_id;
+    uint32_t indices[NS_SOCKET_POOL_MAGAZINE_SIZE];
+    uint32_t num_indices;
+};
+
 
 /* Internal */
 
-/* API */
+internal uint64_t ns_socket_pool_next_id = 1;
+internal thread_local NsSocketPoolMagazine ns_socket_pool_magazine;
 
-int
-ns_socket_pool_create(NsSocketPool *socket_pool, int capacity)
+inline internal NsSocketPoolSocket *
+ns_socket_pool_get_pool_socket(NsSocketPool *socket_pool, uint32_t index)
 {
-    int status;
+    NsSocketPoolSocket *chunk = ns_atomic_load_relaxed(&socket_pool->chunks[index / NS_SOCKET_POOL_CHUNK_SIZE]);
+    NsSocketPoolSocket *result = &chunk[index % NS_SOCKET_POOL_CHUNK_SIZE];
+    return result;
+}
+
+internal void
+ns_socket_pool_push_free(NsSocketPool *socket_pool, uint32_t index)
+{
+    ns_index_stack_push(&socket_pool->free_stack, index, [socket_pool](uint32_t i) {
+        return &ns_socket_pool_get_pool_socket(socket_pool, i)->next_free;
+    });
+}
 
-    NsSocketPoolSocket *sp_sockets = (NsSocketPoolSocket *)ns_memory_allocate(sizeof(NsSocketPoolSocket)*capacity);
-    if(sp_sockets == NULL)
+internal bool
+ns_socket_pool_pop_free(NsSocketPool *socket_pool, uint32_t *index_ptr)
+{
+    bool result = ns_index_stack_pop(&socket_pool->free_stack, index_ptr, [socket_pool](uint32_t i) {
+        return &ns_socket_pool_get_pool_socket(socket_pool, i)->next_free;
+    });
+    return result;
+}
+
+/* A thread's magazine serves one pool at a time. Returns NULL if it's holding another
+   pool's sockets, in which case the caller goes straight to the shared free stack. */
+internal NsSocketPoolMagazine *
+ns_socket_pool_get_magazine(NsSocketPool *socket_pool)
+{
+    NsSocketPoolMagazine *magazine = &ns_socket_pool_magazine;
+    if(magazine->pool_id != socket_pool->id)
     {
-        DebugPrintInfo();
-        return NS_ERROR;
+        if(magazine->num_indices > 0)
+        {
+            // we can't give them back without the other pool's pointer
+            return NULL;
+        }
+
+        magazine->pool_id = socket_pool->id;
+        magazine->num_indices = 0;
     }
+    return magazine;
+}
 
-    socket_pool->sp_sockets = sp_sockets;
-    socket_pool->free_list_head = sp_sockets;
+/* Maps another chunk and puts its sockets on the free stack, except for one which is
+   handed straight back to the caller. The grow mutex must be held. */
+internal int
+ns_socket_pool_map_chunk(NsSocketPool *socket_pool, uint32_t *index_ptr)
+{
+    uint32_t chunk_idx = socket_pool->num_chunks;
+    uint32_t first_index = (chunk_idx*NS_SOCKET_POOL_CHUNK_SIZE);
+    if(chunk_idx >= NS_SOCKET_POOL_MAX_CHUNKS || first_index >= socket_pool->max_capacity)
+    {
+        return NS_ERROR;
+    }
 
-    status = ns_mutex_create(&socket_pool->mutex);
-    if(status != NS_SUCCESS)
+    NsSocketPoolSocket *chunk = (NsSocketPoolSocket *)ns_memory_map(sizeof(NsSocketPoolSocket)*NS_SOCKET_POOL_CHUNK_SIZE);
+    if(chunk == NULL)
     {
         DebugPrintInfo();
-        return status;
+        return NS_ERROR;
     }
 
-    // setup free list
-    for(int i = 0; i < (capacity - 1); i++)
+    uint32_t num_sockets = ns_math_min((uint32_t)NS_SOCKET_POOL_CHUNK_SIZE, socket_pool->max_capacity - first_index);
+    for(uint32_t i = 0; i < num_sockets; i++)
     {
-        sp_sockets[i].next = &sp_sockets[i + 1];
+        chunk[i].index = (first_index + i);
     }
 
-    NsSocketPoolSocket *sp_socket = &sp_sockets[0];
-    socket_pool->offset_from_socket_to_pool_socket = (int)((uint8_t *)sp_socket - (uint8_t *)&sp_socket->socket);
+    // publish the chunk before any of its indices can be seen on the free stack
+    ns_atomic_store(&socket_pool->chunks[chunk_idx], chunk);
+    ns_atomic_store(&socket_pool->num_chunks, chunk_idx + 1);
+
+    // pushed in reverse so low indices come out first
+    for(uint32_t i = (num_sockets - 1); i > 0; i--)
+    {
+        ns_socket_pool_push_free(socket_pool, first_index + i);
+    }
+    *index_ptr = first_index;
 
     return NS_SUCCESS;
 }
 
-int
-ns_socket_pool_destroy(NsSocketPool *socket_pool)
+internal int
+ns_socket_pool_grow(NsSocketPool *socket_pool, uint32_t *index_ptr)
 {
     int status;
 
-    ns_memory_free(socket_pool->sp_sockets);
+    status = ns_mutex_lock(&socket_pool->grow_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    // someone may have grown the pool, or released a socket, while we waited for the lock
+    int grow_status = NS_SUCCESS;
+    if(!ns_socket_pool_pop_free(socket_pool, index_ptr))
+    {
+        grow_status = ns_socket_pool_map_chunk(socket_pool, index_ptr);
+    }
 
-    status = ns_mutex_destroy(&socket_pool->mutex);
+    status = ns_mutex_unlock(&socket_pool->grow_mutex);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    return NS_SUCCESS;
+    return grow_status;
 }
 
+/* API */
+
+/* initial_capacity sockets are mapped up front; the pool grows a chunk at a time after
+   that, up to max_capacity. */
 int
-ns_socket_pool_get(NsSocketPool *socket_pool, NsSocket **socket_ptr)
+ns_socket_pool_create(NsSocketPool *socket_pool, uint32_t initial_capacity,
+                      uint32_t max_capacity = NS_SOCKET_POOL_MAX_CAPACITY)
 {
     int status;
 
-    NsSocketPoolSocket *free = socket_pool->free_list_head;
-    if(free == NULL)
+    if(max_capacity > NS_SOCKET_POOL_MAX_CAPACITY || initial_capacity > max_capacity)
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
 
-    status = ns_mutex_lock(&socket_pool->mutex);
+    socket_pool->id = ns_atomic_fetch_add(&ns_socket_pool_next_id, (uint64_t)1);
+    socket_pool->num_chunks = 0;
+    socket_pool->max_capacity = max_capacity;
+    ns_index_stack_create(&socket_pool->free_stack);
+    memset(&socket_pool->num_in_use, 0, sizeof(socket_pool->num_in_use));
+    memset(&socket_pool->capacity_gauge, 0, sizeof(socket_pool->capacity_gauge));
+
+    status = ns_mutex_create(&socket_pool->grow_mutex);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    // remove from free list
-    socket_pool->free_list_head = free->next;
+    NsSocketPoolSocket sp_socket;
+    socket_pool->offset_from_socket_to_pool_socket = (int)((uint8_t *)&sp_socket - (uint8_t *)&sp_socket.socket);
+
+    // nobody else can see the pool yet, so there's no need for the grow mutex
+    uint32_t num_initial_chunks = ((initial_capacity + NS_SOCKET_POOL_CHUNK_SIZE - 1) / NS_SOCKET_POOL_CHUNK_SIZE);
+    for(uint32_t i = 0; i < num_initial_chunks; i++)
+    {
+        uint32_t index;
+        status = ns_socket_pool_map_chunk(socket_pool, &index);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        ns_socket_pool_push_free(socket_pool, index);
+    }
+
+    return NS_SUCCESS;
+}
+
+/* No sockets may be in use. */
+int
+ns_socket_pool_destroy(NsSocketPool *socket_pool)
+{
+    int status;
+
+    for(uint32_t i = 0; i < socket_pool->num_chunks; i++)
+    {
+        ns_memory_unmap(socket_pool->chunks[i], sizeof(NsSocketPoolSocket)*NS_SOCKET_POOL_CHUNK_SIZE);
+        socket_pool->chunks[i] = NULL;
+    }
+    socket_pool->num_chunks = 0;
 
-    status = ns_mutex_unlock(&socket_pool->mutex);
+    status = ns_mutex_destroy(&socket_pool->grow_mutex);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    *socket_ptr = &free->socket;
+    return NS_SUCCESS;
+}
+
+/* Returns NS_ERROR only once the pool is at its max capacity. */
+int
+ns_socket_pool_get(NsSocketPool *socket_pool, NsSocket **socket_ptr)
+{
+    int status;
+
+    uint32_t index;
+    NsSocketPoolMagazine *magazine = ns_socket_pool_get_magazine(socket_pool);
+    if(magazine != NULL && magazine->num_indices > 0)
+    {
+        index = magazine->indices[--magazine->num_indices];
+    }
+    else if(!ns_socket_pool_pop_free(socket_pool, &index))
+    {
+        status = ns_socket_pool_grow(socket_pool, &index);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    *socket_ptr = &ns_socket_pool_get_pool_socket(socket_pool, index)->socket;
+    ns_metrics_gauge_add(&socket_pool->num_in_use, 1);
 
     return NS_SUCCESS;
 }
 
 int
 ns_socket_pool_release(NsSocketPool *socket_pool, NsSocket *socket)
+{
+    NsSocketPoolSocket *sp_socket = (NsSocketPoolSocket *)((uint8_t *)socket + socket_pool->offset_from_socket_to_pool_socket);
+    ns_metrics_gauge_add(&socket_pool->num_in_use, -1);
+
+    NsSocketPoolMagazine *magazine = ns_socket_pool_get_magazine(socket_pool);
+    if(magazine == NULL)
+    {
+        ns_socket_pool_push_free(socket_pool, sp_socket->index);
+        return NS_SUCCESS;
+    }
+
+    if(magazine->num_indices == NS_SOCKET_POOL_MAGAZINE_SIZE)
+    {
+        // full; hand half back so the next few gets and releases both stay local
+        while(magazine->num_indices > (NS_SOCKET_POOL_MAGAZINE_SIZE / 2))
+        {
+            ns_socket_pool_push_free(socket_pool, magazine->indices[--magazine->num_indices]);
+        }
+    }
+
+    magazine->indices[magazine->num_indices++] = sp_socket->index;
+
+    return NS_SUCCESS;
+}
+
+/* Returns the calling thread's cached sockets to the shared free stack. Threads that exit
+   before the pool is destroyed should call this first, or their cached sockets are lost. */
+void
+ns_socket_pool_flush_thread_cache(NsSocketPool *socket_pool)
+{
+    NsSocketPoolMagazine *magazine = &ns_socket_pool_magazine;
+    if(magazine->pool_id != socket_pool->id)
+    {
+        return;
+    }
+
+    while(magazine->num_indices > 0)
+    {
+        ns_socket_pool_push_free(socket_pool, magazine->indices[--magazine->num_indices]);
+    }
+}
+
+/* Stable for the life of the pool, and always less than its max capacity, so callers can
+   keep per-socket data in their own arrays. */
+int
+ns_socket_pool_get_index(NsSocketPool *socket_pool, NsSocket *socket)
+{
+    NsSocketPoolSocket *sp_socket = (NsSocketPoolSocket *)((uint8_t *)socket + socket_pool->offset_from_socket_to_pool_socket);
+    int index = (int)sp_socket->index;
+    return index;
+}
+
+uint32_t
+ns_socket_pool_get_capacity(NsSocketPool *socket_pool)
+{
+    uint32_t capacity = (ns_atomic_load(&socket_pool->num_chunks)*NS_SOCKET_POOL_CHUNK_SIZE);
+    uint32_t result = ns_math_min(capacity, socket_pool->max_capacity);
+    return result;
+}
+
+/* Sockets handed out and not yet released. */
+int64_t
+ns_socket_pool_get_num_in_use(NsSocketPool *socket_pool)
+{
+    int64_t result = ns_metrics_gauge_get(&socket_pool->num_in_use);
+    return result;
+}
+
+internal int64_t
+ns_socket_pool_get_capacity_callback(void *data)
+{
+    int64_t result = ns_socket_pool_get_capacity((NsSocketPool *)data);
+    return result;
+}
+
+/* Exports the pool's occupancy and capacity. labels (e.g. pool="http") tells pools apart
+   and must outlive the pool. */
+int
+ns_socket_pool_register_metrics(NsSocketPool *socket_pool, const char *labels = NULL)
 {
     int status;
 
-    status = ns_mutex_lock(&socket_pool->mutex);
+    status = ns_metrics_register_gauge(&socket_pool->num_in_use, "ns_socket_pool_sockets_in_use",
+                                       "Sockets handed out by the pool and not yet released.", labels);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    NsSocketPoolSocket *sp_socket = (NsSocketPoolSocket *)((uint8_t *)socket + socket_pool->offset_from_socket_to_pool_socket);
-
-    // add to free list
-    sp_socket->next = socket_pool->free_list_head;
-    socket_pool->free_list_head = sp_socket;
-
-    status = ns_mutex_unlock(&socket_pool->mutex);
+    status = ns_metrics_register_gauge(&socket_pool->capacity_gauge, "ns_socket_pool_capacity",
+                                       "Sockets the pool has mapped.",
+                                       ns_socket_pool_get_capacity_callback, socket_pool, labels);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
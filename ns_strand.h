@@ -0,0 +1,184 @@
+#ifndef NS_STRAND_H
+#define NS_STRAND_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_mpsc_queue.h"
+#include "ns_thread.h"
+#include "ns_worker_threads.h"
+#include "ns_time.h"
+
+
+// returned by ns_strand_add_work() when the strand already has as much work as it holds
+#define NS_STRAND_FULL -4
+
+// how long the drain spins on a slot that's been claimed but not yet filled in before it
+// starts yielding
+#if !defined(NS_STRAND_MAX_SPINS)
+    #define NS_STRAND_MAX_SPINS 64
+#endif
+
+
+/* Runs work on a shared NsWorkerThreads one item at a time, in the order it was added.
+   Different strands still run in parallel. Only the add that takes the strand from idle
+   to busy touches the shared work queue; everything after that is picked up by the
+   worker that's already draining the strand. */
+struct NsStrand
+{
+    NsWorkerThreads *worker_threads;
+    void *(*thread_entry)(void *);
+    NsMpscQueue work_queue;
+
+    // work added but not yet run. whoever takes this from 0 to 1 schedules the drain.
+    uint32_t num_pending;
+};
+
+
+/* Internal */
+
+internal void *
+ns_strand_thread_entry(void *thread_input)
+{
+    NsStrand *strand = (NsStrand *)thread_input;
+
+    while(1)
+    {
+        // each add's work is in the queue before its increment, but with several adders
+        // the increment we're going on can belong to one whose work is behind a slot
+        // another adder has claimed and not yet filled in. it's coming, so wait for it.
+        void *work;
+        for(uint32_t spins = 0; !ns_mpsc_queue_try_get(&strand->work_queue, &work); spins++)
+        {
+            if(spins < NS_STRAND_MAX_SPINS)
+            {
+                ns_atomic_pause();
+            }
+            else
+            {
+                ns_thread_yield();
+            }
+        }
+
+        // keep draining even if this one fails; otherwise the strand would stall forever
+        strand->thread_entry(work);
+
+        if(ns_atomic_fetch_sub(&strand->num_pending, (uint32_t)1) == 1)
+        {
+            break;
+        }
+    }
+
+    return (void *)NS_SUCCESS;
+}
+
+/* API */
+
+int
+ns_strand_create(NsStrand *strand, NsWorkerThreads *worker_threads,
+                 void *(*thread_entry)(void *), uint32_t max_work)
+{
+    int status;
+
+    status = ns_mpsc_queue_create(&strand->work_queue, max_work);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    strand->worker_threads = worker_threads;
+    strand->thread_entry = thread_entry;
+    strand->num_pending = 0;
+
+    return NS_SUCCESS;
+}
+
+/* The strand must be idle; see ns_strand_wait_idle(). */
+int
+ns_strand_destroy(NsStrand *strand)
+{
+    int status;
+
+    status = ns_mpsc_queue_destroy(&strand->work_queue);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* If the worker threads' queue is full, the strand is drained on the calling thread
+   instead; the work's already queued and nobody else would ever pick it up. */
+int
+ns_strand_add_work(NsStrand *strand, void *work)
+{
+    int status;
+
+    if(!ns_mpsc_queue_try_add(&strand->work_queue, work))
+    {
+        return NS_STRAND_FULL;
+    }
+
+    if(ns_atomic_fetch_add(&strand->num_pending, (uint32_t)1) == 0)
+    {
+        bool is_added;
+        status = ns_work_queue_try_add(&strand->worker_threads->work_queue, ns_strand_thread_entry, strand, &is_added);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        // our increment can't just be taken back: the work's in the queue, and anyone who
+        // added after us saw num_pending nonzero and is counting on us. the drain takes each
+        // increment back as it runs the work.
+        if(!is_added)
+        {
+            ns_strand_thread_entry(strand);
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
+bool
+ns_strand_check_idle(NsStrand *strand)
+{
+    bool result = (ns_atomic_load(&strand->num_pending) == 0);
+    return result;
+}
+
+/* Waits until everything added so far has run, or returns NS_TIMED_OUT after timeout_millis
+   (0 waits forever). Meant for teardown, once nothing else is adding, so it polls rather
+   than making every drain check for waiters. Not from the strand's own work, which would
+   wait on itself. */
+int
+ns_strand_wait_idle(NsStrand *strand, uint32_t timeout_millis = 0)
+{
+    uint64_t start_nanos = ns_time_get_nanos();
+    for(uint32_t spins = 0; !ns_strand_check_idle(strand); spins++)
+    {
+        if(spins < NS_STRAND_MAX_SPINS)
+        {
+            ns_atomic_pause();
+        }
+        else if(spins < 2*NS_STRAND_MAX_SPINS)
+        {
+            ns_thread_yield();
+        }
+        else
+        {
+            if(timeout_millis != 0 && ns_time_get_nanos() - start_nanos >= (uint64_t)timeout_millis*1000000)
+            {
+                return NS_TIMED_OUT;
+            }
+            ns_thread_sleep(1);
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
+#endif
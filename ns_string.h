@@ -6,6 +6,7 @@
 #include "ns_common.h"
 
 #include <string.h>
+#include <ctype.h>
 
 /* Chars */
 
@@ -77,13 +78,14 @@ StrCmp(char *String1, char *String2)
     return Result;
 }
 
+/* Copies src up to the delimiter, truncating to fit dst (null terminator included). */
 int
-StringGetToken(char *dst, char *src, int dst_size, char delimiter = ' ')
+ns_string_get_token(char *dst, char *src, int dst_size, char delimiter = ' ')
 {
     int len = 0;
     while(src[len] &&
           src[len] != delimiter &&
-          dst_size)
+          len < (dst_size - 1))
     {
         dst[len] = src[len];
         len++;
@@ -92,6 +94,12 @@ StringGetToken(char *dst, char *src, int dst_size, char delimiter = ' ')
     return len;
 }
 
+int
+StringGetToken(char *dst, char *src, int dst_size, char delimiter = ' ')
+{
+    return ns_string_get_token(dst, src, dst_size, delimiter);
+}
+
 /* Checks for equality excluding null-terminators. */
 inline bool
 CheckStringEqualsWeak(char *String1, char *String2)
@@ -0,0 +1,441 @@
+#ifndef NS_TASK_GRAPH_H
+#define NS_TASK_GRAPH_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_semaphore.h"
+#include "ns_time.h"
+#include "ns_trace.h"
+#include "ns_log.h"
+#include "ns_worker_threads.h"
+
+#include <stdio.h>
+
+
+/* A fixed graph of tasks that's built once and run as many times as you like, e.g. once a
+   frame. A task starts as soon as the last of its dependencies finishes, on whichever thread
+   finished it if that thread's free, otherwise on the workers. Running it doesn't allocate.
+
+       ns_task_graph_create(&graph, &worker_threads);
+       ns_task_graph_add_node(&graph, "fft", do_fft, &audio, &fft);
+       ns_task_graph_add_node(&graph, "visualizer", update_visualizer, &visualizer, &visualizer_node);
+       ns_task_graph_add_dependency(&graph, visualizer_node, fft);
+       ...
+       ns_task_graph_build(&graph);
+
+       // each frame
+       ns_task_graph_run(&graph);
+
+   Every run times each node (and records a trace span per node when tracing's on), and
+   ns_task_graph_print_timing() shows which chain of nodes the run was waiting on. */
+
+#if !defined(NS_TASK_GRAPH_MAX_NODES)
+    #define NS_TASK_GRAPH_MAX_NODES 256
+#endif
+
+// dependencies, across the whole graph
+#if !defined(NS_TASK_GRAPH_MAX_EDGES)
+    #define NS_TASK_GRAPH_MAX_EDGES 1024
+#endif
+
+#define NS_TASK_GRAPH_NO_NODE 0xffffffff
+
+
+struct NsTaskGraphNode
+{
+    const char *name; // must outlive the graph
+    void (*entry)(void *data);
+    void *data;
+    struct NsTaskGraph *graph;
+
+    // set up by build
+    uint32_t *dependents; // into the graph's edges
+    uint32_t num_dependents;
+    uint32_t num_dependencies;
+
+    uint32_t num_dependencies_left; // counts down during a run
+
+    // from the last run, relative to its start
+    uint64_t start_nanos;
+    uint64_t end_nanos;
+    uint32_t critical_dependency; // the dependency it waited on longest, or NS_TASK_GRAPH_NO_NODE
+};
+
+/* Nodes point back into it, so it can't be moved once nodes have been added. */
+struct NsTaskGraph
+{
+    NsTaskGraphNode nodes[NS_TASK_GRAPH_MAX_NODES];
+    uint32_t num_nodes;
+
+    // (from, to) pairs while adding, then every node's dependents back to back
+    uint32_t edge_froms[NS_TASK_GRAPH_MAX_EDGES];
+    uint32_t edge_tos[NS_TASK_GRAPH_MAX_EDGES];
+    uint32_t dependents[NS_TASK_GRAPH_MAX_EDGES];
+    uint32_t num_edges;
+
+    uint32_t roots[NS_TASK_GRAPH_MAX_NODES];
+    uint32_t num_roots;
+    uint32_t order[NS_TASK_GRAPH_MAX_NODES]; // topological
+    bool is_built;
+
+    NsWorkerThreads *worker_threads; // NULL runs everything on the caller
+
+    uint64_t run_start_nanos;
+    uint64_t run_nanos;
+    uint32_t num_nodes_left;
+    NsSemaphore done_semaphore;
+};
+
+
+/* Internal */
+
+internal void ns_task_graph_run_node(NsTaskGraphNode *node);
+
+internal void *
+ns_task_graph_node_entry(void *input)
+{
+    ns_task_graph_run_node((NsTaskGraphNode *)input);
+    return (void *)NS_SUCCESS;
+}
+
+internal void
+ns_task_graph_dispatch(NsTaskGraph *graph, NsTaskGraphNode *node)
+{
+    bool is_added = false;
+    if(graph->worker_threads != NULL)
+    {
+        ns_work_queue_try_add(&graph->worker_threads->work_queue, ns_task_graph_node_entry, node, &is_added);
+    }
+
+    // no workers, or no room for it: we'll do it ourselves
+    if(!is_added)
+    {
+        ns_task_graph_run_node(node);
+    }
+}
+
+/* Runs the node, then the first of its dependents it made ready, and so on; any others it
+   made ready go to the workers. */
+internal void
+ns_task_graph_run_node(NsTaskGraphNode *node)
+{
+    while(node != NULL)
+    {
+        NsTaskGraph *graph = node->graph;
+
+        uint64_t start_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
+        node->start_nanos = ns_time_get_nanos() - graph->run_start_nanos;
+        node->entry(node->data);
+        node->end_nanos = ns_time_get_nanos() - graph->run_start_nanos;
+        if(start_ticks != 0)
+        {
+            ns_trace_record(node->name, start_ticks, ns_trace_get_ticks());
+        }
+
+        NsTaskGraphNode *next_node = NULL;
+        for(uint32_t i = 0; i < node->num_dependents; i++)
+        {
+            NsTaskGraphNode *dependent = &graph->nodes[node->dependents[i]];
+            if(ns_atomic_fetch_sub(&dependent->num_dependencies_left, (uint32_t)1) == 1)
+            {
+                if(next_node == NULL)
+                {
+                    next_node = dependent;
+                }
+                else
+                {
+                    ns_task_graph_dispatch(graph, dependent);
+                }
+            }
+        }
+
+        // the graph's done with once the semaphore's put, so this has to be the last touch
+        if(ns_atomic_fetch_sub(&graph->num_nodes_left, (uint32_t)1) == 1)
+        {
+            ns_semaphore_put(&graph->done_semaphore);
+        }
+
+        node = next_node;
+    }
+}
+
+/* Works out each node's critical_dependency from the last run's times. */
+internal uint32_t
+ns_task_graph_find_critical_path(NsTaskGraph *graph)
+{
+    uint32_t last_node_idx = NS_TASK_GRAPH_NO_NODE;
+    uint64_t last_end_nanos = 0;
+    for(uint32_t i = 0; i < graph->num_nodes; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[graph->order[i]];
+        node->critical_dependency = NS_TASK_GRAPH_NO_NODE;
+        if(node->end_nanos >= last_end_nanos)
+        {
+            last_end_nanos = node->end_nanos;
+            last_node_idx = graph->order[i];
+        }
+    }
+
+    // a node couldn't start until its last dependency was done, so that's the one on the path
+    for(uint32_t i = 0; i < graph->num_edges; i++)
+    {
+        NsTaskGraphNode *from = &graph->nodes[graph->edge_froms[i]];
+        NsTaskGraphNode *to = &graph->nodes[graph->edge_tos[i]];
+        if(to->critical_dependency == NS_TASK_GRAPH_NO_NODE ||
+           from->end_nanos > graph->nodes[to->critical_dependency].end_nanos)
+        {
+            to->critical_dependency = graph->edge_froms[i];
+        }
+    }
+
+    return last_node_idx;
+}
+
+/* API */
+
+/* Holds up to NS_TASK_GRAPH_MAX_NODES nodes and NS_TASK_GRAPH_MAX_EDGES dependencies. */
+int
+ns_task_graph_create(NsTaskGraph *graph, NsWorkerThreads *worker_threads)
+{
+    int status;
+
+    memset(graph, 0, sizeof(NsTaskGraph));
+    graph->worker_threads = worker_threads;
+
+    status = ns_semaphore_create(&graph->done_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+int
+ns_task_graph_destroy(NsTaskGraph *graph)
+{
+    int status;
+
+    status = ns_semaphore_destroy(&graph->done_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+int
+ns_task_graph_add_node(NsTaskGraph *graph, const char *name, void (*entry)(void *data), void *data,
+                       uint32_t *node_idx)
+{
+    if(graph->is_built || graph->num_nodes == NS_TASK_GRAPH_MAX_NODES)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    *node_idx = graph->num_nodes++;
+    NsTaskGraphNode *node = &graph->nodes[*node_idx];
+    node->name = name;
+    node->entry = entry;
+    node->data = data;
+    node->graph = graph;
+
+    return NS_SUCCESS;
+}
+
+/* node_idx won't start until dependency_idx is done. */
+int
+ns_task_graph_add_dependency(NsTaskGraph *graph, uint32_t node_idx, uint32_t dependency_idx)
+{
+    if(graph->is_built || graph->num_edges == NS_TASK_GRAPH_MAX_EDGES ||
+       node_idx >= graph->num_nodes || dependency_idx >= graph->num_nodes || node_idx == dependency_idx)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    graph->edge_froms[graph->num_edges] = dependency_idx;
+    graph->edge_tos[graph->num_edges] = node_idx;
+    graph->num_edges++;
+
+    return NS_SUCCESS;
+}
+
+/* Lays the graph out for running. Fails if the dependencies go round in a circle. No nodes
+   or dependencies can be added after. */
+int
+ns_task_graph_build(NsTaskGraph *graph)
+{
+    uint32_t num_nodes = graph->num_nodes;
+    uint32_t num_edges = graph->num_edges;
+
+    for(uint32_t i = 0; i < num_nodes; i++)
+    {
+        graph->nodes[i].num_dependents = 0;
+        graph->nodes[i].num_dependencies = 0;
+    }
+    for(uint32_t i = 0; i < num_edges; i++)
+    {
+        graph->nodes[graph->edge_froms[i]].num_dependents++;
+        graph->nodes[graph->edge_tos[i]].num_dependencies++;
+    }
+
+    // every node's dependents get a slice of the one array
+    uint32_t offset = 0;
+    for(uint32_t i = 0; i < num_nodes; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[i];
+        node->dependents = &graph->dependents[offset];
+        offset += node->num_dependents;
+        node->num_dependents = 0;
+    }
+    for(uint32_t i = 0; i < num_edges; i++)
+    {
+        NsTaskGraphNode *from = &graph->nodes[graph->edge_froms[i]];
+        from->dependents[from->num_dependents++] = graph->edge_tos[i];
+    }
+
+    // kahn's algorithm, both for the order and to catch cycles
+    graph->num_roots = 0;
+    uint32_t num_ordered = 0;
+    for(uint32_t i = 0; i < num_nodes; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[i];
+        node->num_dependencies_left = node->num_dependencies;
+        if(node->num_dependencies == 0)
+        {
+            graph->roots[graph->num_roots++] = i;
+            graph->order[num_ordered++] = i;
+        }
+    }
+    for(uint32_t i = 0; i < num_ordered; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[graph->order[i]];
+        for(uint32_t j = 0; j < node->num_dependents; j++)
+        {
+            uint32_t dependent_idx = node->dependents[j];
+            if(--graph->nodes[dependent_idx].num_dependencies_left == 0)
+            {
+                graph->order[num_ordered++] = dependent_idx;
+            }
+        }
+    }
+    if(num_ordered != num_nodes)
+    {
+        LogError("task graph has a cycle: only %u of %u nodes can run", num_ordered, num_nodes);
+        return NS_ERROR;
+    }
+
+    graph->is_built = true;
+    return NS_SUCCESS;
+}
+
+/* Runs every node once and returns when they're all done. The calling thread runs nodes
+   too, and anything else in the workers' queue while it waits, so it's fine to call from
+   inside one of the workers. Not to be called again until it returns. */
+int
+ns_task_graph_run(NsTaskGraph *graph)
+{
+    int status;
+
+    if(!graph->is_built)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+    if(graph->num_nodes == 0)
+    {
+        return NS_SUCCESS;
+    }
+
+    for(uint32_t i = 0; i < graph->num_nodes; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[i];
+        node->num_dependencies_left = node->num_dependencies;
+    }
+    graph->num_nodes_left = graph->num_nodes;
+    graph->run_start_nanos = ns_time_get_nanos();
+
+    // the workers get every root but the first, which is ours
+    for(uint32_t i = 1; i < graph->num_roots; i++)
+    {
+        ns_task_graph_dispatch(graph, &graph->nodes[graph->roots[i]]);
+    }
+    ns_task_graph_run_node(&graph->nodes[graph->roots[0]]);
+
+    // work through the queue rather than wait on it: if we're one of the workers ourselves,
+    // what's left of the graph may be queued behind us with nobody else to run it
+    while(graph->worker_threads != NULL && ns_atomic_load(&graph->num_nodes_left) != 0)
+    {
+        NsWork work;
+        bool is_got;
+        status = ns_work_queue_try_get(&graph->worker_threads->work_queue, &work, &is_got);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        // whatever's left is running on other threads
+        if(!is_got)
+        {
+            break;
+        }
+
+        // destroy's quit, which is for a worker, not for us
+        if(work.thread_entry == NULL)
+        {
+            ns_work_queue_add(&graph->worker_threads->work_queue, NULL, NULL);
+            break;
+        }
+
+        status = (int)(intptr_t)work.thread_entry(work.work);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+        }
+    }
+
+    // even if the loop saw the last node finish, its semaphore put may not have happened yet
+    status = ns_semaphore_get(&graph->done_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+    graph->run_nanos = ns_time_get_nanos() - graph->run_start_nanos;
+
+    return NS_SUCCESS;
+}
+
+/* Every node's start and duration in the last run, with the ones the run was waiting on
+   (its critical path) marked. */
+void
+ns_task_graph_print_timing(NsTaskGraph *graph, FILE *file = stdout)
+{
+    uint32_t last_node_idx = ns_task_graph_find_critical_path(graph);
+
+    bool is_critical[NS_TASK_GRAPH_MAX_NODES] = {};
+    uint64_t critical_nanos = 0;
+    for(uint32_t idx = last_node_idx; idx != NS_TASK_GRAPH_NO_NODE; idx = graph->nodes[idx].critical_dependency)
+    {
+        is_critical[idx] = true;
+        critical_nanos += (graph->nodes[idx].end_nanos - graph->nodes[idx].start_nanos);
+    }
+
+    fprintf(file, "task graph: %u nodes, %.1f us, %.1f us of it on the critical path\n",
+            graph->num_nodes, graph->run_nanos/1000.0, critical_nanos/1000.0);
+    for(uint32_t i = 0; i < graph->num_nodes; i++)
+    {
+        NsTaskGraphNode *node = &graph->nodes[graph->order[i]];
+        fprintf(file, "  %c %-24s start: %10.1f us  duration: %10.1f us\n",
+                is_critical[graph->order[i]] ? '*' : ' ', node->name,
+                node->start_nanos/1000.0, (node->end_nanos - node->start_nanos)/1000.0);
+    }
+}
+
+#endif
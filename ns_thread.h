@@ -8,6 +8,7 @@
 #elif defined(LINUX)
     #include <unistd.h>
     #include <pthread.h>
+    #include <sched.h>
 #endif
 
 #include <stdlib.h>
@@ -18,6 +19,25 @@
     typedef pthread_t NsInternalThread;
 #endif
 
+enum NsThreadSchedPolicy
+{
+    NS_THREAD_SCHED_DEFAULT, // whatever the creating thread has
+    NS_THREAD_SCHED_OTHER,
+    NS_THREAD_SCHED_BATCH,
+    NS_THREAD_SCHED_IDLE,
+    NS_THREAD_SCHED_FIFO, // realtime; needs privileges
+    NS_THREAD_SCHED_RR, // realtime; needs privileges
+};
+
+/* Start from ns_thread_attributes_init(); anything left alone keeps the default. */
+struct NsThreadAttributes
+{
+    int cpu; // -1 to let the scheduler move it around
+    uint64_t stack_size; // 0 for the default
+    NsThreadSchedPolicy sched_policy;
+    int sched_priority; // only means something for FIFO and RR
+};
+
 struct NsThread
 {
     NsInternalThread internal_thread;
@@ -27,6 +47,8 @@ struct NsThread
 
     void (*completion_callback)(NsThread *);
     void *extra_data_void_ptr;
+
+    int start_sched_policy; // applied by the thread itself; -1 for none
 };
 
 
@@ -36,6 +58,16 @@ internal void *
 ns_thread_entry(void *input)
 {
     NsThread *thread = (NsThread *)input;
+#if defined(LINUX)
+    if(thread->start_sched_policy != -1)
+    {
+        struct sched_param sched_param = {};
+        if(pthread_setschedparam(pthread_self(), thread->start_sched_policy, &sched_param) != 0)
+        {
+            DebugPrintInfo();
+        }
+    }
+#endif
     void *result = thread->entry(thread->input);
     if(thread->completion_callback != NULL)
     {
@@ -45,9 +77,80 @@ ns_thread_entry(void *input)
     return result;
 }
 
+#if defined(LINUX)
+/* pthread attributes only take OTHER, FIFO and RR, so BATCH and IDLE are left to
+   ns_thread_entry(). */
+internal int
+ns_thread_attributes_to_pthread(NsThreadAttributes *attributes, pthread_attr_t *pthread_attributes)
+{
+    int status;
+
+    if(attributes->cpu >= 0)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(attributes->cpu, &cpu_set);
+        status = pthread_attr_setaffinity_np(pthread_attributes, sizeof(cpu_set), &cpu_set);
+        if(status != 0)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+    }
+
+    if(attributes->stack_size != 0)
+    {
+        status = pthread_attr_setstacksize(pthread_attributes, attributes->stack_size);
+        if(status != 0)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+    }
+
+    if(attributes->sched_policy != NS_THREAD_SCHED_DEFAULT &&
+       attributes->sched_policy != NS_THREAD_SCHED_BATCH &&
+       attributes->sched_policy != NS_THREAD_SCHED_IDLE)
+    {
+        int policy = SCHED_OTHER;
+        switch(attributes->sched_policy)
+        {
+            case NS_THREAD_SCHED_FIFO: policy = SCHED_FIFO; break;
+            case NS_THREAD_SCHED_RR: policy = SCHED_RR; break;
+            default: break;
+        }
+
+        struct sched_param sched_param = {};
+        if(policy == SCHED_FIFO || policy == SCHED_RR)
+        {
+            sched_param.sched_priority = attributes->sched_priority;
+        }
+
+        // otherwise the policy's ignored and copied from the creating thread
+        status = pthread_attr_setinheritsched(pthread_attributes, PTHREAD_EXPLICIT_SCHED);
+        if(status == 0)
+        {
+            status = pthread_attr_setschedpolicy(pthread_attributes, policy);
+        }
+        if(status == 0)
+        {
+            status = pthread_attr_setschedparam(pthread_attributes, &sched_param);
+        }
+        if(status != 0)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+    }
+
+    return NS_SUCCESS;
+}
+#endif
+
 int
 ns_thread_create(NsThread *thread, void *(*thread_entry)(void *), void *thread_input,
-                 void (*completion_callback)(NsThread *), void *extra_data_void_ptr)
+                 void (*completion_callback)(NsThread *), void *extra_data_void_ptr,
+                 NsThreadAttributes *attributes = NULL)
 {
     int status;
 
@@ -55,21 +158,70 @@ ns_thread_create(NsThread *thread, void *(*thread_entry)(void *), void *thread_i
     thread->input = thread_input;
     thread->completion_callback = completion_callback;
     thread->extra_data_void_ptr = extra_data_void_ptr;
+    thread->start_sched_policy = -1;
 
 #if defined(WINDOWS)
 #elif defined(LINUX)
-    status = pthread_create(&thread->internal_thread, NULL, ns_thread_entry, thread);
+    if(attributes != NULL && attributes->sched_policy == NS_THREAD_SCHED_BATCH)
+    {
+        thread->start_sched_policy = SCHED_BATCH;
+    }
+    else if(attributes != NULL && attributes->sched_policy == NS_THREAD_SCHED_IDLE)
+    {
+        thread->start_sched_policy = SCHED_IDLE;
+    }
+
+    if(attributes == NULL)
+    {
+        status = pthread_create(&thread->internal_thread, NULL, ns_thread_entry, thread);
+        if(status != 0)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+        return NS_SUCCESS;
+    }
+
+    pthread_attr_t pthread_attributes;
+    status = pthread_attr_init(&pthread_attributes);
     if(status != 0)
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
+
+    status = ns_thread_attributes_to_pthread(attributes, &pthread_attributes);
+    if(status == NS_SUCCESS)
+    {
+        // EPERM here usually means a realtime policy without the privileges for it
+        status = pthread_create(&thread->internal_thread, &pthread_attributes, ns_thread_entry, thread);
+        if(status != 0)
+        {
+            DebugPrintInfo();
+            status = NS_ERROR;
+        }
+    }
+
+    pthread_attr_destroy(&pthread_attributes);
+    if(status != NS_SUCCESS)
+    {
+        return status;
+    }
 #endif
     return NS_SUCCESS;
 }
 
 /* API */
 
+void
+ns_thread_attributes_init(NsThreadAttributes *attributes)
+{
+    attributes->cpu = -1;
+    attributes->stack_size = 0;
+    attributes->sched_policy = NS_THREAD_SCHED_DEFAULT;
+    attributes->sched_priority = 0;
+}
+
 int
 ns_thread_create(NsThread *thread, void *(*thread_entry)(void *), void *thread_input)
 {
@@ -77,6 +229,15 @@ ns_thread_create(NsThread *thread, void *(*thread_entry)(void *), void *thread_i
     return status;
 }
 
+/* attributes can be NULL, which is the same as not passing any. */
+int
+ns_thread_create(NsThread *thread, void *(*thread_entry)(void *), void *thread_input,
+                 NsThreadAttributes *attributes)
+{
+    int status = ns_thread_create(thread, thread_entry, thread_input, NULL, NULL, attributes);
+    return status;
+}
+
 int
 ns_thread_sleep(unsigned long millis)
 {
@@ -93,4 +254,83 @@ ns_thread_sleep(unsigned long millis)
     return NS_SUCCESS;
 }
 
+/* Gives up the rest of our time slice, for spin loops that have spun long enough. */
+void
+ns_thread_yield()
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    sched_yield();
+#endif
+}
+
+/* Waits for the thread to return. result gets what its entry returned. */
+int
+ns_thread_join(NsThread *thread, void **result = NULL)
+{
+    int status;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    status = pthread_join(thread->internal_thread, result);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+/* Names the calling thread for debuggers, top and the like. Linux cuts it to 15 chars. */
+int
+ns_thread_set_name(const char *name)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    char truncated_name[16];
+    snprintf(truncated_name, sizeof(truncated_name), "%s", name);
+    int status = pthread_setname_np(pthread_self(), truncated_name);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
+int
+ns_thread_get_num_cpus()
+{
+    int result = 1;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_cpus > 0)
+    {
+        result = (int)num_cpus;
+    }
+#endif
+    return result;
+}
+
+/* Keeps the calling thread on one cpu. */
+int
+ns_thread_set_affinity(int cpu)
+{
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int status = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if(status != 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+#endif
+    return NS_SUCCESS;
+}
+
 #endif
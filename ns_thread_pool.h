@@ -1,163 +1,449 @@
-#if 0
-currently, there's still a problem with the fact that the user can call ns_thread_pool_thread_create() on a thread that's already finished executing, therefore causing the pool to not keep track.
-#endif
-
-#if 0
 #ifndef NS_THREAD_POOL_H
 #define NS_THREAD_POOL_H
 
 #include "ns_common.h"
 #include "ns_thread.h"
 #include "ns_mutex.h"
+#include "ns_condv.h"
+#include "ns_atomic.h"
+#include "ns_trace.h"
+#include "ns_numa.h"
+
+#include <stdio.h>
 
-#include <stdlib.h>
 
-#if defined(WINDOWS)
-#elif defined(LINUX)
-    #include <pthread.h>
+#if !defined(NS_THREAD_POOL_MAX_THREADS)
+    #define NS_THREAD_POOL_MAX_THREADS 64
 #endif
 
+// past NS_WEBSOCKET_FRAME_TOO_LARGE (-6), the last code another module defines, so a status
+// a task hands back through a wait can't be taken for one of these
+#define NS_THREAD_POOL_CANCELLED -7 // from the waits, for a task cancelled before it ran
+#define NS_THREAD_POOL_SHUT_DOWN -8 // from ns_thread_pool_submit() once the pool's being destroyed
 
-/* Internal */
 
-/* API */
+/* A fixed set of threads running submitted tasks, where, unlike NsWorkerThreads, you can get
+   a task's result back, wait on it, and shut the pool down cleanly.
+
+   The task doubles as the future: the caller owns it (so submitting doesn't allocate, and
+   there's no limit to how many can be queued) and it has to stay put until it's done or
+   cancelled.
+
+       NsThreadPoolTask task;
+       ns_thread_pool_submit(&pool, &task, entry, input);
+       ...
+       void *result;
+       ns_thread_pool_wait(&pool, &task, &result); */
+
+enum NsThreadPoolTaskState
+{
+    NS_THREAD_POOL_TASK_PENDING,
+    NS_THREAD_POOL_TASK_RUNNING,
+    NS_THREAD_POOL_TASK_DONE,
+    NS_THREAD_POOL_TASK_CANCELLED,
+};
+
+enum NsThreadPoolShutdown
+{
+    NS_THREAD_POOL_DRAIN, // run everything already submitted, then stop
+    NS_THREAD_POOL_CANCEL, // stop once the running tasks are done; the rest are cancelled
+};
+
+struct NsThreadPoolTask
+{
+    void *(*entry)(void *);
+    void *input;
+    void *result;
+    uint32_t state; // NsThreadPoolTaskState
+    NsThreadPoolTask *next; // while it's pending
+};
 
 struct NsThreadPoolThread
 {
     NsThread thread;
-    struct NsThreadPool *thread_pool; // Pointer to thread pool where this thread is from.
+    struct NsThreadPool *thread_pool;
+    int index;
 };
 
 struct NsThreadPool
 {
-    NsThreadPoolThread *tp_threads;
+    NsThreadPoolThread threads[NS_THREAD_POOL_MAX_THREADS];
+    int num_threads;
+    const char *name;
+
     NsMutex mutex;
-    void *memory;
-    int capacity;
-    bool *statuses; // We could place the status in the NsThreadPoolThread, but this is more cache friendly.
+    NsCondv work_condv; // the threads wait on it for tasks
+    NsCondv done_condv; // the waits wait on it for tasks to finish
+
+    // guarded by mutex
+    NsThreadPoolTask *head;
+    NsThreadPoolTask *tail;
+    int num_waiters; // so finishing a task only broadcasts if someone's listening
+    bool is_shutting_down;
 };
 
 
+int ns_thread_pool_destroy(NsThreadPool *thread_pool, NsThreadPoolShutdown shutdown = NS_THREAD_POOL_DRAIN);
+
+
 /* Internal */
 
-internal void
-ns_thread_pool_thread_completion_callback(NsThread *thread)
+inline internal bool
+ns_thread_pool_is_finished(uint32_t state)
 {
-    NsThreadPool *thread_pool = (NsThreadPool *)thread->extra_data_void_ptr;
-    NsThreadPoolThread *tp_threads = thread_pool->tp_threads;
-    bool *statuses = thread_pool->statuses;
-    int thread_pool_capacity = thread_pool->capacity;
+    bool result = (state == NS_THREAD_POOL_TASK_DONE || state == NS_THREAD_POOL_TASK_CANCELLED);
+    return result;
+}
+
+/* Returns NS_SUCCESS, or the status of whatever failed, in which case the thread's given up
+   without the mutex. */
+internal void *
+ns_thread_pool_thread_entry(void *thread_input)
+{
+    int status;
+
+    NsThreadPoolThread *tp_thread = (NsThreadPoolThread *)thread_input;
+    NsThreadPool *thread_pool = tp_thread->thread_pool;
 
-    int tp_thread_idx = 0;
-    for(; tp_thread_idx < thread_pool_capacity; tp_thread_idx++)
+    char name[32];
+    snprintf(name, sizeof(name), "%s %d", thread_pool->name, tp_thread->index);
+    ns_thread_set_name(name);
+    ns_trace_set_thread_name(thread_pool->name);
+
+    status = ns_mutex_lock(&thread_pool->mutex);
+    if(status != NS_SUCCESS)
     {
-        if(thread == &tp_threads[tp_thread_idx].thread)
+        DebugPrintInfo();
+        return (void *)(intptr_t)status;
+    }
+
+    while(1)
+    {
+        while(thread_pool->head == NULL && !thread_pool->is_shutting_down)
+        {
+            status = ns_condv_wait(&thread_pool->work_condv, &thread_pool->mutex);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return (void *)(intptr_t)status;
+            }
+        }
+
+        // when draining, shutting down only means something once the queue's empty
+        NsThreadPoolTask *task = thread_pool->head;
+        if(task == NULL)
         {
             break;
         }
+
+        thread_pool->head = task->next;
+        if(thread_pool->head == NULL)
+        {
+            thread_pool->tail = NULL;
+        }
+        ns_atomic_store(&task->state, (uint32_t)NS_THREAD_POOL_TASK_RUNNING);
+
+        status = ns_mutex_unlock(&thread_pool->mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
+        }
+
+        task->result = task->entry(task->input);
+
+        status = ns_mutex_lock(&thread_pool->mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
+        }
+
+        ns_atomic_store(&task->state, (uint32_t)NS_THREAD_POOL_TASK_DONE);
+        if(thread_pool->num_waiters > 0)
+        {
+            status = ns_condv_broadcast(&thread_pool->done_condv);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                ns_mutex_unlock(&thread_pool->mutex);
+                return (void *)(intptr_t)status;
+            }
+        }
     }
 
-    // sanity check
-    if(!statuses[tp_thread_idx])
+    status = ns_mutex_unlock(&thread_pool->mutex);
+    if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
-        return;
+        return (void *)(intptr_t)status;
     }
 
-    statuses[tp_thread_idx] = false;
+    return (void *)NS_SUCCESS;
 }
 
 /* API */
 
+/* name must outlive the pool. Threads are named "<name> <index>". With a placement, thread
+   i is pinned to the placement's i'th cpu. num_threads can be at most
+   NS_THREAD_POOL_MAX_THREADS. */
 int
-ns_thread_pool_create(NsThreadPool *thread_pool, int capacity)
+ns_thread_pool_create(NsThreadPool *thread_pool, int num_threads, const char *name = "pool",
+                      NsNumaPlacement placement = NS_NUMA_PLACEMENT_NONE)
 {
     int status;
 
-    uint32_t threads_size = (capacity*sizeof(NsThreadPoolThread));
-    uint32_t statuses_size = (capacity*sizeof(bool));
-    uint8_t *memory = (uint8_t *)malloc(threads_size + statuses_size);
-    if(memory == NULL)
+    if(num_threads <= 0 || num_threads > NS_THREAD_POOL_MAX_THREADS)
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
 
-    thread_pool->tp_threads = (NsThreadPoolThread *)memory;
-    thread_pool->statuses = (bool *)(memory + threads_size);
-    thread_pool->capacity = capacity;
+    memset(thread_pool, 0, sizeof(NsThreadPool));
+    thread_pool->name = name;
 
-    NsThreadPoolThread *tp_threads = thread_pool->tp_threads;
-    for(int i = 0; i < capacity; i++)
+    status = ns_mutex_create(&thread_pool->mutex);
+    if(status != NS_SUCCESS)
     {
-        tp_threads[i].thread_pool = thread_pool;
+        DebugPrintInfo();
+        return status;
     }
 
-    status = ns_mutex_create(&thread_pool->mutex);
+    status = ns_condv_create(&thread_pool->work_condv);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    status = ns_condv_create(&thread_pool->done_condv);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        NsThreadPoolThread *tp_thread = &thread_pool->threads[i];
+        tp_thread->thread_pool = thread_pool;
+        tp_thread->index = i;
+
+        NsThreadAttributes attributes;
+        ns_thread_attributes_init(&attributes);
+        ns_numa_set_thread_attributes(&attributes, i, placement);
+
+        status = ns_thread_create(&tp_thread->thread, ns_thread_pool_thread_entry, tp_thread, &attributes);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+
+            // the threads we did start are waiting for work; send them home
+            ns_thread_pool_destroy(thread_pool);
+            return status;
+        }
+
+        // so destroy only joins threads that exist
+        thread_pool->num_threads++;
+    }
+
     return NS_SUCCESS;
 }
 
+/* Stops the pool, draining or cancelling what's still queued, and waits for every thread
+   to exit. Nothing can be submitted from here on, including from the tasks still running. */
 int
-ns_thread_pool_destroy(NsThreadPool *thread_pool)
+ns_thread_pool_destroy(NsThreadPool *thread_pool, NsThreadPoolShutdown shutdown)
 {
-    free(thread_pool->tp_threads);
+    int status;
+
+    ns_mutex_lock(&thread_pool->mutex);
+    thread_pool->is_shutting_down = true;
+    if(shutdown == NS_THREAD_POOL_CANCEL)
+    {
+        for(NsThreadPoolTask *task = thread_pool->head; task != NULL; task = task->next)
+        {
+            ns_atomic_store(&task->state, (uint32_t)NS_THREAD_POOL_TASK_CANCELLED);
+        }
+        thread_pool->head = NULL;
+        thread_pool->tail = NULL;
+        ns_condv_broadcast(&thread_pool->done_condv);
+    }
+    ns_condv_broadcast(&thread_pool->work_condv);
+    ns_mutex_unlock(&thread_pool->mutex);
+
+    int num_errors = 0;
+    for(int i = 0; i < thread_pool->num_threads; i++)
+    {
+        void *thread_result;
+        status = ns_thread_join(&thread_pool->threads[i].thread, &thread_result);
+        if(status != NS_SUCCESS || (int)(intptr_t)thread_result != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            num_errors++;
+        }
+    }
+    thread_pool->num_threads = 0;
+
+    status = ns_condv_destroy(&thread_pool->work_condv);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        num_errors++;
+    }
+
+    status = ns_condv_destroy(&thread_pool->done_condv);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        num_errors++;
+    }
+
+    status = ns_mutex_destroy(&thread_pool->mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        num_errors++;
+    }
+
+    if(num_errors > 0)
+    {
+        return (num_errors > 1) ? NS_MULTIPLE_ERRORS : NS_ERROR;
+    }
+
     return NS_SUCCESS;
 }
 
 int
-ns_thread_pool_thread_get(NsThreadPool *thread_pool, NsThreadPoolThread **tp_thread_ptr)
+ns_thread_pool_submit(NsThreadPool *thread_pool, NsThreadPoolTask *task,
+                      void *(*entry)(void *), void *input)
 {
+    task->entry = entry;
+    task->input = input;
+    task->result = NULL;
+    task->next = NULL;
+    task->state = NS_THREAD_POOL_TASK_PENDING;
+
     ns_mutex_lock(&thread_pool->mutex);
 
-    NsThreadPoolThread *tp_thread = NULL;
-    int thread_pool_capacity = thread_pool->capacity;
-    bool *statuses = thread_pool->statuses;
-    int tp_thread_idx = 0;
-    for(; tp_thread_idx < thread_pool_capacity; tp_thread_idx++)
+    if(thread_pool->is_shutting_down)
     {
-        if(!statuses[tp_thread_idx])
-        {
-            tp_thread = &thread_pool->tp_threads[tp_thread_idx];
-            statuses[tp_thread_idx] = true;
-            break;
-        }
+        ns_mutex_unlock(&thread_pool->mutex);
+        task->state = NS_THREAD_POOL_TASK_CANCELLED;
+        return NS_THREAD_POOL_SHUT_DOWN;
     }
 
+    if(thread_pool->tail != NULL)
+    {
+        thread_pool->tail->next = task;
+    }
+    else
+    {
+        thread_pool->head = task;
+    }
+    thread_pool->tail = task;
+
+    ns_condv_signal(&thread_pool->work_condv);
     ns_mutex_unlock(&thread_pool->mutex);
 
-    if(tp_thread_idx == thread_pool_capacity)
+    return NS_SUCCESS;
+}
+
+/* Doesn't block. */
+inline bool
+ns_thread_pool_is_done(NsThreadPoolTask *task)
+{
+    bool result = ns_thread_pool_is_finished(ns_atomic_load(&task->state));
+    return result;
+}
+
+/* Waits for the task to finish. result gets what its entry returned. Returns
+   NS_THREAD_POOL_CANCELLED if it never ran. */
+int
+ns_thread_pool_wait(NsThreadPool *thread_pool, NsThreadPoolTask *task, void **result = NULL)
+{
+    if(!ns_thread_pool_is_done(task))
     {
-        DebugPrintInfo();
-        return NS_ERROR;
+        ns_mutex_lock(&thread_pool->mutex);
+        thread_pool->num_waiters++;
+        while(!ns_thread_pool_is_finished(task->state))
+        {
+            ns_condv_wait(&thread_pool->done_condv, &thread_pool->mutex);
+        }
+        thread_pool->num_waiters--;
+        ns_mutex_unlock(&thread_pool->mutex);
     }
 
-    *tp_thread_ptr = tp_thread;
+    if(task->state == NS_THREAD_POOL_TASK_CANCELLED)
+    {
+        return NS_THREAD_POOL_CANCELLED;
+    }
+
+    if(result != NULL)
+    {
+        *result = task->result;
+    }
 
     return NS_SUCCESS;
 }
 
+/* Waits for all of them. Returns NS_THREAD_POOL_CANCELLED if any were cancelled. */
 int
-ns_thread_pool_thread_create(NsThreadPoolThread *tp_thread, 
-                             void *(*thread_entry)(void *), void *thread_input)
+ns_thread_pool_wait_all(NsThreadPool *thread_pool, NsThreadPoolTask **tasks, int num_tasks)
 {
-    int status;
+    int result = NS_SUCCESS;
+    for(int i = 0; i < num_tasks; i++)
+    {
+        if(ns_thread_pool_wait(thread_pool, tasks[i]) != NS_SUCCESS)
+        {
+            result = NS_THREAD_POOL_CANCELLED;
+        }
+    }
+    return result;
+}
 
-    status = ns_thread_create(&tp_thread->thread, thread_entry, thread_input, 
-                              ns_thread_pool_thread_completion_callback, tp_thread->thread_pool);
-    if(status != NS_SUCCESS)
+/* Waits for at least one of them and sets task_idx to the first that's finished. Returns
+   NS_THREAD_POOL_CANCELLED if that one was cancelled. */
+int
+ns_thread_pool_wait_any(NsThreadPool *thread_pool, NsThreadPoolTask **tasks, int num_tasks, int *task_idx)
+{
+    if(num_tasks <= 0)
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
 
+    ns_mutex_lock(&thread_pool->mutex);
+    thread_pool->num_waiters++;
+
+    int idx = -1;
+    while(1)
+    {
+        for(int i = 0; i < num_tasks; i++)
+        {
+            if(ns_thread_pool_is_finished(tasks[i]->state))
+            {
+                idx = i;
+                break;
+            }
+        }
+        if(idx != -1)
+        {
+            break;
+        }
+        ns_condv_wait(&thread_pool->done_condv, &thread_pool->mutex);
+    }
+
+    thread_pool->num_waiters--;
+    ns_mutex_unlock(&thread_pool->mutex);
+
+    *task_idx = idx;
+    if(tasks[idx]->state == NS_THREAD_POOL_TASK_CANCELLED)
+    {
+        return NS_THREAD_POOL_CANCELLED;
+    }
+
     return NS_SUCCESS;
 }
 
 #endif
-#endif
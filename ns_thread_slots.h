@@ -0,0 +1,108 @@
+#ifndef NS_THREAD_SLOTS_H
+#define NS_THREAD_SLOTS_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+
+
+// the most slots an NsThreadSlots can hand out
+#if !defined(NS_THREAD_SLOTS_MAX_SLOTS)
+    #define NS_THREAD_SLOTS_MAX_SLOTS 1024
+#endif
+
+#define NS_THREAD_SLOT_NONE 0xffffffff
+
+
+/* Gives each thread that asks an index into some static per-thread array, and takes it
+   back when the thread exits. So the array bounds how many threads can have a slot at
+   once, not how many there ever are. A slot's next owner carries on from wherever the
+   last one left off; whatever's in the array for it is the user's to keep or reset. */
+struct NsThreadSlots
+{
+    uint32_t is_taken[NS_THREAD_SLOTS_MAX_SLOTS];
+    uint32_t num_slots;
+
+    // one past the highest slot ever handed out, so readers only scan that far
+    uint32_t num_slots_used;
+};
+
+/* A thread's claim on a slot. Must be thread_local; its destructor gives the slot back
+   when the thread exits. */
+struct NsThreadSlot
+{
+    NsThreadSlots *slots = NULL;
+    uint32_t idx = NS_THREAD_SLOT_NONE;
+
+    // set once we've either got a slot or found there were none, and once we've exited
+    bool has_tried = false;
+
+    ~NsThreadSlot();
+};
+
+
+/* API */
+
+/* num_slots is the size of the per-thread array the slots index into. */
+void
+ns_thread_slots_create(NsThreadSlots *slots, uint32_t num_slots)
+{
+    Assert(num_slots <= NS_THREAD_SLOTS_MAX_SLOTS);
+    slots->num_slots = num_slots;
+}
+
+/* Returns the calling thread's slot, taking a free one the first time. Returns
+   NS_THREAD_SLOT_NONE if they're all taken, and from then on for this thread, and once
+   the thread's exiting. */
+uint32_t
+ns_thread_slot_get(NsThreadSlot *slot, NsThreadSlots *slots)
+{
+    if(slot->has_tried)
+    {
+        return slot->idx;
+    }
+    slot->has_tried = true;
+
+    for(uint32_t i = 0; i < slots->num_slots; i++)
+    {
+        uint32_t is_taken = ns_atomic_load_relaxed(&slots->is_taken[i]);
+        if(is_taken == 0 &&
+           ns_atomic_compare_exchange(&slots->is_taken[i], &is_taken, (uint32_t)1))
+        {
+            uint32_t num_slots_used = ns_atomic_load(&slots->num_slots_used);
+            while(num_slots_used < (i + 1) &&
+                  !ns_atomic_compare_exchange(&slots->num_slots_used, &num_slots_used, i + 1))
+            {
+            }
+
+            slot->slots = slots;
+            slot->idx = i;
+            return i;
+        }
+    }
+
+    return NS_THREAD_SLOT_NONE;
+}
+
+/* Slots below this may be in use. */
+uint32_t
+ns_thread_slots_get_num_used(NsThreadSlots *slots)
+{
+    uint32_t result = ns_atomic_load(&slots->num_slots_used);
+    return result;
+}
+
+NsThreadSlot::~NsThreadSlot()
+{
+    if(idx != NS_THREAD_SLOT_NONE)
+    {
+        // everything this thread wrote into its slot is visible to whoever takes it next
+        ns_atomic_store(&slots->is_taken[idx], (uint32_t)0);
+    }
+
+    // anything that runs after us on this thread (other thread_local destructors, say)
+    // gets no slot rather than one nobody would give back
+    idx = NS_THREAD_SLOT_NONE;
+    has_tried = true;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef NS_TIME_H
+#define NS_TIME_H
+
+#include "ns_common.h"
+
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    #include <time.h>
+#endif
+
+
+/* API */
+
+/* Monotonic, so only good for measuring intervals. */
+uint64_t
+ns_time_get_nanos()
+{
+    uint64_t nanos = 0;
+#if defined(WINDOWS)
+#elif defined(LINUX)
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    nanos = ((uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec);
+#endif
+    return nanos;
+}
+
+uint64_t
+ns_time_get_millis()
+{
+    uint64_t millis = (ns_time_get_nanos() / 1000000);
+    return millis;
+}
+
+#endif
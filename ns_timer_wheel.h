@@ -0,0 +1,380 @@
+#ifndef NS_TIMER_WHEEL_H
+#define NS_TIMER_WHEEL_H
+
+#include "ns_common.h"
+
+
+#define NS_TIMER_WHEEL_NUM_LEVELS 4
+#define NS_TIMER_WHEEL_SLOT_BITS 6
+#define NS_TIMER_WHEEL_NUM_SLOTS (1 << NS_TIMER_WHEEL_SLOT_BITS)
+#define NS_TIMER_WHEEL_SLOT_MASK (NS_TIMER_WHEEL_NUM_SLOTS - 1)
+
+// where timers too far out to fit in the wheel wait
+#define NS_TIMER_WHEEL_OVERFLOW_LEVEL NS_TIMER_WHEEL_NUM_LEVELS
+
+
+/* Timers are intrusive, so arming and cancelling never allocates and is O(1). A timer
+   must not move in memory while it's armed. */
+struct NsTimer
+{
+    NsTimer *next;
+    NsTimer *prev;
+    uint64_t expiry_tick;
+    uint8_t level;
+    uint8_t slot;
+    bool is_armed;
+
+    void (*callback)(NsTimer *timer, void *data);
+    void *data;
+};
+
+/* Hierarchical timing wheel. Level 0 has one slot per tick; each level above covers 64
+   times the span of the one below it and gets cascaded down as time reaches it. Not
+   thread-safe; the event loop that owns it should be the only one touching it, or
+   callers should lock around it. */
+struct NsTimerWheel
+{
+    uint64_t start_millis;
+    uint64_t tick_millis;
+
+    // the next tick to be processed. everything before it has fired.
+    uint64_t current_tick;
+
+    // list heads. the last level is the overflow list, which only uses slot 0.
+    NsTimer slots[NS_TIMER_WHEEL_NUM_LEVELS + 1][NS_TIMER_WHEEL_NUM_SLOTS];
+
+    // bit per nonempty slot, so finding the next deadline doesn't walk empty slots
+    uint64_t occupied[NS_TIMER_WHEEL_NUM_LEVELS + 1];
+
+    int num_timers;
+};
+
+
+/* Internal */
+
+inline internal bool
+ns_timer_wheel_slot_check_empty(NsTimer *head)
+{
+    bool result = (head->next == head);
+    return result;
+}
+
+internal void
+ns_timer_wheel_link(NsTimerWheel *timer_wheel, NsTimer *timer)
+{
+    uint64_t expiry_tick = timer->expiry_tick;
+    uint64_t current_tick = timer_wheel->current_tick;
+
+    // pick the lowest level whose higher bits agree with now. that way the timer's slot
+    // is always ahead of the level's current slot, and it's cascaded down right on time.
+    int level = 0;
+    for(; level < NS_TIMER_WHEEL_NUM_LEVELS; level++)
+    {
+        int shift = (NS_TIMER_WHEEL_SLOT_BITS*(level + 1));
+        if((expiry_tick >> shift) == (current_tick >> shift))
+        {
+            break;
+        }
+    }
+
+    int slot = 0;
+    if(level < NS_TIMER_WHEEL_NUM_LEVELS)
+    {
+        slot = ((expiry_tick >> (NS_TIMER_WHEEL_SLOT_BITS*level)) & NS_TIMER_WHEEL_SLOT_MASK);
+    }
+
+    NsTimer *head = &timer_wheel->slots[level][slot];
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)slot;
+    timer_wheel->occupied[level] |= ((uint64_t)1 << slot);
+}
+
+internal void
+ns_timer_wheel_unlink(NsTimerWheel *timer_wheel, NsTimer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    NsTimer *head = &timer_wheel->slots[timer->level][timer->slot];
+    if(ns_timer_wheel_slot_check_empty(head))
+    {
+        timer_wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    }
+}
+
+/* Moves everything in the slot out to the caller's list. */
+internal void
+ns_timer_wheel_take_slot(NsTimerWheel *timer_wheel, int level, int slot, NsTimer *list)
+{
+    NsTimer *head = &timer_wheel->slots[level][slot];
+    if(ns_timer_wheel_slot_check_empty(head))
+    {
+        list->next = list;
+        list->prev = list;
+        return;
+    }
+
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+
+    head->next = head;
+    head->prev = head;
+    timer_wheel->occupied[level] &= ~((uint64_t)1 << slot);
+}
+
+internal void
+ns_timer_wheel_cascade(NsTimerWheel *timer_wheel, int level, int slot)
+{
+    NsTimer list;
+    ns_timer_wheel_take_slot(timer_wheel, level, slot, &list);
+
+    while(!ns_timer_wheel_slot_check_empty(&list))
+    {
+        NsTimer *timer = list.next;
+        list.next = timer->next;
+        timer->next->prev = &list;
+
+        ns_timer_wheel_link(timer_wheel, timer);
+    }
+}
+
+/* Earliest tick at which something needs doing: a timer firing or a slot cascading. */
+internal uint64_t
+ns_timer_wheel_get_next_event_tick(NsTimerWheel *timer_wheel)
+{
+    uint64_t current_tick = timer_wheel->current_tick;
+    uint64_t next_event_tick = UINT64_MAX;
+
+    for(int level = 0; level < NS_TIMER_WHEEL_NUM_LEVELS; level++)
+    {
+        uint64_t occupied = timer_wheel->occupied[level];
+        if(occupied == 0)
+        {
+            continue;
+        }
+
+        int shift = (NS_TIMER_WHEEL_SLOT_BITS*level);
+        int current_slot = ((current_tick >> shift) & NS_TIMER_WHEEL_SLOT_MASK);
+
+        // slots behind the current one are always empty, see ns_timer_wheel_link()
+        int slot = __builtin_ctzll(occupied);
+        if(slot < current_slot)
+        {
+            DebugPrintInfo();
+            slot = current_slot;
+        }
+
+        uint64_t block_start = ((current_tick >> (shift + NS_TIMER_WHEEL_SLOT_BITS)) << (shift + NS_TIMER_WHEEL_SLOT_BITS));
+        uint64_t event_tick = (block_start + ((uint64_t)slot << shift));
+        if(event_tick < current_tick)
+        {
+            event_tick = current_tick;
+        }
+
+        if(event_tick < next_event_tick)
+        {
+            next_event_tick = event_tick;
+        }
+    }
+
+    // the overflow list gets another look every time the top level wraps
+    if(timer_wheel->occupied[NS_TIMER_WHEEL_OVERFLOW_LEVEL] != 0)
+    {
+        int shift = (NS_TIMER_WHEEL_SLOT_BITS*NS_TIMER_WHEEL_NUM_LEVELS);
+        uint64_t event_tick = (((current_tick >> shift) + 1) << shift);
+        if(event_tick < next_event_tick)
+        {
+            next_event_tick = event_tick;
+        }
+    }
+
+    return next_event_tick;
+}
+
+/* API */
+
+void
+ns_timer_init(NsTimer *timer, void (*callback)(NsTimer *timer, void *data), void *data)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->is_armed = false;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+bool
+ns_timer_check_armed(NsTimer *timer)
+{
+    return timer->is_armed;
+}
+
+int
+ns_timer_wheel_create(NsTimerWheel *timer_wheel, uint64_t now_millis, uint64_t tick_millis = 1)
+{
+    if(tick_millis == 0)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    timer_wheel->start_millis = now_millis;
+    timer_wheel->tick_millis = tick_millis;
+    timer_wheel->current_tick = 0;
+    timer_wheel->num_timers = 0;
+
+    for(int level = 0; level < (NS_TIMER_WHEEL_NUM_LEVELS + 1); level++)
+    {
+        for(int slot = 0; slot < NS_TIMER_WHEEL_NUM_SLOTS; slot++)
+        {
+            NsTimer *head = &timer_wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+        timer_wheel->occupied[level] = 0;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Does nothing if the timer isn't armed. */
+void
+ns_timer_wheel_cancel(NsTimerWheel *timer_wheel, NsTimer *timer)
+{
+    if(!timer->is_armed)
+    {
+        return;
+    }
+
+    ns_timer_wheel_unlink(timer_wheel, timer);
+    timer->is_armed = false;
+    timer_wheel->num_timers--;
+}
+
+/* Re-arms the timer if it's already armed. */
+void
+ns_timer_wheel_arm(NsTimerWheel *timer_wheel, NsTimer *timer, uint64_t now_millis, uint64_t timeout_millis)
+{
+    ns_timer_wheel_cancel(timer_wheel, timer);
+
+    // round up so we never fire early
+    uint64_t expiry_millis = (now_millis + timeout_millis);
+    uint64_t expiry_tick = 0;
+    if(expiry_millis > timer_wheel->start_millis)
+    {
+        expiry_tick = ((expiry_millis - timer_wheel->start_millis + timer_wheel->tick_millis - 1) / timer_wheel->tick_millis);
+    }
+
+    if(expiry_tick < timer_wheel->current_tick)
+    {
+        expiry_tick = timer_wheel->current_tick;
+    }
+
+    timer->expiry_tick = expiry_tick;
+    timer->is_armed = true;
+    ns_timer_wheel_link(timer_wheel, timer);
+    timer_wheel->num_timers++;
+}
+
+/* Fires every timer that's due by now_millis. Callbacks may arm and cancel timers,
+   including their own. Returns the number of timers fired. */
+int
+ns_timer_wheel_advance(NsTimerWheel *timer_wheel, uint64_t now_millis)
+{
+    if(now_millis < timer_wheel->start_millis)
+    {
+        return 0;
+    }
+
+    uint64_t target_tick = ((now_millis - timer_wheel->start_millis) / timer_wheel->tick_millis);
+    int num_fired = 0;
+
+    while(timer_wheel->current_tick <= target_tick)
+    {
+        // skip straight to the next tick where something happens
+        uint64_t tick = ns_timer_wheel_get_next_event_tick(timer_wheel);
+        if(tick > target_tick)
+        {
+            timer_wheel->current_tick = (target_tick + 1);
+            break;
+        }
+        timer_wheel->current_tick = tick;
+
+        // cascade from the top down so timers can fall through more than one level
+        int overflow_shift = (NS_TIMER_WHEEL_SLOT_BITS*NS_TIMER_WHEEL_NUM_LEVELS);
+        if((tick & (((uint64_t)1 << overflow_shift) - 1)) == 0)
+        {
+            ns_timer_wheel_cascade(timer_wheel, NS_TIMER_WHEEL_OVERFLOW_LEVEL, 0);
+        }
+
+        for(int level = (NS_TIMER_WHEEL_NUM_LEVELS - 1); level > 0; level--)
+        {
+            int shift = (NS_TIMER_WHEEL_SLOT_BITS*level);
+            if((tick & (((uint64_t)1 << shift) - 1)) == 0)
+            {
+                ns_timer_wheel_cascade(timer_wheel, level, ((tick >> shift) & NS_TIMER_WHEEL_SLOT_MASK));
+            }
+        }
+
+        NsTimer expired;
+        ns_timer_wheel_take_slot(timer_wheel, 0, (tick & NS_TIMER_WHEEL_SLOT_MASK), &expired);
+
+        // move on before firing so anything armed from a callback lands in the future
+        timer_wheel->current_tick = (tick + 1);
+
+        while(!ns_timer_wheel_slot_check_empty(&expired))
+        {
+            NsTimer *timer = expired.next;
+            expired.next = timer->next;
+            timer->next->prev = &expired;
+
+            timer->is_armed = false;
+            timer_wheel->num_timers--;
+            num_fired++;
+
+            timer->callback(timer, timer->data);
+        }
+    }
+
+    return num_fired;
+}
+
+/* How long the event loop can sleep before the next deadline, or -1 if there are no
+   timers. May wake a little early when a higher level needs cascading. */
+int
+ns_timer_wheel_get_timeout_millis(NsTimerWheel *timer_wheel, uint64_t now_millis)
+{
+    if(timer_wheel->num_timers == 0)
+    {
+        return -1;
+    }
+
+    uint64_t next_event_tick = ns_timer_wheel_get_next_event_tick(timer_wheel);
+    uint64_t next_event_millis = (timer_wheel->start_millis + next_event_tick*timer_wheel->tick_millis);
+    if(next_event_millis <= now_millis)
+    {
+        return 0;
+    }
+
+    uint64_t timeout_millis = (next_event_millis - now_millis);
+    if(timeout_millis > INT32_MAX)
+    {
+        timeout_millis = INT32_MAX;
+    }
+    return (int)timeout_millis;
+}
+
+int
+ns_timer_wheel_get_num_timers(NsTimerWheel *timer_wheel)
+{
+    return timer_wheel->num_timers;
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef NS_TRACE_H
+#define NS_TRACE_H
+
+#include "ns_common.h"
+#include "ns_atomic.h"
+#include "ns_thread.h"
+#include "ns_thread_slots.h"
+#include "ns_time.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+#include <stdio.h>
+
+
+// per thread. must be a power of 2. once a thread's buffer is full its oldest spans are
+// overwritten, so a dump shows the most recent ones.
+#if !defined(NS_TRACE_EVENTS_PER_THREAD)
+    #define NS_TRACE_EVENTS_PER_THREAD 65536
+#endif
+
+// threads alive at once beyond this many aren't traced. a thread that starts after
+// another exits takes over its buffer, and its track in the dump.
+#if !defined(NS_TRACE_MAX_THREADS)
+    #define NS_TRACE_MAX_THREADS 64
+#endif
+
+#define NS_TRACE_CONCAT_(A, B) A##B
+#define NS_TRACE_CONCAT(A, B) NS_TRACE_CONCAT_(A, B)
+
+/* Traces the rest of the enclosing scope. Name must be a string literal. */
+#define NsTraceSpan(Name) NsTraceScope NS_TRACE_CONCAT(ns_trace_scope_, __LINE__)(Name)
+
+
+struct NsTraceEvent
+{
+    const char *name;
+    uint64_t start_ticks;
+    uint64_t end_ticks;
+};
+
+struct NsTraceBuffer
+{
+    uint64_t num_events; // total ever recorded; the buffer holds the last NS_TRACE_EVENTS_PER_THREAD
+    uint32_t thread_idx;
+    const char *thread_name;
+    NsTraceEvent events[NS_TRACE_EVENTS_PER_THREAD];
+};
+
+struct NsTraceContext
+{
+    NsTraceBuffer buffers[NS_TRACE_MAX_THREADS];
+    NsThreadSlots buffer_slots;
+    uint32_t is_enabled;
+
+    uint64_t start_ticks;
+    double ticks_per_micro;
+};
+
+
+global NsTraceContext ns_trace_context;
+internal thread_local NsThreadSlot ns_trace_thread_slot;
+internal thread_local const char *ns_trace_thread_name;
+
+
+/* Internal */
+
+/* The TSC where there is one. It's assumed to be invariant (constant rate, synced across
+   cores), which anything x86 from the last decade is. */
+inline internal uint64_t
+ns_trace_get_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return ns_time_get_nanos();
+#endif
+}
+
+/* Returns NULL if every buffer's taken by a live thread. */
+internal NsTraceBuffer *
+ns_trace_get_thread_buffer()
+{
+    bool has_tried = ns_trace_thread_slot.has_tried;
+    uint32_t thread_idx = ns_thread_slot_get(&ns_trace_thread_slot, &ns_trace_context.buffer_slots);
+    if(thread_idx == NS_THREAD_SLOT_NONE)
+    {
+        return NULL;
+    }
+
+    NsTraceBuffer *buffer = &ns_trace_context.buffers[thread_idx];
+    if(!has_tried)
+    {
+        buffer->thread_idx = thread_idx;
+        buffer->thread_name = ns_trace_thread_name;
+    }
+    return buffer;
+}
+
+/* API */
+
+inline bool
+ns_trace_is_enabled()
+{
+    bool result = (ns_atomic_load_relaxed(&ns_trace_context.is_enabled) != 0);
+    return result;
+}
+
+/* Records a span that's already over. Does nothing if tracing's off. start_ticks can come
+   from another thread, like when work was queued. */
+inline void
+ns_trace_record(const char *name, uint64_t start_ticks, uint64_t end_ticks)
+{
+    if(!ns_trace_is_enabled())
+    {
+        return;
+    }
+
+    NsTraceBuffer *buffer = ns_trace_get_thread_buffer();
+    if(buffer == NULL)
+    {
+        return;
+    }
+
+    NsTraceEvent *event = &buffer->events[buffer->num_events & (NS_TRACE_EVENTS_PER_THREAD - 1)];
+    event->name = name;
+    event->start_ticks = start_ticks;
+    event->end_ticks = end_ticks;
+    ns_atomic_store(&buffer->num_events, buffer->num_events + 1);
+}
+
+/* Use NsTraceSpan(). Costs a relaxed load and a branch when tracing's off. */
+struct NsTraceScope
+{
+    const char *name;
+    uint64_t start_ticks;
+
+    NsTraceScope(const char *span_name)
+    {
+        name = span_name;
+        start_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
+    }
+
+    ~NsTraceScope()
+    {
+        if(start_ticks != 0)
+        {
+            ns_trace_record(name, start_ticks, ns_trace_get_ticks());
+        }
+    }
+};
+
+/* Names the calling thread's track in the dump. Must be a string literal (or otherwise
+   live forever). */
+void
+ns_trace_set_thread_name(const char *name)
+{
+    ns_trace_thread_name = name;
+    uint32_t thread_idx = ns_trace_thread_slot.idx;
+    if(thread_idx != NS_THREAD_SLOT_NONE)
+    {
+        ns_trace_context.buffers[thread_idx].thread_name = name;
+    }
+}
+
+/* Works out how fast the tick counter runs, which takes a few milliseconds. Tracing starts
+   off; turn it on with ns_trace_set_enabled(). */
+int
+ns_trace_startup()
+{
+    int status;
+
+    uint64_t start_nanos = ns_time_get_nanos();
+    uint64_t start_ticks = ns_trace_get_ticks();
+
+    status = ns_thread_sleep(10);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    uint64_t end_nanos = ns_time_get_nanos();
+    uint64_t end_ticks = ns_trace_get_ticks();
+
+    ns_thread_slots_create(&ns_trace_context.buffer_slots, NS_TRACE_MAX_THREADS);
+    ns_trace_context.ticks_per_micro = ((double)(end_ticks - start_ticks)*1000.0/(double)(end_nanos - start_nanos));
+    ns_trace_context.start_ticks = start_ticks;
+
+    return NS_SUCCESS;
+}
+
+void
+ns_trace_set_enabled(bool is_enabled)
+{
+    ns_atomic_store(&ns_trace_context.is_enabled, (uint32_t)is_enabled);
+}
+
+/* Writes every buffered span as Chrome trace event JSON, which chrome://tracing and
+   ui.perfetto.dev both open. Turn tracing off first; spans recorded during the dump can
+   come out torn. */
+int
+ns_trace_dump(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if(file == NULL)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    double ticks_per_micro = (ns_trace_context.ticks_per_micro > 0.0) ? ns_trace_context.ticks_per_micro : 1000.0;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool is_first = true;
+
+    uint32_t num_buffers = ns_thread_slots_get_num_used(&ns_trace_context.buffer_slots);
+    for(uint32_t i = 0; i < num_buffers; i++)
+    {
+        NsTraceBuffer *buffer = &ns_trace_context.buffers[i];
+
+        if(buffer->thread_name != NULL)
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    is_first ? "" : ",\n", buffer->thread_idx, buffer->thread_name);
+            is_first = false;
+        }
+
+        uint64_t num_events = ns_atomic_load(&buffer->num_events);
+        uint64_t first_event = (num_events > NS_TRACE_EVENTS_PER_THREAD) ? (num_events - NS_TRACE_EVENTS_PER_THREAD) : 0;
+        for(uint64_t j = first_event; j < num_events; j++)
+        {
+            NsTraceEvent *event = &buffer->events[j & (NS_TRACE_EVENTS_PER_THREAD - 1)];
+
+            // the start can be from before we calibrated, or from another core's clock
+            int64_t start = (int64_t)(event->start_ticks - ns_trace_context.start_ticks);
+            int64_t duration = (int64_t)(event->end_ticks - event->start_ticks);
+            if(duration < 0)
+            {
+                duration = 0;
+            }
+
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    is_first ? "" : ",\n", event->name, buffer->thread_idx,
+                    (double)start/ticks_per_micro, (double)duration/ticks_per_micro);
+            is_first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if(fclose(file) != 0)
+    {
+        DebugPrintOsInfo();
+        return NS_ERROR;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Drops everything recorded so far. Only safe while tracing's off and nothing is
+   recording. */
+void
+ns_trace_reset()
+{
+    uint32_t num_buffers = ns_thread_slots_get_num_used(&ns_trace_context.buffer_slots);
+    for(uint32_t i = 0; i < num_buffers; i++)
+    {
+        NsTraceBuffer *buffer = &ns_trace_context.buffers[i];
+        ns_atomic_store(&buffer->num_events, (uint64_t)0);
+    }
+}
+
+#endif
@@ -7,16 +7,10 @@
 
 /* Bits */
 
-uint32_t ns_left_rotate(uint32_t value, int rots)
+/* rots must be in [1, 31]. Compiles down to a single rol. */
+inline uint32_t ns_left_rotate(uint32_t value, int rots)
 {
-    uint32_t mask = 0x80000000;
-    for(int i = 1; i < rots; i++)
-    {
-        mask = ((mask >> 1) | 0x80000000);
-    }
-
-    uint32_t shifted_off_bits = ((value & mask) >> (32 - rots));
-    uint32_t rotated_value = ((value << rots) | shifted_off_bits);
+    uint32_t rotated_value = ((value << rots) | (value >> (32 - rots)));
     return rotated_value;
 }
 
@@ -31,7 +25,7 @@ uint16_t ns_get16be(uint8_t *src)
 
 uint64_t ns_get64be(uint8_t *src)
 {
-    uint16_t result = (((uint64_t)src[0] << 56) |
+    uint64_t result = (((uint64_t)src[0] << 56) |
                        ((uint64_t)src[1] << 48) |
                        ((uint64_t)src[2] << 40) |
                        ((uint64_t)src[3] << 32) |
@@ -92,6 +86,8 @@ inline char ns_to_base64(int Value)
     return (char)Result;
 }
 
+// only for programs that have ns_game_math.h's v4
+#if defined(NS_GAME_MATH_H)
 /* i.e. "FFFFFF" to (1, 1, 1, 1) */
 inline internal v4 ns_hex_string_to_vec(const char *HexString)
 {
@@ -106,5 +102,6 @@ inline internal v4 ns_hex_string_to_vec(const char *HexString)
     Result[3] = 1.0f;
     return Result;
 }
+#endif
 
 #endif
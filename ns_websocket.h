@@ -14,8 +14,60 @@ TODO: add some sort of error callback
 #include "ns_condv.h"
 #include "ns_memory.h"
 #include "ns_worker_threads.h"
+#include "ns_numa.h"
 #include "ns_poll_fds.h"
+#include "ns_atomic.h"
+#include "ns_index_stack.h"
+#include "ns_mpsc_queue.h"
+#include "ns_strand.h"
+#include "ns_time.h"
+#include "ns_timer_wheel.h"
+#include "ns_metrics.h"
+#include "ns_log.h"
+#include "ns_trace.h"
+
+
+// per connection. must be a power of 2.
+#if !defined(NS_WEBSOCKET_MAX_QUEUED_MESSAGES)
+    #define NS_WEBSOCKET_MAX_QUEUED_MESSAGES 256
+#endif
+
+// frames that don't fit in a pool node get their own allocation
+#if !defined(NS_WEBSOCKET_MESSAGE_POOL_SIZE)
+    #define NS_WEBSOCKET_MESSAGE_POOL_SIZE 1024
+#endif
+#if !defined(NS_WEBSOCKET_MESSAGE_POOL_FRAME_SIZE)
+    #define NS_WEBSOCKET_MESSAGE_POOL_FRAME_SIZE Kilobytes(4)
+#endif
+
+// per connection. frames are reassembled here, so no frame can be bigger than this.
+#if !defined(NS_WEBSOCKET_RECEIVE_BUFFER_SIZE)
+    #define NS_WEBSOCKET_RECEIVE_BUFFER_SIZE Kilobytes(16)
+#endif
+
+// handshakes still reading the request or writing the reply, plus finished ones
+// ns_websocket_accept() hasn't picked up yet. we stop accepting when this fills up.
+#if !defined(NS_WEBSOCKET_MAX_PENDING_HANDSHAKES)
+    #define NS_WEBSOCKET_MAX_PENDING_HANDSHAKES 64
+#endif
+#if !defined(NS_WEBSOCKET_HANDSHAKE_TIMEOUT_MILLIS)
+    #define NS_WEBSOCKET_HANDSHAKE_TIMEOUT_MILLIS 5000
+#endif
+
+// we ping idle peers and close the ones that don't pong back in time
+#if !defined(NS_WEBSOCKET_PING_INTERVAL_MILLIS)
+    #define NS_WEBSOCKET_PING_INTERVAL_MILLIS 30000
+#endif
+#if !defined(NS_WEBSOCKET_PONG_TIMEOUT_MILLIS)
+    #define NS_WEBSOCKET_PONG_TIMEOUT_MILLIS 10000
+#endif
 
+#define NS_WEBSOCKET_MESSAGE_NOT_POOLED 0xffffffff
+
+// returned by ns_websocket_try_receive() when there's nothing to read
+#define NS_WEBSOCKET_NO_MESSAGE -4
+#define NS_WEBSOCKET_CLOSED -5
+#define NS_WEBSOCKET_FRAME_TOO_LARGE -6
 
 #define NS_WEBSOCKET_KEY_HEADER "Sec-WebSocket-Key: "
 #define NS_WEBSOCKET_KEY_HEADER_LENGTH strlen(NS_WEBSOCKET_KEY_HEADER)
@@ -44,16 +96,50 @@ struct NsWebSocketMessage
     uint8_t *payload;
     int payload_length;
 
-    NsWebSocketMessage *next;
+    // index of this message's node in the pool, or NS_WEBSOCKET_MESSAGE_NOT_POOLED
+    uint32_t pool_idx;
+    uint32_t next_free;
+};
+
+struct NsWebSocketMessagePool
+{
+    uint8_t *memory;
+    uint32_t node_size;
+    uint32_t capacity;
+    NsIndexStack free_stack;
 };
 
 struct NsWebSocket
 {
     NsSocket socket;
 
+    // inbound messages. the worker threads add to the queue and whoever calls
+    // ns_websocket_receive() gets from it. the semaphore counts published messages.
     NsSemaphore message_semaphore;
-    NsWebSocketMessage *message_head;
-    NsWebSocketMessage *message_tail;
+    NsMpscQueue message_queue;
+    NsWebSocketMessage *partial_message; // message the user has only read part of
+    uint32_t max_queue_depth;
+
+    // frames are handled in the order they arrived, one at a time per websocket
+    NsStrand strand;
+
+    // held while a frame goes out, so the user's frames, our pings and the handler's pongs
+    // can't end up interleaved on the wire
+    NsMutex send_mutex;
+
+    // bytes read off the socket that don't make up a whole frame yet. only touched by the
+    // receiver thread.
+    uint8_t *receive_buffer;
+    uint32_t receive_length;
+
+    // only touched by the receiver thread, except has_pong_arrived, which the handler sets
+    NsTimer ping_timer;
+    bool is_ping_outstanding;
+    uint32_t has_pong_arrived;
+
+    // set once we've been taken out of the poll fds, by ns_websocket_close() or because 
+    // the peer stopped answering pings
+    uint32_t is_removed;
 };
 
 struct NsWebSocketFrame
@@ -69,11 +155,64 @@ struct NsWebSocketFrame
     uint8_t *payload;
 };
 
+enum NsWebSocketHandshakeState
+{
+    NS_WEBSOCKET_HANDSHAKE_FREE,
+    NS_WEBSOCKET_HANDSHAKE_READING_REQUEST,
+    NS_WEBSOCKET_HANDSHAKE_WRITING_REPLY,
+    NS_WEBSOCKET_HANDSHAKE_DONE, // waiting for ns_websocket_accept()
+};
+
+struct NsWebSocketHandshake
+{
+    NsWebSocketHandshakeState state;
+    NsSocket socket;
+    NsTimer timer;
+
+    char request[4096];
+    int request_length;
+
+    char reply[512];
+    int reply_length;
+    int reply_bytes_sent;
+
+    uint32_t next_free;
+};
+
+struct NsWebSocketMetrics
+{
+    NsMetricsCounter connections_accepted;
+    NsMetricsCounter connections_removed;
+    NsMetricsCounter bytes_received;
+    NsMetricsCounter frames_received;
+    NsMetricsCounter frames_dropped; // the websocket's strand was full
+    NsMetricsCounter messages_dropped; // the user wasn't receiving fast enough
+    NsMetricsGauge work_queue_depth;
+    NsMetricsHistogram work_queue_wait_time;
+};
+
 struct NsWebSocketContext
 {
+    NsWebSocketMessagePool message_pool;
     NsWorkerThreads worker_threads;
     NsPollFds poll_fds;
     NsThread ns_websocket_receiver_thread;
+
+    // ping timers. accept arms, close cancels and the receiver thread fires.
+    NsTimerWheel timer_wheel;
+    NsMutex timer_mutex;
+
+    // handshakes run on their own event loop so a slow client can't hold up accepting
+    NsWebSocket *listen_websocket;
+    NsThread ns_websocket_handshake_thread;
+    NsWebSocketHandshake *handshakes;
+    NsTimerWheel handshake_timer_wheel; // only touched by the handshake thread
+    NsIndexStack free_handshakes;
+    NsMpscQueue done_handshakes;
+    NsSemaphore done_handshakes_semaphore;
+    NsMutex accept_mutex;
+
+    NsWebSocketMetrics metrics;
 };
 
 
@@ -84,6 +223,9 @@ int ns_websocket_create(NsWebSocket *websocket, const char *port);
 int ns_websocket_destroy(NsWebSocket *websocket);
 int ns_websocket_accept(NsWebSocket *websocket, NsWebSocket *peer_websocket);
 int ns_websocket_receive(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size);
+int ns_websocket_try_receive(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size);
+int ns_websocket_receive_batch(NsWebSocket *websocket, NsWebSocketMessage **messages, int max_messages, bool is_blocking = true);
+void ns_websocket_message_release(NsWebSocketMessage *message);
 int ns_websocket_send(NsWebSocket *websocket, uint8_t *message, uint32_t message_length, NsWebSocketDataType data_type);
 int ns_websocket_close(NsWebSocket *websocket);
 
@@ -127,99 +269,337 @@ ns_websocket_frame_inflate(uint8_t *raw_frame)
         frame.mask_key = &raw_frame[10];
     }
 
-    frame.payload = (frame.mask_key + 4);
+    frame.payload = frame.mask ? (frame.mask_key + 4) : frame.mask_key;
 
     return frame;
 }
 
-/* message linked list */
+/* Sets *frame_length_ptr to the length of the whole frame at the start of data, or to 0
+   if there isn't enough of it yet to tell. Returns NS_WEBSOCKET_FRAME_TOO_LARGE for a
+   frame that couldn't fit in the receive buffer, which includes any 64-bit length with
+   the top bit set (RFC 6455 doesn't allow those). The length comes from the peer, so
+   it's checked before it's added to anything. */
+internal int
+ns_websocket_frame_get_length(uint8_t *data, uint32_t data_length, uint32_t *frame_length_ptr)
+{
+    *frame_length_ptr = 0;
+    if(data_length < 2)
+    {
+        return NS_SUCCESS;
+    }
+
+    uint64_t header_length = 2;
+    uint64_t payload_length = (data[1] & 0x7f);
+    if(payload_length == 126)
+    {
+        header_length += 2;
+        if(data_length < header_length)
+        {
+            return NS_SUCCESS;
+        }
+        payload_length = ns_get16be(&data[2]);
+    }
+    else if(payload_length == 127)
+    {
+        header_length += 8;
+        if(data_length < header_length)
+        {
+            return NS_SUCCESS;
+        }
+        payload_length = ns_get64be(&data[2]);
+    }
+
+    if((data[1] & 0x80) != 0)
+    {
+        header_length += 4;
+    }
+
+    if((payload_length >> 63) != 0 ||
+       payload_length > (NS_WEBSOCKET_RECEIVE_BUFFER_SIZE - header_length))
+    {
+        return NS_WEBSOCKET_FRAME_TOO_LARGE;
+    }
+
+    *frame_length_ptr = (uint32_t)(header_length + payload_length);
+    return NS_SUCCESS;
+}
+
+/* message pool */
 //{
+internal NsWebSocketMessage *
+ns_websocket_message_pool_get_node(NsWebSocketMessagePool *pool, uint32_t idx)
+{
+    NsWebSocketMessage *node = (NsWebSocketMessage *)(pool->memory + idx*pool->node_size);
+    return node;
+}
+
 internal int
-ns_websocket_message_add(NsWebSocket *websocket, NsWebSocketMessage *message)
+ns_websocket_message_pool_create(NsWebSocketMessagePool *pool, uint32_t capacity)
 {
-    int status;
+    // round up so nodes don't share cache lines
+    uint32_t node_size = (sizeof(NsWebSocketMessage) + NS_WEBSOCKET_MESSAGE_POOL_FRAME_SIZE);
+    node_size = ((node_size + NS_CACHE_LINE_SIZE - 1) & ~(NS_CACHE_LINE_SIZE - 1));
+
+    pool->memory = (uint8_t *)ns_memory_allocate(node_size*capacity);
+    if(pool->memory == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    pool->node_size = node_size;
+    pool->capacity = capacity;
+    ns_index_stack_create(&pool->free_stack);
 
-    message->next = NULL;
+    auto get_next_ptr = [pool](uint32_t idx) { return &ns_websocket_message_pool_get_node(pool, idx)->next_free; };
+    for(uint32_t i = capacity; i > 0; i--)
+    {
+        ns_index_stack_push(&pool->free_stack, i - 1, get_next_ptr);
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Gets a message with room for raw_frame_size bytes of frame. Falls back to its own
+   allocation if the frame's too big for a node or the pool is dry. */
+internal NsWebSocketMessage *
+ns_websocket_message_allocate(uint32_t raw_frame_size)
+{
+    NsWebSocketMessagePool *pool = &ns_websocket_context.message_pool;
+    auto get_next_ptr = [pool](uint32_t idx) { return &ns_websocket_message_pool_get_node(pool, idx)->next_free; };
 
-    // empty?
-    if(websocket->message_head == NULL)
+    NsWebSocketMessage *message;
+    uint32_t pool_idx;
+    if(raw_frame_size <= NS_WEBSOCKET_MESSAGE_POOL_FRAME_SIZE &&
+       ns_index_stack_pop(&pool->free_stack, &pool_idx, get_next_ptr))
     {
-        websocket->message_head = message;
-        websocket->message_tail = message;
+        message = ns_websocket_message_pool_get_node(pool, pool_idx);
+        message->pool_idx = pool_idx;
     }
     else
     {
-        websocket->message_tail->next = message;
-        websocket->message_tail = message;
+        message = (NsWebSocketMessage *)ns_memory_allocate(sizeof(NsWebSocketMessage) + raw_frame_size);
+        if(message == NULL)
+        {
+            DebugPrintInfo();
+            return NULL;
+        }
+        message->pool_idx = NS_WEBSOCKET_MESSAGE_NOT_POOLED;
     }
 
-    status = ns_semaphore_put(&websocket->message_semaphore);
+    message->raw_frame = (uint8_t *)(message + 1);
+    return message;
+}
+//}
+
+/* message queue */
+//{
+internal int
+ns_websocket_message_queue_create(NsWebSocket *websocket)
+{
+    int status;
+
+    status = ns_semaphore_create(&websocket->message_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_mpsc_queue_create(&websocket->message_queue, NS_WEBSOCKET_MAX_QUEUED_MESSAGES);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    websocket->partial_message = NULL;
+    websocket->max_queue_depth = 0;
+
     return NS_SUCCESS;
 }
 
 internal int
-ns_websocket_message_get(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size)
+ns_websocket_message_queue_destroy(NsWebSocket *websocket)
 {
     int status;
 
-    status = ns_semaphore_get(&websocket->message_semaphore);
+    // give back whatever the user never read
+    if(websocket->partial_message != NULL)
+    {
+        ns_websocket_message_release(websocket->partial_message);
+        websocket->partial_message = NULL;
+    }
+
+    void *message;
+    while(ns_mpsc_queue_try_get(&websocket->message_queue, &message))
+    {
+        ns_websocket_message_release((NsWebSocketMessage *)message);
+    }
+
+    status = ns_mpsc_queue_destroy(&websocket->message_queue);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    NsWebSocketMessage *head = websocket->message_head;
+    status = ns_semaphore_destroy(&websocket->message_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
 
-    // sanity check
-    if(head == NULL)
+    return NS_SUCCESS;
+}
+
+/* Can be called from any number of threads. */
+internal int
+ns_websocket_message_add(NsWebSocket *websocket, NsWebSocketMessage *message)
+{
+    int status;
+
+    if(!ns_mpsc_queue_try_add(&websocket->message_queue, message))
     {
+        // the user isn't keeping up. drop it rather than grow without bound.
         DebugPrintInfo();
+        ns_metrics_counter_add(&ns_websocket_context.metrics.messages_dropped);
+        ns_websocket_message_release(message);
         return NS_ERROR;
     }
 
-    int bytes_to_copy = ns_math_min((uint32_t)head->payload_length, (uint32_t)dest_size);
-    memcpy(dest, head->payload, bytes_to_copy);
+    // track high water mark
+    uint32_t queue_depth = ns_mpsc_queue_get_size(&websocket->message_queue);
+    uint32_t max_queue_depth = ns_atomic_load_relaxed(&websocket->max_queue_depth);
+    while(queue_depth > max_queue_depth &&
+          !ns_atomic_compare_exchange(&websocket->max_queue_depth, &max_queue_depth, queue_depth));
 
-    // did we copy the whole message?
-    if(bytes_to_copy == head->payload_length)
+    // only put after the add is published, so a get never finds the queue empty
+    status = ns_semaphore_put(&websocket->message_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Returns NS_WEBSOCKET_NO_MESSAGE if we're not blocking and the queue is empty. */
+internal int
+ns_websocket_message_pop(NsWebSocket *websocket, NsWebSocketMessage **message_ptr, bool is_blocking)
+{
+    int status;
+
+    if(is_blocking)
+    {
+        status = ns_semaphore_get(&websocket->message_semaphore);
+    }
+    else
     {
-        // single element?  
-        if(head->next == NULL)
+        status = ns_semaphore_try_get(&websocket->message_semaphore);
+        if(status == NS_TIMED_OUT)
         {
-            websocket->message_head = NULL;
-            websocket->message_tail = NULL;
+            return NS_WEBSOCKET_NO_MESSAGE;
         }
-        else
+    }
+
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    if(!ns_mpsc_queue_try_get(&websocket->message_queue, (void **)message_ptr))
+    {
+        // we were woken up because the peer's gone. leave the wake up for whoever's next.
+        if(ns_atomic_load(&websocket->is_removed))
         {
-            websocket->message_head = head->next;
+            status = ns_semaphore_put(&websocket->message_semaphore);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+
+            return NS_WEBSOCKET_CLOSED;
         }
-        ns_memory_free(head);
+
+        DebugPrintInfo();
+        return NS_ERROR;
     }
-    else
+
+    return NS_SUCCESS;
+}
+
+internal int
+ns_websocket_message_get(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size, bool is_blocking)
+{
+    int status;
+
+    // finish the last message before starting a new one
+    NsWebSocketMessage *message = websocket->partial_message;
+    if(message == NULL)
     {
-        head->payload += bytes_to_copy;
-        head->payload_length -= bytes_to_copy;
+        status = ns_websocket_message_pop(websocket, &message, is_blocking);
+        if(status == NS_WEBSOCKET_CLOSED)
+        {
+            return 0;
+        }
 
-        // we didn't read the whole message, so reverse our decrement
-        status = ns_semaphore_put(&websocket->message_semaphore);
         if(status != NS_SUCCESS)
         {
-            DebugPrintInfo();
             return status;
         }
     }
 
+    int bytes_to_copy = ns_math_min((uint32_t)message->payload_length, (uint32_t)dest_size);
+    memcpy(dest, message->payload, bytes_to_copy);
+
+    // did we copy the whole message?
+    if(bytes_to_copy == message->payload_length)
+    {
+        websocket->partial_message = NULL;
+        ns_websocket_message_release(message);
+    }
+    else
+    {
+        message->payload += bytes_to_copy;
+        message->payload_length -= bytes_to_copy;
+        websocket->partial_message = message;
+    }
+
     return bytes_to_copy;
 }
 //}
 
+/* Sends a whole frame under the websocket's send mutex. Returns what ns_socket_send()
+   does. */
+internal int
+ns_websocket_send_frame(NsWebSocket *websocket, uint8_t *frame, uint32_t frame_size)
+{
+    int status;
+
+    status = ns_mutex_lock(&websocket->send_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    int bytes_sent = ns_socket_send(&websocket->socket, frame, frame_size);
+
+    status = ns_mutex_unlock(&websocket->send_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return bytes_sent;
+}
+
 internal void *
 ns_websocket_message_handler_thread_entry(void *thread_input)
 {
@@ -227,7 +607,6 @@ ns_websocket_message_handler_thread_entry(void *thread_input)
 
     NsWebSocketMessage *new_message = (NsWebSocketMessage *)thread_input;
     NsWebSocket *websocket = new_message->websocket;
-    NsSocket *socket = &websocket->socket;
     uint8_t *raw_frame = new_message->raw_frame;
     int raw_frame_length = new_message->raw_frame_length;
 
@@ -238,27 +617,35 @@ ns_websocket_message_handler_thread_entry(void *thread_input)
         case NS_WEBSOCKET_OPCODE_TEXT:
         case NS_WEBSOCKET_OPCODE_BINARY:
         {
+            // the receiver thread checked the whole frame fits in raw_frame, so go by that
+            // rather than trusting the header again
+            int payload_length = (int)(raw_frame_length - (frame.payload - raw_frame));
+
             // decode
-            for(uint32_t i = 0; i < frame.payload_length; i++)
+            if(frame.mask)
             {
-                frame.payload[i] ^= frame.mask_key[i % 4];
+                for(int i = 0; i < payload_length; i++)
+                {
+                    frame.payload[i] ^= frame.mask_key[i % 4];
+                }
             }
 
             new_message->payload = frame.payload;
-            new_message->payload_length = frame.payload_length;
+            new_message->payload_length = payload_length;
             ns_websocket_message_add(websocket, new_message);
         } break;
 
         case NS_WEBSOCKET_OPCODE_CONNECTION_CLOSE:
         {
-            printf("websocket: received close request. closing...\n");
+            LogInfo("websocket: received close request. closing...");
 
             // finish closing process
-            int bytes_sent = ns_socket_send(socket, raw_frame, raw_frame_length);
+            int bytes_sent = ns_websocket_send_frame(websocket, raw_frame, raw_frame_length);
+            ns_websocket_message_release(new_message);
             if(bytes_sent < 0)
             {
                 DebugPrintInfo();
-                return (void *)bytes_sent;
+                return (void *)(intptr_t)bytes_sent;
             }
 
             // user should close websocket
@@ -266,111 +653,285 @@ ns_websocket_message_handler_thread_entry(void *thread_input)
 
         case NS_WEBSOCKET_OPCODE_PING:
         {
-            printf("received a ping\n");
+            LogDebug("websocket: received a ping");
 
             // change opcode to pong
             raw_frame[0] &= ~NS_WEBSOCKET_OPCODE_PING;
             raw_frame[0] |= NS_WEBSOCKET_OPCODE_PONG;
 
             // send pong
-            int bytes_sent = ns_socket_send(socket, raw_frame, raw_frame_length);
+            int bytes_sent = ns_websocket_send_frame(websocket, raw_frame, raw_frame_length);
+            ns_websocket_message_release(new_message);
             if(bytes_sent != raw_frame_length)
             {
                 DebugPrintInfo();
-                return (void *)bytes_sent;
+                return (void *)(intptr_t)bytes_sent;
             }
+        } break;
 
-            ns_memory_free(new_message);
+        case NS_WEBSOCKET_OPCODE_PONG:
+        {
+            ns_atomic_store(&websocket->has_pong_arrived, (uint32_t)1);
+            ns_websocket_message_release(new_message);
         } break;
 
         default:
         {
             DebugPrintInfo();
+            ns_websocket_message_release(new_message);
         } break;
     }
 
     return (void *)NS_SUCCESS;
 }
 
-internal void *
-ns_websocket_receiver_thread_entry(void *thread_data)
+/* ping timers */
+//{
+/* Takes a websocket whose peer has gone away out of the poll fds and wakes up anyone
+   waiting to receive from it. The user still has to ns_websocket_close() it. */
+internal void
+ns_websocket_remove_dead(NsWebSocket *websocket)
 {
     int status;
-    NsPollFd *pollfds = ns_poll_fds_get(&ns_websocket_context.poll_fds);
-    int pollfds_capacity = ns_poll_fds_get_capacity(&ns_websocket_context.poll_fds);
 
-    while(1)
+    if(ns_atomic_exchange(&websocket->is_removed, (uint32_t)1) != 0)
     {
-        status = ns_poll_fds_wait_till_nonempty_and_lock(&ns_websocket_context.poll_fds);
-        if(status != NS_SUCCESS)
-        {
-            DebugPrintInfo();
-            return (void *)status;
-        }
+        return;
+    }
 
-        int num_fds_ready = ns_socket_poll(pollfds, pollfds_capacity, 10);
-        if(num_fds_ready < 0)
-        {
-            DebugPrintInfo();
-            return (void *)NS_ERROR;
-        }
+    ns_metrics_counter_add(&ns_websocket_context.metrics.connections_removed);
 
-        status = ns_poll_fds_unlock(&ns_websocket_context.poll_fds);
-        if(status != NS_SUCCESS)
+    status = ns_poll_fds_remove(&ns_websocket_context.poll_fds, websocket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+
+    status = ns_semaphore_put(&websocket->message_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+}
+
+/* Runs on the receiver thread with the timer mutex held, so it mustn't wait on anything a
+   single peer can hold up: if a frame's already going out, or the peer's not reading and
+   there's no room for the ping, we just try again later. */
+internal void
+ns_websocket_ping_timer_callback(NsTimer *timer, void *data)
+{
+    NsWebSocket *websocket = (NsWebSocket *)data;
+    uint64_t now_millis = ns_time_get_millis();
+
+    if(websocket->is_ping_outstanding)
+    {
+        if(!ns_atomic_load(&websocket->has_pong_arrived))
         {
-            DebugPrintInfo();
-            return (void *)status;
+            LogInfo("websocket: peer didn't answer our ping. closing...");
+            ns_websocket_remove_dead(websocket);
+            return;
         }
 
-        if(num_fds_ready > 0)
-        {
-            for(int i = 0; i < pollfds_capacity; i++)
-            {
-                NsPollFd *pollfd = &pollfds[i];
-                if(pollfd->fd >= 0)
-                {
-                    // is this websocket ready for reading?
-                    if((pollfd->revents & NS_SOCKET_POLL_IN) != 0)
-                    {
-                        NsWebSocket *websocket = (NsWebSocket *)ns_poll_fds_get_container(&ns_websocket_context.poll_fds, i);
-                        NsSocket *socket = &websocket->socket;
+        websocket->is_ping_outstanding = false;
+        ns_timer_wheel_arm(&ns_websocket_context.timer_wheel, timer, now_millis, NS_WEBSOCKET_PING_INTERVAL_MILLIS);
+        return;
+    }
 
-                        int message_size = ns_socket_get_bytes_available(socket);
-                        if(message_size > 0)
-                        {
-                            NsWebSocketMessage *message = (NsWebSocketMessage *)ns_memory_allocate(sizeof(NsWebSocketMessage) + message_size);
-                            uint8_t *raw_frame = (uint8_t *)(message + 1);
+    if(!ns_mutex_try_lock(&websocket->send_mutex))
+    {
+        ns_timer_wheel_arm(&ns_websocket_context.timer_wheel, timer, now_millis, NS_WEBSOCKET_PONG_TIMEOUT_MILLIS);
+        return;
+    }
 
-                            int bytes_received = ns_socket_receive(socket, raw_frame, message_size);
-                            if(bytes_received == message_size)
-                            {
-                                // sanity check
-                                if(bytes_received != message_size)
-                                {
-                                    DebugPrintInfo();
-                                    return (void *)NS_ERROR;
-                                }
+    ns_atomic_store(&websocket->has_pong_arrived, (uint32_t)0);
 
-                                message->websocket = websocket;
-                                message->raw_frame = raw_frame;
-                                message->raw_frame_length = bytes_received;
+    uint8_t ping_frame[2] = { (0x80 | NS_WEBSOCKET_OPCODE_PING), 0x00 };
+    int bytes_sent = ns_socket_send(&websocket->socket, ping_frame, sizeof(ping_frame), false);
 
-                                status = ns_worker_threads_add_work(&ns_websocket_context.worker_threads, 
-                                                                    ns_websocket_message_handler_thread_entry, (void *)message);
-                                if(status != NS_SUCCESS)
-                                {
-                                    DebugPrintInfo();
-                                    return (void *)status;
-                                }
-                            }
-                            else if(bytes_received == 0)
-                            {
+    if(ns_mutex_unlock(&websocket->send_mutex) != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+
+    if(bytes_sent == NS_SOCKET_WOULD_BLOCK)
+    {
+        ns_timer_wheel_arm(&ns_websocket_context.timer_wheel, timer, now_millis, NS_WEBSOCKET_PONG_TIMEOUT_MILLIS);
+        return;
+    }
+
+    // half a ping can't be taken back, and the rest would have to wait for room
+    if(bytes_sent != sizeof(ping_frame))
+    {
+        ns_websocket_remove_dead(websocket);
+        return;
+    }
+
+    websocket->is_ping_outstanding = true;
+    ns_timer_wheel_arm(&ns_websocket_context.timer_wheel, timer, now_millis, NS_WEBSOCKET_PONG_TIMEOUT_MILLIS);
+}
+
+/* Fires expired timers and returns how long we can sleep until the next one, or -1. */
+internal int
+ns_websocket_fire_timers(int *timeout_millis_ptr)
+{
+    int status;
+
+    status = ns_mutex_lock(&ns_websocket_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    uint64_t now_millis = ns_time_get_millis();
+    ns_timer_wheel_advance(&ns_websocket_context.timer_wheel, now_millis);
+    *timeout_millis_ptr = ns_timer_wheel_get_timeout_millis(&ns_websocket_context.timer_wheel, now_millis);
+
+    status = ns_mutex_unlock(&ns_websocket_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+//}
+
+/* Hands every whole frame in the websocket's receive buffer to its strand and keeps the
+   partial one at the end, if any. A read can end anywhere: mid frame, or several frames in. */
+internal int
+ns_websocket_dispatch_frames(NsWebSocket *websocket)
+{
+    int status;
+    NsTraceSpan("dispatch");
+
+    uint8_t *buffer = websocket->receive_buffer;
+    uint32_t offset = 0;
+    while(1)
+    {
+        uint32_t length = (websocket->receive_length - offset);
+        uint32_t frame_length;
+        status = ns_websocket_frame_get_length(&buffer[offset], length, &frame_length);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        if(frame_length == 0 ||
+           frame_length > length)
+        {
+            break;
+        }
+
+        NsWebSocketMessage *message = ns_websocket_message_allocate(frame_length);
+        if(message == NULL)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+
+        memcpy(message->raw_frame, &buffer[offset], frame_length);
+        message->websocket = websocket;
+        message->raw_frame_length = (int)frame_length;
+
+        offset += frame_length;
+        ns_metrics_counter_add(&ns_websocket_context.metrics.frames_received);
+
+        status = ns_strand_add_work(&websocket->strand, (void *)message);
+        if(status == NS_STRAND_FULL)
+        {
+            // the handlers aren't keeping up. drop it rather than grow without bound.
+            DebugPrintInfo();
+            ns_metrics_counter_add(&ns_websocket_context.metrics.frames_dropped);
+            ns_websocket_message_release(message);
+        }
+        else if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    websocket->receive_length -= offset;
+    memmove(buffer, &buffer[offset], websocket->receive_length);
+
+    return NS_SUCCESS;
+}
+
+internal void *
+ns_websocket_receive_loop(void *thread_data)
+{
+    int status;
+    ns_trace_set_thread_name("websocket receiver");
+    NsPollFd *pollfds = ns_poll_fds_get(&ns_websocket_context.poll_fds);
+    int pollfds_capacity = ns_poll_fds_get_capacity(&ns_websocket_context.poll_fds);
+
+    while(1)
+    {
+        int timeout_millis;
+        status = ns_websocket_fire_timers(&timeout_millis);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return (void *)(intptr_t)status;
+        }
+
+        // new websockets and newly armed ping timers wake us, so we can sleep until the
+        // next timer
+        int num_fds_ready = ns_poll_fds_poll(&ns_websocket_context.poll_fds, timeout_millis);
+        if(num_fds_ready < 0)
+        {
+            DebugPrintInfo();
+            return (void *)NS_ERROR;
+        }
+
+        if(num_fds_ready > 0)
+        {
+            for(int i = 0; i < pollfds_capacity; i++)
+            {
+                NsPollFd *pollfd = &pollfds[i];
+                if(pollfd->fd >= 0)
+                {
+                    // is this websocket ready for reading?
+                    if((pollfd->revents & NS_SOCKET_POLL_IN) != 0)
+                    {
+                        NsWebSocket *websocket = (NsWebSocket *)ns_poll_fds_get_container(&ns_websocket_context.poll_fds, i);
+                        NsSocket *socket = &websocket->socket;
+
+                        int message_size = ns_socket_get_bytes_available(socket);
+                        if(message_size > 0)
+                        {
+                            // anything that doesn't fit is picked up on the next poll
+                            int buffer_space = (NS_WEBSOCKET_RECEIVE_BUFFER_SIZE - websocket->receive_length);
+                            int bytes_to_receive = ns_math_min(message_size, buffer_space);
+
+                            int bytes_received = ns_socket_receive(socket, &websocket->receive_buffer[websocket->receive_length], bytes_to_receive);
+                            if(bytes_received == bytes_to_receive)
+                            {
+                                websocket->receive_length += bytes_received;
+                                ns_metrics_counter_add(&ns_websocket_context.metrics.bytes_received, bytes_received);
+
+                                status = ns_websocket_dispatch_frames(websocket);
+                                if(status == NS_WEBSOCKET_FRAME_TOO_LARGE)
+                                {
+                                    LogWarn("websocket: peer sent a frame bigger than our receive buffer. closing...");
+                                    ns_websocket_remove_dead(websocket);
+                                }
+                                else if(status != NS_SUCCESS)
+                                {
+                                    DebugPrintInfo();
+                                    return (void *)(intptr_t)status;
+                                }
+                            }
+                            else if(bytes_received == 0)
+                            {
                                 // user should close websocket
                             }
                             else
                             {
                                 DebugPrintInfo();
-                                return (void *)bytes_received;
+                                return (void *)(intptr_t)bytes_received;
                             }
                         }
                         else if(message_size == 0)
@@ -381,12 +942,12 @@ ns_websocket_receiver_thread_entry(void *thread_data)
                         else if(message_size == NS_SOCKET_BAD_FD &&
                                 pollfd->fd == -1)
                         {
-                            printf("websocket: socket removed right out from under our noses!\n");
+                            LogDebug("websocket: socket removed right out from under our noses!");
                         }
                         else
                         {
                             DebugPrintInfo();
-                            return (void *)message_size;
+                            return (void *)(intptr_t)message_size;
                         }
                     }
                 }
@@ -394,8 +955,518 @@ ns_websocket_receiver_thread_entry(void *thread_data)
         }
     }
 
-    return (void *)NS_SUCCESS;
+    return (void *)NS_SUCCESS;
+}
+
+internal void *
+ns_websocket_receiver_thread_entry(void *thread_data)
+{
+    void *result = ns_websocket_receive_loop(thread_data);
+
+    // however we got out, removes shouldn't wait on us anymore
+    if(ns_poll_fds_stop_polling(&ns_websocket_context.poll_fds) != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+    }
+
+    return result;
+}
+
+/* handshakes */
+//{
+internal int
+ns_websocket_handshake_build_reply(NsWebSocketHandshake *handshake)
+{
+    int status;
+
+    char *request = handshake->request;
+
+    // find key
+    char *start_of_key = strstr(request, NS_WEBSOCKET_KEY_HEADER);
+    if(start_of_key == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+    start_of_key += NS_WEBSOCKET_KEY_HEADER_LENGTH;
+
+    char reply_key[128];
+    {
+        char peer_key[128];
+        {
+            // place key in buffer
+            int length = 0;
+            while(start_of_key[length] != '\r' &&
+                  start_of_key[length] != 0)
+            {
+                if(length >= 64)
+                {
+                    DebugPrintInfo();
+                    return NS_ERROR;
+                }
+
+                peer_key[length] = start_of_key[length];
+                length++;
+            }
+            peer_key[length] = 0;
+        }
+
+        strcat(peer_key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+
+        status = ns_sha1(peer_key, reply_key);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    int reply_length = snprintf(handshake->reply, sizeof(handshake->reply),
+                                "HTTP/1.1 101 Switching Protocols\r\n"
+                                "Upgrade: websocket\r\n"
+                                "Connection: Upgrade\r\n"
+                                "Sec-WebSocket-Accept: %s\r\n"
+                                "\r\n", reply_key);
+    if(reply_length <= 0 ||
+       reply_length >= (int)sizeof(handshake->reply))
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    handshake->reply_length = reply_length;
+    handshake->reply_bytes_sent = 0;
+
+    return NS_SUCCESS;
+}
+
+internal void
+ns_websocket_handshake_free(uint32_t handshake_idx)
+{
+    NsWebSocketHandshake *handshakes = ns_websocket_context.handshakes;
+    auto get_next_ptr = [handshakes](uint32_t idx) { return &handshakes[idx].next_free; };
+
+    handshakes[handshake_idx].state = NS_WEBSOCKET_HANDSHAKE_FREE;
+    ns_index_stack_push(&ns_websocket_context.free_handshakes, handshake_idx, get_next_ptr);
+}
+
+internal void
+ns_websocket_handshake_fail(uint32_t handshake_idx)
+{
+    NsWebSocketHandshake *handshake = &ns_websocket_context.handshakes[handshake_idx];
+    ns_timer_wheel_cancel(&ns_websocket_context.handshake_timer_wheel, &handshake->timer);
+    ns_socket_close(&handshake->socket);
+    ns_websocket_handshake_free(handshake_idx);
+}
+
+internal void
+ns_websocket_handshake_timer_callback(NsTimer *, void *data)
+{
+    LogInfo("websocket: handshake timed out");
+    ns_websocket_handshake_fail((uint32_t)(uintptr_t)data);
+}
+
+/* Moves the handshake along as far as it can go without blocking. */
+internal int
+ns_websocket_handshake_advance(uint32_t handshake_idx)
+{
+    int status;
+
+    NsWebSocketHandshake *handshake = &ns_websocket_context.handshakes[handshake_idx];
+    NsSocket *socket = &handshake->socket;
+
+    if(handshake->state == NS_WEBSOCKET_HANDSHAKE_READING_REQUEST)
+    {
+        int space_left = (sizeof(handshake->request) - 1 - handshake->request_length);
+        int bytes_received = ns_socket_receive(socket, &handshake->request[handshake->request_length], space_left);
+        if(bytes_received == NS_SOCKET_WOULD_BLOCK)
+        {
+            return NS_SUCCESS;
+        }
+
+        if(bytes_received <= 0)
+        {
+            return NS_ERROR;
+        }
+
+        handshake->request_length += bytes_received;
+        handshake->request[handshake->request_length] = 0;
+
+        if(strstr(handshake->request, "\r\n\r\n") == NULL)
+        {
+            // is there room for the rest?
+            if(handshake->request_length == (int)(sizeof(handshake->request) - 1))
+            {
+                DebugPrintInfo();
+                return NS_ERROR;
+            }
+
+            return NS_SUCCESS;
+        }
+
+        status = ns_websocket_handshake_build_reply(handshake);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        handshake->state = NS_WEBSOCKET_HANDSHAKE_WRITING_REPLY;
+    }
+
+    if(handshake->state == NS_WEBSOCKET_HANDSHAKE_WRITING_REPLY)
+    {
+        int bytes_sent = ns_socket_send(socket, &handshake->reply[handshake->reply_bytes_sent],
+                                        handshake->reply_length - handshake->reply_bytes_sent);
+        if(bytes_sent == NS_SOCKET_WOULD_BLOCK)
+        {
+            return NS_SUCCESS;
+        }
+
+        if(bytes_sent <= 0)
+        {
+            return NS_ERROR;
+        }
+
+        handshake->reply_bytes_sent += bytes_sent;
+        if(handshake->reply_bytes_sent < handshake->reply_length)
+        {
+            return NS_SUCCESS;
+        }
+
+        // the rest of the websocket code expects blocking sockets
+        status = ns_socket_set_blocking(socket, true);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        ns_timer_wheel_cancel(&ns_websocket_context.handshake_timer_wheel, &handshake->timer);
+        handshake->state = NS_WEBSOCKET_HANDSHAKE_DONE;
+
+        // the queue holds as many as there are handshakes, so this can't fail
+        if(!ns_mpsc_queue_try_add(&ns_websocket_context.done_handshakes, (void *)(uintptr_t)handshake_idx))
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+
+        status = ns_semaphore_put(&ns_websocket_context.done_handshakes_semaphore);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Accepts until the backlog's empty or we're out of handshakes. */
+internal int
+ns_websocket_handshake_accept_all(uint64_t now_millis)
+{
+    int status;
+
+    NsWebSocketHandshake *handshakes = ns_websocket_context.handshakes;
+    auto get_next_ptr = [handshakes](uint32_t idx) { return &handshakes[idx].next_free; };
+
+    while(1)
+    {
+        uint32_t handshake_idx;
+        if(!ns_index_stack_pop(&ns_websocket_context.free_handshakes, &handshake_idx, get_next_ptr))
+        {
+            return NS_SUCCESS;
+        }
+
+        NsWebSocketHandshake *handshake = &handshakes[handshake_idx];
+        status = ns_socket_accept(&ns_websocket_context.listen_websocket->socket, &handshake->socket);
+        if(status != NS_SUCCESS)
+        {
+            ns_websocket_handshake_free(handshake_idx);
+
+            if(status == NS_SOCKET_WOULD_BLOCK)
+            {
+                return NS_SUCCESS;
+            }
+
+            DebugPrintInfo();
+            return status;
+        }
+
+        handshake->socket.completion_callback = NULL;
+        handshake->socket.extra_data_void_ptr = NULL;
+
+        status = ns_socket_set_blocking(&handshake->socket, false);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            ns_websocket_handshake_fail(handshake_idx);
+            continue;
+        }
+
+        // every frame is written whole, so nagle would only hold small ones back
+        status = ns_socket_set_no_delay(&handshake->socket, true);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            ns_websocket_handshake_fail(handshake_idx);
+            continue;
+        }
+
+        handshake->state = NS_WEBSOCKET_HANDSHAKE_READING_REQUEST;
+        handshake->request_length = 0;
+
+        ns_timer_init(&handshake->timer, ns_websocket_handshake_timer_callback, (void *)(uintptr_t)handshake_idx);
+        ns_timer_wheel_arm(&ns_websocket_context.handshake_timer_wheel, &handshake->timer,
+                           now_millis, NS_WEBSOCKET_HANDSHAKE_TIMEOUT_MILLIS);
+
+        // the request is often already here
+        status = ns_websocket_handshake_advance(handshake_idx);
+        if(status != NS_SUCCESS)
+        {
+            ns_websocket_handshake_fail(handshake_idx);
+        }
+    }
+}
+
+internal void *
+ns_websocket_handshake_thread_entry(void *thread_input)
+{
+    int status;
+
+    NsWebSocketHandshake *handshakes = ns_websocket_context.handshakes;
+    NsInternalSocket listen_internal_socket = ns_socket_get_internal(&ns_websocket_context.listen_websocket->socket);
+
+    // one for the listening socket, one for each handshake
+    NsPollFd pollfds[1 + NS_WEBSOCKET_MAX_PENDING_HANDSHAKES];
+    uint32_t pollfd_handshake_idxs[1 + NS_WEBSOCKET_MAX_PENDING_HANDSHAKES];
+
+    while(1)
+    {
+        // expire anyone who's taking too long and find out how long we can sleep
+        uint64_t now_millis = ns_time_get_millis();
+        ns_timer_wheel_advance(&ns_websocket_context.handshake_timer_wheel, now_millis);
+        int timeout_millis = ns_timer_wheel_get_timeout_millis(&ns_websocket_context.handshake_timer_wheel, now_millis);
+
+        int num_pollfds = 0;
+        {
+            // don't accept more than we have room for
+            if(!ns_index_stack_check_empty(&ns_websocket_context.free_handshakes))
+            {
+                NsPollFd *pollfd = &pollfds[num_pollfds++];
+                pollfd->fd = listen_internal_socket;
+                pollfd->events = NS_SOCKET_POLL_IN;
+                pollfd->revents = 0;
+            }
+            // we're full until ns_websocket_accept() frees one up, so check back soon
+            else if(timeout_millis < 0 || timeout_millis > 10)
+            {
+                timeout_millis = 10;
+            }
+
+            for(uint32_t i = 0; i < NS_WEBSOCKET_MAX_PENDING_HANDSHAKES; i++)
+            {
+                NsWebSocketHandshake *handshake = &handshakes[i];
+                if(handshake->state != NS_WEBSOCKET_HANDSHAKE_READING_REQUEST &&
+                   handshake->state != NS_WEBSOCKET_HANDSHAKE_WRITING_REPLY)
+                {
+                    continue;
+                }
+
+                NsPollFd *pollfd = &pollfds[num_pollfds];
+                pollfd->fd = ns_socket_get_internal(&handshake->socket);
+                pollfd->events = (handshake->state == NS_WEBSOCKET_HANDSHAKE_READING_REQUEST) ? POLLIN : POLLOUT;
+                pollfd->revents = 0;
+                pollfd_handshake_idxs[num_pollfds] = i;
+                num_pollfds++;
+            }
+        }
+
+        int num_fds_ready = ns_socket_poll(pollfds, num_pollfds, timeout_millis);
+        if(num_fds_ready < 0)
+        {
+            DebugPrintInfo();
+            return (void *)NS_ERROR;
+        }
+
+        if(num_fds_ready == 0)
+        {
+            continue;
+        }
+
+        now_millis = ns_time_get_millis();
+
+        for(int i = 0; i < num_pollfds; i++)
+        {
+            NsPollFd *pollfd = &pollfds[i];
+            if(pollfd->revents == 0)
+            {
+                continue;
+            }
+
+            if(pollfd->fd == listen_internal_socket)
+            {
+                status = ns_websocket_handshake_accept_all(now_millis);
+                if(status != NS_SUCCESS)
+                {
+                    DebugPrintInfo();
+                    return (void *)(intptr_t)status;
+                }
+            }
+            else
+            {
+                uint32_t handshake_idx = pollfd_handshake_idxs[i];
+                status = ns_websocket_handshake_advance(handshake_idx);
+                if(status != NS_SUCCESS)
+                {
+                    ns_websocket_handshake_fail(handshake_idx);
+                }
+            }
+        }
+    }
+
+    return (void *)NS_SUCCESS;
+}
+
+internal int
+ns_websocket_handshakes_create()
+{
+    int status;
+
+    NsWebSocketHandshake *handshakes = (NsWebSocketHandshake *)ns_memory_allocate(sizeof(NsWebSocketHandshake)*NS_WEBSOCKET_MAX_PENDING_HANDSHAKES);
+    if(handshakes == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    ns_websocket_context.handshakes = handshakes;
+    ns_index_stack_create(&ns_websocket_context.free_handshakes);
+
+    status = ns_timer_wheel_create(&ns_websocket_context.handshake_timer_wheel, ns_time_get_millis());
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    for(uint32_t i = NS_WEBSOCKET_MAX_PENDING_HANDSHAKES; i > 0; i--)
+    {
+        ns_websocket_handshake_free(i - 1);
+    }
+
+    status = ns_mpsc_queue_create(&ns_websocket_context.done_handshakes, NS_WEBSOCKET_MAX_PENDING_HANDSHAKES);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_semaphore_create(&ns_websocket_context.done_handshakes_semaphore);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_mutex_create(&ns_websocket_context.accept_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+//}
+
+/* metrics */
+//{
+internal int64_t
+ns_websocket_get_work_queue_depth(void *data)
+{
+    int64_t result = ns_work_queue_get_depth(&ns_websocket_context.worker_threads.work_queue);
+    return result;
+}
+
+internal int
+ns_websocket_register_metrics()
+{
+    int status;
+
+    NsWebSocketMetrics *metrics = &ns_websocket_context.metrics;
+    memset(metrics, 0, sizeof(*metrics));
+
+    status = ns_metrics_register_counter(&metrics->connections_accepted, "ns_websocket_connections_accepted_total",
+                                         "Websockets handed out by ns_websocket_accept().");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->connections_removed, "ns_websocket_connections_removed_total",
+                                         "Websockets whose peer went away or stopped answering pings.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->bytes_received, "ns_websocket_received_bytes_total",
+                                         "Bytes read from peers.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->frames_received, "ns_websocket_frames_received_total",
+                                         "Whole frames read from peers.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->frames_dropped, "ns_websocket_frames_dropped_total",
+                                         "Frames dropped because the handlers weren't keeping up.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_counter(&metrics->messages_dropped, "ns_websocket_messages_dropped_total",
+                                         "Messages dropped because the user wasn't receiving them.");
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_gauge(&metrics->work_queue_depth, "ns_websocket_work_queue_depth",
+                                       "Frames waiting for a handler.",
+                                       ns_websocket_get_work_queue_depth, NULL);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_metrics_register_histogram(&metrics->work_queue_wait_time, "ns_websocket_work_queue_wait_seconds",
+                                           "Time frames spend waiting for a handler.", 1e-9);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
 }
+//}
 
 internal NsInternalSocket
 ns_websocket_get_internal(NsWebSocket *websocket)
@@ -406,8 +1477,11 @@ ns_websocket_get_internal(NsWebSocket *websocket)
 
 /* API */
 
+/* With a placement, the receiver thread is pinned to its first cpu and the workers to the
+   ones after. The handshake thread isn't pinned; it's mostly asleep. */
 int
-ns_websockets_startup(int max_connections, int max_threads)
+ns_websockets_startup(int max_connections, int max_threads,
+                      NsNumaPlacement placement = NS_NUMA_PLACEMENT_NONE)
 {
     int status;
 
@@ -418,6 +1492,34 @@ ns_websockets_startup(int max_connections, int max_threads)
         return NS_ERROR;
     }
 
+    status = ns_websocket_message_pool_create(&ns_websocket_context.message_pool, NS_WEBSOCKET_MESSAGE_POOL_SIZE);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_websocket_handshakes_create();
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_timer_wheel_create(&ns_websocket_context.timer_wheel, ns_time_get_millis());
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_mutex_create(&ns_websocket_context.timer_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
     status = ns_poll_fds_create(&ns_websocket_context.poll_fds, NS_WEBSOCKET, max_connections);
     if(status != NS_SUCCESS)
     {
@@ -427,15 +1529,29 @@ ns_websockets_startup(int max_connections, int max_threads)
 
     int max_work = ns_math_max(2*max_connections, 64);
     status = ns_worker_threads_create(&ns_websocket_context.worker_threads, 
-                                      max_threads - 1, max_work);
+                                      max_threads - 1, max_work, placement, 1);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_websocket_register_metrics();
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    ns_work_queue_set_wait_time_histogram(&ns_websocket_context.worker_threads.work_queue,
+                                          &ns_websocket_context.metrics.work_queue_wait_time);
+
+    NsThreadAttributes attributes;
+    ns_thread_attributes_init(&attributes);
+    ns_numa_set_thread_attributes(&attributes, 0, placement);
+
     status = ns_thread_create(&ns_websocket_context.ns_websocket_receiver_thread,
-                              ns_websocket_receiver_thread_entry, NULL);
+                              ns_websocket_receiver_thread_entry, NULL, &attributes);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
@@ -445,6 +1561,8 @@ ns_websockets_startup(int max_connections, int max_threads)
     return NS_SUCCESS;
 }
 
+/* Handshakes with peers start as soon as this returns; ns_websocket_accept() picks up the 
+   finished ones. Only one listening websocket is supported. */
 int 
 ns_websocket_listen(NsWebSocket *websocket, const char *port)
 {
@@ -456,6 +1574,23 @@ ns_websocket_listen(NsWebSocket *websocket, const char *port)
         return NS_ERROR;
     }
 
+    status = ns_socket_set_blocking(&websocket->socket, false);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_websocket_context.listen_websocket = websocket;
+
+    status = ns_thread_create(&ns_websocket_context.ns_websocket_handshake_thread,
+                              ns_websocket_handshake_thread_entry, NULL);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
     return NS_SUCCESS;
 }
 
@@ -465,111 +1600,202 @@ ns_websocket_close(NsWebSocket *websocket)
     int status;
     NsSocket *socket = &websocket->socket;
 
-    // must remove() before close() because ns_socket_get_bytes_available()
-    status = ns_poll_fds_remove(&ns_websocket_context.poll_fds, websocket);
+    // cancel first so the receiver thread can't ping us after we're closed
+    {
+        status = ns_mutex_lock(&ns_websocket_context.timer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        ns_timer_wheel_cancel(&ns_websocket_context.timer_wheel, &websocket->ping_timer);
+
+        status = ns_mutex_unlock(&ns_websocket_context.timer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    // must remove() before close() because ns_socket_get_bytes_available().
+    // we may have already been removed if the peer stopped answering pings.
+    if(ns_atomic_exchange(&websocket->is_removed, (uint32_t)1) == 0)
+    {
+        status = ns_poll_fds_remove(&ns_websocket_context.poll_fds, websocket);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    status = ns_socket_close(&websocket->socket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Frees what the websocket's inbound queue holds. Call after ns_websocket_close(); waits for
+   the messages already handed to the websocket's strand to be handled first, so not from
+   inside a message handler. */
+int
+ns_websocket_destroy(NsWebSocket *websocket)
+{
+    int status;
+
+    // once it's closed nothing more is added, so this only waits on what's in flight
+    status = ns_strand_wait_idle(&websocket->strand);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    status = ns_socket_close(&websocket->socket);
+    status = ns_strand_destroy(&websocket->strand);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
-        return NS_ERROR;
+        return status;
     }
 
+    status = ns_mutex_destroy(&websocket->send_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_websocket_message_queue_destroy(websocket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    ns_memory_free(websocket->receive_buffer);
+    websocket->receive_buffer = NULL;
+
     return NS_SUCCESS;
 }
 
+/* Waits for a peer that's finished its handshake. The handshake itself happens on the
+   handshake thread, so this never waits on a slow peer while a fast one is ready. */
 int 
 ns_websocket_accept(NsWebSocket *websocket, NsWebSocket *peer_websocket)
 {
     int status;
 
+    // sanity check
+    if(websocket != ns_websocket_context.listen_websocket)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
     if(ns_poll_fds_is_full(&ns_websocket_context.poll_fds))
     {
         DebugPrintInfo();
         return NS_ERROR;
     }
 
-    NsSocket *peer_socket = &peer_websocket->socket;
-    status = ns_socket_accept(&websocket->socket, peer_socket);
+    status = ns_semaphore_get(&ns_websocket_context.done_handshakes_semaphore);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    char peer_handshake[4096];
-    int peer_handshake_length = 0;
+    // the queue only takes one consumer at a time
+    void *handshake_idx_void_ptr;
     {
-        int peer_handshake_length = ns_socket_receive(peer_socket, peer_handshake, sizeof(peer_handshake));
-        if(peer_handshake_length <= 0)
+        status = ns_mutex_lock(&ns_websocket_context.accept_mutex);
+        if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return peer_handshake_length;
+            return status;
         }
 
-        peer_handshake[peer_handshake_length] = 0;
-    }
+        bool got_handshake = ns_mpsc_queue_try_get(&ns_websocket_context.done_handshakes, &handshake_idx_void_ptr);
 
-    char peer_handshake_reply[512] =
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: ";
-    {
-        char reply_key[128];
+        status = ns_mutex_unlock(&ns_websocket_context.accept_mutex);
+        if(status != NS_SUCCESS)
         {
-            char peer_key[128];
-            {
-                char *start_of_key = NULL;
-                for(unsigned int i = 0; i < (peer_handshake_length - NS_WEBSOCKET_KEY_HEADER_LENGTH); i++)
-                {
-                    if(!strncmp(&peer_handshake[i], NS_WEBSOCKET_KEY_HEADER, NS_WEBSOCKET_KEY_HEADER_LENGTH))
-                    {
-                        start_of_key = &peer_handshake[i + NS_WEBSOCKET_KEY_HEADER_LENGTH];
-                        break;
-                    }
-                }
+            DebugPrintInfo();
+            return status;
+        }
 
-                // place key in buffer
-                int length = 0;
-                while(*start_of_key != '\r')
-                {
-                    peer_key[length++] = *start_of_key++;
-                }
-                peer_key[length] = 0;
-            }
+        // sanity check
+        if(!got_handshake)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+    }
 
-            strcat(peer_key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    uint32_t handshake_idx = (uint32_t)(uintptr_t)handshake_idx_void_ptr;
+    peer_websocket->socket = ns_websocket_context.handshakes[handshake_idx].socket;
+    ns_websocket_handshake_free(handshake_idx);
 
-            status = ns_sha1(peer_key, reply_key);
-            if(status != NS_SUCCESS)
-            {
-                DebugPrintInfo();
-                return status;
-            }
-        }
+    status = ns_websocket_message_queue_create(peer_websocket);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
 
-        // fill out key for our handshake reply
-        int handshake_reply_length = strlen(peer_handshake_reply);
-        strcat(&peer_handshake_reply[handshake_reply_length], reply_key);
-        handshake_reply_length += strlen(reply_key);
-        peer_handshake_reply[handshake_reply_length++] = '\r';
-        peer_handshake_reply[handshake_reply_length++] = '\n';
-        peer_handshake_reply[handshake_reply_length++] = '\r';
-        peer_handshake_reply[handshake_reply_length++] = '\n';
-        peer_handshake_reply[handshake_reply_length++] = 0;
+    peer_websocket->receive_buffer = (uint8_t *)ns_memory_allocate(NS_WEBSOCKET_RECEIVE_BUFFER_SIZE);
+    if(peer_websocket->receive_buffer == NULL)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
     }
+    peer_websocket->receive_length = 0;
 
-    int bytes_sent = ns_socket_send(peer_socket, peer_handshake_reply, strlen(peer_handshake_reply));
-    if(bytes_sent <= 0) 
+    status = ns_strand_create(&peer_websocket->strand, &ns_websocket_context.worker_threads,
+                              ns_websocket_message_handler_thread_entry, NS_WEBSOCKET_MAX_QUEUED_MESSAGES);
+    if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
-        return bytes_sent;
+        return status;
+    }
+
+    status = ns_mutex_create(&peer_websocket->send_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    peer_websocket->is_removed = 0;
+    peer_websocket->is_ping_outstanding = false;
+    peer_websocket->has_pong_arrived = 0;
+    ns_timer_init(&peer_websocket->ping_timer, ns_websocket_ping_timer_callback, peer_websocket);
+
+    // start pinging. armed before the add so the add's wakeup gets the receiver thread
+    // to notice the timer too.
+    {
+        status = ns_mutex_lock(&ns_websocket_context.timer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        ns_timer_wheel_arm(&ns_websocket_context.timer_wheel, &peer_websocket->ping_timer,
+                           ns_time_get_millis(), NS_WEBSOCKET_PING_INTERVAL_MILLIS);
+
+        status = ns_mutex_unlock(&ns_websocket_context.timer_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
     }
 
     status = ns_poll_fds_add(&ns_websocket_context.poll_fds, peer_websocket);
@@ -579,14 +1805,16 @@ ns_websocket_accept(NsWebSocket *websocket, NsWebSocket *peer_websocket)
         return status;
     }
 
+    ns_metrics_counter_add(&ns_websocket_context.metrics.connections_accepted);
+
     return NS_SUCCESS;
 }
 
 int 
 ns_websocket_receive(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size)
 {
-    int message_length = ns_websocket_message_get(websocket, dest, dest_size);
-    if(message_length <= 0)
+    int message_length = ns_websocket_message_get(websocket, dest, dest_size, true);
+    if(message_length < 0)
     {
         DebugPrintInfo();
         return message_length;
@@ -601,11 +1829,98 @@ ns_websocket_receive(NsWebSocket *websocket, char *dest, uint32_t dest_size)
     return message_length;
 }
 
+/* Like ns_websocket_receive(), but returns NS_WEBSOCKET_NO_MESSAGE instead of blocking. */
 int 
-ns_websocket_send(NsWebSocket *websocket, uint8_t *message, uint32_t message_size, NsWebSocketDataType data_type)
+ns_websocket_try_receive(NsWebSocket *websocket, uint8_t *dest, uint32_t dest_size)
 {
-    NsSocket *socket = &websocket->socket;
+    int message_length = ns_websocket_message_get(websocket, dest, dest_size, false);
+    if(message_length < 0 && 
+       message_length != NS_WEBSOCKET_NO_MESSAGE)
+    {
+        DebugPrintInfo();
+        return message_length;
+    }
+    return message_length;
+}
+
+int 
+ns_websocket_try_receive(NsWebSocket *websocket, char *dest, uint32_t dest_size)
+{
+    int message_length = ns_websocket_try_receive(websocket, (uint8_t *)dest, dest_size);
+    return message_length;
+}
+
+/* Hands back up to max_messages whole messages without copying them. If is_blocking, 
+   waits for the first one; never waits for the rest. Each message must be given back 
+   with ns_websocket_message_release(). Returns the number of messages. */
+int
+ns_websocket_receive_batch(NsWebSocket *websocket, NsWebSocketMessage **messages, int max_messages, 
+                           bool is_blocking)
+{
+    int status;
+    int num_messages = 0;
 
+    if(websocket->partial_message != NULL &&
+       max_messages > 0)
+    {
+        messages[num_messages++] = websocket->partial_message;
+        websocket->partial_message = NULL;
+    }
+
+    while(num_messages < max_messages)
+    {
+        bool should_block = (is_blocking && num_messages == 0);
+        status = ns_websocket_message_pop(websocket, &messages[num_messages], should_block);
+        if(status == NS_WEBSOCKET_NO_MESSAGE ||
+           status == NS_WEBSOCKET_CLOSED)
+        {
+            break;
+        }
+
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+
+        num_messages++;
+    }
+
+    return num_messages;
+}
+
+void
+ns_websocket_message_release(NsWebSocketMessage *message)
+{
+    if(message->pool_idx == NS_WEBSOCKET_MESSAGE_NOT_POOLED)
+    {
+        ns_memory_free(message);
+        return;
+    }
+
+    NsWebSocketMessagePool *pool = &ns_websocket_context.message_pool;
+    auto get_next_ptr = [pool](uint32_t idx) { return &ns_websocket_message_pool_get_node(pool, idx)->next_free; };
+    ns_index_stack_push(&pool->free_stack, message->pool_idx, get_next_ptr);
+}
+
+/* Number of messages waiting to be received. */
+uint32_t
+ns_websocket_get_queue_depth(NsWebSocket *websocket)
+{
+    uint32_t queue_depth = ns_mpsc_queue_get_size(&websocket->message_queue);
+    return queue_depth;
+}
+
+uint32_t
+ns_websocket_get_max_queue_depth(NsWebSocket *websocket)
+{
+    uint32_t max_queue_depth = ns_atomic_load_relaxed(&websocket->max_queue_depth);
+    return max_queue_depth;
+}
+
+int 
+ns_websocket_send(NsWebSocket *websocket, uint8_t *message, uint32_t message_size, NsWebSocketDataType data_type)
+{
     uint8_t frame[Kilobytes(64)]; // TODO: ...
     if(message_size >= sizeof(frame))
     {
@@ -661,7 +1976,7 @@ ns_websocket_send(NsWebSocket *websocket, uint8_t *message, uint32_t message_siz
         frame_size += message_size;
     }
 
-    int bytes_sent = ns_socket_send(socket, frame, frame_size);
+    int bytes_sent = ns_websocket_send_frame(websocket, frame, frame_size);
     if(bytes_sent != frame_size)
     {
         if(bytes_sent == NS_SOCKET_CONNECTION_CLOSED)
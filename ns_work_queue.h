@@ -6,12 +6,18 @@
 #include "ns_mutex.h"
 #include "ns_semaphore.h"
 #include "ns_memory.h"
+#include "ns_atomic.h"
+#include "ns_time.h"
+#include "ns_metrics.h"
+#include "ns_trace.h"
 
 
 struct NsWork
 {
     void *(*thread_entry)(void *);
     void *work;
+    uint64_t add_nanos; // 0 unless the queue had a wait time histogram when it was added
+    uint64_t add_ticks; // 0 unless tracing was on when it was added
 };
 
 struct NsWorkQueue
@@ -24,6 +30,9 @@ struct NsWorkQueue
     NsMutex add_mutex;
     NsMutex get_mutex;
     NsSemaphore semaphore;
+
+    // how long work sits in the queue, in nanoseconds. NULL if nobody's asked.
+    NsMetricsHistogram *wait_time_histogram;
 };
 
 
@@ -55,6 +64,49 @@ ns_work_queue_print(NsWorkQueue *work_queue)
            work_queue->start, work_queue->end, work_queue->head, work_queue->tail);
 }
 
+/* Once the semaphore's been gotten. */
+internal int
+ns_work_queue_take(NsWorkQueue *work_queue, NsWork *work)
+{
+    int status;
+
+    status = ns_mutex_lock(&work_queue->get_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    // the semaphore says there's something, and acquiring tail makes sure we see what the
+    // adder wrote into its slot before publishing it
+    NsWork *head = work_queue->head;
+    NsWork *tail = ns_atomic_load(&work_queue->tail);
+    Assert(head != tail);
+    *work = *head;
+
+    // released, so an adder that sees the slot as free can't write it until we've copied it
+    ns_atomic_store(&work_queue->head, ns_work_queue_get_next(work_queue, head));
+
+    status = ns_mutex_unlock(&work_queue->get_mutex);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    // either can be switched on while this was queued, with nothing to measure from
+    if(work_queue->wait_time_histogram != NULL && work->add_nanos != 0)
+    {
+        ns_metrics_histogram_record(work_queue->wait_time_histogram, ns_time_get_nanos() - work->add_nanos);
+    }
+    if(work->add_ticks != 0)
+    {
+        ns_trace_record("queue wait", work->add_ticks, ns_trace_get_ticks());
+    }
+
+    return NS_SUCCESS;
+}
+
 /* API */
 
 int
@@ -97,6 +149,7 @@ ns_work_queue_create(NsWorkQueue *work_queue, int max_work)
     work_queue->end = work + max_work;
     work_queue->head = work_queue->start;
     work_queue->tail = work_queue->start;
+    work_queue->wait_time_histogram = NULL;
 
     return NS_SUCCESS;
 }
@@ -132,8 +185,9 @@ ns_work_queue_destroy(NsWorkQueue *work_queue)
     return NS_SUCCESS;
 }
 
+/* Copies the work out, since its slot can be reused as soon as we let go of it. */
 int 
-ns_work_queue_get(NsWorkQueue *work_queue, NsWork **work_ptr)
+ns_work_queue_get(NsWorkQueue *work_queue, NsWork *work)
 {
     int status;
 
@@ -144,33 +198,57 @@ ns_work_queue_get(NsWorkQueue *work_queue, NsWork **work_ptr)
         return status;
     }
 
-    status = ns_mutex_lock(&work_queue->get_mutex);
+    status = ns_work_queue_take(work_queue, work);
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
-    NsWork *head = work_queue->head;
-    *work_ptr = head;
-    work_queue->head = ns_work_queue_get_next(work_queue, head);
+    return NS_SUCCESS;
+}
 
-    status = ns_mutex_unlock(&work_queue->get_mutex);
+/* Like ns_work_queue_get(), but an empty queue doesn't block: is_got just comes back false.
+   For threads that would otherwise sit waiting on work that's queued behind them. */
+int
+ns_work_queue_try_get(NsWorkQueue *work_queue, NsWork *work, bool *is_got)
+{
+    int status;
+
+    *is_got = false;
+
+    status = ns_semaphore_try_get(&work_queue->semaphore);
+    if(status == NS_TIMED_OUT)
+    {
+        return NS_SUCCESS;
+    }
     if(status != NS_SUCCESS)
     {
         DebugPrintInfo();
         return status;
     }
 
+    status = ns_work_queue_take(work_queue, work);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    *is_got = true;
     return NS_SUCCESS;
 }
 
+/* Like ns_work_queue_add(), but a full queue isn't an error: is_added just comes back false,
+   for callers that have somewhere else to put the work. */
 int 
-ns_work_queue_add(NsWorkQueue *work_queue, 
-                  void *(*worker_thread_entry)(void *), void *work)
+ns_work_queue_try_add(NsWorkQueue *work_queue, 
+                      void *(*worker_thread_entry)(void *), void *work, bool *is_added)
 {
     int status;
 
+    *is_added = false;
+
     status = ns_mutex_lock(&work_queue->add_mutex);
     if(status != NS_SUCCESS)
     {
@@ -182,17 +260,24 @@ ns_work_queue_add(NsWorkQueue *work_queue,
     NsWork *next_tail = ns_work_queue_get_next(work_queue, tail);
 
     // is there enough room?
-    if(next_tail == work_queue->head)
+    if(next_tail == ns_atomic_load(&work_queue->head))
     {
-        ns_work_queue_print(work_queue);
-        DebugPrintInfo();
-        return NS_ERROR;
+        status = ns_mutex_unlock(&work_queue->add_mutex);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        return NS_SUCCESS;
     }
 
     tail->thread_entry = worker_thread_entry;
     tail->work = work;
+    tail->add_nanos = (work_queue->wait_time_histogram != NULL) ? ns_time_get_nanos() : 0;
+    tail->add_ticks = ns_trace_is_enabled() ? ns_trace_get_ticks() : 0;
 
-    work_queue->tail = next_tail;
+    // released, so the slot's contents are visible before the slot is
+    ns_atomic_store(&work_queue->tail, next_tail);
 
     status = ns_mutex_unlock(&work_queue->add_mutex);
     if(status != NS_SUCCESS)
@@ -208,7 +293,54 @@ ns_work_queue_add(NsWorkQueue *work_queue,
         return status;
     }
 
+    *is_added = true;
     return NS_SUCCESS;
 }
 
+int 
+ns_work_queue_add(NsWorkQueue *work_queue, 
+                  void *(*worker_thread_entry)(void *), void *work)
+{
+    int status;
+
+    bool is_added;
+    status = ns_work_queue_try_add(work_queue, worker_thread_entry, work, &is_added);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    if(!is_added)
+    {
+        ns_work_queue_print(work_queue);
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    return NS_SUCCESS;
+}
+
+/* Work added but not yet picked up. Only a snapshot; it can be stale by the time it's
+   returned. */
+uint32_t
+ns_work_queue_get_depth(NsWorkQueue *work_queue)
+{
+    NsWork *head = ns_atomic_load_relaxed(&work_queue->head);
+    NsWork *tail = ns_atomic_load_relaxed(&work_queue->tail);
+    int64_t depth = (tail - head);
+    if(depth < 0)
+    {
+        depth += (work_queue->end - work_queue->start);
+    }
+    return (uint32_t)depth;
+}
+
+/* Records how long each piece of work waits in the queue from here on, in nanoseconds. */
+void
+ns_work_queue_set_wait_time_histogram(NsWorkQueue *work_queue, NsMetricsHistogram *histogram)
+{
+    work_queue->wait_time_histogram = histogram;
+}
+
 #endif
@@ -6,6 +6,7 @@
 #include "ns_math.h"
 #include "ns_memory.h"
 #include "ns_work_queue.h"
+#include "ns_numa.h"
 
 
 struct NsWorkerThreads
@@ -23,29 +24,39 @@ ns_worker_threads_worker_thread_entry(void *thread_input)
 {
     int status;
     NsWorkerThreads *worker_threads = (NsWorkerThreads *)thread_input;
+    ns_trace_set_thread_name("worker");
 
     while(1)
     {
-        NsWork *work;
+        NsWork work;
         status = ns_work_queue_get(&worker_threads->work_queue, &work);
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
-            return (void *)status;
+            return (void *)(intptr_t)status;
         }
 
-        status = (int)work->thread_entry(work->work);
+        // destroy's way of telling us to stop, queued behind any work still waiting
+        if(work.thread_entry == NULL)
+        {
+            return (void *)NS_SUCCESS;
+        }
+
+        status = (int)(intptr_t)work.thread_entry(work.work);
         if(status != NS_SUCCESS)
         {
-            return (void *)status;
+            return (void *)(intptr_t)status;
         }
     }
 }
 
 /* API */
 
+/* With a placement, thread i is pinned to the cpu for placement index first_placement_idx + i,
+   so callers with threads of their own can put those on the first few. */
 int
-ns_worker_threads_create(NsWorkerThreads *worker_threads, int max_threads, int max_work)
+ns_worker_threads_create(NsWorkerThreads *worker_threads, int max_threads, int max_work,
+                         NsNumaPlacement placement = NS_NUMA_PLACEMENT_NONE, int first_placement_idx = 0)
 {
     // we need at least 2... for now
     if(max_work < 2)
@@ -72,7 +83,11 @@ ns_worker_threads_create(NsWorkerThreads *worker_threads, int max_threads, int m
 
     for(int i = 0; i < max_threads; i++)
     {
-        status = ns_thread_create(&threads[i], ns_worker_threads_worker_thread_entry, worker_threads);
+        NsThreadAttributes attributes;
+        ns_thread_attributes_init(&attributes);
+        ns_numa_set_thread_attributes(&attributes, first_placement_idx + i, placement);
+
+        status = ns_thread_create(&threads[i], ns_worker_threads_worker_thread_entry, worker_threads, &attributes);
         if(status != NS_SUCCESS)
         {
             DebugPrintInfo();
@@ -86,11 +101,48 @@ ns_worker_threads_create(NsWorkerThreads *worker_threads, int max_threads, int m
     return NS_SUCCESS;
 }
 
+/* Lets the threads finish the work that's already queued, then waits for them to exit. */
 int
 ns_worker_threads_destroy(NsWorkerThreads *worker_threads)
 {
     int status;
 
+    for(int i = 0; i < worker_threads->thread_capacity; i++)
+    {
+        // the queue can be full, in which case give the threads a second to empty it
+        bool is_added = false;
+        for(int num_tries = 0; !is_added; num_tries++)
+        {
+            if(num_tries == 1000)
+            {
+                DebugPrintInfo();
+                return NS_TIMED_OUT;
+            }
+            if(num_tries > 0)
+            {
+                ns_thread_sleep(1);
+            }
+
+            status = ns_work_queue_try_add(&worker_threads->work_queue, NULL, NULL, &is_added);
+            if(status != NS_SUCCESS)
+            {
+                DebugPrintInfo();
+                return status;
+            }
+        }
+    }
+
+    // a thread whose work failed has already exited; joining it just returns
+    for(int i = 0; i < worker_threads->thread_capacity; i++)
+    {
+        status = ns_thread_join(&worker_threads->threads[i]);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
     ns_memory_free(worker_threads->threads);
 
     status = ns_work_queue_destroy(&worker_threads->work_queue);
@@ -0,0 +1,308 @@
+#include "ns_common.h"
+#include "ns_time.h"
+#include "ns_atomic.h"
+#include "ns_thread.h"
+#include "ns_mutex.h"
+#include "ns_semaphore.h"
+#include "ns_rw_lock.h"
+#include "ns_seq_lock.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* Build: g++ -O2 -o rw_lock_benchmark rw_lock_benchmark.cpp -lpthread
+          g++ -O2 -DNS_FUTEX -o rw_lock_benchmark_futex rw_lock_benchmark.cpp -lpthread
+   Guards a small table with NsMutex, NsRwLock and NsSeqLock and has every thread read it,
+   writing only now and then, at 1, 2, 4, ... threads. Readers check every copy they make
+   for torn writes. Throughput should only scale with threads for the rw and seq locks,
+   and only on a machine with that many cores.
+
+   Options:
+     --threads N   most threads to run with (default 8)
+     --writes N    writes per 1000 operations (default 1)
+     --duration N  milliseconds per run (default 500) */
+
+#define BENCHMARK_NUM_VALUES 8
+
+enum BenchmarkLockType
+{
+    BenchmarkLockType_Mutex,
+    BenchmarkLockType_RwLock,
+    BenchmarkLockType_SeqLock,
+};
+
+struct BenchmarkOptions
+{
+    int threads;
+    int writes;
+    int duration;
+};
+
+/* What's being guarded: a writer sets every value to the same thing, so a reader that sees
+   different values saw a torn write. */
+struct BenchmarkTable
+{
+    uint64_t values[BENCHMARK_NUM_VALUES];
+};
+
+struct BenchmarkShared
+{
+    BenchmarkOptions *options;
+    BenchmarkLockType lock_type;
+    NsMutex mutex;
+    NsRwLock rw_lock;
+    NsSeqLock seq_lock;
+    NsSemaphore done_semaphore;
+    NsSemaphore idle_semaphore; // never put
+
+    uint32_t num_ready;
+    uint32_t is_go;
+    uint32_t is_stop;
+
+    alignas(NS_CACHE_LINE_SIZE) BenchmarkTable table;
+    alignas(NS_CACHE_LINE_SIZE) uint64_t num_reads;
+    uint64_t num_writes;
+    uint64_t num_torn_reads;
+};
+
+struct BenchmarkThread
+{
+    NsThread thread;
+    BenchmarkShared *shared;
+    uint32_t index;
+};
+
+/* ns_common.h leaves logging to the program. */
+internal void _Log(const char *Format, ...)
+{
+    va_list args;
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+}
+
+void wait_for_go(BenchmarkShared *shared)
+{
+    ns_atomic_fetch_add(&shared->num_ready, (uint32_t)1);
+    while(!ns_atomic_load(&shared->is_go))
+    {
+        ns_atomic_pause();
+    }
+}
+
+bool is_torn(BenchmarkTable *table)
+{
+    for(int i = 1; i < BENCHMARK_NUM_VALUES; i++)
+    {
+        if(table->values[i] != table->values[0])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void read_table(BenchmarkShared *shared, BenchmarkTable *table)
+{
+    switch(shared->lock_type)
+    {
+        case BenchmarkLockType_Mutex:
+        {
+            ns_mutex_lock(&shared->mutex);
+            *table = shared->table;
+            ns_mutex_unlock(&shared->mutex);
+        } break;
+        case BenchmarkLockType_RwLock:
+        {
+            ns_rw_lock_read_lock(&shared->rw_lock);
+            *table = shared->table;
+            ns_rw_lock_read_unlock(&shared->rw_lock);
+        } break;
+        case BenchmarkLockType_SeqLock:
+        {
+            ns_seq_lock_read(&shared->seq_lock, table, &shared->table);
+        } break;
+    }
+}
+
+void write_table(BenchmarkShared *shared, uint64_t value)
+{
+    BenchmarkTable table;
+    for(int i = 0; i < BENCHMARK_NUM_VALUES; i++)
+    {
+        table.values[i] = value;
+    }
+
+    switch(shared->lock_type)
+    {
+        case BenchmarkLockType_Mutex:
+        {
+            ns_mutex_lock(&shared->mutex);
+            shared->table = table;
+            ns_mutex_unlock(&shared->mutex);
+        } break;
+        case BenchmarkLockType_RwLock:
+        {
+            ns_rw_lock_write_lock(&shared->rw_lock);
+            shared->table = table;
+            ns_rw_lock_write_unlock(&shared->rw_lock);
+        } break;
+        case BenchmarkLockType_SeqLock:
+        {
+            ns_seq_lock_write(&shared->seq_lock, &shared->table, &table);
+        } break;
+    }
+}
+
+void *worker_entry(void *thread_input)
+{
+    BenchmarkThread *thread = (BenchmarkThread *)thread_input;
+    BenchmarkShared *shared = thread->shared;
+    wait_for_go(shared);
+
+    uint64_t random = 0x9e3779b97f4a7c15ull*(thread->index + 1);
+    uint64_t num_reads = 0;
+    uint64_t num_writes = 0;
+    uint64_t num_torn_reads = 0;
+    while(!ns_atomic_load_relaxed(&shared->is_stop))
+    {
+        // checking the clock would cost more than the locks, so do a batch between checks
+        for(int i = 0; i < 256; i++)
+        {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+
+            if((int)(random % 1000) < shared->options->writes)
+            {
+                write_table(shared, random);
+                num_writes++;
+            }
+            else
+            {
+                BenchmarkTable table;
+                read_table(shared, &table);
+                num_torn_reads += is_torn(&table);
+                num_reads++;
+            }
+        }
+    }
+
+    ns_atomic_fetch_add(&shared->num_reads, num_reads);
+    ns_atomic_fetch_add(&shared->num_writes, num_writes);
+    ns_atomic_fetch_add(&shared->num_torn_reads, num_torn_reads);
+    ns_semaphore_put(&shared->done_semaphore);
+    return NULL;
+}
+
+/* Runs num_threads threads for the configured duration and prints their throughput. */
+void run_threads(BenchmarkShared *shared, const char *name, int num_threads)
+{
+    shared->num_ready = 0;
+    shared->is_go = 0;
+    shared->is_stop = 0;
+    shared->num_reads = 0;
+    shared->num_writes = 0;
+    shared->num_torn_reads = 0;
+
+    BenchmarkThread *threads = (BenchmarkThread *)malloc(sizeof(BenchmarkThread)*num_threads);
+    for(int i = 0; i < num_threads; i++)
+    {
+        threads[i].shared = shared;
+        threads[i].index = i;
+        ns_thread_create(&threads[i].thread, worker_entry, &threads[i]);
+    }
+
+    while(ns_atomic_load(&shared->num_ready) < (uint32_t)num_threads)
+    {
+        ns_thread_sleep(1);
+    }
+
+    uint64_t start_nanos = ns_time_get_nanos();
+    ns_atomic_store(&shared->is_go, (uint32_t)1);
+    ns_thread_sleep(shared->options->duration);
+    ns_atomic_store(&shared->is_stop, (uint32_t)1);
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_semaphore_get(&shared->done_semaphore);
+    }
+    uint64_t nanos = (ns_time_get_nanos() - start_nanos);
+
+    uint64_t num_ops = shared->num_reads + shared->num_writes;
+    printf("  %-8s threads: %2d  %8.2f Mops/s  %8.1f ns/op per thread  writes: %llu",
+           name, num_threads, num_ops*1e3/nanos, (double)nanos*num_threads/num_ops,
+           (unsigned long long)shared->num_writes);
+    if(shared->num_torn_reads != 0)
+    {
+        printf("  torn reads: %llu!", (unsigned long long)shared->num_torn_reads);
+    }
+    printf("\n");
+
+    // the threads have put their last semaphore, but may not have returned yet
+    ns_thread_sleep(10);
+    free(threads);
+}
+
+void *idle_thread_entry(void *thread_input)
+{
+    BenchmarkShared *shared = (BenchmarkShared *)thread_input;
+    ns_semaphore_get(&shared->idle_semaphore);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options;
+    options.threads = 8;
+    options.writes = 1;
+    options.duration = 500;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--threads") && i + 1 < argc)
+        {
+            options.threads = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--writes") && i + 1 < argc)
+        {
+            options.writes = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--duration") && i + 1 < argc)
+        {
+            options.duration = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--threads N] [--writes N] [--duration N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchmarkShared *shared = (BenchmarkShared *)calloc(1, sizeof(BenchmarkShared));
+    shared->options = &options;
+    ns_mutex_create(&shared->mutex);
+    ns_rw_lock_create(&shared->rw_lock);
+    ns_seq_lock_create(&shared->seq_lock);
+    ns_semaphore_create(&shared->done_semaphore, 0);
+    ns_semaphore_create(&shared->idle_semaphore, 0);
+
+    printf("writes per 1000 ops: %d, cpus: %ld\n", options.writes, sysconf(_SC_NPROCESSORS_ONLN));
+
+    // glibc skips the atomics while a process only has one thread, which a server never is
+    NsThread idle_thread;
+    ns_thread_create(&idle_thread, idle_thread_entry, shared);
+
+    for(int num_threads = 1; num_threads <= options.threads; num_threads *= 2)
+    {
+        shared->lock_type = BenchmarkLockType_Mutex;
+        run_threads(shared, "mutex", num_threads);
+        shared->lock_type = BenchmarkLockType_RwLock;
+        run_threads(shared, "rw lock", num_threads);
+        shared->lock_type = BenchmarkLockType_SeqLock;
+        run_threads(shared, "seq lock", num_threads);
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "ns_common.h"
+#include "ns_memory.h"
+#include "ns_time.h"
+#include "ns_sha1.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Build: g++ -O2 -o sha1_benchmark sha1_benchmark.cpp
+   Hashes a buffer with every implementation the cpu supports and prints MB/s. Each
+   implementation's digest is checked against the scalar one. */
+
+#define BENCHMARK_BUFFER_SIZE Megabytes(16)
+#define BENCHMARK_ITERATIONS 16
+
+struct Sha1Benchmark
+{
+    NsSha1Implementation implementation;
+    const char *name;
+};
+
+Sha1Benchmark benchmarks[] = {
+    { NS_SHA1_SCALAR, "scalar" },
+    { NS_SHA1_SSSE3, "ssse3" },
+    { NS_SHA1_SHANI, "sha-ni" },
+};
+
+/* ns_common.h leaves allocation to the program. */
+internal void *ns_memory_allocate(size_t size)
+{
+    void *result = malloc(size);
+    return result;
+}
+
+internal void ns_memory_free(void *memory)
+{
+    free(memory);
+}
+
+void print_digest(uint8_t *digest)
+{
+    for(int i = 0; i < NS_SHA1_DIGEST_SIZE; i++)
+    {
+        printf("%02x", digest[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *buffer = (uint8_t *)ns_memory_allocate(BENCHMARK_BUFFER_SIZE);
+    if(buffer == NULL)
+    {
+        DebugPrintInfo();
+        return 1;
+    }
+
+    srand(1);
+    for(uint32_t i = 0; i < BENCHMARK_BUFFER_SIZE; i++)
+    {
+        buffer[i] = (uint8_t)rand();
+    }
+
+    uint8_t scalar_digest[NS_SHA1_DIGEST_SIZE];
+    for(uint32_t i = 0; i < ArrayCount(benchmarks); i++)
+    {
+        Sha1Benchmark *benchmark = &benchmarks[i];
+        if(!ns_sha1_check_supported(benchmark->implementation))
+        {
+            printf("%-8s not supported\n", benchmark->name);
+            continue;
+        }
+
+        uint8_t digest[NS_SHA1_DIGEST_SIZE];
+        uint64_t start_nanos = ns_time_get_nanos();
+        for(int iteration = 0; iteration < BENCHMARK_ITERATIONS; iteration++)
+        {
+            NsSha1 sha1;
+            ns_sha1_init(&sha1, benchmark->implementation);
+            ns_sha1_update(&sha1, buffer, BENCHMARK_BUFFER_SIZE);
+            ns_sha1_final(&sha1, digest);
+        }
+        uint64_t elapsed_nanos = (ns_time_get_nanos() - start_nanos);
+
+        if(benchmark->implementation == NS_SHA1_SCALAR)
+        {
+            memcpy(scalar_digest, digest, sizeof(digest));
+        }
+        else if(memcmp(scalar_digest, digest, sizeof(digest)) != 0)
+        {
+            printf("%-8s digest mismatch\n", benchmark->name);
+            return 1;
+        }
+
+        double megabytes = ((double)BENCHMARK_BUFFER_SIZE*BENCHMARK_ITERATIONS)/(1024.0*1024.0);
+        double seconds = (double)elapsed_nanos/1e9;
+        printf("%-8s %8.1f MB/s  ", benchmark->name, megabytes/seconds);
+        print_digest(digest);
+        printf("\n");
+    }
+
+    // the websocket accept key path: lots of tiny one shot hashes
+    {
+        char key[] = "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        char accept_key[32];
+        const int num_keys = 1000000;
+        uint64_t start_nanos = ns_time_get_nanos();
+        for(int i = 0; i < num_keys; i++)
+        {
+            ns_sha1(key, accept_key);
+        }
+        uint64_t elapsed_nanos = (ns_time_get_nanos() - start_nanos);
+        printf("accept key: %.1f ns/key (%s)\n", (double)elapsed_nanos/num_keys, accept_key);
+    }
+
+    ns_memory_free(buffer);
+
+    return 0;
+}
@@ -0,0 +1,722 @@
+#include "ns_common.h"
+#include "ns_memory.h"
+#include "ns_time.h"
+#include "ns_atomic.h"
+#include "ns_util.h"
+#include "ns_socket.h"
+#include "ns_thread.h"
+#include "ns_semaphore.h"
+#include "ns_histogram.h"
+#include "ns_websocket.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdarg.h>
+
+/* Build: g++ -O2 -o websocket_benchmark websocket_benchmark.cpp -lpthread
+   Runs an ns_websocket server in a child process and connects to it over loopback with
+   N clients, each doing the usual upgrade handshake and then sending masked binary frames
+   on a fixed schedule.
+
+   echo mode: the server sends every message back to whoever sent it. every client sends.
+   broadcast mode: the server sends every message to every client. only the first client
+   sends, and throughput is counted in deliveries, so one send to 64 clients is 64.
+
+   Every frame carries two timestamps: when it was due to be sent and when it actually went
+   into the send buffer. Latency from the due time is the corrected one: if the server (or
+   the client) stalls, the frames that should have gone out during the stall are charged
+   for it, instead of quietly not being sent (coordinated omission). Latency from the
+   actual send time is printed alongside so the difference is visible.
+
+   Options:
+     --mode echo|broadcast  (default echo)
+     --connections N        client connections (default 64)
+     --size N               payload bytes per frame, at least 16 (default 64)
+     --rate N               total frames/s sent across all clients (default 20000)
+     --duration N           seconds measured (default 5)
+     --warmup N             seconds run before measuring (default 1)
+     --threads N            client threads (default 2)
+     --server-threads N     max_threads for ns_websockets_startup (default 4) */
+
+#define BENCHMARK_SEND_BUFFER_SIZE Kilobytes(64)
+#define BENCHMARK_RECEIVE_BUFFER_SIZE Kilobytes(64)
+#define BENCHMARK_MAX_PAYLOAD_SIZE (NS_WEBSOCKET_RECEIVE_BUFFER_SIZE - 14)
+#define BENCHMARK_PORT "18180"
+
+enum BenchmarkMode
+{
+    BENCHMARK_ECHO,
+    BENCHMARK_BROADCAST,
+};
+
+struct BenchmarkOptions
+{
+    BenchmarkMode mode;
+    int connections;
+    int size;
+    double rate;
+    int duration_seconds;
+    int warmup_seconds;
+    int threads;
+    int server_threads;
+};
+
+struct ClientConnection
+{
+    NsSocket socket;
+    bool is_open;
+    bool is_sender;
+
+    uint64_t next_send_nanos;
+
+    // frames built but not yet written
+    uint8_t send_buffer[BENCHMARK_SEND_BUFFER_SIZE];
+    uint32_t send_length;
+
+    uint8_t receive_buffer[BENCHMARK_RECEIVE_BUFFER_SIZE];
+    uint32_t receive_length;
+};
+
+struct ClientThread
+{
+    NsThread thread;
+    BenchmarkOptions *options;
+    ClientConnection *connections;
+    int num_connections;
+    uint64_t interval_nanos;
+    uint32_t random_state;
+
+    NsHistogram corrected_histogram;
+    NsHistogram uncorrected_histogram;
+    uint64_t num_sent;
+    uint64_t num_received;
+    uint64_t num_errors;
+
+    NsSemaphore *done_semaphore;
+};
+
+/* ns_common.h leaves logging to the program. */
+internal void _Log(const char *Format, ...)
+{
+    va_list args;
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+}
+
+/* ns_common.h leaves allocation to the program too. */
+internal void *ns_memory_allocate(size_t size)
+{
+    void *result = malloc(size);
+    return result;
+}
+
+internal void ns_memory_free(void *memory)
+{
+    free(memory);
+}
+
+/* server (child process) */
+//{
+struct BenchmarkServer
+{
+    BenchmarkMode mode;
+    NsWebSocket listener;
+    NsWebSocket *peers;
+    NsThread *peer_threads;
+    uint32_t num_peers;
+};
+
+global BenchmarkServer benchmark_server;
+
+void *server_peer_thread_entry(void *thread_input)
+{
+    NsWebSocket *peer = (NsWebSocket *)thread_input;
+    NsWebSocketMessage *messages[64];
+
+    while(1)
+    {
+        int num_messages = ns_websocket_receive_batch(peer, messages, ArrayCount(messages));
+        if(num_messages <= 0)
+        {
+            break;
+        }
+
+        for(int i = 0; i < num_messages; i++)
+        {
+            NsWebSocketMessage *message = messages[i];
+            if(benchmark_server.mode == BENCHMARK_ECHO)
+            {
+                ns_websocket_send(peer, message->payload, message->payload_length, BINARY);
+            }
+            else
+            {
+                uint32_t num_peers = ns_atomic_load(&benchmark_server.num_peers);
+                for(uint32_t p = 0; p < num_peers; p++)
+                {
+                    ns_websocket_send(&benchmark_server.peers[p], message->payload, message->payload_length, BINARY);
+                }
+            }
+            ns_websocket_message_release(message);
+        }
+    }
+
+    return NULL;
+}
+
+int run_server(BenchmarkOptions *options)
+{
+    int status;
+
+    status = ns_websockets_startup(options->connections, options->server_threads);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    status = ns_websocket_listen(&benchmark_server.listener, BENCHMARK_PORT);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    benchmark_server.mode = options->mode;
+    benchmark_server.peers = (NsWebSocket *)ns_memory_allocate(sizeof(NsWebSocket)*options->connections);
+    benchmark_server.peer_threads = (NsThread *)ns_memory_allocate(sizeof(NsThread)*options->connections);
+    for(int i = 0; i < options->connections; i++)
+    {
+        NsWebSocket *peer = &benchmark_server.peers[i];
+        status = ns_websocket_accept(&benchmark_server.listener, peer);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        ns_atomic_store(&benchmark_server.num_peers, (uint32_t)(i + 1));
+
+        status = ns_thread_create(&benchmark_server.peer_threads[i], server_peer_thread_entry, peer);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    return NS_SUCCESS;
+}
+//}
+
+/* client */
+//{
+int client_connect(NsSocket *socket)
+{
+    int status;
+
+    // the child might not be listening yet
+    int attempt = 0;
+    while(1)
+    {
+        status = ns_socket_connect(socket, "127.0.0.1", BENCHMARK_PORT);
+        if(status == NS_SUCCESS)
+        {
+            break;
+        }
+        if(status != NS_SOCKET_CONNECTION_REFUSED || ++attempt == 500)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+        ns_thread_sleep(10);
+    }
+
+    status = ns_socket_set_no_delay(socket, true);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    const char *request =
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    int request_length = strlen(request);
+    if(ns_socket_send(socket, (char *)request, request_length) != request_length)
+    {
+        DebugPrintInfo();
+        return NS_ERROR;
+    }
+
+    // the server doesn't say anything after the reply until we do, so reading up to the
+    // blank line can't eat a frame
+    char reply[512];
+    int reply_length = 0;
+    while(reply_length < (int)sizeof(reply) - 1)
+    {
+        int bytes_received = ns_socket_receive(socket, &reply[reply_length], 1);
+        if(bytes_received != 1)
+        {
+            DebugPrintInfo();
+            return NS_ERROR;
+        }
+        reply_length++;
+        reply[reply_length] = 0;
+        if(reply_length >= 4 && !strcmp(&reply[reply_length - 4], "\r\n\r\n"))
+        {
+            break;
+        }
+    }
+
+    if(strncmp(reply, "HTTP/1.1 101", 12) != 0 ||
+       strstr(reply, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == NULL)
+    {
+        printf("bad handshake reply:\n%s", reply);
+        return NS_ERROR;
+    }
+
+    status = ns_socket_set_blocking(socket, false);
+    if(status != NS_SUCCESS)
+    {
+        DebugPrintInfo();
+        return status;
+    }
+
+    return NS_SUCCESS;
+}
+
+uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= (x << 13);
+    x ^= (x >> 17);
+    x ^= (x << 5);
+    *state = x;
+    return x;
+}
+
+/* Appends a masked binary frame carrying the due and actual send times. Returns false if
+   the send buffer's full. */
+bool queue_frame(ClientThread *client_thread, ClientConnection *connection, uint64_t due_nanos, uint64_t now_nanos)
+{
+    uint32_t payload_size = client_thread->options->size;
+    uint32_t header_size = (payload_size <= 125) ? 6 : 8;
+    if(connection->send_length + header_size + payload_size > BENCHMARK_SEND_BUFFER_SIZE)
+    {
+        return false;
+    }
+
+    uint8_t *frame = &connection->send_buffer[connection->send_length];
+    frame[0] = (0x80 | NS_WEBSOCKET_OPCODE_BINARY);
+    if(payload_size <= 125)
+    {
+        frame[1] = (0x80 | payload_size);
+    }
+    else
+    {
+        frame[1] = (0x80 | 126);
+        ns_put16be(&frame[2], payload_size);
+    }
+
+    uint8_t *mask_key = &frame[header_size - 4];
+    uint32_t mask = next_random(&client_thread->random_state);
+    memcpy(mask_key, &mask, 4);
+
+    uint8_t *payload = &frame[header_size];
+    memcpy(&payload[0], &due_nanos, 8);
+    memcpy(&payload[8], &now_nanos, 8);
+    memset(&payload[16], 'x', payload_size - 16);
+    for(uint32_t i = 0; i < payload_size; i++)
+    {
+        payload[i] ^= mask_key[i % 4];
+    }
+
+    connection->send_length += (header_size + payload_size);
+    return true;
+}
+
+void flush_frames(ClientThread *client_thread, ClientConnection *connection)
+{
+    if(connection->send_length == 0)
+    {
+        return;
+    }
+
+    int bytes_sent = ns_socket_send(&connection->socket, connection->send_buffer, connection->send_length);
+    if(bytes_sent == NS_SOCKET_WOULD_BLOCK)
+    {
+        return;
+    }
+    if(bytes_sent < 0)
+    {
+        connection->is_open = false;
+        client_thread->num_errors++;
+        return;
+    }
+
+    connection->send_length -= bytes_sent;
+    memmove(connection->send_buffer, &connection->send_buffer[bytes_sent], connection->send_length);
+}
+
+/* Reads whatever's there and records latencies for every whole frame. The server doesn't
+   mask. */
+void receive_frames(ClientThread *client_thread, ClientConnection *connection, bool is_measuring)
+{
+    while(1)
+    {
+        uint32_t space = (BENCHMARK_RECEIVE_BUFFER_SIZE - connection->receive_length);
+        int bytes_received = ns_socket_receive(&connection->socket, &connection->receive_buffer[connection->receive_length], space);
+        if(bytes_received == NS_SOCKET_WOULD_BLOCK)
+        {
+            return;
+        }
+        if(bytes_received <= 0)
+        {
+            connection->is_open = false;
+            client_thread->num_errors++;
+            return;
+        }
+        connection->receive_length += bytes_received;
+
+        uint64_t now_nanos = ns_time_get_nanos();
+        uint32_t offset = 0;
+        while(1)
+        {
+            uint8_t *frame = &connection->receive_buffer[offset];
+            uint32_t length = (connection->receive_length - offset);
+            uint32_t frame_length;
+            if(ns_websocket_frame_get_length(frame, length, &frame_length) != NS_SUCCESS)
+            {
+                connection->is_open = false;
+                client_thread->num_errors++;
+                return;
+            }
+            if(frame_length == 0 || frame_length > length)
+            {
+                break;
+            }
+            offset += frame_length;
+
+            // pings and whatnot
+            uint32_t opcode = (frame[0] & 0x0f);
+            if(opcode != NS_WEBSOCKET_OPCODE_BINARY)
+            {
+                continue;
+            }
+
+            NsWebSocketFrame inflated_frame = ns_websocket_frame_inflate(frame);
+            uint8_t *payload = inflated_frame.payload;
+            uint64_t due_nanos;
+            uint64_t sent_nanos;
+            memcpy(&due_nanos, &payload[0], 8);
+            memcpy(&sent_nanos, &payload[8], 8);
+
+            if(is_measuring)
+            {
+                ns_histogram_record(&client_thread->corrected_histogram, now_nanos - due_nanos);
+                ns_histogram_record(&client_thread->uncorrected_histogram, now_nanos - sent_nanos);
+                client_thread->num_received++;
+            }
+        }
+
+        connection->receive_length -= offset;
+        memmove(connection->receive_buffer, &connection->receive_buffer[offset], connection->receive_length);
+    }
+}
+
+void *client_thread_entry(void *thread_input)
+{
+    ClientThread *client_thread = (ClientThread *)thread_input;
+    BenchmarkOptions *options = client_thread->options;
+
+    NsPollFd *pollfds = (NsPollFd *)ns_memory_allocate(sizeof(NsPollFd)*client_thread->num_connections);
+
+    uint64_t start_nanos = ns_time_get_nanos();
+    uint64_t measure_nanos = start_nanos + (uint64_t)options->warmup_seconds*1000000000;
+    uint64_t end_nanos = measure_nanos + (uint64_t)options->duration_seconds*1000000000;
+
+    // stagger the senders across one interval
+    for(int i = 0; i < client_thread->num_connections; i++)
+    {
+        uint64_t offset = (client_thread->interval_nanos*i/client_thread->num_connections);
+        client_thread->connections[i].next_send_nanos = start_nanos + offset;
+    }
+
+    bool is_measuring = false;
+    while(1)
+    {
+        uint64_t now_nanos = ns_time_get_nanos();
+        if(now_nanos >= end_nanos)
+        {
+            break;
+        }
+        if(!is_measuring && now_nanos >= measure_nanos)
+        {
+            is_measuring = true;
+        }
+
+        uint64_t wake_nanos = ns_math_min(end_nanos, now_nanos + 100000000);
+        for(int i = 0; i < client_thread->num_connections; i++)
+        {
+            ClientConnection *connection = &client_thread->connections[i];
+            if(!connection->is_open)
+            {
+                pollfds[i].fd = -1;
+                continue;
+            }
+
+            if(connection->is_sender)
+            {
+                // if the send buffer's full the schedule stalls rather than skips, and the
+                // late frames are still charged from when they were due
+                while(connection->next_send_nanos <= now_nanos &&
+                      queue_frame(client_thread, connection, connection->next_send_nanos, now_nanos))
+                {
+                    connection->next_send_nanos += client_thread->interval_nanos;
+                    if(is_measuring)
+                    {
+                        client_thread->num_sent++;
+                    }
+                }
+                wake_nanos = ns_math_min(wake_nanos, connection->next_send_nanos);
+
+                flush_frames(client_thread, connection);
+            }
+
+            pollfds[i].fd = connection->socket.internal_socket;
+            pollfds[i].events = (POLLIN | ((connection->send_length > 0) ? POLLOUT : 0));
+            pollfds[i].revents = 0;
+        }
+
+        uint64_t timeout_nanos = (wake_nanos > now_nanos) ? (wake_nanos - now_nanos) : 0;
+        timespec timeout;
+        timeout.tv_sec = (timeout_nanos / 1000000000);
+        timeout.tv_nsec = (timeout_nanos % 1000000000);
+        int num_fds_ready = ppoll(pollfds, client_thread->num_connections, &timeout, NULL);
+        if(num_fds_ready < 0)
+        {
+            DebugPrintInfo();
+            break;
+        }
+
+        for(int i = 0; i < client_thread->num_connections && num_fds_ready > 0; i++)
+        {
+            if(pollfds[i].fd < 0 || pollfds[i].revents == 0)
+            {
+                continue;
+            }
+            num_fds_ready--;
+
+            if((pollfds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0)
+            {
+                receive_frames(client_thread, &client_thread->connections[i], is_measuring);
+            }
+        }
+    }
+
+    ns_memory_free(pollfds);
+    ns_semaphore_put(client_thread->done_semaphore);
+
+    return NULL;
+}
+
+int run_clients(BenchmarkOptions *options)
+{
+    int status;
+
+    ClientConnection *connections = (ClientConnection *)ns_memory_allocate(sizeof(ClientConnection)*options->connections);
+    memset(connections, 0, sizeof(ClientConnection)*options->connections);
+    for(int i = 0; i < options->connections; i++)
+    {
+        status = client_connect(&connections[i].socket);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+        connections[i].is_open = true;
+        connections[i].is_sender = (options->mode == BENCHMARK_ECHO || i == 0);
+    }
+
+    // the server picks up finished handshakes on its own time; give it a moment so the
+    // first broadcasts reach everyone
+    ns_thread_sleep(100);
+
+    int num_senders = (options->mode == BENCHMARK_ECHO) ? options->connections : 1;
+    uint64_t interval_nanos = (uint64_t)(1e9*num_senders/options->rate);
+
+    NsSemaphore done_semaphore;
+    ns_semaphore_create(&done_semaphore, 0);
+
+    int num_threads = ns_math_min(options->threads, options->connections);
+    ClientThread *client_threads = (ClientThread *)ns_memory_allocate(sizeof(ClientThread)*num_threads);
+    int first_connection_index = 0;
+    for(int i = 0; i < num_threads; i++)
+    {
+        ClientThread *client_thread = &client_threads[i];
+        int num_thread_connections = (options->connections / num_threads) + ((i < options->connections % num_threads) ? 1 : 0);
+
+        client_thread->options = options;
+        client_thread->connections = &connections[first_connection_index];
+        client_thread->num_connections = num_thread_connections;
+        client_thread->interval_nanos = interval_nanos;
+        client_thread->random_state = (0x9e3779b9*(i + 1));
+        client_thread->num_sent = 0;
+        client_thread->num_received = 0;
+        client_thread->num_errors = 0;
+        client_thread->done_semaphore = &done_semaphore;
+        ns_histogram_create(&client_thread->corrected_histogram);
+        ns_histogram_create(&client_thread->uncorrected_histogram);
+
+        first_connection_index += num_thread_connections;
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        status = ns_thread_create(&client_threads[i].thread, client_thread_entry, &client_threads[i]);
+        if(status != NS_SUCCESS)
+        {
+            DebugPrintInfo();
+            return status;
+        }
+    }
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_semaphore_get(&done_semaphore);
+    }
+
+    NsHistogram corrected_histogram;
+    NsHistogram uncorrected_histogram;
+    ns_histogram_create(&corrected_histogram);
+    ns_histogram_create(&uncorrected_histogram);
+    uint64_t num_sent = 0;
+    uint64_t num_received = 0;
+    uint64_t num_errors = 0;
+    for(int i = 0; i < num_threads; i++)
+    {
+        ns_histogram_merge(&corrected_histogram, &client_threads[i].corrected_histogram);
+        ns_histogram_merge(&uncorrected_histogram, &client_threads[i].uncorrected_histogram);
+        ns_histogram_destroy(&client_threads[i].corrected_histogram);
+        ns_histogram_destroy(&client_threads[i].uncorrected_histogram);
+        num_sent += client_threads[i].num_sent;
+        num_received += client_threads[i].num_received;
+        num_errors += client_threads[i].num_errors;
+    }
+
+    double seconds = (double)options->duration_seconds;
+    printf("sent:      %12.0f frames/s\n", num_sent/seconds);
+    printf("delivered: %12.0f frames/s  %10.1f MB/s\n", num_received/seconds,
+           (num_received*(double)options->size)/(seconds*1024.0*1024.0));
+    printf("errors:    %12llu\n", (unsigned long long)num_errors);
+    printf("%-12s %10s %10s %10s %10s %10s\n", "latency us", "p50", "p99", "p99.9", "p99.99", "max");
+
+    NsHistogram *histograms[] = { &corrected_histogram, &uncorrected_histogram };
+    const char *histogram_names[] = { "corrected", "uncorrected" };
+    for(uint32_t i = 0; i < ArrayCount(histograms); i++)
+    {
+        NsHistogram *histogram = histograms[i];
+        printf("%-12s %10.1f %10.1f %10.1f %10.1f %10.1f\n", histogram_names[i],
+               ns_histogram_get_percentile(histogram, 50.0)/1000.0,
+               ns_histogram_get_percentile(histogram, 99.0)/1000.0,
+               ns_histogram_get_percentile(histogram, 99.9)/1000.0,
+               ns_histogram_get_percentile(histogram, 99.99)/1000.0,
+               ns_histogram_get_max(histogram)/1000.0);
+        ns_histogram_destroy(histogram);
+    }
+
+    for(int i = 0; i < options->connections; i++)
+    {
+        ns_socket_close(&connections[i].socket);
+    }
+    ns_memory_free(client_threads);
+    ns_memory_free(connections);
+
+    return NS_SUCCESS;
+}
+//}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options = {};
+    options.mode = BENCHMARK_ECHO;
+    options.connections = 64;
+    options.size = 64;
+    options.rate = 20000;
+    options.duration_seconds = 5;
+    options.warmup_seconds = 1;
+    options.threads = 2;
+    options.server_threads = 4;
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "--mode")) options.mode = !strcmp(argv[i + 1], "broadcast") ? BENCHMARK_BROADCAST : BENCHMARK_ECHO;
+        else if(!strcmp(argv[i], "--connections")) options.connections = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--size")) options.size = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--rate")) options.rate = atof(argv[i + 1]);
+        else if(!strcmp(argv[i], "--duration")) options.duration_seconds = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--warmup")) options.warmup_seconds = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--threads")) options.threads = atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--server-threads")) options.server_threads = atoi(argv[i + 1]);
+        else
+        {
+            printf("unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    options.connections = ns_math_max(1, options.connections);
+    options.size = ns_math_max(16, ns_math_min(options.size, BENCHMARK_MAX_PAYLOAD_SIZE));
+    options.duration_seconds = ns_math_max(1, options.duration_seconds);
+    if(options.rate <= 0)
+    {
+        printf("--rate must be positive\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%s, %d connections, %d byte frames, %.0f frames/s, %d server threads\n",
+           (options.mode == BENCHMARK_ECHO) ? "echo" : "broadcast", options.connections,
+           options.size, options.rate, options.server_threads);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        // the server talks a lot
+        if(freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL)
+        {
+            _exit(1);
+        }
+        if(run_server(&options) != NS_SUCCESS)
+        {
+            _exit(1);
+        }
+        while(1)
+        {
+            pause();
+        }
+    }
+    if(pid < 0)
+    {
+        DebugPrintInfo();
+        return 1;
+    }
+
+    int status = run_clients(&options);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    return (status == NS_SUCCESS) ? 0 : 1;
+}